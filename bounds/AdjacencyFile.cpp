@@ -0,0 +1,94 @@
+#include "AdjacencyFile.h"
+
+#include <stdlib.h>
+
+#include "Checkpoint.h"
+
+#include <algorithm>
+#include <vector>
+
+static const char s_MAGIC[8] = { 'S', 'P', 'A', 'D', 'J', 'A', 'C', 'Y' };
+static const unsigned int s_VERSION = 1;
+
+AdjacencyFile::AdjacencyFile(const std::string& path) :
+    m_path(path)
+{
+    m_outf = fopen(path.c_str(), "wb");
+
+    if (!m_outf)
+    {
+        fprintf(stderr, "Cannot open output file: %s\n", path.c_str());
+        exit(1);
+    }
+
+    write(s_MAGIC, sizeof(s_MAGIC));
+    write(&s_VERSION, sizeof(s_VERSION));
+}
+
+AdjacencyFile::AdjacencyFile(const std::string& path, long long size) :
+    m_path(path)
+{
+    m_outf = reopenFile(path, size);
+}
+
+AdjacencyFile::~AdjacencyFile()
+{
+    if (m_outf)
+    {
+        fclose(m_outf);
+    }
+}
+
+void AdjacencyFile::writePlane(int z, const AdjacencyMap& adjacency)
+{
+    std::vector<EdgeKey> keys;
+    keys.reserve(adjacency.size());
+
+    for (AdjacencyMap::const_iterator it = adjacency.begin();
+         it != adjacency.end(); ++it)
+    {
+        keys.push_back((*it).first);
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    unsigned int count = keys.size();
+    write(&z, sizeof(z));
+    write(&count, sizeof(count));
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        unsigned int edge[3];
+        edge[0] = (unsigned int)(keys[i] >> 32);
+        edge[1] = (unsigned int)(keys[i] & 0xFFFFFFFF);
+        edge[2] = (*adjacency.find(keys[i])).second;
+
+        write(edge, sizeof(edge));
+    }
+}
+
+long long AdjacencyFile::sync()
+{
+    return syncFile(m_outf, m_path);
+}
+
+void AdjacencyFile::close()
+{
+    if (fclose(m_outf) != 0)
+    {
+        m_outf = NULL;
+        fprintf(stderr, "ERROR: cannot write %s\n", m_path.c_str());
+        exit(1);
+    }
+
+    m_outf = NULL;
+}
+
+void AdjacencyFile::write(const void* data, size_t size)
+{
+    if (fwrite(data, size, 1, m_outf) != 1)
+    {
+        fprintf(stderr, "ERROR: cannot write %s\n", m_path.c_str());
+        exit(1);
+    }
+}
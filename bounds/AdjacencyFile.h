@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+#include "PlaneStats.h"
+
+//
+// Writes superpixel_adjacency.bin, the in-plane superpixel
+// neighbour graph.  All values are little endian:
+//
+//   header:     char magic[8] = "SPADJACY", uint32 version = 1
+//   each plane: int32 plane, uint32 count, then count edges of
+//               uint32 spid1, uint32 spid2, uint32 length
+//
+// Planes are in order and every plane is written, even if it has
+// no edges.  Within a plane edges are sorted with spid1 < spid2.
+// length is the number of pixel edges the two superpixels share,
+// using 4-connectivity.
+//
+class AdjacencyFile
+{
+public:
+    // Exits if the file cannot be created
+    AdjacencyFile(const std::string& path);
+
+    // Carry on from a checkpoint, keeping the first size bytes
+    AdjacencyFile(const std::string& path, long long size);
+
+    ~AdjacencyFile();
+
+    void writePlane(int z, const AdjacencyMap& adjacency);
+
+    // Flush the planes so far to disk and return the file's length
+    long long sync();
+
+    // Exits if the file cannot be finished
+    void close();
+
+private:
+    void write(const void* data, size_t size);
+
+    std::string m_path;
+    FILE* m_outf;
+};
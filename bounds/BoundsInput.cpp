@@ -0,0 +1,84 @@
+#include "BoundsInput.h"
+
+#include <stdlib.h>
+
+//
+// TextBoundsInput
+//
+
+TextBoundsInput::TextBoundsInput(const std::string& path) :
+    m_path(path),
+    m_line(0)
+{
+    m_inf = fopen(path.c_str(), "r");
+
+    if (!m_inf)
+    {
+        fprintf(stderr, "Cannot open input file: %s\n", path.c_str());
+        exit(1);
+    }
+}
+
+TextBoundsInput::~TextBoundsInput()
+{
+    fclose(m_inf);
+}
+
+bool TextBoundsInput::readRow(uint32* row)
+{
+    char buffer[1024];
+
+    while (fgets(buffer, sizeof(buffer), m_inf))
+    {
+        ++m_line;
+
+        // Skip the header and blank lines
+        if (buffer[0] == '#' || buffer[0] == '\n')
+        {
+            continue;
+        }
+
+        if (sscanf(buffer, "%u %u %u %u %u %u %u",
+            &row[0], &row[1], &row[2], &row[3],
+            &row[4], &row[5], &row[6]) != BOUNDS_FILE_COLUMNS)
+        {
+            fprintf(stderr, "ERROR: bad line %d in %s\n",
+                m_line, m_path.c_str());
+            exit(1);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+//
+// BinaryBoundsInput
+//
+
+BinaryBoundsInput::BinaryBoundsInput(const std::string& path)
+{
+    try
+    {
+        m_reader.open(path);
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
+
+bool BinaryBoundsInput::readRow(uint32* row)
+{
+    try
+    {
+        return m_reader.readRows(row);
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+#include "BoundsFile.h"
+
+//
+// Reads back rows written by a BoundsOutput, one at a time, so
+// an existing bounds file can be spliced without loading it whole.
+// A row is BOUNDS_FILE_COLUMNS values, same columns as the TXT file.
+//
+class BoundsInput
+{
+public:
+    virtual ~BoundsInput() {}
+
+    // Read the next row, false at the end of the file
+    virtual bool readRow(uint32* row) = 0;
+};
+
+//
+// superpixel_bounds.txt
+//
+class TextBoundsInput : public BoundsInput
+{
+public:
+    // Exits if the file cannot be opened
+    TextBoundsInput(const std::string& path);
+    virtual ~TextBoundsInput();
+
+    // Exits on a malformed line
+    virtual bool readRow(uint32* row);
+
+private:
+    std::string m_path;
+    FILE* m_inf;
+    int m_line;
+};
+
+//
+// superpixel_bounds.bin, see BoundsFile.h
+//
+class BinaryBoundsInput : public BoundsInput
+{
+public:
+    // Exits if the file cannot be opened or is incomplete
+    BinaryBoundsInput(const std::string& path);
+
+    virtual bool readRow(uint32* row);
+
+private:
+    BoundsFileReader m_reader;
+};
@@ -0,0 +1,135 @@
+#include "BoundsManifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+// 64-bit FNV-1a
+static const uint64 s_FNV_OFFSET = 14695981039346656037ULL;
+static const uint64 s_FNV_PRIME = 1099511628211ULL;
+
+static void hashValue(uint64& hash, uint64 value)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= s_FNV_PRIME;
+    }
+}
+
+bool BoundsManifest::read(const std::string& path)
+{
+    FILE* fp = fopen(path.c_str(), "r");
+
+    if (!fp)
+    {
+        return false;
+    }
+
+    m_signatures.clear();
+
+    char buffer[1024];
+    int line = 0;
+
+    while (fgets(buffer, sizeof(buffer), fp))
+    {
+        ++line;
+
+        if (buffer[0] == '#' || buffer[0] == '\n')
+        {
+            continue;
+        }
+
+        int z;
+        uint64 signature;
+
+        if (sscanf(buffer, "%d %llx", &z, &signature) != 2)
+        {
+            fprintf(stderr, "ERROR: bad line %d in %s\n", line, path.c_str());
+            exit(1);
+        }
+
+        m_signatures[z] = signature;
+    }
+
+    fclose(fp);
+    return true;
+}
+
+void BoundsManifest::write(const std::string& path)
+{
+    // Write aside and rename, so an interrupted write never
+    // leaves a manifest that claims planes are up to date
+    std::string tmppath = path + ".tmp";
+    FILE* fp = fopen(tmppath.c_str(), "w");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open output file: %s\n", tmppath.c_str());
+        exit(1);
+    }
+
+    fprintf(fp, "# superpixel bounds tile manifest\n");
+    fprintf(fp, "# plane\tsignature\n\n");
+
+    for (SignatureMap::iterator it = m_signatures.begin();
+         it != m_signatures.end(); ++it)
+    {
+        fprintf(fp, "%d\t%016llx\n", (*it).first, (*it).second);
+    }
+
+    if (fclose(fp) != 0 || rename(tmppath.c_str(), path.c_str()) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot write %s\n", path.c_str());
+        exit(1);
+    }
+}
+
+bool BoundsManifest::getSignature(int z, uint64& signature) const
+{
+    SignatureMap::const_iterator it = m_signatures.find(z);
+
+    if (it == m_signatures.end())
+    {
+        return false;
+    }
+
+    signature = (*it).second;
+    return true;
+}
+
+void BoundsManifest::setSignature(int z, uint64 signature)
+{
+    m_signatures[z] = signature;
+}
+
+uint64 BoundsManifest::computeSignature(Stack& stack, const TileOrder& order,
+    int z)
+{
+    uint64 hash = s_FNV_OFFSET;
+
+    hashValue(hash, order.rows);
+    hashValue(hash, order.cols);
+
+    for (int i = 0; i < order.cols; ++i)
+    {
+        for (int j = 0; j < order.rows; ++j)
+        {
+            std::string path = stack.getTilePath(0, j, i, 's', z);
+            struct stat buf;
+
+            if (stat(path.c_str(), &buf) != 0)
+            {
+                // Missing tile, still changes the signature
+                hashValue(hash, ~0ULL);
+                continue;
+            }
+
+            hashValue(hash, buf.st_size);
+            hashValue(hash, buf.st_mtim.tv_sec);
+            hashValue(hash, buf.st_mtim.tv_nsec);
+        }
+    }
+
+    return hash;
+}
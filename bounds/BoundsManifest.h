@@ -0,0 +1,40 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "common.h"
+#include "Stack.h"
+#include "TilePrefetcher.h"
+
+//
+// Records a signature of the tiles of each plane, saved next to
+// the bounds output.  A later run with --update compares the saved
+// signatures to the current ones to find the planes whose tiles
+// changed since their bounds were computed.
+//
+// The signature hashes the size and modification time of every
+// tile in the plane, so finding changed planes costs a stat() per
+// tile rather than decoding anything.
+//
+class BoundsManifest
+{
+public:
+    // Read the manifest, false if it does not exist
+    bool read(const std::string& path);
+
+    // Write the manifest, exits on error
+    void write(const std::string& path);
+
+    // Get the saved signature of plane z, false if there is none
+    bool getSignature(int z, uint64& signature) const;
+
+    void setSignature(int z, uint64 signature);
+
+    // Compute the current signature of the tiles of plane z
+    static uint64 computeSignature(Stack& stack, const TileOrder& order, int z);
+
+private:
+    typedef std::map<int, uint64> SignatureMap;
+    SignatureMap m_signatures;
+};
@@ -0,0 +1,155 @@
+#include "BoundsOutput.h"
+
+#include <stdlib.h>
+
+#include "Checkpoint.h"
+#include "Table.h"
+
+//
+// TextBoundsOutput
+//
+
+TextBoundsOutput::TextBoundsOutput(const std::string& path) :
+    m_path(path)
+{
+    m_outf = fopen(path.c_str(), "w");
+
+    if (!m_outf)
+    {
+        fprintf(stderr, "Cannot open output file: %s\n", path.c_str());
+        exit(1);
+    }
+
+    // Write the header
+    fprintf(m_outf, "# superpixel bounding boxes and volumes\n");
+    fprintf(m_outf, "# plane\tsp\tx y width height volume\n\n");
+}
+
+TextBoundsOutput::TextBoundsOutput(const std::string& path, long long size) :
+    m_path(path)
+{
+    m_outf = reopenFile(path, size);
+}
+
+void TextBoundsOutput::writeRow(int z, unsigned int spid, int x, int y,
+    int width, int height, int volume)
+{
+    fprintf(m_outf, "%d\t%d\t%d %d %d %d %d\n",
+        z, spid, x, y, width, height, volume);
+}
+
+long long TextBoundsOutput::sync()
+{
+    return syncFile(m_outf, m_path);
+}
+
+void TextBoundsOutput::close()
+{
+    fclose(m_outf);
+    m_outf = NULL;
+}
+
+//
+// BinaryBoundsOutput
+//
+
+BinaryBoundsOutput::BinaryBoundsOutput(const std::string& path)
+{
+    try
+    {
+        m_writer.open(path);
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
+
+BinaryBoundsOutput::BinaryBoundsOutput(const std::string& path, long long size)
+{
+    try
+    {
+        m_writer.reopen(path, uint64(size));
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
+
+void BinaryBoundsOutput::writeRow(int z, unsigned int spid, int x, int y,
+    int width, int height, int volume)
+{
+    uint32 row[BOUNDS_FILE_COLUMNS] = {
+        uint32(z), spid, uint32(x), uint32(y),
+        uint32(width), uint32(height), uint32(volume) };
+
+    try
+    {
+        m_writer.writeRow(row);
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
+
+long long BinaryBoundsOutput::sync()
+{
+    try
+    {
+        return (long long)m_writer.sync();
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
+
+void BinaryBoundsOutput::close()
+{
+    try
+    {
+        m_writer.close();
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+}
+
+//
+// TableBoundsOutput
+//
+
+TableBoundsOutput::TableBoundsOutput()
+{
+    // Padding of 1.0 doubles the table each time it fills up,
+    // so appending a row at a time stays cheap
+    m_table = new Table(0, BOUNDS_FILE_COLUMNS, 1.0);
+}
+
+TableBoundsOutput::~TableBoundsOutput()
+{
+    delete m_table;
+}
+
+void TableBoundsOutput::writeRow(int z, unsigned int spid, int x, int y,
+    int width, int height, int volume)
+{
+    uint32 row = m_table->getRows();
+    m_table->addRows(1);
+
+    m_table->setValue(row, 0, z);
+    m_table->setValue(row, 1, spid);
+    m_table->setValue(row, 2, x);
+    m_table->setValue(row, 3, y);
+    m_table->setValue(row, 4, width);
+    m_table->setValue(row, 5, height);
+    m_table->setValue(row, 6, volume);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+#include "BoundsFile.h"
+
+class Table;
+
+//
+// Where the rows for each plane go.  Rows arrive plane by plane,
+// sorted by spid within a plane.
+//
+class BoundsOutput
+{
+public:
+    virtual ~BoundsOutput() {}
+
+    virtual void writeRow(int z, unsigned int spid, int x, int y,
+        int width, int height, int volume) = 0;
+
+    // Flush the rows so far to disk and return the output's length,
+    // which a --checkpoint run can later resume from
+    virtual long long sync() = 0;
+
+    // Finish the output, called once after the last plane
+    virtual void close() = 0;
+};
+
+//
+// superpixel_bounds.txt
+//
+class TextBoundsOutput : public BoundsOutput
+{
+public:
+    // Exits if the file cannot be created
+    TextBoundsOutput(const std::string& path);
+
+    // Carry on from a checkpoint, keeping the first size bytes
+    TextBoundsOutput(const std::string& path, long long size);
+
+    virtual void writeRow(int z, unsigned int spid, int x, int y,
+        int width, int height, int volume);
+
+    virtual long long sync();
+    virtual void close();
+
+private:
+    std::string m_path;
+    FILE* m_outf;
+};
+
+//
+// superpixel_bounds.bin, see BoundsFile.h
+//
+class BinaryBoundsOutput : public BoundsOutput
+{
+public:
+    // Exits if the file cannot be created
+    BinaryBoundsOutput(const std::string& path);
+
+    // Carry on from a checkpoint, keeping the first size bytes
+    BinaryBoundsOutput(const std::string& path, long long size);
+
+    virtual void writeRow(int z, unsigned int spid, int x, int y,
+        int width, int height, int volume);
+
+    virtual long long sync();
+    virtual void close();
+
+private:
+    BoundsFileWriter m_writer;
+};
+
+//
+// Rows go into a 7 column Table in memory, same columns as the
+// TXT file, so they can be handed straight to HdfStack.
+//
+class TableBoundsOutput : public BoundsOutput
+{
+public:
+    TableBoundsOutput();
+    virtual ~TableBoundsOutput();
+
+    virtual void writeRow(int z, unsigned int spid, int x, int y,
+        int width, int height, int volume);
+
+    // Nothing is on disk
+    virtual long long sync() { return 0; }
+    virtual void close() {}
+
+    Table* getTable() { return m_table; }
+
+private:
+    Table* m_table;
+};
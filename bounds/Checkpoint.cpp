@@ -0,0 +1,178 @@
+#include "Checkpoint.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <map>
+
+Checkpoint::Checkpoint() :
+    zmin(0),
+    zmax(-1),
+    binary(false),
+    moments(false),
+    adjacency(false),
+    lastPlane(-1),
+    boundsSize(-1),
+    momentsSize(-1),
+    adjacencySize(-1)
+{
+}
+
+bool Checkpoint::read(const std::string& path)
+{
+    FILE* fp = fopen(path.c_str(), "r");
+
+    if (!fp)
+    {
+        return false;
+    }
+
+    std::map<std::string, long long> values;
+    char buffer[1024];
+
+    while (fgets(buffer, sizeof(buffer), fp))
+    {
+        // Skip the header and blank lines
+        if (buffer[0] == '#' || buffer[0] == '\n')
+        {
+            continue;
+        }
+
+        char key[256];
+        long long value;
+
+        if (sscanf(buffer, "%255[^=]=%lld", key, &value) != 2)
+        {
+            fprintf(stderr, "ERROR: bad line in %s: %s", path.c_str(), buffer);
+            exit(1);
+        }
+
+        values[key] = value;
+    }
+
+    fclose(fp);
+
+    const char* keys[] = { "zmin", "zmax", "binary", "moments", "adjacency",
+        "plane", "bounds", "moments_size", "adjacency_size" };
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+    {
+        if (values.find(keys[i]) == values.end())
+        {
+            fprintf(stderr, "ERROR: no '%s' in %s\n", keys[i], path.c_str());
+            exit(1);
+        }
+    }
+
+    zmin = int(values["zmin"]);
+    zmax = int(values["zmax"]);
+    binary = values["binary"] != 0;
+    moments = values["moments"] != 0;
+    adjacency = values["adjacency"] != 0;
+    lastPlane = int(values["plane"]);
+    boundsSize = values["bounds"];
+    momentsSize = values["moments_size"];
+    adjacencySize = values["adjacency_size"];
+
+    return true;
+}
+
+void Checkpoint::write(const std::string& path)
+{
+    // Write aside and rename, so a crash leaves either the old
+    // checkpoint or the new one
+    std::string tmppath = path + ".tmp";
+    FILE* fp = fopen(tmppath.c_str(), "w");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot open output file: %s\n", tmppath.c_str());
+        exit(1);
+    }
+
+    fprintf(fp, "# superpixel bounds checkpoint\n\n");
+    fprintf(fp, "zmin=%d\n", zmin);
+    fprintf(fp, "zmax=%d\n", zmax);
+    fprintf(fp, "binary=%d\n", binary ? 1 : 0);
+    fprintf(fp, "moments=%d\n", moments ? 1 : 0);
+    fprintf(fp, "adjacency=%d\n", adjacency ? 1 : 0);
+    fprintf(fp, "plane=%d\n", lastPlane);
+    fprintf(fp, "bounds=%lld\n", boundsSize);
+    fprintf(fp, "moments_size=%lld\n", momentsSize);
+    fprintf(fp, "adjacency_size=%lld\n", adjacencySize);
+
+    syncFile(fp, tmppath);
+
+    if (fclose(fp) != 0 || rename(tmppath.c_str(), path.c_str()) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot write %s\n", path.c_str());
+        exit(1);
+    }
+
+    // The rename is only durable once the directory is synced
+    std::string dir = ".";
+    size_t slash = path.rfind('/');
+
+    if (slash != std::string::npos)
+    {
+        dir = path.substr(0, slash + 1);
+    }
+
+    int fd = open(dir.c_str(), O_RDONLY);
+
+    if (fd >= 0)
+    {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+bool Checkpoint::matches(const Checkpoint& other) const
+{
+    return zmin == other.zmin && zmax == other.zmax &&
+        binary == other.binary && moments == other.moments &&
+        adjacency == other.adjacency;
+}
+
+long long syncFile(FILE* fp, const std::string& path)
+{
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot sync %s\n", path.c_str());
+        exit(1);
+    }
+
+    return ftello(fp);
+}
+
+FILE* reopenFile(const std::string& path, long long size)
+{
+    FILE* fp = fopen(path.c_str(), "r+b");
+
+    if (!fp)
+    {
+        fprintf(stderr, "ERROR: cannot reopen %s\n", path.c_str());
+        exit(1);
+    }
+
+    struct stat buf;
+
+    if (fstat(fileno(fp), &buf) != 0 || buf.st_size < off_t(size))
+    {
+        fprintf(stderr, "ERROR: %s is shorter than its checkpoint\n",
+            path.c_str());
+        exit(1);
+    }
+
+    if (ftruncate(fileno(fp), off_t(size)) != 0 ||
+        fseeko(fp, 0, SEEK_END) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot truncate %s to %lld\n",
+            path.c_str(), size);
+        exit(1);
+    }
+
+    return fp;
+}
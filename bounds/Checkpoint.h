@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+
+//
+// Progress of a bounds --checkpoint run, saved next to the output
+// after every plane.
+//
+// It records the last plane written and how long each output file
+// was right after it, once the files were synced to disk.  A run
+// which is killed leaves the checkpoint behind, and the next run
+// truncates each output back to its recorded length, so a partly
+// written plane is dropped, and carries on with the next plane.
+//
+// The settings which decide what the outputs hold are saved too,
+// so a resume with different ones is refused instead of mixing
+// two kinds of output in one file.
+//
+class Checkpoint
+{
+public:
+    Checkpoint();
+
+    // Read the checkpoint, false if it does not exist.  Exits if
+    // it is malformed.
+    bool read(const std::string& path);
+
+    // Write and sync the checkpoint, replacing the old one only
+    // once the new one is on disk.  Exits on error.
+    void write(const std::string& path);
+
+    // Same run settings as other
+    bool matches(const Checkpoint& other) const;
+
+    // The run
+    int zmin;
+    int zmax;
+    bool binary;
+    bool moments;
+    bool adjacency;
+
+    // Last plane written, zmin - 1 if none
+    int lastPlane;
+
+    // Length of each output after lastPlane, -1 if not written
+    long long boundsSize;
+    long long momentsSize;
+    long long adjacencySize;
+};
+
+// Flush fp, sync it to disk and return its length.  Exits on error.
+long long syncFile(FILE* fp, const std::string& path);
+
+// Open an existing file to carry on writing it, truncated to size.
+// Exits on error.
+FILE* reopenFile(const std::string& path, long long size);
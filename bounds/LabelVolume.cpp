@@ -0,0 +1,148 @@
+#include "LabelVolume.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+LabelVolume::LabelVolume(const std::string& path, const std::string& dataset,
+    int blocksize) :
+    m_path(path),
+    m_file(-1),
+    m_dataset(-1),
+    m_wide(false)
+{
+    m_file = H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+
+    if (m_file < 0)
+    {
+        fprintf(stderr, "ERROR: cannot open HDF5 file %s\n", path.c_str());
+        exit(1);
+    }
+
+    // Every chunk is read whole and only once, so the chunk cache
+    // would just be an extra copy
+    hid_t access = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(access, 0, 0, H5D_CHUNK_CACHE_W0_DEFAULT);
+
+    m_dataset = H5Dopen(m_file, dataset.c_str(), access);
+    H5Pclose(access);
+
+    if (m_dataset < 0)
+    {
+        fprintf(stderr, "ERROR: cannot open dataset %s in %s\n",
+            dataset.c_str(), path.c_str());
+        exit(1);
+    }
+
+    hid_t type = H5Dget_type(m_dataset);
+    bool integer = H5Tget_class(type) == H5T_INTEGER;
+    m_wide = H5Tget_size(type) > 4;
+    H5Tclose(type);
+
+    if (!integer)
+    {
+        fprintf(stderr, "ERROR: dataset %s is not integer labels\n",
+            dataset.c_str());
+        exit(1);
+    }
+
+    hid_t space = H5Dget_space(m_dataset);
+    hsize_t dims[3];
+
+    if (H5Sget_simple_extent_ndims(space) != 3)
+    {
+        fprintf(stderr, "ERROR: dataset %s is not 3D (z, y, x)\n",
+            dataset.c_str());
+        exit(1);
+    }
+
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+
+    hid_t create = H5Dget_create_plist(m_dataset);
+    hsize_t chunk[3];
+
+    if (H5Pget_layout(create) == H5D_CHUNKED)
+    {
+        H5Pget_chunk(create, 3, chunk);
+    }
+    else
+    {
+        chunk[0] = 1;
+        chunk[1] = blocksize;
+        chunk[2] = blocksize;
+    }
+
+    H5Pclose(create);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        m_dims[i] = int(dims[i]);
+        m_block[i] = int(chunk[i] < dims[i] ? chunk[i] : dims[i]);
+    }
+
+    printf("volume=%dx%dx%d block=%dx%dx%d\n",
+        m_dims[2], m_dims[1], m_dims[0],
+        m_block[2], m_block[1], m_block[0]);
+}
+
+LabelVolume::~LabelVolume()
+{
+    H5Dclose(m_dataset);
+    H5Fclose(m_file);
+}
+
+void LabelVolume::read(int z, int row, int col, int depth, int height,
+    int width, std::vector<unsigned int>& data)
+{
+    size_t count = size_t(depth) * height * width;
+    data.resize(count);
+
+    ScopedLock lock(m_mutex);
+
+    hsize_t start[3] = { hsize_t(z), hsize_t(row), hsize_t(col) };
+    hsize_t size[3] = { hsize_t(depth), hsize_t(height), hsize_t(width) };
+
+    hid_t fileSpace = H5Dget_space(m_dataset);
+    H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, start, NULL, size, NULL);
+    hid_t memSpace = H5Screate_simple(3, size, NULL);
+
+    herr_t status;
+
+    if (m_wide)
+    {
+        m_wideData.resize(count);
+        status = H5Dread(m_dataset, H5T_NATIVE_ULLONG, memSpace, fileSpace,
+            H5P_DEFAULT, &m_wideData[0]);
+    }
+    else
+    {
+        status = H5Dread(m_dataset, H5T_NATIVE_UINT, memSpace, fileSpace,
+            H5P_DEFAULT, &data[0]);
+    }
+
+    H5Sclose(memSpace);
+    H5Sclose(fileSpace);
+
+    if (status < 0)
+    {
+        fprintf(stderr, "ERROR: cannot read %s at z=%d row=%d col=%d\n",
+            m_path.c_str(), z, row, col);
+        exit(1);
+    }
+
+    if (m_wide)
+    {
+        // Spids are 32 bits everywhere else
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (m_wideData[i] > 0xFFFFFFFFULL)
+            {
+                fprintf(stderr, "ERROR: label %llu in %s does not fit "
+                    "in 32 bits\n", m_wideData[i], m_path.c_str());
+                exit(1);
+            }
+
+            data[i] = (unsigned int)m_wideData[i];
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <hdf5.h>
+
+#include <string>
+#include <vector>
+
+#include "Threads.h"
+
+//
+// A superpixel label volume stored as an integer HDF5 dataset,
+// laid out (z, y, x) with row 0 at the top of each plane, the same
+// as the rows of a PNG.
+//
+// The volume is read in blocks.  If the dataset is chunked a block
+// is one chunk, so every chunk is read and decompressed exactly
+// once.  Otherwise a block is one plane deep and blocksize square.
+//
+// HDF5 is not thread safe, so reads are serialized.  Callers get
+// their parallelism from working on the blocks once they are read.
+//
+class LabelVolume
+{
+public:
+    // Exits if the dataset cannot be opened or is not a 3D integer
+    // dataset
+    LabelVolume(const std::string& path, const std::string& dataset,
+        int blocksize);
+    ~LabelVolume();
+
+    int getDepth() const { return m_dims[0]; }
+    int getHeight() const { return m_dims[1]; }
+    int getWidth() const { return m_dims[2]; }
+
+    int getBlockDepth() const { return m_block[0]; }
+    int getBlockHeight() const { return m_block[1]; }
+    int getBlockWidth() const { return m_block[2]; }
+
+    // Read depth x height x width labels starting at plane z, row
+    // and column.  data is resized to fit and is in (z, y, x) order.
+    // Exits on error.
+    void read(int z, int row, int col, int depth, int height, int width,
+        std::vector<unsigned int>& data);
+
+private:
+    std::string m_path;
+
+    hid_t m_file;
+    hid_t m_dataset;
+
+    // Labels wider than 32 bits are read as 64 bits and checked
+    bool m_wide;
+    std::vector<unsigned long long> m_wideData;
+
+    int m_dims[3];
+    int m_block[3];
+
+    Mutex m_mutex;
+};
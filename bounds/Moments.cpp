@@ -0,0 +1,58 @@
+#include "Moments.h"
+
+#include <math.h>
+
+void Moments::addSpan(int x0, int x1, int y)
+{
+    long long n = x1 - x0 + 1;
+    long long a = x0;
+    long long b = x1;
+
+    // Sums of x and x*x over x0..x1 in closed form
+    long long sx = n * (a + b) / 2;
+    long long sxx = (b * (b + 1) * (2 * b + 1) - (a - 1) * a * (2 * a - 1)) / 6;
+
+    sumX += sx;
+    sumY += n * y;
+    sumXX += sxx;
+    sumYY += n * y * y;
+    sumXY += sx * y;
+}
+
+void Moments::add(const Moments& other)
+{
+    sumX += other.sumX;
+    sumY += other.sumY;
+    sumXX += other.sumXX;
+    sumYY += other.sumYY;
+    sumXY += other.sumXY;
+    perimeter += other.perimeter;
+}
+
+Shape::Shape(const Moments& moments, int volume)
+{
+    double n = volume;
+
+    cx = moments.sumX / n;
+    cy = moments.sumY / n;
+
+    mxx = moments.sumXX / n - cx * cx;
+    myy = moments.sumYY / n - cy * cy;
+    mxy = moments.sumXY / n - cx * cy;
+
+    // Eigenvalues of the covariance matrix are the variances
+    // along the ellipse axes
+    double mean = (mxx + myy) / 2;
+    double diff = (mxx - myy) / 2;
+    double root = sqrt(diff * diff + mxy * mxy);
+
+    double major2 = mean + root;
+    double minor2 = mean - root;
+
+    orientation = 0.5 * atan2(2 * mxy, mxx - myy);
+
+    // For a solid ellipse the variance along an axis is a^2/4
+    // where a is the semi-axis, so the full length is 4*sqrt
+    major = 4 * sqrt(major2 > 0 ? major2 : 0);
+    minor = 4 * sqrt(minor2 > 0 ? minor2 : 0);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ext/hash_map>
+
+namespace ext = __gnu_cxx;
+
+//
+// Raw moments and perimeter of one superpixel in one plane.
+//
+// Sums are kept as integers so they add up the same no matter
+// which order tiles are merged in, the threaded output matches
+// the serial output exactly.
+//
+// The perimeter is the number of pixel edges between the
+// superpixel and a different superpixel or the edge of the plane,
+// using 4-connectivity.
+//
+struct Moments
+{
+    Moments() :
+        sumX(0), sumY(0), sumXX(0), sumYY(0), sumXY(0), perimeter(0)
+    {}
+
+    // Add a run of pixels x0..x1 on row y
+    void addSpan(int x0, int x1, int y);
+
+    void add(const Moments& other);
+
+    long long sumX;
+    long long sumY;
+    long long sumXX;
+    long long sumYY;
+    long long sumXY;
+    long long perimeter;
+};
+
+//
+// Shape derived from the moments of a superpixel with volume
+// pixels: centroid, central second moments normalized by volume,
+// and the ellipse with the same second moments.  Orientation is
+// the angle of the major axis from the x axis in radians, the
+// axis lengths are full lengths not radii.
+//
+struct Shape
+{
+    Shape(const Moments& moments, int volume);
+
+    double cx;
+    double cy;
+    double mxx;
+    double myy;
+    double mxy;
+    double orientation;
+    double major;
+    double minor;
+};
+
+typedef ext::hash_map<unsigned int, Moments> MomentsMap;
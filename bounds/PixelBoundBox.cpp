@@ -45,6 +45,28 @@ void PixelBoundBox::unionPoint(int x, int y)
     }
 }
 
+// Union a horizontal run of pixels x0..x1 on row y, x0 <= x1
+void PixelBoundBox::unionSpan(int x0, int x1, int y)
+{
+    if (x0 < m_x0)
+    {
+        m_x0 = x0;
+    }
+    if (x1 > m_x1)
+    {
+        m_x1 = x1;
+    }
+
+    if (y < m_y0)
+    {
+        m_y0 = y;
+    }
+    else if (y > m_y1)
+    {
+        m_y1 = y;
+    }
+}
+
 void PixelBoundBox::unionBounds(const PixelBoundBox& other)
 {
     // Using if's here is slightly faster than
@@ -1,3 +1,5 @@
+#pragma once
+
 class PixelBoundBox
 {
 public:
@@ -12,6 +14,7 @@ public:
     int getHeight() const { return m_y1 - m_y0 + 1; }
 
     void unionPoint(int x, int y);
+    void unionSpan(int x0, int x1, int y);
     void unionBounds(const PixelBoundBox& other);
 
 private:
@@ -0,0 +1,97 @@
+#include "PlaneStats.h"
+
+void PlaneStats::merge(PlaneStats& other)
+{
+    for (MomentsMap::iterator it = other.moments.begin();
+         it != other.moments.end(); ++it)
+    {
+        moments[(*it).first].add((*it).second);
+    }
+
+    for (AdjacencyMap::iterator it = other.adjacency.begin();
+         it != other.adjacency.end(); ++it)
+    {
+        adjacency[(*it).first] += (*it).second;
+    }
+
+    for (TileEdgesMap::iterator it = other.edges.begin();
+         it != other.edges.end(); ++it)
+    {
+        TileEdges& from = (*it).second;
+        TileEdges& tile = edges[(*it).first];
+
+        tile.x = from.x;
+        tile.y = from.y;
+        tile.width = from.width;
+        tile.height = from.height;
+        tile.left.swap(from.left);
+        tile.right.swap(from.right);
+        tile.bottom.swap(from.bottom);
+        tile.top.swap(from.top);
+    }
+
+    other.moments.clear();
+    other.adjacency.clear();
+    other.edges.clear();
+}
+
+void PlaneStats::addSeams()
+{
+    for (TileEdgesMap::iterator it = edges.begin(); it != edges.end(); ++it)
+    {
+        const TileEdges& tile = (*it).second;
+
+        // Each seam is counted from the tile to its left or below,
+        // the plane's border is counted from the tile inside it
+        TileEdgesMap::iterator right =
+            edges.find(std::make_pair(tile.x + tile.width, tile.y));
+        TileEdgesMap::iterator above =
+            edges.find(std::make_pair(tile.x, tile.y + tile.height));
+
+        addSeam(tile.right,
+            right == edges.end() ? NULL : &(*right).second.left);
+        addSeam(tile.top,
+            above == edges.end() ? NULL : &(*above).second.bottom);
+
+        if (tile.x == 0)
+        {
+            addSeam(tile.left, NULL);
+        }
+
+        if (tile.y == 0)
+        {
+            addSeam(tile.bottom, NULL);
+        }
+    }
+
+    edges.clear();
+}
+
+void PlaneStats::addSeam(const std::vector<unsigned int>& side,
+    const std::vector<unsigned int>* other)
+{
+    for (size_t k = 0; k < side.size(); ++k)
+    {
+        if (other == NULL || k >= other->size())
+        {
+            // Nothing on the other side, the edge of the plane
+            if (countMoments)
+            {
+                ++moments[side[k]].perimeter;
+            }
+        }
+        else if ((*other)[k] != side[k])
+        {
+            if (countMoments)
+            {
+                ++moments[side[k]].perimeter;
+                ++moments[(*other)[k]].perimeter;
+            }
+
+            if (countAdjacency)
+            {
+                ++adjacency[makeEdgeKey(side[k], (*other)[k])];
+            }
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <map>
+#include <utility>
+#include <vector>
+#include <ext/hash_map>
+
+#include "Moments.h"
+
+namespace ext = __gnu_cxx;
+
+//
+// A pair of touching superpixels, the smaller spid in the high
+// 32 bits so sorting keys sorts the pairs.
+//
+typedef unsigned long long EdgeKey;
+
+inline EdgeKey makeEdgeKey(unsigned int a, unsigned int b)
+{
+    if (a > b)
+    {
+        unsigned int tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    return (EdgeKey(a) << 32) | b;
+}
+
+struct EdgeKeyHash
+{
+    size_t operator()(EdgeKey key) const
+    {
+        return size_t(key ^ (key >> 32) * 0x9E3779B1UL);
+    }
+};
+
+// Shared boundary length of each pair, in pixel edges
+typedef ext::hash_map<EdgeKey, unsigned int, EdgeKeyHash> AdjacencyMap;
+
+//
+// The spids along the four sides of one tile.  Pixels on either
+// side of a seam between tiles are in different tiles, so the
+// edges between them are only counted once the whole plane is done.
+//
+struct TileEdges
+{
+    TileEdges() : x(0), y(0), width(0), height(0) {}
+
+    // Pixels the tile covers
+    int x;
+    int y;
+    int width;
+    int height;
+
+    // left and right are indexed by y, bottom and top by x
+    std::vector<unsigned int> left;
+    std::vector<unsigned int> right;
+    std::vector<unsigned int> bottom;
+    std::vector<unsigned int> top;
+};
+
+// Tile edges by the x, y of the tile's first pixel
+typedef std::map<std::pair<int, int>, TileEdges> TileEdgesMap;
+
+//
+// Per-plane results beyond bounds and volumes, for the superpixels
+// of one plane plus the edges of the tiles seen so far.
+//
+// Both results come from the same walk over the edges between
+// 4-connected pixels: an edge between two different superpixels
+// adds to both perimeters and to the pair's adjacency, an edge on
+// the plane's border only adds to the perimeter.
+//
+struct PlaneStats
+{
+    PlaneStats() : countMoments(false), countAdjacency(false) {}
+
+    // Add other into this one and clear it
+    void merge(PlaneStats& other);
+
+    // Count the edges along tile seams and the plane's border,
+    // call once after every tile of the plane has been added
+    void addSeams();
+
+    bool countMoments;
+    bool countAdjacency;
+
+    MomentsMap moments;
+    AdjacencyMap adjacency;
+    TileEdgesMap edges;
+
+private:
+    void addSeam(const std::vector<unsigned int>& side,
+        const std::vector<unsigned int>* other);
+};
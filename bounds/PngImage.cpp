@@ -28,6 +28,18 @@ void abort_(const char * s, ...)
 }
 
 
+static void createPngReadStruct(png_structp& png_ptr, png_infop& info_ptr)
+{
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    
+    if (!png_ptr)
+        abort_("[read_png_file] png_create_read_struct failed");
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+        abort_("[read_png_file] png_create_info_struct failed");
+}
+
 PngImage::PngImage(const char* filename) :
     m_rgba(false),
     m_colsize(0)
@@ -44,19 +56,50 @@ PngImage::PngImage(const char* filename) :
 
 
     /* initialize stuff */
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    
-    if (!png_ptr)
-        abort_("[read_png_file] png_create_read_struct failed");
-
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
-        abort_("[read_png_file] png_create_info_struct failed");
+    png_structp png_ptr;
+    png_infop info_ptr;
+    createPngReadStruct(png_ptr, info_ptr);
 
     if (setjmp(png_jmpbuf(png_ptr)))
         abort_("[read_png_file] Error during init_io");
 
     png_init_io(png_ptr, fp);
+
+    readImage(png_ptr, info_ptr, filename);
+
+    fclose(fp);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+}
+
+PngImage::PngImage(const png_byte* data, size_t size, const char* name) :
+    m_rgba(false),
+    m_colsize(0)
+{
+    if (size < 8 || png_sig_cmp((png_bytep)data, 0, 8))
+        abort_("[read_png_file] File %s is not recognized as a PNG file", name);
+
+    PngMemorySource source;
+    source.data = data;
+    source.size = size;
+    source.pos = 8;
+
+    png_structp png_ptr;
+    png_infop info_ptr;
+    createPngReadStruct(png_ptr, info_ptr);
+
+    png_set_read_fn(png_ptr, &source, PngMemorySource::readMemory);
+
+    readImage(png_ptr, info_ptr, name);
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+}
+
+void PngImage::readImage(png_structp png_ptr, png_infop info_ptr,
+    const char* name)
+{
+    if (setjmp(png_jmpbuf(png_ptr)))
+        abort_("[read_png_file] Error reading header of %s", name);
+
     png_set_sig_bytes(png_ptr, 8);
 
     png_read_info(png_ptr, info_ptr);
@@ -67,6 +110,7 @@ PngImage::PngImage(const char* filename) :
     m_color_type = png_get_color_type(png_ptr, info_ptr);
     m_bit_depth = png_get_bit_depth(png_ptr, info_ptr);
 
+    png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr, info_ptr);
 
 
@@ -80,9 +124,6 @@ PngImage::PngImage(const char* filename) :
 
     png_read_image(png_ptr, m_row_pointers);
 
-    fclose(fp);
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    
     // We only support 8-bit RGBA or 16-bit Grayscale but we could
     // easily add support for more if needed, libpng supports 
     // them all.
@@ -98,7 +139,7 @@ PngImage::PngImage(const char* filename) :
     }
     else
     {
-        abort_("UNSUPPORTED PNG FORMAT: %s\n", filename);
+        abort_("UNSUPPORTED PNG FORMAT: %s\n", name);
     }
 }
 
@@ -109,6 +150,183 @@ PngImage::~PngImage()
     free(m_row_pointers);
 }
 
+void PngImage::getPixelIDRange(unsigned int& lo, unsigned int& hi) const
+{
+    lo = 0xFFFFFFFF;
+    hi = 0;
+
+    for (int y = 0; y < m_height; ++y)
+    {
+        const png_byte* row = m_row_pointers[y];
+
+        for (int x = 0; x < m_width; ++x)
+        {
+            unsigned int id;
+
+            if (m_rgba)
+            {
+                id = ((const unsigned int*)row)[x];
+            }
+            else
+            {
+                id = (row[2*x] << 8) + row[2*x + 1];
+            }
+
+            if (id < lo)
+            {
+                lo = id;
+            }
+            if (id > hi)
+            {
+                hi = id;
+            }
+        }
+    }
+}
+
+PngRowReader::PngRowReader() :
+    m_filename(NULL),
+    m_fp(NULL),
+    m_png_ptr(NULL),
+    m_info_ptr(NULL),
+    m_colsize(0),
+    m_width(0),
+    m_height(0),
+    m_interlaced(false)
+{
+}
+
+PngRowReader::~PngRowReader()
+{
+    close();
+}
+
+void PngRowReader::open(const char* filename)
+{
+    png_byte header[8];
+
+    m_filename = filename;
+
+    m_fp = fopen(filename, "rb");
+    if (!m_fp)
+        abort_("[read_png_row] File %s could not be opened for reading", filename);
+    if (fread(header, 1, 8, m_fp) != 8 || png_sig_cmp(header, 0, 8))
+        abort_("[read_png_row] File %s is not recognized as a PNG file", filename);
+
+    createReadStruct();
+    png_init_io(m_png_ptr, m_fp);
+
+    readHeader();
+}
+
+void PngRowReader::open(const png_byte* data, size_t size, const char* name)
+{
+    m_filename = name;
+
+    if (size < 8 || png_sig_cmp((png_bytep)data, 0, 8))
+        abort_("[read_png_row] File %s is not recognized as a PNG file", name);
+
+    m_source.data = data;
+    m_source.size = size;
+    m_source.pos = 8;
+
+    createReadStruct();
+    png_set_read_fn(m_png_ptr, &m_source, PngMemorySource::readMemory);
+
+    readHeader();
+}
+
+void PngMemorySource::readMemory(png_structp png_ptr, png_bytep out,
+    png_size_t length)
+{
+    PngMemorySource* source = (PngMemorySource*)png_get_io_ptr(png_ptr);
+
+    if (source->pos + length > source->size)
+        png_error(png_ptr, "read past end of data");
+
+    memcpy(out, source->data + source->pos, length);
+    source->pos += length;
+}
+
+void PngRowReader::createReadStruct()
+{
+    m_png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+    if (!m_png_ptr)
+        abort_("[read_png_row] png_create_read_struct failed");
+
+    m_info_ptr = png_create_info_struct(m_png_ptr);
+    if (!m_info_ptr)
+        abort_("[read_png_row] png_create_info_struct failed");
+}
+
+void PngRowReader::readHeader()
+{
+    if (setjmp(png_jmpbuf(m_png_ptr)))
+        abort_("[read_png_row] Error reading header of %s", m_filename);
+
+    png_set_sig_bytes(m_png_ptr, 8);
+
+    png_read_info(m_png_ptr, m_info_ptr);
+
+    m_width = png_get_image_width(m_png_ptr, m_info_ptr);
+    m_height = png_get_image_height(m_png_ptr, m_info_ptr);
+    m_interlaced = (png_get_interlace_type(m_png_ptr, m_info_ptr) !=
+        PNG_INTERLACE_NONE);
+
+    png_byte color_type = png_get_color_type(m_png_ptr, m_info_ptr);
+    png_byte bit_depth = png_get_bit_depth(m_png_ptr, m_info_ptr);
+
+    png_read_update_info(m_png_ptr, m_info_ptr);
+
+    // Same formats as PngImage
+    if (color_type == PNG_COLOR_TYPE_RGBA && bit_depth == 8)
+    {
+        m_colsize = 4;
+    }
+    else if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth == 16)
+    {
+        m_colsize = 2;
+    }
+    else
+    {
+        abort_("UNSUPPORTED PNG FORMAT: %s\n", m_filename);
+    }
+
+    size_t rowbytes = png_get_rowbytes(m_png_ptr, m_info_ptr);
+
+    if (m_row.size() < rowbytes)
+    {
+        m_row.resize(rowbytes);
+    }
+}
+
+const png_byte* PngRowReader::readRow()
+{
+    if (setjmp(png_jmpbuf(m_png_ptr)))
+        abort_("[read_png_row] Error reading row of %s", m_filename);
+
+    png_read_row(m_png_ptr, &m_row[0], NULL);
+
+    return &m_row[0];
+}
+
+void PngRowReader::close()
+{
+    if (m_png_ptr)
+    {
+        png_destroy_read_struct(&m_png_ptr, &m_info_ptr, NULL);
+        m_png_ptr = NULL;
+        m_info_ptr = NULL;
+    }
+
+    if (m_fp)
+    {
+        fclose(m_fp);
+        m_fp = NULL;
+    }
+}
+
 void PngImage::write(const char* filename)
 {
     /* create file */
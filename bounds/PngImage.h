@@ -1,11 +1,33 @@
+#pragma once
+
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include <vector>
+
+
+// Compressed PNG bytes which were already read into memory, handed
+// to libpng with png_set_read_fn(png_ptr, &source, readMemory)
+struct PngMemorySource
+{
+    const png_byte* data;
+    size_t size;
+    size_t pos;
+
+    static void readMemory(png_structp png_ptr, png_bytep out,
+        png_size_t length);
+};
+
 
 class PngImage
 {
 public:
     PngImage(const char* filename);
+
+    // Decode compressed PNG bytes in memory, name is only used in
+    // error messages
+    PngImage(const png_byte* data, size_t size,
+        const char* name = "PNG data");
     ~PngImage();
 
     void write(const char* filename);
@@ -31,10 +53,26 @@ public:
         }
     }
 
+    // Get a whole row, y is flipped like getPixel
+    const png_byte* getRow(int y) const
+    {
+        return m_row_pointers[m_height - y - 1];
+    }
+
+    // Lowest and highest pixel ID in the image
+    void getPixelIDRange(unsigned int& lo, unsigned int& hi) const;
+
     int getWidth() const { return m_width; }
     int getHeight() const { return m_height; }
 
+    // Bytes per pixel, 4 for RGBA or 2 for 16-bit grayscale
+    int getColSize() const { return m_colsize; }
+
 private:
+    // Read the header and every row once the input is set up
+    void readImage(png_structp png_ptr, png_infop info_ptr,
+        const char* name);
+
     bool m_rgba;
     int m_colsize;
 
@@ -46,3 +84,64 @@ private:
     
     png_bytep *m_row_pointers;
 };
+
+
+//
+// Decodes a PNG one row at a time with png_read_row, so only a single
+// row is ever held in memory.  The row buffer is kept between open()
+// calls so one reader can decode many tiles without reallocating.
+//
+// The PNG can come from a file, or from compressed bytes which were
+// already read into memory.
+//
+// Only non-interlaced images can be streamed; for interlaced images
+// isInterlaced() is true and the caller should use PngImage instead.
+//
+class PngRowReader
+{
+public:
+    PngRowReader();
+    ~PngRowReader();
+
+    // Open the file and read the header
+    void open(const char* filename);
+
+    // Read from compressed PNG bytes in memory, name is only used in
+    // error messages.  The bytes must stay put until close().
+    void open(const png_byte* data, size_t size, const char* name);
+
+    // Release the file and libpng state
+    void close();
+
+    // Decode the next row, top row first.  The returned pointer
+    // is good until the next call.
+    const png_byte* readRow();
+
+    int getWidth() const { return m_width; }
+    int getHeight() const { return m_height; }
+    int getColSize() const { return m_colsize; }
+    bool isInterlaced() const { return m_interlaced; }
+
+private:
+    // Not copyable
+    PngRowReader(const PngRowReader&);
+    PngRowReader& operator=(const PngRowReader&);
+
+    // Create the libpng structs, then read and check the header
+    void createReadStruct();
+    void readHeader();
+
+    const char* m_filename;
+    FILE* m_fp;
+    PngMemorySource m_source;
+
+    png_structp m_png_ptr;
+    png_infop m_info_ptr;
+
+    int m_colsize;
+    int m_width;
+    int m_height;
+    bool m_interlaced;
+
+    std::vector<png_byte> m_row;
+};
@@ -15,7 +15,7 @@
 //
 // Is there a stdlib thing for this?
 //
-std::string join(const std::string& p1, const std::string& p2)
+static std::string join(const std::string& p1, const std::string& p2)
 {
    char sep = '/';
    std::string tmp = p1;
@@ -36,9 +36,22 @@ std::string join(const std::string& p1, const std::string& p2)
 // Metadata
 //
 
-Metadata::Metadata(std::string root)
+Metadata::Metadata(std::string root) :
+    m_path(join(root, "tiles/metadata.txt")),
+    m_loaded(false)
 {
-    std::string path = join(root, "tiles/metadata.txt");
+}
+
+bool Metadata::exists()
+{
+    std::ifstream fin(m_path.c_str());
+    return bool(fin);
+}
+
+void Metadata::load()
+{
+    const std::string& path = m_path;
+    m_loaded = true;
 
     char buffer[1024];
     std::ifstream fin(path.c_str());
@@ -66,6 +79,11 @@ Metadata::Metadata(std::string root)
 
 int Metadata::getIntValue(std::string key)
 {
+    if (!m_loaded)
+    {
+        load();
+    }
+
     if (m_values.find(key) == m_values.end())
     {
         fprintf(stderr, "ERROR: no metadata value for '%s'\n", key.c_str());
@@ -88,6 +106,11 @@ Stack::Stack(const std::string& root, int tilesize) :
 {
 }
 
+bool Stack::hasMetadata()
+{
+    return m_metadata.exists();
+}
+
 int Stack::getMetadataValue(std::string key)
 {
     return m_metadata.getIntValue(key);
@@ -122,6 +145,40 @@ std::string Stack::getSuperpixelBoundsPath()
     return join(m_root, "superpixel_bounds.txt");
 }
 
+std::string Stack::getSuperpixelBoundsBinPath()
+{
+    return join(m_root, "superpixel_bounds.bin");
+}
+
+std::string Stack::getSuperpixelBoundsShardPath(int zmin, int zmax,
+    bool binary)
+{
+    char name[256];
+    snprintf(name, 256, "superpixel_bounds.%d-%d.%s", zmin, zmax,
+        binary ? "bin" : "txt");
+    return join(m_root, name);
+}
+
+std::string Stack::getSuperpixelMomentsPath()
+{
+    return join(m_root, "superpixel_moments.txt");
+}
+
+std::string Stack::getSuperpixelAdjacencyPath()
+{
+    return join(m_root, "superpixel_adjacency.bin");
+}
+
+std::string Stack::getBoundsManifestPath()
+{
+    return join(m_root, "superpixel_bounds.manifest");
+}
+
+std::string Stack::getStackPath()
+{
+    return join(m_root, "stack.h5");
+}
+
 std::string Stack::getTilePath(int lod, int row, int col, char channel, int section)
 {
     char path[1024];
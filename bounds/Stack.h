@@ -1,17 +1,26 @@
- #include <string>
+#pragma once
+
+#include <string>
 #include <map>
 
 //
-// Parses and holds metadata from tiles/metadata.txt
+// Parses and holds metadata from tiles/metadata.txt, the file is
+// read the first time a value is asked for
 //
 class Metadata
 {
 public:
     Metadata(std::string root);
 
+    bool exists();
+
     int getIntValue(std::string key);
 
 private:
+    void load();
+
+    std::string m_path;
+    bool m_loaded;
     std::map<std::string, std::string> m_values;
 };
 
@@ -23,12 +32,30 @@ class Stack
 public:
     Stack(const std::string& root, int tilesize);
 
+    // Stacks made from a label volume may have no tiles/metadata.txt
+    bool hasMetadata();
+
     int getMetadataValue(std::string key);
 
     int getNumRows(int lod);
     int getNumCols(int lod);
 
     std::string getSuperpixelBoundsPath();
+    std::string getSuperpixelBoundsBinPath();
+
+    // Bounds of planes zmin..zmax only, from a sharded run
+    std::string getSuperpixelBoundsShardPath(int zmin, int zmax,
+        bool binary);
+    std::string getSuperpixelMomentsPath();
+    std::string getSuperpixelAdjacencyPath();
+
+    // Tile signatures of the planes in the bounds file
+    std::string getBoundsManifestPath();
+
+    // Where compilestack writes the HDF5 stack
+    std::string getStackPath();
+
+    const std::string& getRoot() const { return m_root; }
 
     std::string getTilePath(int lod, int row, int col, char channel, int section);
 
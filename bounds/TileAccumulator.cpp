@@ -0,0 +1,362 @@
+#include "TileAccumulator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 256K entries is about 17MB per accumulator
+const unsigned int TileAccumulator::s_DENSE_MAX = 1 << 18;
+
+TileAccumulator::TileAccumulator() :
+    m_base(0),
+    m_range(0),
+    m_anchored(true),
+    m_lastSpid(0),
+    m_last(NULL),
+    m_stats(false),
+    m_countMoments(false),
+    m_countAdjacency(false),
+    m_hasPrev(false)
+{
+}
+
+void TileAccumulator::begin(unsigned int minSpid, unsigned int maxSpid)
+{
+    m_last = NULL;
+    m_anchored = true;
+    m_stats = false;
+    m_countMoments = false;
+
+    if (maxSpid - minSpid < s_DENSE_MAX)
+    {
+        setWindow(minSpid, maxSpid - minSpid + 1);
+    }
+    else
+    {
+        setWindow(0, 0);
+    }
+}
+
+void TileAccumulator::begin()
+{
+    m_last = NULL;
+    m_anchored = false;
+    m_stats = false;
+    m_countMoments = false;
+    setWindow(0, 0);
+}
+
+void TileAccumulator::beginStats(const PlaneStats& stats,
+    int x, int y, int width, int height)
+{
+    m_stats = true;
+    m_countMoments = stats.countMoments;
+    m_countAdjacency = stats.countAdjacency;
+    m_hasPrev = false;
+
+    m_edges.x = x;
+    m_edges.y = y;
+    m_edges.width = width;
+    m_edges.height = height;
+    m_edges.left.resize(height);
+    m_edges.right.resize(height);
+    m_edges.bottom.resize(width);
+    m_edges.top.resize(width);
+}
+
+void TileAccumulator::setWindow(unsigned int base, unsigned int range)
+{
+    m_base = base;
+    m_range = range;
+
+    if (m_denseAccum.size() < range)
+    {
+        m_denseAccum.resize(range);
+    }
+}
+
+TileAccumulator::Accum* TileAccumulator::lookup(unsigned int spid)
+{
+    unsigned int index = spid - m_base;
+
+    if (index >= m_range && !m_anchored && spid != 0)
+    {
+        // First real superpixel in a streamed tile, the rest
+        // of the tile's spids are very likely close to it
+        unsigned int half = s_DENSE_MAX / 2;
+        setWindow(spid > half ? spid - half : 0, s_DENSE_MAX);
+        m_anchored = true;
+
+        index = spid - m_base;
+    }
+
+    if (index < m_range)
+    {
+        Accum* accum = &m_denseAccum[index];
+
+        if (accum->volume == 0)
+        {
+            m_touched.push_back(index);
+        }
+
+        return accum;
+    }
+    else
+    {
+        // Nodes don't move when the map grows, so the pointer
+        // stays good until the entry is erased in finish()
+        return &m_sparseAccum[spid];
+    }
+}
+
+void TileAccumulator::addRow(const unsigned char* row, int colsize,
+    int width, int x, int y)
+{
+    int start = 0;
+
+    if (colsize == 4)
+    {
+        const unsigned int* pixels = (const unsigned int*)row;
+        unsigned int spid = pixels[0];
+
+        for (int k = 1; k < width; ++k)
+        {
+            if (pixels[k] != spid)
+            {
+                addSpan(spid, x + start, x + k - 1, y);
+                spid = pixels[k];
+                start = k;
+            }
+        }
+
+        addSpan(spid, x + start, x + width - 1, y);
+    }
+    else
+    {
+        unsigned int spid = (row[0] << 8) + row[1];
+
+        for (int k = 1; k < width; ++k)
+        {
+            unsigned int next = (row[2*k] << 8) + row[2*k + 1];
+
+            if (next != spid)
+            {
+                addSpan(spid, x + start, x + k - 1, y);
+                spid = next;
+                start = k;
+            }
+        }
+
+        addSpan(spid, x + start, x + width - 1, y);
+    }
+
+    if (m_stats)
+    {
+        addRowStats(row, colsize, width, y);
+    }
+}
+
+static inline unsigned int getSpid(const unsigned char* row, int colsize,
+    int k)
+{
+    if (colsize == 4)
+    {
+        return ((const unsigned int*)row)[k];
+    }
+    else
+    {
+        return (row[2*k] << 8) + row[2*k + 1];
+    }
+}
+
+void TileAccumulator::addEdge(unsigned int a, unsigned int b)
+{
+    if (m_countMoments)
+    {
+        ++lookup(a)->moments.perimeter;
+        ++lookup(b)->moments.perimeter;
+    }
+
+    if (m_countAdjacency)
+    {
+        ++m_adjacency[makeEdgeKey(a, b)];
+    }
+}
+
+void TileAccumulator::addRowStats(const unsigned char* row, int colsize,
+    int width, int y)
+{
+    // Edges between neighbours in the row, the tile's own left and
+    // right sides are counted by PlaneStats::addSeams()
+    for (int k = 1; k < width; ++k)
+    {
+        if (memcmp(row + (k - 1) * colsize, row + k * colsize, colsize) != 0)
+        {
+            addEdge(getSpid(row, colsize, k - 1), getSpid(row, colsize, k));
+        }
+    }
+
+    // Edges against the previous row, rows arrive in order but
+    // that can be either up or down
+    size_t rowbytes = size_t(width) * colsize;
+
+    if (m_hasPrev && memcmp(row, &m_prevRow[0], rowbytes) != 0)
+    {
+        for (int k = 0; k < width; ++k)
+        {
+            unsigned int spid = getSpid(row, colsize, k);
+            unsigned int prev = getSpid(&m_prevRow[0], colsize, k);
+
+            if (spid != prev)
+            {
+                addEdge(spid, prev);
+            }
+        }
+    }
+
+    m_prevRow.assign(row, row + rowbytes);
+    m_hasPrev = true;
+
+    // Save the tile's sides for the seams
+    int tileY = y - m_edges.y;
+
+    m_edges.left[tileY] = getSpid(row, colsize, 0);
+    m_edges.right[tileY] = getSpid(row, colsize, width - 1);
+
+    if (tileY == 0 || tileY == m_edges.height - 1)
+    {
+        std::vector<unsigned int>& side =
+            tileY == 0 ? m_edges.bottom : m_edges.top;
+
+        for (int k = 0; k < width; ++k)
+        {
+            side[k] = getSpid(row, colsize, k);
+        }
+    }
+}
+
+static void unionInto(unsigned int spid, const PixelBoundBox& box, int volume,
+    const Moments& moments,
+    TileAccumulator::BoundsMap& bounds, TileAccumulator::VolumeMap& volumes,
+    PlaneStats* stats)
+{
+    if (stats && stats->countMoments)
+    {
+        stats->moments[spid].add(moments);
+    }
+
+    // Only perimeter edges were counted here, the pixels went to
+    // the spid's other accumulator
+    if (volume == 0)
+    {
+        return;
+    }
+
+    TileAccumulator::BoundsMap::iterator it = bounds.find(spid);
+
+    if (it == bounds.end())
+    {
+        bounds[spid] = box;
+        volumes[spid] = volume;
+    }
+    else
+    {
+        (*it).second.unionBounds(box);
+        volumes[spid] += volume;
+    }
+}
+
+void TileAccumulator::finish(BoundsMap& bounds, VolumeMap& volumes,
+    PlaneStats* stats)
+{
+    if (!m_stats)
+    {
+        stats = NULL;
+    }
+
+    // A spid can be in both if it was seen before the window was
+    // anchored, unionInto() combines them correctly
+    for (size_t i = 0; i < m_touched.size(); ++i)
+    {
+        Accum& accum = m_denseAccum[m_touched[i]];
+        unionInto(m_base + m_touched[i], accum.box, accum.volume,
+            accum.moments, bounds, volumes, stats);
+        accum = Accum();
+    }
+
+    m_touched.clear();
+
+    for (AccumMap::iterator it = m_sparseAccum.begin();
+         it != m_sparseAccum.end(); ++it)
+    {
+        unionInto((*it).first, (*it).second.box, (*it).second.volume,
+            (*it).second.moments, bounds, volumes, stats);
+    }
+
+    m_sparseAccum.clear();
+
+    if (stats)
+    {
+        for (AdjacencyMap::iterator it = m_adjacency.begin();
+             it != m_adjacency.end(); ++it)
+        {
+            stats->adjacency[(*it).first] += (*it).second;
+        }
+
+        m_adjacency.clear();
+
+        TileEdges& tile =
+            stats->edges[std::make_pair(m_edges.x, m_edges.y)];
+
+        tile.x = m_edges.x;
+        tile.y = m_edges.y;
+        tile.width = m_edges.width;
+        tile.height = m_edges.height;
+        tile.left.swap(m_edges.left);
+        tile.right.swap(m_edges.right);
+        tile.bottom.swap(m_edges.bottom);
+        tile.top.swap(m_edges.top);
+    }
+
+    m_stats = false;
+    m_countMoments = false;
+
+    m_last = NULL;
+}
+
+bool isZeroBytes(const unsigned char* p, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // OR together 64 bytes at a time and compare once
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 64 <= n; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(p + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF)
+        {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        if (p[i] != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
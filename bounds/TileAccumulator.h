@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <ext/hash_map>
+
+#include "Moments.h"
+#include "PixelBoundBox.h"
+#include "PlaneStats.h"
+
+namespace ext = __gnu_cxx;
+
+//
+// Accumulates bounds and volumes for the superpixels of one tile.
+//
+// Pixels are fed one scanline at a time and identical spids along
+// a scanline are grouped into runs, so we do one update per run
+// instead of one per pixel.  The accumulator of the last spid is
+// remembered, since neighbouring runs are very often the same
+// superpixel.
+//
+// Spids inside a compact window index a dense array, anything
+// outside the window falls back to a hash_map.  Either way the
+// plane maps are only touched once per spid, in finish().
+//
+// Moments, perimeters and adjacency are only accumulated if
+// beginStats() is called for the tile, they cost a second pass
+// over each row.
+//
+class TileAccumulator
+{
+public:
+    typedef ext::hash_map<unsigned int, PixelBoundBox> BoundsMap;
+    typedef ext::hash_map<unsigned int, int> VolumeMap;
+
+    TileAccumulator();
+
+    // Start a new tile whose spids are all in [minSpid, maxSpid]
+    void begin(unsigned int minSpid, unsigned int maxSpid);
+
+    // Start a new tile whose spid range is not known up front, as
+    // when streaming rows.  The dense window is centered on the
+    // first non-zero spid we see.
+    void begin();
+
+    // Also accumulate what stats asks for in this tile, which
+    // covers the given pixels.  Call after begin().
+    void beginStats(const PlaneStats& stats,
+        int x, int y, int width, int height);
+
+    bool hasStats() const { return m_stats; }
+
+    // Add one decoded scanline.  colsize is 4 for RGBA (spid is
+    // the native 32-bit value) or 2 for 16-bit big endian gray.
+    // The pixels cover x..x+width-1 on row y.
+    void addRow(const unsigned char* row, int colsize, int width,
+        int x, int y);
+
+    // Add a run of pixels x0..x1 on row y which are all spid
+    void addSpan(unsigned int spid, int x0, int x1, int y)
+    {
+        if (m_last == NULL || spid != m_lastSpid)
+        {
+            m_last = lookup(spid);
+            m_lastSpid = spid;
+        }
+
+        if (m_last->volume == 0)
+        {
+            m_last->box = PixelBoundBox(x0, y, x1, y);
+        }
+        else
+        {
+            m_last->box.unionSpan(x0, x1, y);
+        }
+
+        m_last->volume += x1 - x0 + 1;
+
+        if (m_countMoments)
+        {
+            m_last->moments.addSpan(x0, x1, y);
+        }
+    }
+
+    // Union everything into the plane maps and reset for the next
+    // tile.  stats may be NULL if beginStats() was not called.
+    void finish(BoundsMap& bounds, VolumeMap& volumes, PlaneStats* stats);
+
+private:
+    struct Accum
+    {
+        Accum() : volume(0) {}
+
+        PixelBoundBox box;
+        int volume;
+        Moments moments;
+    };
+
+    typedef ext::hash_map<unsigned int, Accum> AccumMap;
+
+    Accum* lookup(unsigned int spid);
+
+    // Count edges inside the row and against the row before it,
+    // and save the tile's sides
+    void addRowStats(const unsigned char* row, int colsize, int width,
+        int y);
+
+    // Count one edge between two different superpixels
+    void addEdge(unsigned int a, unsigned int b);
+
+    // Largest spid range we will index densely
+    static const unsigned int s_DENSE_MAX;
+
+    // Set up the dense window [base, base + range)
+    void setWindow(unsigned int base, unsigned int range);
+
+    // Dense window, m_range is zero if there is none
+    unsigned int m_base;
+    unsigned int m_range;
+    bool m_anchored;
+
+    // Indexed by spid - m_base, plus which entries were touched
+    std::vector<Accum> m_denseAccum;
+    std::vector<unsigned int> m_touched;
+
+    // Spids outside the window
+    AccumMap m_sparseAccum;
+
+    unsigned int m_lastSpid;
+    Accum* m_last;
+
+    // Stats state, only used if m_stats
+    bool m_stats;
+    bool m_countMoments;
+    bool m_countAdjacency;
+    AdjacencyMap m_adjacency;
+    TileEdges m_edges;
+    std::vector<unsigned char> m_prevRow;
+    bool m_hasPrev;
+};
+
+// Return true if all n bytes are zero, uses SSE2 when available
+bool isZeroBytes(const unsigned char* p, size_t n);
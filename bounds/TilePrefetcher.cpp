@@ -0,0 +1,178 @@
+#include "TilePrefetcher.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+int TileOrder::getNumPlanes() const
+{
+    return planes.empty() ? zmax - zmin + 1 : int(planes.size());
+}
+
+int TileOrder::getPlane(int n) const
+{
+    return planes.empty() ? zmin + n : planes[n];
+}
+
+void TileOrder::getTile(long index, int& z, int& i, int& j) const
+{
+    int tile = int(index % tilesPerPlane());
+
+    z = getPlane(int(index / tilesPerPlane()));
+    i = tile / rows;
+    j = tile % rows;
+}
+
+long TileOrder::getIndex(int z, int i, int j) const
+{
+    long n = z - zmin;
+
+    if (!planes.empty())
+    {
+        n = std::lower_bound(planes.begin(), planes.end(), z) - planes.begin();
+    }
+
+    return n * tilesPerPlane() + i * rows + j;
+}
+
+TilePrefetcher::TilePrefetcher(Stack& stack, const TileOrder& order,
+    int threads, int depth) :
+    m_stack(stack),
+    m_order(order),
+    m_numThreads(threads),
+    m_depth(depth),
+    m_nextRead(0),
+    m_inflight(0),
+    m_stop(false)
+{
+}
+
+TilePrefetcher::~TilePrefetcher()
+{
+    {
+        ScopedLock lock(m_mutex);
+        m_stop = true;
+        m_changed.broadcast();
+    }
+
+    joinThreads(m_threads);
+
+    for (BufferMap::iterator it = m_buffers.begin(); it != m_buffers.end(); ++it)
+    {
+        delete (*it).second;
+    }
+}
+
+void TilePrefetcher::start()
+{
+    startThreads(m_numThreads, ioMain, this, m_threads);
+}
+
+void* TilePrefetcher::ioMain(void* arg)
+{
+    TilePrefetcher* prefetcher = (TilePrefetcher*)arg;
+    prefetcher->runIO();
+    return NULL;
+}
+
+void TilePrefetcher::runIO()
+{
+    while (true)
+    {
+        long index;
+        Buffer* buffer;
+
+        {
+            ScopedLock lock(m_mutex);
+
+            while (!m_stop && m_nextRead < m_order.size() &&
+                   m_inflight >= m_depth)
+            {
+                m_changed.wait(m_mutex);
+            }
+
+            if (m_stop || m_nextRead == m_order.size())
+            {
+                return;
+            }
+
+            index = m_nextRead++;
+            ++m_inflight;
+
+            buffer = new Buffer();
+            m_buffers[index] = buffer;
+        }
+
+        int z, i, j;
+        m_order.getTile(index, z, i, j);
+
+        readFile(m_stack.getTilePath(0, j, i, 's', z), buffer->bytes);
+
+        {
+            ScopedLock lock(m_mutex);
+            buffer->ready = true;
+            m_changed.broadcast();
+        }
+    }
+}
+
+void TilePrefetcher::readFile(const std::string& path, TileBytes& bytes)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+
+    if (!fp)
+    {
+        fprintf(stderr, "ERROR: cannot open tile %s\n", path.c_str());
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    bytes.resize(size);
+
+    if (size > 0 && fread(&bytes[0], 1, size, fp) != size_t(size))
+    {
+        fprintf(stderr, "ERROR: cannot read tile %s\n", path.c_str());
+        exit(1);
+    }
+
+    fclose(fp);
+}
+
+const TileBytes& TilePrefetcher::get(long index)
+{
+    ScopedLock lock(m_mutex);
+
+    while (true)
+    {
+        BufferMap::iterator it = m_buffers.find(index);
+
+        if (it != m_buffers.end() && (*it).second->ready)
+        {
+            // Buffer is only deleted by release(), so this
+            // reference stays good after we unlock
+            return (*it).second->bytes;
+        }
+
+        m_changed.wait(m_mutex);
+    }
+}
+
+void TilePrefetcher::release(long index)
+{
+    ScopedLock lock(m_mutex);
+
+    BufferMap::iterator it = m_buffers.find(index);
+
+    if (it != m_buffers.end())
+    {
+        delete (*it).second;
+        m_buffers.erase(it);
+
+        --m_inflight;
+        m_changed.broadcast();
+    }
+}
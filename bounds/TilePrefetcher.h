@@ -0,0 +1,100 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "Stack.h"
+#include "Threads.h"
+
+//
+// The order we process tiles in: plane by plane, and within a
+// plane column by column, then row by row.  Tile index N is the
+// Nth tile in that order.
+//
+// Normally every plane from zmin to zmax is processed.  If planes
+// is not empty only those planes are, it must be sorted.
+//
+struct TileOrder
+{
+    TileOrder() : zmin(0), zmax(-1), rows(0), cols(0) {}
+
+    int tilesPerPlane() const { return rows * cols; }
+    long size() const { return long(getNumPlanes()) * tilesPerPlane(); }
+
+    // Planes in the order they are processed
+    int getNumPlanes() const;
+    int getPlane(int n) const;
+
+    void getTile(long index, int& z, int& i, int& j) const;
+    long getIndex(int z, int i, int j) const;
+
+    int zmin;
+    int zmax;
+    int rows;
+    int cols;
+    std::vector<int> planes;
+};
+
+typedef std::vector<unsigned char> TileBytes;
+
+//
+// Reads compressed tiles ahead of the decoders.
+//
+// I/O threads read whole tile files into memory in TileOrder, so
+// on network storage the wait for one tile overlaps the decode of
+// the tiles before it.  At most depth tiles are held in memory,
+// counting the ones being read and the ones being decoded.
+//
+// Decoders call get() for the tile they want, which blocks until
+// it has been read, and then release() when they are done.
+//
+class TilePrefetcher
+{
+public:
+    TilePrefetcher(Stack& stack, const TileOrder& order,
+        int threads, int depth);
+
+    // Stops and joins the I/O threads
+    ~TilePrefetcher();
+
+    void start();
+
+    // Wait for the tile to be read and return its bytes, they
+    // stay valid until release()
+    const TileBytes& get(long index);
+
+    // Free the tile's bytes, making room to read another
+    void release(long index);
+
+private:
+    struct Buffer
+    {
+        Buffer() : ready(false) {}
+
+        TileBytes bytes;
+        bool ready;
+    };
+
+    typedef std::map<long, Buffer*> BufferMap;
+
+    static void* ioMain(void* arg);
+    void runIO();
+
+    // Read the whole file into bytes
+    void readFile(const std::string& path, TileBytes& bytes);
+
+    Stack& m_stack;
+    TileOrder m_order;
+    int m_numThreads;
+    int m_depth;
+
+    ThreadList m_threads;
+
+    // Guarded by m_mutex
+    Mutex m_mutex;
+    Condition m_changed;
+    BufferMap m_buffers;
+    long m_nextRead;
+    int m_inflight;
+    bool m_stop;
+};
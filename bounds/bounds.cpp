@@ -8,155 +8,1419 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <set>
+#include <vector>
 #include <ext/hash_map>
 #include <iostream>
 #include <fstream>
 
+#include "HdfStack.h"
+#include "timers.h"
+
+#include "BoundsInput.h"
+#include "Checkpoint.h"
+#include "BoundsManifest.h"
+#include "BoundsOutput.h"
+#include "AdjacencyFile.h"
+#include "LabelVolume.h"
 #include "PngImage.h"
 #include "PixelBoundBox.h"
 #include "Stack.h"
+#include "Threads.h"
+#include "TileAccumulator.h"
+#include "TilePrefetcher.h"
+
+namespace ext = __gnu_cxx;
+
+class BoundsCreator
+{
+public:
+    // Command line options
+    struct Options
+    {
+        Options() :
+            threads(1),
+            ioThreads(0),
+            queueDepth(16),
+            binary(false),
+            compile(false),
+            update(false),
+            moments(false),
+            adjacency(false),
+            dataset("stack"),
+            zmin(-1),
+            zmax(-1),
+            checkpoint(false)
+        {}
+
+        // Decode threads, 1 means the serial path
+        int threads;
+
+        // Threads reading tiles ahead of the decoders, 0 means
+        // each decoder reads its own tiles
+        int ioThreads;
+
+        // Most tiles held in memory by the readahead
+        int queueDepth;
+
+        // Write superpixel_bounds.bin instead of the TXT file
+        bool binary;
+
+        // Keep the bounds in memory and write stack.h5 directly,
+        // same result as running compilestack afterwards
+        bool compile;
+
+        // Recompute only some planes and splice them into the
+        // existing output
+        bool update;
+
+        // Planes to update, if empty the manifest decides
+        std::set<int> planes;
+
+        // Also write superpixel_moments.txt
+        bool moments;
+
+        // Also write superpixel_adjacency.bin
+        bool adjacency;
+
+        // Read labels from this HDF5 file instead of the tiles
+        std::string volume;
+        std::string dataset;
+
+        // Only do these planes instead of the metadata's range,
+        // -1 if not given.  The output is a shard of the bounds
+        // for mergebounds to put together.
+        int zmin;
+        int zmax;
+
+        bool isShard() const { return zmin >= 0 || zmax >= 0; }
+
+        // Save progress after every plane, and resume from it if
+        // an earlier run was killed
+        bool checkpoint;
+    };
+
+    BoundsCreator(std::string root, int tilesize, const Options& options);
+
+    typedef ext::hash_map<unsigned int, PixelBoundBox> BoundsMap;
+    typedef ext::hash_map<unsigned int, int> VolumeMap;
+
+    // Per-thread scratch space, reused from tile to tile
+    struct TileScratch
+    {
+        TileAccumulator accum;
+        PngRowReader reader;
+    };
+
+    void create();
+
+    void processPlane(int z);
+    // stats is NULL unless we are computing moments or adjacency
+    void processTile(int z, int i, int j,
+        BoundsMap& bounds,
+        VolumeMap& volumes,
+        PlaneStats* stats,
+        TileScratch& scratch);
+
+private:    
+    // Decode a tile row by row, feeding each row to the accumulator
+    void streamTile(PngRowReader& reader, int baseX, int baseY,
+        BoundsMap& bounds, VolumeMap& volumes, PlaneStats* stats,
+        TileAccumulator& accum);
+
+    // Accumulate a tile which was decoded in full
+    void processImage(const PngImage& image, int baseX, int baseY,
+        BoundsMap& bounds, VolumeMap& volumes, PlaneStats* stats,
+        TileAccumulator& accum);
+
+    bool isTileEmpty(const PngImage& image);
+
+    // Write the rows for one finished plane, sorted by spid
+    void writePlane(int z, BoundsMap& bounds, VolumeMap& volumes,
+        PlaneStats* stats);
+
+    // Create superpixel_moments.txt and write its header, or
+    // reopen it to resume from a checkpoint.  It may already exist
+    // if we are resuming.
+    void openMoments(const Checkpoint* reopen, bool resuming);
+
+    // Sync the outputs and record that plane z is done
+    void saveCheckpoint(int z);
+
+    // Set up stats for a plane, NULL if we are not computing any
+    PlaneStats* getStats(PlaneStats& stats);
+
+    // Open the label volume and size m_order from it
+    void openVolume();
+
+    // Narrow m_order to the --zmin/--zmax planes
+    void chooseShard();
+
+    // Decide which planes --update recomputes, fills m_order.planes
+    // and the signatures of those planes
+    void choosePlanes(BoundsManifest& current);
+
+    // Replace the updated planes of the output file with the
+    // new rows from bounds
+    void spliceOutput(const std::string& outpath, Table* bounds);
+
+    // Build stack.h5 from the bounds table and the mapping files
+    void compileStack(const std::string& outpath, Table* bounds);
+
+    //
+    // Worker pool, used when there is more than one thread
+    //
+    // Tiles are handed out in plane order.  Each worker accumulates
+    // into its own maps and merges them into the shared PlaneResult
+    // when it moves on to another plane.  The main thread writes
+    // planes out in order as they complete, so the output is the
+    // same as the serial path.
+    //
+    struct PlaneResult
+    {
+        PlaneResult() : tilesDone(0) {}
+
+        Mutex mutex;
+        BoundsMap bounds;
+        VolumeMap volumes;
+        PlaneStats stats;
+        int tilesDone;
+    };
+
+    typedef std::map<int, PlaneResult*> PlaneResultMap;
+
+    enum ClaimResult { CLAIM_TILE, CLAIM_FLUSH, CLAIM_DONE };
+
+    void processPlanesParallel();
+
+    static void* workerMain(void* arg);
+    void runWorker();
+
+    // Claim the next tile.  A worker holding tiles of heldZ is
+    // told to flush them before it moves on to another plane,
+    // so the writer never waits on a worker which is blocked.
+    ClaimResult claimTile(int heldZ, int& z, int& i, int& j);
+
+    // Wait for planes to finish and write them in order
+    void writePlanes();
+
+    // Merge one worker's maps into the shared result for plane z
+    void mergeTiles(int z, int tiles, BoundsMap& bounds, VolumeMap& volumes,
+        PlaneStats& stats);
+
+    //
+    // Label volume input
+    //
+    // The work unit is one block of the volume: a tile of the plane
+    // grid but as many planes deep as a chunk.  Each worker splits
+    // its block into planes and merges each one like a tile, so the
+    // writer is the same as for tiles.
+    //
+    void processVolume();
+
+    static void* volumeWorkerMain(void* arg);
+    void runVolumeWorker();
+
+    // Get the next block, false when there are none left
+    bool claimBlock(long& block);
+
+    // Accumulate one plane of a block, rows are top row first
+    void processBlock(const unsigned int* labels, int baseX, int baseY,
+        int width, int height, BoundsMap& bounds, VolumeMap& volumes,
+        PlaneStats* stats, TileAccumulator& accum);
+
+    Stack m_stack;
+    int m_tilesize;
+    Options m_options;
+
+    // Every tile we will process, in order
+    TileOrder m_order;
+
+    // Reads tiles ahead if we have I/O threads, otherwise NULL
+    TilePrefetcher* m_prefetcher;
+
+    // Label volume we read instead of tiles, otherwise NULL
+    LabelVolume* m_volume;
+
+    BoundsOutput* m_output;
+
+    // superpixel_moments.txt if we are computing moments
+    FILE* m_momentsf;
+
+    // superpixel_adjacency.bin if we are computing adjacency
+    AdjacencyFile* m_adjacency;
+
+    // Progress of a --checkpoint run, otherwise NULL
+    Checkpoint* m_checkpoint;
+    std::string m_checkpointPath;
+
+    // Scratch space for the serial path, workers have their own
+    TileScratch m_scratch;
+
+    // Shared worker state, guarded by m_mutex
+    Mutex m_mutex;
+    Condition m_changed;
+    PlaneResultMap m_results;
+    long m_nextTile;
+
+    // Position in m_order of the next plane to write
+    int m_nextWrite;
+};
+
+// We never overwrite an output file
+static void exitIfExists(const std::string& path)
+{
+    struct stat buf;
+    if (stat(path.c_str(), &buf) == 0)
+    {
+        fprintf(stderr, "ERROR: %s already exists\n", path.c_str());
+        fprintf(stderr, "ERROR: delete first to recreate.\n");
+        exit(1);
+    }
+}
+
+BoundsCreator::BoundsCreator(std::string root, int tilesize,
+    const Options& options) :
+    m_stack(root, tilesize),
+    m_tilesize(tilesize),
+    m_options(options),
+    m_prefetcher(NULL),
+    m_volume(NULL),
+    m_output(NULL),
+    m_momentsf(NULL),
+    m_adjacency(NULL),
+    m_checkpoint(NULL),
+    m_nextTile(0),
+    m_nextWrite(0)
+{
+}
+
+void BoundsCreator::create()
+{
+    if (!m_options.volume.empty())
+    {
+        openVolume();
+    }
+    else
+    {
+        m_order.rows = m_stack.getNumRows(0);
+        m_order.cols = m_stack.getNumCols(0);
+        m_order.zmin = m_stack.getMetadataValue("zmin");
+        m_order.zmax = m_stack.getMetadataValue("zmax");
+    }
+
+    if (m_options.isShard())
+    {
+        chooseShard();
+    }
+
+    int zmin = m_order.zmin;
+    int zmax = m_order.zmax;
+
+    printf("Rows=%d\n", m_order.rows);
+    printf("Cols=%d\n", m_order.cols);
+    printf("zmin=%d\n", zmin);
+    printf("zmax=%d\n", zmax);
+
+    std::string outpath;
+
+    // The bounds file in the format we are not writing, compilestack
+    // would have to guess which of the two is current
+    std::string otherpath;
+
+    if (m_options.compile)
+    {
+        outpath = m_stack.getStackPath();
+    }
+    else if (m_options.isShard())
+    {
+        outpath = m_stack.getSuperpixelBoundsShardPath(zmin, zmax,
+            m_options.binary);
+        otherpath = m_stack.getSuperpixelBoundsShardPath(zmin, zmax,
+            !m_options.binary);
+    }
+    else if (m_options.binary)
+    {
+        outpath = m_stack.getSuperpixelBoundsBinPath();
+        otherpath = m_stack.getSuperpixelBoundsPath();
+    }
+    else
+    {
+        outpath = m_stack.getSuperpixelBoundsPath();
+        otherpath = m_stack.getSuperpixelBoundsBinPath();
+    }
+
+    struct stat buf;
+    bool exists = stat(outpath.c_str(), &buf) == 0;
+
+    if (m_options.update && !exists)
+    {
+        fprintf(stderr, "ERROR: %s does not exist\n", outpath.c_str());
+        fprintf(stderr, "ERROR: run without --update to create it.\n");
+        exit(1);
+    }
+
+    // Where an earlier --checkpoint run stopped, if it did
+    Checkpoint resume;
+    bool resuming = false;
+
+    if (m_options.checkpoint)
+    {
+        m_checkpointPath = outpath + ".checkpoint";
+
+        m_checkpoint = new Checkpoint();
+        m_checkpoint->zmin = zmin;
+        m_checkpoint->zmax = zmax;
+        m_checkpoint->binary = m_options.binary;
+        m_checkpoint->moments = m_options.moments;
+        m_checkpoint->adjacency = m_options.adjacency;
+
+        resuming = resume.read(m_checkpointPath);
+
+        if (resuming && !resume.matches(*m_checkpoint))
+        {
+            fprintf(stderr, "ERROR: %s is from a run with other options\n",
+                m_checkpointPath.c_str());
+            exit(1);
+        }
+    }
+
+    if (!m_options.update && !resuming)
+    {
+        exitIfExists(outpath);
+    }
+
+    if (!m_options.update && !otherpath.empty())
+    {
+        exitIfExists(otherpath);
+    }
+
+    // Signatures of the planes we process, taken before reading
+    // their tiles so a tile changed during the run is caught next time
+    BoundsManifest current;
+
+    // A checkpointed run keeps them from its first start
+    std::string signaturepath = m_checkpointPath + ".manifest";
+
+    if (m_options.update)
+    {
+        choosePlanes(current);
+
+        if (m_order.planes.empty())
+        {
+            printf("All planes are up to date\n");
+            return;
+        }
+
+        // Only the updated planes are held in memory
+        m_output = new TableBoundsOutput();
+    }
+    else
+    {
+        if (resuming)
+        {
+            if (!current.read(signaturepath))
+            {
+                fprintf(stderr, "ERROR: cannot read %s\n",
+                    signaturepath.c_str());
+                exit(1);
+            }
+
+            // lastPlane is zmin - 1 until the first plane is written
+            if (resume.lastPlane < zmin)
+            {
+                printf("No plane finished yet, starting at plane %d\n",
+                    zmin);
+            }
+            else
+            {
+                printf("Resuming after plane %d\n", resume.lastPlane);
+            }
+
+            for (int z = resume.lastPlane + 1; z < zmax + 1; ++z)
+            {
+                m_order.planes.push_back(z);
+            }
+        }
+        else
+        {
+            // There are no tiles to sign for a label volume
+            for (int z = zmin; z < zmax + 1 && !m_volume; ++z)
+            {
+                current.setSignature(z,
+                    BoundsManifest::computeSignature(m_stack, m_order, z));
+            }
+
+            // Checkpoint before creating the outputs, so a run
+            // killed at any point after this can be resumed
+            if (m_checkpoint)
+            {
+                current.write(signaturepath);
+
+                m_checkpoint->lastPlane = zmin - 1;
+                m_checkpoint->write(m_checkpointPath);
+            }
+        }
+
+        // A run killed while creating the outputs has no sizes
+        // yet, and creates them again
+        const Checkpoint* reopen =
+            resuming && resume.boundsSize >= 0 ? &resume : NULL;
+
+        if (m_options.moments)
+        {
+            openMoments(reopen, resuming);
+        }
+
+        if (m_options.adjacency)
+        {
+            std::string path = m_stack.getSuperpixelAdjacencyPath();
+
+            if (reopen)
+            {
+                m_adjacency = new AdjacencyFile(path, reopen->adjacencySize);
+            }
+            else
+            {
+                if (!resuming)
+                {
+                    exitIfExists(path);
+                }
+
+                m_adjacency = new AdjacencyFile(path);
+            }
+        }
+
+        if (m_options.compile)
+        {
+            m_output = new TableBoundsOutput();
+        }
+        else if (reopen && m_options.binary)
+        {
+            m_output = new BinaryBoundsOutput(outpath, reopen->boundsSize);
+        }
+        else if (reopen)
+        {
+            m_output = new TextBoundsOutput(outpath, reopen->boundsSize);
+        }
+        else if (m_options.binary)
+        {
+            m_output = new BinaryBoundsOutput(outpath);
+        }
+        else
+        {
+            m_output = new TextBoundsOutput(outpath);
+        }
+
+        // Record the sizes of the outputs as they are now
+        if (m_checkpoint)
+        {
+            saveCheckpoint(resuming ? resume.lastPlane : zmin - 1);
+        }
+    }
+
+    // Nothing left to do but finish the outputs
+    bool finished = resuming && m_order.planes.empty();
+
+    if (m_options.ioThreads > 0 && !finished)
+    {
+        printf("io-threads=%d queue-depth=%d\n",
+            m_options.ioThreads, m_options.queueDepth);
+
+        m_prefetcher = new TilePrefetcher(m_stack, m_order,
+            m_options.ioThreads, m_options.queueDepth);
+        m_prefetcher->start();
+    }
+
+    if (finished)
+    {
+        printf("All planes were done before the checkpoint\n");
+    }
+    else if (m_volume)
+    {
+        printf("threads=%d\n", m_options.threads);
+        processVolume();
+    }
+    else if (m_options.threads > 1)
+    {
+        printf("threads=%d\n", m_options.threads);
+        processPlanesParallel();
+    }
+    else
+    {
+        for (int n = 0; n < m_order.getNumPlanes(); ++n)
+        {
+            processPlane(m_order.getPlane(n));
+        }
+    }
+
+    delete m_prefetcher;
+    m_prefetcher = NULL;
+
+    delete m_volume;
+    m_volume = NULL;
+
+    m_output->close();
+
+    if (m_momentsf)
+    {
+        fclose(m_momentsf);
+        m_momentsf = NULL;
+    }
+
+    if (m_adjacency)
+    {
+        m_adjacency->close();
+        delete m_adjacency;
+        m_adjacency = NULL;
+    }
+
+    if (m_options.compile)
+    {
+        compileStack(outpath, ((TableBoundsOutput*)m_output)->getTable());
+    }
+    else
+    {
+        std::string manifestpath = m_stack.getBoundsManifestPath();
+
+        if (m_options.update)
+        {
+            spliceOutput(outpath, ((TableBoundsOutput*)m_output)->getTable());
+
+            // Keep the old signatures of planes we did not touch
+            BoundsManifest manifest;
+            manifest.read(manifestpath);
+
+            for (int n = 0; n < m_order.getNumPlanes(); ++n)
+            {
+                int z = m_order.getPlane(n);
+                uint64 signature;
+                current.getSignature(z, signature);
+                manifest.setSignature(z, signature);
+            }
+
+            manifest.write(manifestpath);
+        }
+        else if (m_options.isShard())
+        {
+            // The manifest covers the whole bounds file, which a
+            // shard is not
+        }
+        else if (!m_options.volume.empty())
+        {
+            // The tiles did not make these bounds, so a manifest
+            // left from an earlier run must not vouch for them
+            unlink(manifestpath.c_str());
+        }
+        else
+        {
+            current.write(manifestpath);
+        }
+    }
+
+    delete m_output;
+    m_output = NULL;
+
+    if (m_checkpoint)
+    {
+        // The outputs are complete
+        unlink(m_checkpointPath.c_str());
+        unlink(signaturepath.c_str());
+
+        delete m_checkpoint;
+        m_checkpoint = NULL;
+    }
+}
+
+void BoundsCreator::openMoments(const Checkpoint* reopen, bool resuming)
+{
+    std::string path = m_stack.getSuperpixelMomentsPath();
+
+    if (reopen)
+    {
+        m_momentsf = reopenFile(path, reopen->momentsSize);
+        return;
+    }
+
+    if (!resuming)
+    {
+        exitIfExists(path);
+    }
+
+    m_momentsf = fopen(path.c_str(), "w");
+
+    if (!m_momentsf)
+    {
+        fprintf(stderr, "Cannot open output file: %s\n", path.c_str());
+        exit(1);
+    }
+
+    // Same plane and sp columns as superpixel_bounds.txt
+    fprintf(m_momentsf, "# superpixel moments and shape\n");
+    fprintf(m_momentsf, "# plane\tsp\tcx cy mxx myy mxy orientation "
+        "major minor perimeter\n\n");
+}
+
+void BoundsCreator::saveCheckpoint(int z)
+{
+    m_checkpoint->lastPlane = z;
+    m_checkpoint->boundsSize = m_output->sync();
+
+    if (m_momentsf)
+    {
+        m_checkpoint->momentsSize =
+            syncFile(m_momentsf, m_stack.getSuperpixelMomentsPath());
+    }
+
+    if (m_adjacency)
+    {
+        m_checkpoint->adjacencySize = m_adjacency->sync();
+    }
+
+    m_checkpoint->write(m_checkpointPath);
+}
+
+PlaneStats* BoundsCreator::getStats(PlaneStats& stats)
+{
+    if (!m_momentsf && !m_adjacency)
+    {
+        return NULL;
+    }
+
+    stats.countMoments = m_momentsf != NULL;
+    stats.countAdjacency = m_adjacency != NULL;
+
+    return &stats;
+}
+
+void BoundsCreator::openVolume()
+{
+    m_volume = new LabelVolume(m_options.volume, m_options.dataset, m_tilesize);
+
+    int width = m_volume->getWidth();
+    int height = m_volume->getHeight();
+    int blockWidth = m_volume->getBlockWidth();
+    int blockHeight = m_volume->getBlockHeight();
+
+    m_order.rows = (height + blockHeight - 1) / blockHeight;
+    m_order.cols = (width + blockWidth - 1) / blockWidth;
+
+    // Number planes like the stack if it has metadata, then the
+    // volume must be the same size
+    m_order.zmin = 0;
+
+    if (m_stack.hasMetadata())
+    {
+        m_order.zmin = m_stack.getMetadataValue("zmin");
+
+        if (m_stack.getMetadataValue("width") != width ||
+            m_stack.getMetadataValue("height") != height ||
+            m_stack.getMetadataValue("zmax") - m_order.zmin + 1 !=
+                m_volume->getDepth())
+        {
+            fprintf(stderr, "ERROR: volume size does not match "
+                "tiles/metadata.txt\n");
+            exit(1);
+        }
+    }
+
+    m_order.zmax = m_order.zmin + m_volume->getDepth() - 1;
+}
+
+void BoundsCreator::chooseShard()
+{
+    int zmin = m_options.zmin >= 0 ? m_options.zmin : m_order.zmin;
+    int zmax = m_options.zmax >= 0 ? m_options.zmax : m_order.zmax;
+
+    if (zmin < m_order.zmin || zmax > m_order.zmax || zmin > zmax)
+    {
+        fprintf(stderr, "ERROR: planes %d-%d are not within %d-%d\n",
+            zmin, zmax, m_order.zmin, m_order.zmax);
+        exit(1);
+    }
+
+    m_order.zmin = zmin;
+    m_order.zmax = zmax;
+}
+
+void BoundsCreator::choosePlanes(BoundsManifest& current)
+{
+    if (!m_options.planes.empty())
+    {
+        for (std::set<int>::iterator it = m_options.planes.begin();
+             it != m_options.planes.end(); ++it)
+        {
+            int z = *it;
+
+            if (z < m_order.zmin || z > m_order.zmax)
+            {
+                fprintf(stderr, "ERROR: plane %d is outside zmin..zmax\n", z);
+                exit(1);
+            }
+
+            m_order.planes.push_back(z);
+            current.setSignature(z,
+                BoundsManifest::computeSignature(m_stack, m_order, z));
+        }
+
+        printf("update: %zu planes given\n", m_order.planes.size());
+        return;
+    }
+
+    std::string manifestpath = m_stack.getBoundsManifestPath();
+    BoundsManifest saved;
+
+    if (!saved.read(manifestpath))
+    {
+        fprintf(stderr, "ERROR: %s does not exist\n", manifestpath.c_str());
+        fprintf(stderr, "ERROR: use --planes to say which planes changed.\n");
+        exit(1);
+    }
+
+    for (int z = m_order.zmin; z < m_order.zmax + 1; ++z)
+    {
+        uint64 signature =
+            BoundsManifest::computeSignature(m_stack, m_order, z);
+        uint64 previous;
+
+        if (!saved.getSignature(z, previous) || previous != signature)
+        {
+            m_order.planes.push_back(z);
+            current.setSignature(z, signature);
+        }
+    }
+
+    printf("update: %zu of %d planes changed\n",
+        m_order.planes.size(), m_order.zmax - m_order.zmin + 1);
+}
+
+void BoundsCreator::spliceOutput(const std::string& outpath, Table* bounds)
+{
+    // Merge into a new file and rename it over the old one, so the
+    // old file is intact until the new one is complete
+    std::string tmppath = outpath + ".tmp";
+
+    BoundsInput* input = NULL;
+    BoundsOutput* output = NULL;
+
+    if (m_options.binary)
+    {
+        input = new BinaryBoundsInput(outpath);
+        output = new BinaryBoundsOutput(tmppath);
+    }
+    else
+    {
+        input = new TextBoundsInput(outpath);
+        output = new TextBoundsOutput(tmppath);
+    }
+
+    std::set<int> updated(m_order.planes.begin(), m_order.planes.end());
+
+    // Both are in plane order, so new rows for a plane go out
+    // just before the first old row past it
+    const uint32* data = bounds->getData();
+    uint32 rows = bounds->getRows();
+    uint32 next = 0;
+
+    uint32 row[BOUNDS_FILE_COLUMNS];
+
+    while (true)
+    {
+        bool more = input->readRow(row);
+
+        while (next < rows &&
+            (!more || int(data[next * BOUNDS_FILE_COLUMNS]) < int(row[0])))
+        {
+            const uint32* r = data + next * BOUNDS_FILE_COLUMNS;
+            output->writeRow(r[0], r[1], r[2], r[3], r[4], r[5], r[6]);
+            ++next;
+        }
+
+        if (!more)
+        {
+            break;
+        }
+
+        if (updated.find(int(row[0])) == updated.end())
+        {
+            output->writeRow(row[0], row[1], row[2], row[3],
+                row[4], row[5], row[6]);
+        }
+    }
+
+    delete input;
+    output->close();
+    delete output;
+
+    if (rename(tmppath.c_str(), outpath.c_str()) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot rename %s\n", tmppath.c_str());
+        exit(1);
+    }
+
+    printf("Updated %zu planes in %s\n", updated.size(), outpath.c_str());
+}
+
+void BoundsCreator::compileStack(const std::string& outpath, Table* bounds)
+{
+    try
+    {
+        HdfStack stack;
+        {
+            PBT pbt("loadTXT");
+            stack.loadTXT(m_stack.getRoot(), m_stack.getRoot(), bounds);
+        }
+        {
+            PBT pbt("write");
+            stack.save(outpath.c_str(), 0);
+        }
+    }
+    catch (std::string& error)
+    {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        exit(1);
+    }
+    catch (std::exception& e)
+    {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        exit(1);
+    }
+}
+
+void BoundsCreator::processPlane(int z)
+{
+    BoundsMap bounds;
+    VolumeMap volumes;
+    PlaneStats stats;
+    PlaneStats* planeStats = getStats(stats);
+
+    for (int i = 0; i < m_order.cols; ++i)
+    {
+        for (int j = 0; j < m_order.rows; ++j)
+        {
+            processTile(z, i, j, bounds, volumes, planeStats, m_scratch);
+        }
+    }
+
+    writePlane(z, bounds, volumes, planeStats);
+}
+
+void BoundsCreator::writePlane(int z, BoundsMap& bounds, VolumeMap& volumes,
+    PlaneStats* stats)
+{
+    typedef std::list<unsigned int> SpidList;
+    SpidList spids;
+    
+    for (BoundsMap::iterator it = bounds.begin(); it != bounds.end(); ++it)
+    {
+        spids.push_back((*it).first);
+    }
+
+    spids.sort();
+
+    if (stats)
+    {
+        stats->addSeams();
+    }
+
+    for (SpidList::iterator it = spids.begin(); it != spids.end(); ++it)
+    {
+        unsigned int spid = *it;
+        const PixelBoundBox& box = bounds[spid];    
+        int trueArea = volumes[spid];
+        int width = box.getWidth();
+        int height = box.getHeight();
+        
+        m_output->writeRow(z, spid, box.getX(), box.getY(),
+            width, height, trueArea);
+
+        if (m_momentsf)
+        {
+            const Moments& spMoments = stats->moments[spid];
+            Shape shape(spMoments, trueArea);
+
+            fprintf(m_momentsf,
+                "%d\t%d\t%.3f %.3f %.3f %.3f %.3f %.4f %.3f %.3f %lld\n",
+                z, spid, shape.cx, shape.cy, shape.mxx, shape.myy, shape.mxy,
+                shape.orientation, shape.major, shape.minor,
+                spMoments.perimeter);
+        }
+
+        // Sanity check that the exact area/volume is never
+        // greater than the bound box area.
+        int rectArea = width * height;
+        assert(trueArea <= rectArea);
+    }
+    
+    if (m_adjacency)
+    {
+        m_adjacency->writePlane(z, stats->adjacency);
+    }
+
+    printf("z=%d superpixels=%zu\n", z, bounds.size());
+
+    if (m_checkpoint)
+    {
+        saveCheckpoint(z);
+    }
+}
+
+void BoundsCreator::processPlanesParallel()
+{
+    m_nextTile = 0;
+    m_nextWrite = 0;
+
+    // Workers run on their own threads, this thread is the writer
+    ThreadList workers;
+    startThreads(m_options.threads, workerMain, this, workers);
+
+    writePlanes();
+
+    joinThreads(workers);
+}
+
+void BoundsCreator::writePlanes()
+{
+    int tilesPerPlane = m_order.tilesPerPlane();
+
+    for (int n = 0; n < m_order.getNumPlanes(); ++n)
+    {
+        int z = m_order.getPlane(n);
+        PlaneResult* result = NULL;
+
+        {
+            ScopedLock lock(m_mutex);
+
+            while (true)
+            {
+                PlaneResultMap::iterator it = m_results.find(z);
+
+                if (it != m_results.end() &&
+                    it->second->tilesDone == tilesPerPlane)
+                {
+                    result = it->second;
+                    m_results.erase(it);
+                    break;
+                }
+
+                m_changed.wait(m_mutex);
+            }
+        }
+
+        writePlane(z, result->bounds, result->volumes,
+            getStats(result->stats));
+        delete result;
+
+        {
+            ScopedLock lock(m_mutex);
+            m_nextWrite = n + 1;
+            m_changed.broadcast();
+        }
+    }
+}
+
+void* BoundsCreator::workerMain(void* arg)
+{
+    BoundsCreator* creator = (BoundsCreator*)arg;
+    creator->runWorker();
+    return NULL;
+}
+
+void BoundsCreator::runWorker()
+{
+    BoundsMap bounds;
+    VolumeMap volumes;
+    PlaneStats stats;
+    PlaneStats* planeStats = getStats(stats);
+    TileScratch scratch;
+
+    // Plane of the tiles we are holding, and how many
+    int heldZ = -1;
+    int held = 0;
+
+    while (true)
+    {
+        int z, i, j;
+        ClaimResult claim = claimTile(heldZ, z, i, j);
+
+        if (claim == CLAIM_FLUSH)
+        {
+            mergeTiles(heldZ, held, bounds, volumes, stats);
+            heldZ = -1;
+            held = 0;
+        }
+        else if (claim == CLAIM_TILE)
+        {
+            processTile(z, i, j, bounds, volumes, planeStats, scratch);
+            heldZ = z;
+            ++held;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (held > 0)
+    {
+        mergeTiles(heldZ, held, bounds, volumes, stats);
+    }
+}
+
+BoundsCreator::ClaimResult BoundsCreator::claimTile(
+    int heldZ, int& z, int& i, int& j)
+{
+    ScopedLock lock(m_mutex);
+
+    // Don't run too far ahead of the writer, that would only
+    // pile up finished planes in memory
+    int window = m_options.threads + 1;
+
+    while (true)
+    {
+        if (m_nextTile == m_order.size())
+        {
+            return heldZ >= 0 ? CLAIM_FLUSH : CLAIM_DONE;
+        }
+
+        int nextZ, nextI, nextJ;
+        m_order.getTile(m_nextTile, nextZ, nextI, nextJ);
+
+        if (heldZ >= 0 && nextZ != heldZ)
+        {
+            return CLAIM_FLUSH;
+        }
+
+        // Planes are counted in TileOrder, they need not be adjacent
+        int nextPlane = int(m_nextTile / m_order.tilesPerPlane());
+
+        if (nextZ == heldZ || nextPlane < m_nextWrite + window)
+        {
+            break;
+        }
+
+        m_changed.wait(m_mutex);
+    }
+
+    // Same tile order as processPlane, columns outside rows inside
+    m_order.getTile(m_nextTile, z, i, j);
+    ++m_nextTile;
+
+    return CLAIM_TILE;
+}
+
+void BoundsCreator::mergeTiles(int z, int tiles,
+    BoundsMap& bounds, VolumeMap& volumes, PlaneStats& stats)
+{
+    PlaneResult* result = NULL;
+
+    {
+        ScopedLock lock(m_mutex);
+
+        PlaneResultMap::iterator it = m_results.find(z);
+
+        if (it == m_results.end())
+        {
+            result = new PlaneResult();
+            m_results[z] = result;
+        }
+        else
+        {
+            result = it->second;
+        }
+    }
 
-namespace ext = __gnu_cxx;
+    {
+        ScopedLock lock(result->mutex);
 
-class BoundsCreator
-{
-public:
-    BoundsCreator(std::string root, int tilesize);
+        for (BoundsMap::iterator it = bounds.begin(); it != bounds.end(); ++it)
+        {
+            unsigned int spid = (*it).first;
+            BoundsMap::iterator found = result->bounds.find(spid);
 
-    typedef ext::hash_map<unsigned int, PixelBoundBox> BoundsMap;
-    typedef ext::hash_map<unsigned int, int> VolumeMap;
+            if (found == result->bounds.end())
+            {
+                result->bounds[spid] = (*it).second;
+                result->volumes[spid] = volumes[spid];
+            }
+            else
+            {
+                (*found).second.unionBounds((*it).second);
+                result->volumes[spid] += volumes[spid];
+            }
+        }
 
-    void create();
+        result->stats.merge(stats);
+    }
 
-    void processPlane(int z);
-    void processTile(int z, int i, int j,
-        BoundsMap& bounds,
-        VolumeMap& volumes);
+    bounds.clear();
+    volumes.clear();
 
-private:    
-    bool isTileEmpty(const PngImage& image);
+    {
+        ScopedLock lock(m_mutex);
+        result->tilesDone += tiles;
+        m_changed.broadcast();
+    }
+}
 
-    Stack m_stack;
-    int m_tilesize;
+void BoundsCreator::processVolume()
+{
+    m_nextTile = 0;
+    m_nextWrite = 0;
 
-    FILE* m_outf;
-};
+    // Even with one thread the worker runs on its own thread, the
+    // writer is the same as for tiles
+    ThreadList workers;
+    startThreads(m_options.threads, volumeWorkerMain, this, workers);
 
-BoundsCreator::BoundsCreator(std::string root, int tilesize) :
-    m_stack(root, tilesize),
-    m_tilesize(tilesize),
-    m_outf(NULL)
+    writePlanes();
+
+    joinThreads(workers);
+}
+
+void* BoundsCreator::volumeWorkerMain(void* arg)
 {
+    BoundsCreator* creator = (BoundsCreator*)arg;
+    creator->runVolumeWorker();
+    return NULL;
 }
 
-void BoundsCreator::create()
+void BoundsCreator::runVolumeWorker()
 {
-    std::string outpath = m_stack.getSuperpixelBoundsPath();
+    int depth = m_volume->getBlockDepth();
+    int blockWidth = m_volume->getBlockWidth();
+    int blockHeight = m_volume->getBlockHeight();
+    int planes = m_order.getNumPlanes();
+    int tilesPerPlane = m_order.tilesPerPlane();
 
-    // Check if it already exists
-    struct stat buf;
-    if (stat(outpath.c_str(), &buf) == 0)
-    {
-        fprintf(stderr, "ERROR: superpixel_bounds.txt already exists\n");
-        fprintf(stderr, "ERROR: delete first to recreate.\n");
-        exit(1);
-    }
+    // One set of maps per plane of a block
+    std::vector<BoundsMap> bounds(depth);
+    std::vector<VolumeMap> volumes(depth);
+    std::vector<PlaneStats> stats(depth);
 
-    m_outf = fopen(outpath.c_str(), "w");
-    
-    if (!m_outf)
+    TileScratch scratch;
+    std::vector<unsigned int> labels;
+
+    long block;
+
+    while (claimBlock(block))
     {
-        fprintf(stderr, "Cannot open output file: %s\n", outpath.c_str());
-        return;
-    }
+        int slab = int(block / tilesPerPlane);
+        int tile = int(block % tilesPerPlane);
+        int i = tile / m_order.rows;
+        int j = tile % m_order.rows;
 
-    // Write the header
-    fprintf(m_outf, "# superpixel bounding boxes and volumes\n");
-    fprintf(m_outf, "# plane\tsp\tx y width height volume\n\n");
-    
-    printf("Rows=%d\n", m_stack.getNumRows(0));
-    printf("Cols=%d\n", m_stack.getNumCols(0));
+        int z0 = slab * depth;
+        int row = j * blockHeight;
+        int col = i * blockWidth;
 
-    int zmin = m_stack.getMetadataValue("zmin");
-    int zmax = m_stack.getMetadataValue("zmax");
+        int blockDepth = std::min(depth, planes - z0);
+        int height = std::min(blockHeight, m_volume->getHeight() - row);
+        int width = std::min(blockWidth, m_volume->getWidth() - col);
 
-    printf("zmin=%d\n", zmin);
-    printf("zmax=%d\n", zmax);
+        m_volume->read(z0, row, col, blockDepth, height, width, labels);
 
-    for (int z = zmin; z < zmax + 1; ++z)
-    {
-        processPlane(z);
-    }
+        // Our y is flipped, the bottom row of the volume is y = 0
+        int baseX = col;
+        int baseY = m_volume->getHeight() - row - height;
+
+        for (int k = 0; k < blockDepth; ++k)
+        {
+            processBlock(&labels[size_t(k) * height * width], baseX, baseY,
+                width, height, bounds[k], volumes[k], getStats(stats[k]),
+                scratch.accum);
 
-    fclose(m_outf);
+            mergeTiles(m_order.getPlane(z0 + k), 1,
+                bounds[k], volumes[k], stats[k]);
+        }
+    }
 }
 
-void BoundsCreator::processPlane(int z)
+bool BoundsCreator::claimBlock(long& block)
 {
-    BoundsMap bounds;
-    VolumeMap volumes;
+    ScopedLock lock(m_mutex);
+
+    int depth = m_volume->getBlockDepth();
+    long blocks = long((m_order.getNumPlanes() + depth - 1) / depth) *
+        m_order.tilesPerPlane();
 
-    for (int i = 0; i < m_stack.getNumCols(0); ++i)
+    while (true)
     {
-        for (int j = 0; j < m_stack.getNumRows(0); ++j)
+        if (m_nextTile == blocks)
+        {
+            return false;
+        }
+
+        // Stay within two slabs of the writer, so at most a few
+        // slabs of planes are held in memory
+        int slab = int(m_nextTile / m_order.tilesPerPlane());
+
+        if (slab * depth < m_nextWrite + 2 * depth)
         {
-            processTile(z, i, j, bounds, volumes);
+            break;
         }
+
+        m_changed.wait(m_mutex);
     }
 
-    typedef std::list<unsigned int> SpidList;
-    SpidList spids;
-    
-    for (BoundsMap::iterator it = bounds.begin(); it != bounds.end(); ++it)
+    block = m_nextTile++;
+    return true;
+}
+
+void BoundsCreator::processBlock(const unsigned int* labels,
+    int baseX, int baseY, int width, int height,
+    BoundsMap& bounds, VolumeMap& volumes, PlaneStats* stats,
+    TileAccumulator& accum)
+{
+    size_t rowbytes = size_t(width) * sizeof(unsigned int);
+
+    accum.begin();
+
+    if (stats)
     {
-        spids.push_back((*it).first);
+        accum.beginStats(*stats, baseX, baseY, width, height);
     }
 
-    spids.sort();
-
-    for (SpidList::iterator it = spids.begin(); it != spids.end(); ++it)
+    for (int row = 0; row < height; ++row)
     {
-        unsigned int spid = *it;
-        const PixelBoundBox& box = bounds[spid];    
-        int trueArea = volumes[spid];
-        int width = box.getWidth();
-        int height = box.getHeight();
-        
-        fprintf(m_outf, "%d\t%d\t%d %d %d %d %d\n",
-            z, spid, box.getX(), box.getY(), 
-            width, height, trueArea);
+        const unsigned char* pixels =
+            (const unsigned char*)(labels + size_t(row) * width);
+        int y = baseY + height - row - 1;
 
-        // Sanity check that the exact area/volume is never
-        // greater than the bound box area.
-        int rectArea = width * height;
-        assert(trueArea <= rectArea);
+        if (!stats && isZeroBytes(pixels, rowbytes))
+        {
+            accum.addSpan(0, baseX, baseX + width - 1, y);
+        }
+        else
+        {
+            accum.addRow(pixels, sizeof(unsigned int), width, baseX, y);
+        }
     }
-    
-    printf("z=%d superpixels=%zu\n", z, bounds.size());
+
+    accum.finish(bounds, volumes, stats);
 }
 
 void BoundsCreator::processTile(int z, int i, int j,
     BoundsMap& bounds,
-    VolumeMap& volumes)
+    VolumeMap& volumes,
+    PlaneStats* stats,
+    TileScratch& scratch)
 {
     std::string path = m_stack.getTilePath(0, j, i, 's', z);
     printf("%s\n", path.c_str());
 
-    PngImage image(path.c_str());    
-
-    int width = image.getWidth();
-    int height = image.getHeight();
-
-    //printf("width=%d height=%d\n", image.getWidth(), image.getHeight());
-
     // Note that i, j always represent full tiles, because only the
     // final edge/corner tile is ever partial
     int baseX = m_tilesize * i;
     int baseY = m_tilesize * j;
 
+    long index = m_order.getIndex(z, i, j);
+
+    // Compressed tile bytes an I/O thread already read
+    const png_byte* data = NULL;
+    size_t size = 0;
+
+    if (m_prefetcher)
+    {
+        const TileBytes& bytes = m_prefetcher->get(index);
+        data = bytes.empty() ? NULL : &bytes[0];
+        size = bytes.size();
+        scratch.reader.open(data, size, path.c_str());
+    }
+    else
+    {
+        scratch.reader.open(path.c_str());
+    }
+
+    if (scratch.reader.isInterlaced())
+    {
+        // png_read_row can't hand us finished rows of an interlaced
+        // image, so decode the whole thing
+        scratch.reader.close();
+
+        if (m_prefetcher)
+        {
+            PngImage image(data, size, path.c_str());
+            processImage(image, baseX, baseY, bounds, volumes, stats,
+                scratch.accum);
+        }
+        else
+        {
+            PngImage image(path.c_str());
+            processImage(image, baseX, baseY, bounds, volumes, stats,
+                scratch.accum);
+        }
+    }
+    else
+    {
+        streamTile(scratch.reader, baseX, baseY, bounds, volumes, stats,
+            scratch.accum);
+        scratch.reader.close();
+    }
+
+    if (m_prefetcher)
+    {
+        m_prefetcher->release(index);
+    }
+}
+
+void BoundsCreator::streamTile(PngRowReader& reader, int baseX, int baseY,
+    BoundsMap& bounds, VolumeMap& volumes, PlaneStats* stats,
+    TileAccumulator& accum)
+{
+    int width = reader.getWidth();
+    int height = reader.getHeight();
+    int colsize = reader.getColSize();
+    size_t rowbytes = size_t(width) * colsize;
+
+    // 16-bit spids always fit the dense window
+    if (colsize == 2)
+    {
+        accum.begin(0, 0xFFFF);
+    }
+    else
+    {
+        accum.begin();
+    }
+
+    if (stats)
+    {
+        accum.beginStats(*stats, baseX, baseY, width, height);
+    }
+
+    // Rows come top row first, but our y is flipped like
+    // PngImage::getPixel so the top row is the highest y
+    for (int row = 0; row < height; ++row)
+    {
+        const png_byte* pixels = reader.readRow();
+        int y = baseY + height - row - 1;
+
+        // Empty rows are common, skip decoding them.  Stats need
+        // every row since edges compare neighbouring rows.
+        if (!stats && isZeroBytes(pixels, rowbytes))
+        {
+            accum.addSpan(0, baseX, baseX + width - 1, y);
+        }
+        else
+        {
+            accum.addRow(pixels, colsize, width, baseX, y);
+        }
+    }
+
+    accum.finish(bounds, volumes, stats);
+}
+
+void BoundsCreator::processImage(const PngImage& image, int baseX, int baseY,
+    BoundsMap& bounds, VolumeMap& volumes, PlaneStats* stats,
+    TileAccumulator& accum)
+{
+    int width = image.getWidth();
+    int height = image.getHeight();
+
     // As a special case for speed if tile is completely empty we can
     // union in the bounds in a single step.
-    if (isTileEmpty(image))
+    if (!stats && isTileEmpty(image))
     {
         int edgeX = baseX + width - 1;
         int edgeY = baseY + height - 1;
@@ -176,69 +1440,253 @@ void BoundsCreator::processTile(int z, int i, int j,
     }
     else
     {
-        // The tile is not empty, union every pixel separately
-        for (int tileX = 0; tileX < width; ++tileX)
+        // The tile is not empty, scan it row by row.  Rows are
+        // contiguous in memory, columns are not.
+        unsigned int minSpid, maxSpid;
+        image.getPixelIDRange(minSpid, maxSpid);
+
+        accum.begin(minSpid, maxSpid);
+
+        if (stats)
         {
-            for (int tileY = 0; tileY < height; ++tileY)
-            {
-                int x = baseX + tileX;
-                int y = baseY + tileY;
-                unsigned int spid = image.getPixelID(tileX, tileY);
-            
-                if (bounds.find(spid) == bounds.end())
-                {
-                    bounds[spid] = PixelBoundBox(x, y);
-                    volumes[spid] = 1;
-                }
-                else
-                {   
-                    bounds[spid].unionPoint(x, y);
-                    volumes[spid] += 1;
-                }
-            }
+            accum.beginStats(*stats, baseX, baseY, width, height);
+        }
+
+        for (int tileY = 0; tileY < height; ++tileY)
+        {
+            accum.addRow(image.getRow(tileY), image.getColSize(), width,
+                baseX, baseY + tileY);
         }
+
+        accum.finish(bounds, volumes, stats);
     }
 }
 
 bool BoundsCreator::isTileEmpty(const PngImage& image)
 {
-    for (int x = 0; x < image.getWidth(); ++x)
+    // A spid is zero only if all its bytes are zero, so we can
+    // check raw bytes instead of decoding pixels
+    size_t rowbytes = size_t(image.getWidth()) * image.getColSize();
+
+    for (int y = 0; y < image.getHeight(); ++y)
     {
-        for (int y = 0; y < image.getHeight(); ++y)
+        if (!isZeroBytes(image.getRow(y), rowbytes))
         {
-            unsigned int spid = image.getPixelID(x, y);
-        
-            if (spid != 0)
-            {
-                return false;
-            }
+            return false;
         }
     }
 
     return true;
 }
 
+// Parse a list like 10-20,35 into planes
+static bool parsePlanes(const char* list, std::set<int>& planes)
+{
+    const char* p = list;
+
+    while (*p)
+    {
+        int first, last, count;
+
+        if (sscanf(p, "%d-%d%n", &first, &last, &count) == 2)
+        {
+            p += count;
+        }
+        else if (sscanf(p, "%d%n", &first, &count) == 1)
+        {
+            last = first;
+            p += count;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (last < first)
+        {
+            return false;
+        }
+
+        for (int z = first; z <= last; ++z)
+        {
+            planes.insert(z);
+        }
+
+        if (*p == ',')
+        {
+            ++p;
+        }
+        else if (*p)
+        {
+            return false;
+        }
+    }
+
+    return !planes.empty();
+}
+
+static void usage(const char* argv0)
+{
+    printf("Usage: %s [options] <stack_path> [<tilesize>=1024]\n", argv0);
+    printf("  --threads N       decode tiles on N threads\n");
+    printf("  --io-threads N    read tiles ahead on N threads\n");
+    printf("  --queue-depth N   read at most N tiles ahead (default 16)\n");
+    printf("  --binary          write superpixel_bounds.bin instead of .txt\n");
+    printf("  --compile         write stack.h5 directly, no bounds file\n");
+    printf("  --moments         also write centroids, second moments, ellipse\n");
+    printf("                    fit and perimeter to superpixel_moments.txt\n");
+    printf("  --adjacency       also write touching superpixel pairs and their\n");
+    printf("                    boundary length to superpixel_adjacency.bin\n");
+    printf("  --volume FILE[:DATASET]\n");
+    printf("                    read labels from a (z, y, x) HDF5 dataset,\n");
+    printf("                    default dataset 'stack', instead of tiles\n");
+    printf("  --zmin N          start at plane N instead of the metadata's zmin\n");
+    printf("  --zmax N          end at plane N instead of the metadata's zmax\n");
+    printf("                    either makes superpixel_bounds.ZMIN-ZMAX.txt,\n");
+    printf("                    a shard for mergebounds\n");
+    printf("  --checkpoint      save progress after every plane, and resume\n");
+    printf("                    from it if an earlier run was killed\n");
+    printf("  --update          recompute planes whose tiles changed since\n");
+    printf("                    the last run and splice them into the output\n");
+    printf("  --planes LIST     with --update, recompute these planes instead,\n");
+    printf("                    for example 10-20,35\n");
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
     std::string root;
     int tilesize = 1024;
+    BoundsCreator::Options options;
+
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc)
+        {
+            options.ioThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc)
+        {
+            options.queueDepth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--binary") == 0)
+        {
+            options.binary = true;
+        }
+        else if (strcmp(argv[i], "--compile") == 0)
+        {
+            options.compile = true;
+        }
+        else if (strcmp(argv[i], "--moments") == 0)
+        {
+            options.moments = true;
+        }
+        else if (strcmp(argv[i], "--adjacency") == 0)
+        {
+            options.adjacency = true;
+        }
+        else if (strcmp(argv[i], "--volume") == 0 && i + 1 < argc)
+        {
+            options.volume = argv[++i];
+
+            size_t colon = options.volume.rfind(':');
+
+            if (colon != std::string::npos)
+            {
+                options.dataset = options.volume.substr(colon + 1);
+                options.volume = options.volume.substr(0, colon);
+            }
+        }
+        else if (strcmp(argv[i], "--zmin") == 0 && i + 1 < argc)
+        {
+            options.zmin = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--zmax") == 0 && i + 1 < argc)
+        {
+            options.zmax = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0)
+        {
+            options.checkpoint = true;
+        }
+        else if (strcmp(argv[i], "--update") == 0)
+        {
+            options.update = true;
+        }
+        else if (strcmp(argv[i], "--planes") == 0 && i + 1 < argc)
+        {
+            if (!parsePlanes(argv[++i], options.planes))
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage(argv[0]);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
     
-    if (argc == 2)
+    if (args.size() == 1)
     {    
-        root = argv[1];
+        root = args[0];
     }
-    else if (argc == 3)
+    else if (args.size() == 2)
     {
-        root = argv[1];
-        tilesize = atoi(argv[2]);    
+        root = args[0];
+        tilesize = atoi(args[1]);    
     }
     else
     {
-        printf("Usage: %s <stack_path> [<tilesize>=1024]\n", argv[0]);
-        exit(1);
+        usage(argv[0]);
+    }
+
+    if (options.threads < 1 || options.ioThreads < 0 ||
+        options.queueDepth < 1)
+    {
+        usage(argv[0]);
+    }
+
+    // Only bounds files can be updated in place, not stack.h5,
+    // the moments or the adjacency
+    if ((options.update &&
+         (options.compile || options.moments || options.adjacency)) ||
+        (!options.planes.empty() && !options.update))
+    {
+        usage(argv[0]);
+    }
+
+    // Updates and readahead are for tiles
+    if (!options.volume.empty() && (options.update || options.ioThreads > 0))
+    {
+        usage(argv[0]);
+    }
+
+    // A shard is just bounds, and only tiles can be sharded
+    if (options.isShard() &&
+        (options.update || options.compile || options.moments ||
+         options.adjacency || !options.volume.empty()))
+    {
+        usage(argv[0]);
+    }
+
+    // Only files written plane by plane can be resumed
+    if (options.checkpoint &&
+        (options.update || options.compile || !options.volume.empty()))
+    {
+        usage(argv[0]);
     }
 
-    BoundsCreator creator(root, tilesize);
+    BoundsCreator creator(root, tilesize, options);
     creator.create();
 
     return 0;
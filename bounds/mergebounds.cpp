@@ -0,0 +1,283 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "BoundsFile.h"
+#include "BoundsInput.h"
+#include "BoundsOutput.h"
+
+//
+// Put together the bounds shards written by bounds --zmin/--zmax
+// into one bounds file.
+//
+// Shards may be given in any order, either format, and are sorted
+// by their first plane.  Between them they must cover a run of
+// planes with no gaps and no plane in more than one shard, and each
+// shard's rows must be in plane then spid order, as bounds writes
+// them.  The output is the same as a single bounds run over all
+// the planes.
+//
+class BoundsMerger
+{
+public:
+    BoundsMerger(const std::string& outpath, bool binary);
+    ~BoundsMerger();
+
+    // Exits if the shard cannot be opened or is empty
+    void addShard(const std::string& path);
+
+    // Exits on a gap or overlap, or if zmin/zmax are given and the
+    // shards do not cover exactly those planes
+    void merge(int zmin, int zmax);
+
+private:
+    struct Shard
+    {
+        std::string path;
+        BoundsInput* input;
+
+        // Next row, read ahead so shards can be sorted
+        uint32 row[BOUNDS_FILE_COLUMNS];
+
+        bool operator<(const Shard& other) const
+        {
+            return int(row[0]) < int(other.row[0]);
+        }
+    };
+
+    // Remove the partial output and exit
+    void fail();
+
+    std::string m_outpath;
+    std::string m_tmppath;
+    bool m_binary;
+
+    std::vector<Shard> m_shards;
+};
+
+BoundsMerger::BoundsMerger(const std::string& outpath, bool binary) :
+    m_outpath(outpath),
+    m_tmppath(outpath + ".tmp"),
+    m_binary(binary)
+{
+}
+
+BoundsMerger::~BoundsMerger()
+{
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        delete m_shards[i].input;
+    }
+}
+
+void BoundsMerger::addShard(const std::string& path)
+{
+    Shard shard;
+    shard.path = path;
+
+    if (isBoundsFile(path))
+    {
+        shard.input = new BinaryBoundsInput(path);
+    }
+    else
+    {
+        shard.input = new TextBoundsInput(path);
+    }
+
+    if (!shard.input->readRow(shard.row))
+    {
+        fprintf(stderr, "ERROR: %s has no planes\n", path.c_str());
+        exit(1);
+    }
+
+    m_shards.push_back(shard);
+}
+
+void BoundsMerger::fail()
+{
+    unlink(m_tmppath.c_str());
+    exit(1);
+}
+
+void BoundsMerger::merge(int zmin, int zmax)
+{
+    std::sort(m_shards.begin(), m_shards.end());
+
+    int firstZ = int(m_shards[0].row[0]);
+
+    if (zmin >= 0 && firstZ != zmin)
+    {
+        if (firstZ > zmin)
+        {
+            fprintf(stderr, "ERROR: planes %d-%d are missing\n",
+                zmin, firstZ - 1);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: planes %d-%d are before zmin\n",
+                firstZ, zmin - 1);
+        }
+
+        exit(1);
+    }
+
+    BoundsOutput* output = NULL;
+
+    if (m_binary)
+    {
+        output = new BinaryBoundsOutput(m_tmppath);
+    }
+    else
+    {
+        output = new TextBoundsOutput(m_tmppath);
+    }
+
+    // Last plane and spid written so far
+    int lastZ = -1;
+    uint32 lastSpid = 0;
+    bool first = true;
+
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        Shard& shard = m_shards[i];
+        int shardZmin = int(shard.row[0]);
+
+        if (!first && shardZmin <= lastZ)
+        {
+            fprintf(stderr, "ERROR: %s and %s both have plane %d\n",
+                m_shards[i - 1].path.c_str(), shard.path.c_str(),
+                shardZmin);
+            fail();
+        }
+
+        uint32* row = shard.row;
+
+        do
+        {
+            int z = int(row[0]);
+
+            if (!first && (z < lastZ || (z == lastZ && row[1] <= lastSpid)))
+            {
+                fprintf(stderr, "ERROR: %s is not sorted at plane %d "
+                    "sp %u\n", shard.path.c_str(), z, row[1]);
+                fail();
+            }
+
+            if (!first && z > lastZ + 1)
+            {
+                fprintf(stderr, "ERROR: planes %d-%d are missing, "
+                    "before %s\n", lastZ + 1, z - 1, shard.path.c_str());
+                fail();
+            }
+
+            output->writeRow(z, row[1], row[2], row[3], row[4], row[5],
+                row[6]);
+
+            lastZ = z;
+            lastSpid = row[1];
+            first = false;
+        }
+        while (shard.input->readRow(row));
+
+        printf("%s: planes %d-%d\n", shard.path.c_str(), shardZmin, lastZ);
+    }
+
+    if (zmax >= 0 && lastZ != zmax)
+    {
+        if (lastZ < zmax)
+        {
+            fprintf(stderr, "ERROR: planes %d-%d are missing\n",
+                lastZ + 1, zmax);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: planes %d-%d are past zmax\n",
+                zmax + 1, lastZ);
+        }
+
+        fail();
+    }
+
+    output->close();
+    delete output;
+
+    if (rename(m_tmppath.c_str(), m_outpath.c_str()) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot rename %s\n", m_tmppath.c_str());
+        fail();
+    }
+
+    printf("Wrote planes %d-%d to %s\n", firstZ, lastZ, m_outpath.c_str());
+}
+
+static void usage(const char* argv0)
+{
+    printf("Usage: %s [options] <output> <shard> [<shard> ...]\n", argv0);
+    printf("  --binary          write superpixel_bounds.bin format\n");
+    printf("  --zmin N          the shards must start at plane N\n");
+    printf("  --zmax N          the shards must end at plane N\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    bool binary = false;
+    int zmin = -1;
+    int zmax = -1;
+
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--binary") == 0)
+        {
+            binary = true;
+        }
+        else if (strcmp(argv[i], "--zmin") == 0 && i + 1 < argc)
+        {
+            zmin = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--zmax") == 0 && i + 1 < argc)
+        {
+            zmax = atoi(argv[++i]);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage(argv[0]);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() < 2)
+    {
+        usage(argv[0]);
+    }
+
+    std::string outpath = args[0];
+
+    if (access(outpath.c_str(), F_OK) == 0)
+    {
+        fprintf(stderr, "ERROR: %s exists.\n", outpath.c_str());
+        fprintf(stderr, "ERROR: delete first to recreate.\n");
+        exit(1);
+    }
+
+    BoundsMerger merger(outpath, binary);
+
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        merger.addShard(args[i]);
+    }
+
+    merger.merge(zmin, zmax);
+
+    return 0;
+}
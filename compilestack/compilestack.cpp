@@ -4,12 +4,20 @@
 
 #include "timers.h"
 #include "HdfStack.h"
+#include "StackCompiler.h"
+#include "TxtFile.h"
+#include "Threads.h"
 #include "util.h"
 
-int compilestack(std::string root, std::string outpath)
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+int compilestack(std::string root, std::string outpath, size_t budget,
+    std::string scratch, int compression)
 {
     std::string outfile = join(outpath, "stack.h5");
-   
+
     if (fileExists(outfile))
     {
         printf("ERROR: file '%s' already exists\n", outfile.c_str());
@@ -17,6 +25,15 @@ int compilestack(std::string root, std::string outpath)
         return -1;
     }
 
+    if (budget > 0)
+    {
+        PBT pbt("compile");
+        StackCompiler compiler(root, outpath, budget, scratch);
+        compiler.setCompression(compression);
+        compiler.compile(outfile);
+        return 0;
+    }
+
     HdfStack stack;
     {
         PBT pbt("loadTXT");
@@ -24,12 +41,155 @@ int compilestack(std::string root, std::string outpath)
     }
     {
         PBT pbt("write");
+        stack.setCompression(compression);
         stack.save(outfile.c_str(), 0);
     }
 
     return 0;
 }
 
+//
+// Compile planes zmin to zmax into stack.ZMIN-ZMAX.h5, one shard for
+// mergestack to put together with the others.  Each shard logs to its
+// own directory, so shards can run at once in the same output path.
+//
+int compileshard(std::string root, std::string outpath, int zmin, int zmax,
+    int compression)
+{
+    std::string outfile = join(outpath,
+        FormatString("stack.%d-%d.h5", zmin, zmax));
+    std::string logpath = join(outpath,
+        FormatString("stack.%d-%d.logs", zmin, zmax));
+
+    if (fileExists(outfile))
+    {
+        printf("ERROR: file '%s' already exists\n", outfile.c_str());
+        printf("ERROR: cannot overwrite existing file, delete it manually.\n");
+        return -1;
+    }
+
+    if (mkdir(logpath.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        printf("ERROR: cannot create '%s'\n", logpath.c_str());
+        return -1;
+    }
+
+    HdfStack stack;
+    {
+        PBT pbt("loadTXTShard");
+        stack.loadTXTShard(root, logpath, zmin, zmax);
+    }
+    {
+        PBT pbt("write");
+
+        // Write aside so mergestack never sees a partial shard
+        std::string tmpfile = outfile + ".tmp";
+        stack.setCompression(compression);
+        stack.save(tmpfile, 0);
+
+        if (rename(tmpfile.c_str(), outfile.c_str()) != 0)
+        {
+            printf("ERROR: cannot rename '%s'\n", tmpfile.c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Apply a newer segment to body map to an existing stack.h5, instead
+// of compiling the whole stack again.
+//
+int updatebodies(std::string root, std::string outpath, std::string mappath,
+    int compression)
+{
+    std::string infile = join(root, "stack.h5");
+    std::string outfile = join(outpath, "stack.h5");
+
+    if (outfile != infile && fileExists(outfile))
+    {
+        printf("ERROR: file '%s' already exists\n", outfile.c_str());
+        printf("ERROR: cannot overwrite existing file, delete it manually.\n");
+        return -1;
+    }
+
+    HdfStack stack;
+    {
+        PBT pbt("load");
+        stack.load(infile);
+    }
+
+    Table* bodies = NULL;
+    {
+        PBT pbt("read %s", mappath.c_str());
+        bodies = readTxtFile(mappath, NUM_TXT_BODY_COLUMNS, getNumCores());
+    }
+    {
+        PBT pbt("updateBodies");
+        stack.updateBodies(bodies, outpath);
+    }
+
+    delete bodies;
+
+    {
+        PBT pbt("write");
+
+        // Write aside, the output may replace the input
+        std::string tmpfile = outfile + ".tmp";
+        stack.setCompression(compression);
+        stack.save(tmpfile, 0);
+
+        if (rename(tmpfile.c_str(), outfile.c_str()) != 0)
+        {
+            printf("ERROR: cannot rename '%s'\n", tmpfile.c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Parse a size like 512M or 8G, 0 if not valid
+static size_t parseSize(const char* text)
+{
+    char* end;
+    double value = strtod(text, &end);
+
+    switch (*end)
+    {
+        case 'k': case 'K': value *= 1024.0; ++end; break;
+        case 'm': case 'M': value *= 1024.0 * 1024.0; ++end; break;
+        case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; ++end; break;
+    }
+
+    if (end == text || *end != 0 || value < 1.0)
+    {
+        return 0;
+    }
+
+    return size_t(value);
+}
+
+void usage(const char* name)
+{
+    printf("USAGE: %s [options] <stack-path> [output-path]\n", name);
+    printf("  --memory-budget SIZE  compile within about SIZE bytes of memory,\n");
+    printf("                        for example 4G, by sorting the TXT files on\n");
+    printf("                        disk and writing one plane at a time\n");
+    printf("  --scratch DIR         with --memory-budget, put sorted runs in DIR\n");
+    printf("                        instead of $TMPDIR or /tmp\n");
+    printf("  --zmin N --zmax M     compile only planes N to M into\n");
+    printf("                        stack.ZMIN-ZMAX.h5, a shard for mergestack\n");
+    printf("  --update-bodies FILE  load the existing stack.h5 and move segments\n");
+    printf("                        to the bodies in FILE, some or all of a newer\n");
+    printf("                        segment_to_body_map.txt, without recompiling\n");
+    printf("  --compress LEVEL      write chunked datasets deflated at LEVEL,\n");
+    printf("                        1 (fastest) to 9 (smallest), compressed on\n");
+    printf("                        every core\n");
+    exit(1);
+}
+
 //
 // compilestack
 //
@@ -38,23 +198,119 @@ int compilestack(std::string root, std::string outpath)
 //     superpixel_to_segment_map.txt
 //     segment_to_body_map.txt
 //
+// If bounds wrote superpixel_bounds.bin it is used instead of
+// superpixel_bounds.txt.  If both exist the newer is used, with a
+// warning.
+//
+// With --memory-budget the stack is compiled by StackCompiler, for
+// stacks whose TXT files do not fit in memory.
+//
+// With --update-bodies only the segment to body mapping of an
+// existing stack.h5 is changed.
+//
+// With --zmin and --zmax only some planes are compiled, into a shard
+// which mergestack puts together with the others.
+//
 int main(int argc, char* argv[])
 {
     assert(sizeof(uint32) == 4);
 
-    if (argc == 2 || argc == 3)
+    size_t budget = 0;
+    std::string mappath;
+    int zmin = -1;
+    int zmax = -1;
+    int compression = 0;
+    std::string scratch = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
     {
-        const char* stackpath = argv[1];
-        const char* outpath = argv[1];
+        if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc)
+        {
+            budget = parseSize(argv[++i]);
+
+            if (budget == 0)
+            {
+                printf("ERROR: bad memory budget '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--scratch") == 0 && i + 1 < argc)
+        {
+            scratch = argv[++i];
+        }
+        else if (strcmp(argv[i], "--zmin") == 0 && i + 1 < argc)
+        {
+            zmin = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--zmax") == 0 && i + 1 < argc)
+        {
+            zmax = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--update-bodies") == 0 && i + 1 < argc)
+        {
+            mappath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc)
+        {
+            compression = atoi(argv[++i]);
+
+            if (compression < 1 || compression > 9)
+            {
+                printf("ERROR: bad compression level '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage(argv[0]);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    bool shard = zmin >= 0 || zmax >= 0;
+
+    if (shard && (zmin < 0 || zmax < zmin))
+    {
+        printf("ERROR: need 0 <= --zmin <= --zmax\n");
+        usage(argv[0]);
+    }
+
+    if (shard && (budget > 0 || !mappath.empty()))
+    {
+        printf("ERROR: --zmin/--zmax cannot be used with --memory-budget "
+            "or --update-bodies\n");
+        usage(argv[0]);
+    }
+
+    if (args.size() == 1 || args.size() == 2)
+    {
+        const char* stackpath = args[0];
+        const char* outpath = args[0];
     
-        if (argc == 3)
+        if (args.size() == 2)
         {
-            outpath = argv[2];
+            outpath = args[1];
         }
     
         try
         {
-            return compilestack(stackpath, outpath);
+            if (!mappath.empty())
+            {
+                return updatebodies(stackpath, outpath, mappath, compression);
+            }
+
+            if (shard)
+            {
+                return compileshard(stackpath, outpath, zmin, zmax,
+                    compression);
+            }
+
+            return compilestack(stackpath, outpath, budget, scratch,
+                compression);
         }
         catch (std::string& error)
         {
@@ -67,7 +323,6 @@ int main(int argc, char* argv[])
     }
     else
     {
-        printf("USAGE: %s <stack-path> [output-path]\n", argv[0]);
-        exit(1);
+        usage(argv[0]);
     }
 }
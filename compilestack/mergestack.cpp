@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "timers.h"
+#include "StackMerger.h"
+#include "util.h"
+
+#include <string.h>
+
+static void usage(const char* argv0)
+{
+    printf("Usage: %s [options] <output> <shard> [<shard> ...]\n", argv0);
+    printf("  Puts together the stack.ZMIN-ZMAX.h5 shards written by\n");
+    printf("  compilestack --zmin/--zmax into one stack.h5\n");
+    printf("  --compress LEVEL  write chunked datasets deflated at LEVEL,\n");
+    printf("                    1 (fastest) to 9 (smallest)\n");
+    exit(1);
+}
+
+//
+// Merge the shards of a sharded compile.  Shards may be given in any
+// order, but must cover a run of planes with no gaps or overlaps, and
+// no segment other than the zero segment may be in two shards.
+//
+int main(int argc, char* argv[])
+{
+    assert(sizeof(uint32) == 4);
+
+    int compression = 0;
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc)
+        {
+            compression = atoi(argv[++i]);
+
+            if (compression < 1 || compression > 9)
+            {
+                printf("ERROR: bad compression level '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage(argv[0]);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() < 2)
+    {
+        usage(argv[0]);
+    }
+
+    std::string outpath = args[0];
+
+    if (fileExists(outpath))
+    {
+        printf("ERROR: file '%s' already exists\n", outpath.c_str());
+        printf("ERROR: cannot overwrite existing file, delete it manually.\n");
+        return -1;
+    }
+
+    try
+    {
+        PBT pbt("mergestack");
+
+        StackMerger merger;
+        merger.setCompression(compression);
+
+        for (size_t i = 1; i < args.size(); ++i)
+        {
+            merger.addShard(args[i]);
+        }
+
+        merger.merge(outpath);
+    }
+    catch (std::string& error)
+    {
+        printf("ERROR: %s\n", error.c_str());
+        return -1;
+    }
+
+    return 0;
+}
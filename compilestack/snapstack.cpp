@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "timers.h"
+#include "HdfStack.h"
+#include "util.h"
+
+#include <string.h>
+
+static void usage(const char* argv0)
+{
+    printf("Usage: %s [options] export <stack.h5> <snapshot>\n", argv0);
+    printf("       %s [options] import <snapshot> <stack.h5>\n", argv0);
+    printf("  Converts between an HDF-STACK and a snapshot, a flat copy of\n");
+    printf("  its tables which HdfStack::loadSnapshot() maps in milliseconds\n");
+    printf("  --checksums       check every table as it is read\n");
+    printf("  --compress LEVEL  on import write chunked datasets deflated\n");
+    printf("                    at LEVEL, 1 (fastest) to 9 (smallest)\n");
+    exit(1);
+}
+
+//
+// Export an HDF-STACK to a snapshot or import one back.  Import
+// saves like any other stack, so the HDF-STACK is garbage collected.
+//
+int main(int argc, char* argv[])
+{
+    assert(sizeof(uint32) == 4);
+
+    bool checksums = false;
+    int compression = 0;
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--checksums") == 0)
+        {
+            checksums = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc)
+        {
+            compression = atoi(argv[++i]);
+
+            if (compression < 1 || compression > 9)
+            {
+                printf("ERROR: bad compression level '%s'\n", argv[i]);
+                usage(argv[0]);
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage(argv[0]);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() != 3)
+    {
+        usage(argv[0]);
+    }
+
+    bool exporting = strcmp(args[0], "export") == 0;
+
+    if (!exporting && strcmp(args[0], "import") != 0)
+    {
+        usage(argv[0]);
+    }
+
+    std::string inpath = args[1];
+    std::string outpath = args[2];
+
+    if (fileExists(outpath))
+    {
+        printf("ERROR: file '%s' already exists\n", outpath.c_str());
+        printf("ERROR: cannot overwrite existing file, delete it manually.\n");
+        return -1;
+    }
+
+    try
+    {
+        HdfStack stack;
+
+        if (exporting)
+        {
+            {
+                PBT pbt("load");
+                stack.load(inpath, checksums);
+            }
+            {
+                PBT pbt("write snapshot");
+                stack.saveSnapshot(outpath);
+            }
+        }
+        else
+        {
+            {
+                PBT pbt("load snapshot");
+                stack.loadSnapshot(inpath, checksums);
+            }
+            {
+                PBT pbt("write");
+                stack.setCompression(compression);
+                stack.save(outpath, 0);
+            }
+        }
+    }
+    catch (std::string& error)
+    {
+        printf("ERROR: %s\n", error.c_str());
+        return -1;
+    }
+    catch (std::exception& e)
+    {
+        printf("ERROR: %s\n", e.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,251 @@
+#include "BoundsFile.h"
+#include "Table.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char s_MAGIC[8] = { 'S', 'P', 'B', 'O', 'U', 'N', 'D', 'S' };
+static const uint32 s_VERSION = 1;
+
+// Write through a larger buffer than the stdio default
+static const size_t s_BUFFER_SIZE = 1 << 20;
+
+BoundsFileWriter::BoundsFileWriter() :
+    m_file(NULL),
+    m_rows(0)
+{
+}
+
+BoundsFileWriter::~BoundsFileWriter()
+{
+    if (m_file)
+    {
+        fclose(m_file);
+    }
+}
+
+void BoundsFileWriter::open(const std::string& path)
+{
+    m_path = path;
+    m_file = fopen(path.c_str(), "wb");
+
+    if (!m_file)
+    {
+        throw FormatString("Cannot open %s for writing", path.c_str());
+    }
+
+    setvbuf(m_file, NULL, _IOFBF, s_BUFFER_SIZE);
+
+    // Written again with the real row count by close()
+    BoundsFileHeader header;
+    memcpy(header.magic, s_MAGIC, sizeof(s_MAGIC));
+    header.version = s_VERSION;
+    header.columns = BOUNDS_FILE_COLUMNS;
+    header.rows = 0;
+
+    if (fwrite(&header, sizeof(header), 1, m_file) != 1)
+    {
+        throw FormatString("Cannot write header to %s", path.c_str());
+    }
+
+    m_rows = 0;
+}
+
+void BoundsFileWriter::reopen(const std::string& path, uint64 size)
+{
+    m_path = path;
+
+    uint64 rowsize = sizeof(uint32) * BOUNDS_FILE_COLUMNS;
+
+    if (size < sizeof(BoundsFileHeader) ||
+        (size - sizeof(BoundsFileHeader)) % rowsize != 0)
+    {
+        throw FormatString("%llu is not a row boundary of %s",
+            (unsigned long long)size, path.c_str());
+    }
+
+    m_file = fopen(path.c_str(), "r+b");
+
+    struct stat buf;
+
+    if (!m_file || fstat(fileno(m_file), &buf) != 0 ||
+        uint64(buf.st_size) < size)
+    {
+        throw FormatString("Cannot reopen %s at %llu", path.c_str(),
+            (unsigned long long)size);
+    }
+
+    if (ftruncate(fileno(m_file), off_t(size)) != 0 ||
+        fseeko(m_file, 0, SEEK_END) != 0)
+    {
+        throw FormatString("Cannot truncate %s", path.c_str());
+    }
+
+    setvbuf(m_file, NULL, _IOFBF, s_BUFFER_SIZE);
+
+    m_rows = (size - sizeof(BoundsFileHeader)) / rowsize;
+}
+
+uint64 BoundsFileWriter::sync()
+{
+    if (fflush(m_file) != 0 || fsync(fileno(m_file)) != 0)
+    {
+        throw FormatString("Cannot sync %s", m_path.c_str());
+    }
+
+    return uint64(ftello(m_file));
+}
+
+void BoundsFileWriter::writeRow(const uint32* row)
+{
+    if (fwrite(row, sizeof(uint32), BOUNDS_FILE_COLUMNS, m_file) !=
+        BOUNDS_FILE_COLUMNS)
+    {
+        throw FormatString("Cannot write to %s", m_path.c_str());
+    }
+
+    ++m_rows;
+}
+
+void BoundsFileWriter::close()
+{
+    uint64 rows = m_rows;
+
+    if (fseek(m_file, offsetof(BoundsFileHeader, rows), SEEK_SET) != 0 ||
+        fwrite(&rows, sizeof(rows), 1, m_file) != 1)
+    {
+        throw FormatString("Cannot finish %s", m_path.c_str());
+    }
+
+    if (fclose(m_file) != 0)
+    {
+        m_file = NULL;
+        throw FormatString("Cannot close %s", m_path.c_str());
+    }
+
+    m_file = NULL;
+}
+
+bool isBoundsFile(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+
+    if (!file)
+    {
+        return false;
+    }
+
+    char magic[8];
+    bool result = fread(magic, sizeof(magic), 1, file) == 1 &&
+        memcmp(magic, s_MAGIC, sizeof(s_MAGIC)) == 0;
+
+    fclose(file);
+    return result;
+}
+
+BoundsFileReader::BoundsFileReader() :
+    m_file(NULL),
+    m_rows(0),
+    m_read(0)
+{
+}
+
+BoundsFileReader::~BoundsFileReader()
+{
+    close();
+}
+
+void BoundsFileReader::open(const std::string& path)
+{
+    m_path = path;
+    m_file = fopen(path.c_str(), "rb");
+
+    if (!m_file)
+    {
+        throw FormatString("Cannot open %s", path.c_str());
+    }
+
+    setvbuf(m_file, NULL, _IOFBF, s_BUFFER_SIZE);
+
+    BoundsFileHeader header;
+
+    if (fread(&header, sizeof(header), 1, m_file) != 1 ||
+        memcmp(header.magic, s_MAGIC, sizeof(s_MAGIC)) != 0)
+    {
+        close();
+        throw FormatString("%s is not a binary bounds file", path.c_str());
+    }
+
+    if (header.version != s_VERSION || header.columns != BOUNDS_FILE_COLUMNS)
+    {
+        close();
+        throw FormatString("%s has unsupported version=%u columns=%u",
+            path.c_str(), header.version, header.columns);
+    }
+
+    // Size must match the row count from the header exactly
+    struct stat st;
+    uint64 rowbytes = sizeof(uint32) * BOUNDS_FILE_COLUMNS;
+    uint64 expected = sizeof(header) + header.rows * rowbytes;
+
+    if (fstat(fileno(m_file), &st) != 0 || uint64(st.st_size) != expected)
+    {
+        close();
+        throw FormatString("%s is truncated or was not closed", path.c_str());
+    }
+
+    m_rows = header.rows;
+    m_read = 0;
+}
+
+bool BoundsFileReader::readRows(uint32* rows, uint64 count)
+{
+    if (m_read + count > m_rows)
+    {
+        return false;
+    }
+
+    if (count > 0 &&
+        fread(rows, sizeof(uint32) * BOUNDS_FILE_COLUMNS, count, m_file) != count)
+    {
+        throw FormatString("Cannot read %s", m_path.c_str());
+    }
+
+    m_read += count;
+    return true;
+}
+
+void BoundsFileReader::close()
+{
+    if (m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
+
+Table* readBoundsFile(const std::string& path)
+{
+    printf("Reading %s...\n", path.c_str());
+
+    BoundsFileReader reader;
+    reader.open(path);
+
+    Table* table = new Table(reader.getRows(), BOUNDS_FILE_COLUMNS);
+
+    try
+    {
+        reader.readRows(table->getData(), reader.getRows());
+    }
+    catch (std::string&)
+    {
+        delete table;
+        throw;
+    }
+
+    return table;
+}
@@ -0,0 +1,95 @@
+//
+// BoundsFile.h
+//
+
+#pragma once
+
+#include "common.h"
+
+//
+// Binary version of superpixel_bounds.txt
+//
+// A small header followed by rows of little endian uint32 values,
+// the same 7 columns as the TXT file:
+//
+//   PLANE SPID X Y WIDTH HEIGHT VOLUME
+//
+// The header holds the row count, which is only filled in when the
+// file is closed.  So a file from a crashed run is caught when it is
+// read instead of being silently short.
+//
+struct BoundsFileHeader
+{
+    char magic[8];
+    uint32 version;
+    uint32 columns;
+    uint64 rows;
+};
+
+#define BOUNDS_FILE_COLUMNS 7
+
+//
+// Writes a binary bounds file one row at a time.
+//
+class BoundsFileWriter
+{
+public:
+    BoundsFileWriter();
+    ~BoundsFileWriter();
+
+    // Create the file and write a placeholder header
+    void open(const std::string& path);
+
+    // Carry on writing a file which was never closed, keeping its
+    // first size bytes, a length returned by sync()
+    void reopen(const std::string& path, uint64 size);
+
+    // Append one row of BOUNDS_FILE_COLUMNS values
+    void writeRow(const uint32* row);
+
+    // Flush the rows so far to disk and return the file's length
+    uint64 sync();
+
+    // Fill in the row count and close
+    void close();
+
+    uint64 getRows() const { return m_rows; }
+
+private:
+    std::string m_path;
+    FILE* m_file;
+    uint64 m_rows;
+};
+
+//
+// Reads a binary bounds file, either a row at a time or in bulk.
+//
+class BoundsFileReader
+{
+public:
+    BoundsFileReader();
+    ~BoundsFileReader();
+
+    // Open and check the header, throws std::string if the file
+    // is not a complete binary bounds file
+    void open(const std::string& path);
+
+    // Read the next count rows, false at the end of the file
+    bool readRows(uint32* rows, uint64 count = 1);
+
+    void close();
+
+    uint64 getRows() const { return m_rows; }
+
+private:
+    std::string m_path;
+    FILE* m_file;
+    uint64 m_rows;
+    uint64 m_read;
+};
+
+// Return true if the file starts with our magic
+bool isBoundsFile(const std::string& path);
+
+// Read a whole binary bounds file into a new 7 column Table
+Table* readBoundsFile(const std::string& path);
@@ -0,0 +1,162 @@
+#include "Checksum.h"
+
+#include <algorithm>
+
+static const uint64 s_P1 = 11400714785074694791ULL;
+static const uint64 s_P2 = 14029467366897019727ULL;
+static const uint64 s_P3 = 1609587929392839161ULL;
+static const uint64 s_P4 = 9650029242287828579ULL;
+static const uint64 s_P5 = 2870177450012600261ULL;
+
+static inline uint64 rotl(uint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64 read64(const unsigned char* p)
+{
+    uint64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32 read32(const unsigned char* p)
+{
+    uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64 mixRound(uint64 acc, uint64 input)
+{
+    acc += input * s_P2;
+    acc = rotl(acc, 31);
+    return acc * s_P1;
+}
+
+static inline uint64 mergeRound(uint64 acc, uint64 value)
+{
+    acc ^= mixRound(0, value);
+    return acc * s_P1 + s_P4;
+}
+
+Checksum::Checksum(uint64 seed) :
+    m_seed(seed),
+    m_total(0),
+    m_buffered(0)
+{
+    m_v[0] = seed + s_P1 + s_P2;
+    m_v[1] = seed + s_P2;
+    m_v[2] = seed;
+    m_v[3] = seed - s_P1;
+}
+
+void Checksum::update(const void* data, size_t bytes)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + bytes;
+
+    m_total += bytes;
+
+    // Finish a stripe left over from the last update
+    if (m_buffered > 0)
+    {
+        size_t take = std::min(bytes, sizeof(m_buffer) - m_buffered);
+        memcpy(m_buffer + m_buffered, p, take);
+        m_buffered += take;
+        p += take;
+
+        if (m_buffered < sizeof(m_buffer))
+        {
+            return;
+        }
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            m_v[lane] = mixRound(m_v[lane], read64(m_buffer + lane * 8));
+        }
+
+        m_buffered = 0;
+    }
+
+    uint64 v0 = m_v[0];
+    uint64 v1 = m_v[1];
+    uint64 v2 = m_v[2];
+    uint64 v3 = m_v[3];
+
+    while (end - p >= 32)
+    {
+        v0 = mixRound(v0, read64(p));
+        v1 = mixRound(v1, read64(p + 8));
+        v2 = mixRound(v2, read64(p + 16));
+        v3 = mixRound(v3, read64(p + 24));
+        p += 32;
+    }
+
+    m_v[0] = v0;
+    m_v[1] = v1;
+    m_v[2] = v2;
+    m_v[3] = v3;
+
+    memcpy(m_buffer, p, end - p);
+    m_buffered = end - p;
+}
+
+uint64 Checksum::digest() const
+{
+    uint64 h;
+
+    if (m_total >= 32)
+    {
+        h = rotl(m_v[0], 1) + rotl(m_v[1], 7) + rotl(m_v[2], 12) +
+            rotl(m_v[3], 18);
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            h = mergeRound(h, m_v[lane]);
+        }
+    }
+    else
+    {
+        h = m_seed + s_P5;
+    }
+
+    h += m_total;
+
+    const unsigned char* p = m_buffer;
+    const unsigned char* end = m_buffer + m_buffered;
+
+    for (; end - p >= 8; p += 8)
+    {
+        h ^= mixRound(0, read64(p));
+        h = rotl(h, 27) * s_P1 + s_P4;
+    }
+
+    if (end - p >= 4)
+    {
+        h ^= uint64(read32(p)) * s_P1;
+        h = rotl(h, 23) * s_P2 + s_P3;
+        p += 4;
+    }
+
+    for (; p < end; ++p)
+    {
+        h ^= *p * s_P5;
+        h = rotl(h, 11) * s_P1;
+    }
+
+    h ^= h >> 33;
+    h *= s_P2;
+    h ^= h >> 29;
+    h *= s_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64 Checksum::of(const void* data, size_t bytes)
+{
+    Checksum checksum;
+    checksum.update(data, bytes);
+    return checksum.digest();
+}
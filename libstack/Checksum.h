@@ -0,0 +1,41 @@
+//
+// Checksum.h
+//
+
+#pragma once
+
+#include "common.h"
+
+//
+// 64-bit XXH64 checksum, which runs at memory speed, so checking a
+// table as it is read costs little next to reading it.
+//
+// Data can be added in pieces of any size, the result is the same
+// as adding it all at once.  Values are hashed as they are laid out
+// in memory, which on our little endian hosts matches the little
+// endian datasets in the file.
+//
+class Checksum
+{
+public:
+    Checksum(uint64 seed = 0);
+
+    void update(const void* data, size_t bytes);
+
+    // Checksum of everything added so far
+    uint64 digest() const;
+
+    // Checksum of one block of memory
+    static uint64 of(const void* data, size_t bytes);
+
+private:
+    uint64 m_seed;
+    uint64 m_total;
+
+    // Accumulators of the four lanes
+    uint64 m_v[4];
+
+    // Bytes waiting for a full 32 byte stripe
+    unsigned char m_buffer[32];
+    size_t m_buffered;
+};
@@ -0,0 +1,31 @@
+#include "ExternalSort.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+FILE* createScratchFile(const std::string& dir, const std::string& name)
+{
+    std::string path = join(dir, name + ".XXXXXX");
+    std::vector<char> buffer(path.begin(), path.end());
+    buffer.push_back(0);
+
+    int fd = mkstemp(&buffer[0]);
+
+    if (fd < 0)
+    {
+        throw FormatString("Cannot create scratch file in %s: %s",
+            dir.c_str(), strerror(errno));
+    }
+
+    unlink(&buffer[0]);
+
+    FILE* fp = fdopen(fd, "w+b");
+
+    if (!fp)
+    {
+        close(fd);
+        throw FormatString("Cannot open scratch file in %s", dir.c_str());
+    }
+
+    return fp;
+}
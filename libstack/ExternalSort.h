@@ -0,0 +1,375 @@
+//
+// ExternalSort.h
+//
+
+#pragma once
+
+#include "common.h"
+#include "util.h"
+
+#include <algorithm>
+#include <queue>
+
+//
+// Create an anonymous file in dir for scratch data.  It is unlinked
+// at once, so it goes away when closed, even after a crash.
+// Throws std::string on failure.
+//
+FILE* createScratchFile(const std::string& dir, const std::string& name);
+
+//
+// Sorts more records than fit in memory.
+//
+// Records are added in any order and buffered.  Whenever the buffer
+// reaches the memory budget it is sorted and spilled to a scratch
+// file as a sorted run.  Once every record is added, reading merges
+// the runs.  If nothing was ever spilled the records are sorted and
+// read straight from memory.  The sorted records can be read more
+// than once, by calling rewind().
+//
+// Each run holds a file open and needs a read buffer while merging,
+// so there are never more than getMaxRuns().  Once there are that
+// many the smaller half are merged into one new run, which keeps the
+// buffers of any merge within the budget however small it is.
+//
+// T is plain old data with an operator<.  Records which compare
+// equal come back in no particular order, so callers who care add
+// a row number to the key.
+//
+template <class T>
+class ExternalSorter
+{
+public:
+    ExternalSorter(const std::string& name, const std::string& scratch,
+        size_t budget) :
+        m_name(name),
+        m_scratch(scratch),
+        m_capacity(std::max(size_t(1), budget / sizeof(T))),
+        m_maxRuns(std::max(size_t(2), std::min(size_t(s_MAX_RUNS),
+            m_capacity / s_MIN_READ))),
+        m_position(0),
+        m_size(0),
+        m_finished(false)
+    {
+    }
+
+    ~ExternalSorter()
+    {
+        for (size_t i = 0; i < m_runs.size(); ++i)
+        {
+            fclose(m_runs[i].file);
+        }
+    }
+
+    void add(const T& record)
+    {
+        assert(!m_finished);
+
+        if (m_buffer.empty())
+        {
+            m_buffer.reserve(m_capacity);
+        }
+
+        m_buffer.push_back(record);
+        ++m_size;
+
+        if (m_buffer.size() == m_capacity)
+        {
+            spill();
+        }
+    }
+
+    // Call after the last add(), then read with next()
+    void finish()
+    {
+        m_finished = true;
+
+        if (m_runs.empty())
+        {
+            std::sort(m_buffer.begin(), m_buffer.end());
+        }
+        else
+        {
+            if (!m_buffer.empty())
+            {
+                spill();
+            }
+
+            // Free the buffer for whoever is next
+            std::vector<T>().swap(m_buffer);
+        }
+
+        rewind();
+    }
+
+    // Start reading from the first record again
+    void rewind()
+    {
+        assert(m_finished);
+        m_position = 0;
+
+        if (m_runs.empty())
+        {
+            return;
+        }
+
+        // The merge reads each run through its share of the budget
+        startMerge(m_runs, m_heap, m_capacity / m_runs.size());
+    }
+
+    // Get the next record in order, false at the end
+    bool next(T& record)
+    {
+        if (m_runs.empty())
+        {
+            if (m_position == m_buffer.size())
+            {
+                return false;
+            }
+
+            record = m_buffer[m_position++];
+            return true;
+        }
+
+        if (m_heap.empty())
+        {
+            return false;
+        }
+
+        record = m_heap.top().record;
+        size_t run = m_heap.top().run;
+        m_heap.pop();
+
+        pushNext(m_runs, m_heap, run);
+        return true;
+    }
+
+    uint64 size() const { return m_size; }
+
+    // Number of sorted runs spilled to disk, 0 if all in memory
+    size_t getRuns() const { return m_runs.size(); }
+
+    // Most runs held at once, fewer when the budget is too small to
+    // read s_MIN_READ records from each
+    size_t getMaxRuns() const { return m_maxRuns; }
+
+private:
+    // Records read from a run at a time, unless the budget is tiny
+    static const size_t s_MIN_READ = 256;
+
+    // Runs held at once, each is a file descriptor
+    static const size_t s_MAX_RUNS = 64;
+
+    // A sorted run in a scratch file and the records read from it
+    // but not merged yet
+    struct Run
+    {
+        FILE* file;
+        uint64 records;
+        std::vector<T> buffer;
+        size_t next;
+        size_t end;
+    };
+
+    // The next record of one run, waiting to be merged
+    struct Head
+    {
+        T record;
+        size_t run;
+    };
+
+    // Orders the heap smallest first
+    struct HeadAfter
+    {
+        bool operator()(const Head& a, const Head& b) const
+        {
+            return b.record < a.record;
+        }
+    };
+
+    typedef std::priority_queue<Head, std::vector<Head>, HeadAfter> Heap;
+
+    // Biggest first, so the smallest runs are at the end
+    static bool biggerRun(const Run& a, const Run& b)
+    {
+        return a.records > b.records;
+    }
+
+    void spill()
+    {
+        std::sort(m_buffer.begin(), m_buffer.end());
+
+        FILE* fp = createScratchFile(m_scratch, m_name);
+
+        if (fwrite(&m_buffer[0], sizeof(T), m_buffer.size(), fp) !=
+            m_buffer.size() || fflush(fp) != 0)
+        {
+            fclose(fp);
+            throw FormatString("Cannot write %s run to %s", m_name.c_str(),
+                m_scratch.c_str());
+        }
+
+        Run run;
+        run.file = fp;
+        run.records = m_buffer.size();
+        run.next = run.end = 0;
+
+        m_runs.push_back(run);
+        m_buffer.clear();
+
+        if (m_runs.size() >= m_maxRuns)
+        {
+            // The merge has the whole budget, add() allocates the
+            // buffer again
+            std::vector<T>().swap(m_buffer);
+            mergeRuns();
+        }
+    }
+
+    //
+    // Merge the smaller half of the runs into one new run.  Each run
+    // is merged about log(runs) / log(m_maxRuns / 2) times in all.
+    //
+    void mergeRuns()
+    {
+        std::sort(m_runs.begin(), m_runs.end(), biggerRun);
+
+        size_t count = std::max(size_t(2), m_runs.size() / 2);
+        std::vector<Run> inputs(m_runs.end() - count, m_runs.end());
+        m_runs.erase(m_runs.end() - count, m_runs.end());
+
+        // The inputs and the output share the budget
+        size_t records = m_capacity / (count + 1);
+        std::vector<T> out;
+        out.reserve(std::max(size_t(1), records));
+
+        Run run;
+        run.file = NULL;
+        run.records = 0;
+        run.next = run.end = 0;
+
+        try
+        {
+            run.file = createScratchFile(m_scratch, m_name);
+
+            Heap heap;
+            startMerge(inputs, heap, records);
+
+            while (!heap.empty())
+            {
+                out.push_back(heap.top().record);
+                size_t input = heap.top().run;
+                heap.pop();
+
+                pushNext(inputs, heap, input);
+
+                if (out.size() == out.capacity() || heap.empty())
+                {
+                    if (fwrite(&out[0], sizeof(T), out.size(), run.file) !=
+                        out.size())
+                    {
+                        throw FormatString("Cannot write %s run to %s",
+                            m_name.c_str(), m_scratch.c_str());
+                    }
+
+                    run.records += out.size();
+                    out.clear();
+                }
+            }
+
+            if (fflush(run.file) != 0)
+            {
+                throw FormatString("Cannot write %s run to %s",
+                    m_name.c_str(), m_scratch.c_str());
+            }
+        }
+        catch (...)
+        {
+            // Closed by the destructor with the others
+            m_runs.insert(m_runs.end(), inputs.begin(), inputs.end());
+
+            if (run.file)
+            {
+                fclose(run.file);
+            }
+
+            throw;
+        }
+
+        for (size_t i = 0; i < inputs.size(); ++i)
+        {
+            fclose(inputs[i].file);
+        }
+
+        m_runs.push_back(run);
+    }
+
+    // Read the first records of each run, records at a time
+    void startMerge(std::vector<Run>& runs, Heap& heap, size_t records)
+    {
+        heap = Heap();
+
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            Run& run = runs[i];
+
+            if (fseeko(run.file, 0, SEEK_SET) != 0)
+            {
+                throw FormatString("Cannot rewind %s run", m_name.c_str());
+            }
+
+            run.buffer.resize(std::max(size_t(1), records));
+            run.next = run.end = 0;
+
+            pushNext(runs, heap, i);
+        }
+    }
+
+    void pushNext(std::vector<Run>& runs, Heap& heap, size_t i)
+    {
+        Run& run = runs[i];
+
+        if (run.next == run.end)
+        {
+            run.next = 0;
+            run.end = fread(&run.buffer[0], sizeof(T), run.buffer.size(),
+                run.file);
+
+            if (run.end == 0)
+            {
+                if (ferror(run.file))
+                {
+                    throw FormatString("Cannot read %s run", m_name.c_str());
+                }
+
+                // This run is all merged
+                std::vector<T>().swap(run.buffer);
+                return;
+            }
+        }
+
+        Head head;
+        head.record = run.buffer[run.next++];
+        head.run = i;
+        heap.push(head);
+    }
+
+    std::string m_name;
+    std::string m_scratch;
+
+    // Records held before spilling a run, and held by all the runs
+    // together while merging
+    size_t m_capacity;
+    std::vector<T> m_buffer;
+
+    size_t m_maxRuns;
+
+    std::vector<Run> m_runs;
+    Heap m_heap;
+
+    // Next record in m_buffer when nothing was spilled
+    size_t m_position;
+
+    uint64 m_size;
+    bool m_finished;
+};
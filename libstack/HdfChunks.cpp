@@ -0,0 +1,588 @@
+#include "HdfChunks.h"
+#include "Threads.h"
+#include "util.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+// About 1MB of values a chunk, big enough for deflate to do well
+// and small enough that a plane read alone doesn't read much extra
+static const uint32 s_CHUNK_VALUES = 1 << 18;
+
+// Chunks compressed or decompressed at once, per thread
+static const int s_CHUNKS_PER_THREAD = 4;
+
+uint32 getChunkRows(uint64 rows, uint32 columns)
+{
+    uint32 chunkRows = std::max(uint32(1), s_CHUNK_VALUES / columns);
+    return uint32(std::min(rows, uint64(chunkRows)));
+}
+
+hid_t createChunkedProperties(uint32 chunkRows, uint32 columns, int level)
+{
+    hsize_t dims[2] = { chunkRows, columns };
+
+    hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+
+    if (plist < 0 ||
+        H5Pset_chunk(plist, 2, dims) < 0 ||
+        (level > 0 && H5Pset_shuffle(plist) < 0) ||
+        (level > 0 && H5Pset_deflate(plist, level) < 0))
+    {
+        throw std::string("Cannot create chunked dataset properties");
+    }
+
+    return plist;
+}
+
+//
+// Shuffle the 4-byte values of a chunk, as HDF5's shuffle filter
+// does: byte j of value i goes to j * values + i.  Values past
+// validValues are zero, the padding of the last chunk.
+//
+static void shuffle(const uint32* data, size_t validValues, size_t values,
+    unsigned char* out)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    for (size_t j = 0; j < 4; ++j)
+    {
+        unsigned char* lane = out + j * values;
+
+        for (size_t i = 0; i < validValues; ++i)
+        {
+            lane[i] = bytes[i * 4 + j];
+        }
+
+        memset(lane + validValues, 0, values - validValues);
+    }
+}
+
+static void unshuffle(const unsigned char* in, size_t values,
+    unsigned char* out)
+{
+    for (size_t j = 0; j < 4; ++j)
+    {
+        const unsigned char* lane = in + j * values;
+
+        for (size_t i = 0; i < values; ++i)
+        {
+            out[i * 4 + j] = lane[i];
+        }
+    }
+}
+
+//
+// Compression of one batch of chunks, shared by the threads.
+//
+struct WriteChunk
+{
+    const uint32* data;
+    uint32 rows;
+    std::vector<unsigned char> out;
+};
+
+struct WriteJob
+{
+    WriteJob() : next(0), failed(false) {}
+
+    std::vector<WriteChunk> chunks;
+    uint32 chunkRows;
+    uint32 columns;
+    int level;
+
+    Mutex mutex;
+    size_t next;
+    bool failed;
+};
+
+static void* compressMain(void* arg)
+{
+    WriteJob* job = (WriteJob*)arg;
+
+    size_t values = size_t(job->chunkRows) * job->columns;
+    std::vector<unsigned char> shuffled(values * sizeof(uint32));
+
+    while (true)
+    {
+        size_t n;
+
+        {
+            ScopedLock lock(job->mutex);
+
+            if (job->next == job->chunks.size())
+            {
+                return NULL;
+            }
+
+            n = job->next++;
+        }
+
+        WriteChunk& chunk = job->chunks[n];
+
+        shuffle(chunk.data, size_t(chunk.rows) * job->columns, values,
+            &shuffled[0]);
+
+        uLongf size = compressBound(shuffled.size());
+        chunk.out.resize(size);
+
+        if (compress2(&chunk.out[0], &size, &shuffled[0], shuffled.size(),
+                job->level) != Z_OK)
+        {
+            ScopedLock lock(job->mutex);
+            job->failed = true;
+            continue;
+        }
+
+        chunk.out.resize(size);
+    }
+}
+
+ChunkWriter::ChunkWriter(hid_t dataset, const std::string& name,
+    uint64 rows, uint32 columns, uint32 chunkRows, int level, int threads) :
+    m_dataset(dataset),
+    m_name(name),
+    m_rows(rows),
+    m_columns(columns),
+    m_chunkRows(chunkRows),
+    m_level(level),
+    m_threads(std::max(threads, 1))
+{
+}
+
+uint64 ChunkWriter::getBatchRows() const
+{
+    return uint64(m_chunkRows) * m_threads * s_CHUNKS_PER_THREAD;
+}
+
+void ChunkWriter::write(uint64 firstRow, const uint32* data, uint64 count)
+{
+    if (firstRow % m_chunkRows != 0 ||
+        (count % m_chunkRows != 0 && firstRow + count != m_rows))
+    {
+        throw FormatString("Rows %llu to %llu of %s are not whole chunks",
+            firstRow, firstRow + count, m_name.c_str());
+    }
+
+    uint64 batchRows = getBatchRows();
+
+    for (uint64 done = 0; done < count; done += batchRows)
+    {
+        WriteJob job;
+        job.chunkRows = m_chunkRows;
+        job.columns = m_columns;
+        job.level = m_level;
+
+        uint64 end = std::min(count, done + batchRows);
+
+        for (uint64 row = done; row < end; row += m_chunkRows)
+        {
+            WriteChunk chunk;
+            chunk.data = data + row * m_columns;
+            chunk.rows = uint32(std::min(uint64(m_chunkRows), end - row));
+            job.chunks.push_back(chunk);
+        }
+
+        int threads = std::min(size_t(m_threads), job.chunks.size());
+
+        if (threads > 1)
+        {
+            runThreads(threads, compressMain, &job);
+        }
+        else
+        {
+            compressMain(&job);
+        }
+
+        if (job.failed)
+        {
+            throw FormatString("Cannot compress %s", m_name.c_str());
+        }
+
+        // In order, HDF5 is not thread safe
+        for (size_t i = 0; i < job.chunks.size(); ++i)
+        {
+            const WriteChunk& chunk = job.chunks[i];
+            hsize_t offset[2] = { firstRow + done + i * m_chunkRows, 0 };
+
+            if (H5Dwrite_chunk(m_dataset, H5P_DEFAULT, 0, offset,
+                    chunk.out.size(), &chunk.out[0]) < 0)
+            {
+                throw FormatString("Cannot write %s", m_name.c_str());
+            }
+        }
+    }
+}
+
+//
+// A dataset ChunkReader::read() was given, its chunks may still be
+// queued after it is closed.
+//
+struct ChunkReader::Dataset
+{
+    std::string name;
+    uint32 columns;
+    uint32 chunkRows;
+
+    // In pipeline order, undone last to first
+    std::vector<H5Z_filter_t> filters;
+};
+
+// Part of a chunk which goes to a target
+struct ChunkPiece
+{
+    uint32 row;
+    uint32 rows;
+    uint32* data;
+};
+
+struct ChunkReader::Chunk
+{
+    const Dataset* dataset;
+    uint64 firstRow;
+
+    // As stored, and the filters HDF5 says were skipped
+    std::vector<unsigned char> stored;
+    uint32 mask;
+
+    std::vector<ChunkPiece> pieces;
+};
+
+struct ChunkReader::Job
+{
+    Job() : next(0), failed(false) {}
+
+    std::vector<Chunk*>* chunks;
+
+    Mutex mutex;
+    size_t next;
+    bool failed;
+    std::string error;
+};
+
+bool ChunkReader::canRead(hid_t dataset)
+{
+    hid_t plist = H5Dget_create_plist(dataset);
+
+    if (plist < 0)
+    {
+        return false;
+    }
+
+    bool ok = H5Pget_layout(plist) == H5D_CHUNKED;
+
+    hsize_t dims[2];
+    ok = ok && H5Pget_chunk(plist, 2, dims) == 2;
+
+    hid_t space = H5Dget_space(dataset);
+    hsize_t extent[2];
+
+    ok = ok && H5Sget_simple_extent_ndims(space) == 2 &&
+        H5Sget_simple_extent_dims(space, extent, NULL) == 2 &&
+        dims[1] == extent[1];
+
+    H5Sclose(space);
+
+    int filters = ok ? H5Pget_nfilters(plist) : 0;
+
+    for (int i = 0; i < filters && ok; ++i)
+    {
+        unsigned int flags;
+        size_t values = 0;
+        H5Z_filter_t filter = H5Pget_filter2(plist, i, &flags, &values,
+            NULL, 0, NULL, NULL);
+
+        ok = filter == H5Z_FILTER_SHUFFLE || filter == H5Z_FILTER_DEFLATE;
+    }
+
+    H5Pclose(plist);
+    return ok;
+}
+
+ChunkReader::ChunkReader(int threads) :
+    m_threads(std::max(threads, 1)),
+    m_queuedBytes(0),
+    m_failed(false)
+{
+}
+
+ChunkReader::~ChunkReader()
+{
+    for (size_t i = 0; i < m_chunks.size(); ++i)
+    {
+        delete m_chunks[i];
+    }
+
+    for (size_t i = 0; i < m_datasets.size(); ++i)
+    {
+        delete m_datasets[i];
+    }
+}
+
+// For sorting targets by row
+static bool earlierTarget(const ChunkTarget& a, const ChunkTarget& b)
+{
+    return a.firstRow < b.firstRow;
+}
+
+void ChunkReader::read(hid_t dataset, const std::string& name,
+    const std::vector<ChunkTarget>& targets)
+{
+    Dataset* info = new Dataset();
+    m_datasets.push_back(info);
+
+    info->name = name;
+
+    hid_t plist = H5Dget_create_plist(dataset);
+    hsize_t dims[2];
+
+    if (plist < 0 || H5Pget_chunk(plist, 2, dims) != 2)
+    {
+        throw FormatString("Cannot get chunks of %s", name.c_str());
+    }
+
+    info->chunkRows = dims[0];
+    info->columns = dims[1];
+
+    int filters = H5Pget_nfilters(plist);
+
+    for (int i = 0; i < filters; ++i)
+    {
+        unsigned int flags;
+        size_t values = 0;
+        info->filters.push_back(H5Pget_filter2(plist, i, &flags, &values,
+            NULL, 0, NULL, NULL));
+    }
+
+    H5Pclose(plist);
+
+    std::vector<ChunkTarget> sorted(targets);
+    std::sort(sorted.begin(), sorted.end(), earlierTarget);
+
+    uint64 chunkBytes = uint64(info->chunkRows) * info->columns *
+        sizeof(uint32);
+    Chunk* last = NULL;
+
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        const ChunkTarget& target = sorted[i];
+        uint64 end = target.firstRow + target.rows;
+
+        for (uint64 row = target.firstRow; row < end; )
+        {
+            uint64 firstRow = row - row % info->chunkRows;
+
+            // Neighbouring targets often share a chunk
+            if (!last || last->firstRow != firstRow)
+            {
+                if (m_queuedBytes >= chunkBytes * m_threads *
+                    s_CHUNKS_PER_THREAD)
+                {
+                    decompress();
+                }
+
+                last = new Chunk();
+                last->dataset = info;
+                last->firstRow = firstRow;
+                m_chunks.push_back(last);
+
+                hsize_t offset[2] = { firstRow, 0 };
+                hsize_t size = 0;
+
+                if (H5Dget_chunk_storage_size(dataset, offset, &size) < 0 ||
+                    size == 0)
+                {
+                    throw FormatString("Cannot find chunk at row %llu of %s",
+                        firstRow, name.c_str());
+                }
+
+                last->stored.resize(size);
+
+                if (H5Dread_chunk(dataset, H5P_DEFAULT, offset, &last->mask,
+                        &last->stored[0]) < 0)
+                {
+                    throw FormatString("Cannot read chunk at row %llu of %s",
+                        firstRow, name.c_str());
+                }
+
+                m_queuedBytes += chunkBytes;
+            }
+
+            uint64 next = std::min(end, firstRow + info->chunkRows);
+
+            ChunkPiece piece;
+            piece.row = row - firstRow;
+            piece.rows = next - row;
+            piece.data = target.data +
+                (row - target.firstRow) * info->columns;
+            last->pieces.push_back(piece);
+
+            row = next;
+        }
+    }
+}
+
+//
+// Undo the filters of one chunk into out, false if it is not what
+// we expect
+//
+static bool decodeChunk(const std::vector<unsigned char>& stored,
+    uint32 mask, const std::vector<H5Z_filter_t>& filters, size_t bytes,
+    std::vector<unsigned char>& out, std::vector<unsigned char>& temp)
+{
+    const unsigned char* data = &stored[0];
+    size_t size = stored.size();
+
+    for (int i = int(filters.size()) - 1; i >= 0; --i)
+    {
+        // Optional filters may have been skipped for this chunk
+        if (mask & (1u << i))
+        {
+            continue;
+        }
+
+        unsigned char* dest = data == &out[0] ? &temp[0] : &out[0];
+
+        if (filters[i] == H5Z_FILTER_DEFLATE)
+        {
+            uLongf destSize = bytes;
+
+            if (uncompress(dest, &destSize, data, size) != Z_OK ||
+                destSize != bytes)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (size != bytes)
+            {
+                return false;
+            }
+
+            unshuffle(data, bytes / sizeof(uint32), dest);
+        }
+
+        data = dest;
+        size = bytes;
+    }
+
+    if (size != bytes)
+    {
+        return false;
+    }
+
+    if (data != &out[0])
+    {
+        memcpy(&out[0], data, bytes);
+    }
+
+    return true;
+}
+
+void* ChunkReader::workerMain(void* arg)
+{
+    Job* job = (Job*)arg;
+
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> temp;
+
+    while (true)
+    {
+        size_t n;
+
+        {
+            ScopedLock lock(job->mutex);
+
+            if (job->next == job->chunks->size())
+            {
+                return NULL;
+            }
+
+            n = job->next++;
+        }
+
+        Chunk* chunk = (*job->chunks)[n];
+        const Dataset* dataset = chunk->dataset;
+
+        size_t bytes = size_t(dataset->chunkRows) * dataset->columns *
+            sizeof(uint32);
+
+        out.resize(bytes);
+        temp.resize(bytes);
+
+        if (!decodeChunk(chunk->stored, chunk->mask, dataset->filters, bytes,
+                out, temp))
+        {
+            ScopedLock lock(job->mutex);
+
+            if (!job->failed)
+            {
+                job->failed = true;
+                job->error = FormatString(
+                    "Cannot decompress chunk at row %llu of %s",
+                    chunk->firstRow, dataset->name.c_str());
+            }
+
+            continue;
+        }
+
+        const uint32* values = (const uint32*)&out[0];
+
+        for (size_t i = 0; i < chunk->pieces.size(); ++i)
+        {
+            const ChunkPiece& piece = chunk->pieces[i];
+
+            memcpy(piece.data, values + size_t(piece.row) * dataset->columns,
+                size_t(piece.rows) * dataset->columns * sizeof(uint32));
+        }
+    }
+}
+
+void ChunkReader::decompress()
+{
+    if (m_chunks.empty())
+    {
+        return;
+    }
+
+    Job job;
+    job.chunks = &m_chunks;
+
+    int threads = std::min(size_t(m_threads), m_chunks.size());
+
+    if (threads > 1)
+    {
+        runThreads(threads, workerMain, &job);
+    }
+    else
+    {
+        workerMain(&job);
+    }
+
+    if (job.failed && !m_failed)
+    {
+        m_failed = true;
+        m_error = job.error;
+    }
+
+    for (size_t i = 0; i < m_chunks.size(); ++i)
+    {
+        delete m_chunks[i];
+    }
+
+    m_chunks.clear();
+    m_queuedBytes = 0;
+}
+
+void ChunkReader::finish()
+{
+    decompress();
+
+    if (m_failed)
+    {
+        throw m_error;
+    }
+}
@@ -0,0 +1,117 @@
+//
+// HdfChunks.h
+//
+
+#pragma once
+
+#include "common.h"
+#include "hdf5.h"
+
+//
+// Chunked datasets with the shuffle and deflate filters, compressed
+// and decompressed on threads of our own.
+//
+// HDF5 runs filters on the calling thread one chunk at a time, and
+// is not thread safe, so we run the filters ourselves and hand HDF5
+// the finished chunks with H5Dwrite_chunk() and H5Dread_chunk().
+// The datasets carry the standard filters, so HDF5 itself, h5dump
+// or h5py read them like any other.
+//
+// A chunk is a block of whole rows.  Shuffle stores the low byte of
+// every value, then the next byte and so on, so the high bytes of
+// our small values and the 0xFF bytes of EMPTY_VALUE are in long
+// runs which deflate squeezes down to almost nothing.
+//
+
+// Rows in each chunk of a compressed dataset, 0 if rows is 0 and
+// the dataset cannot be chunked
+uint32 getChunkRows(uint64 rows, uint32 columns);
+
+// Dataset creation properties for chunks of chunkRows rows, shuffled
+// then deflated at level 1 to 9, or not filtered at all at level 0.
+// The caller closes them.
+hid_t createChunkedProperties(uint32 chunkRows, uint32 columns, int level);
+
+//
+// Writes the chunks of one dataset created with
+// createChunkedProperties().
+//
+class ChunkWriter
+{
+public:
+    ChunkWriter(hid_t dataset, const std::string& name, uint64 rows,
+        uint32 columns, uint32 chunkRows, int level, int threads);
+
+    // Compress and write count rows from firstRow, which must start
+    // a chunk.  count must be whole chunks unless it runs to the end
+    // of the dataset.  Throws std::string on failure.
+    void write(uint64 firstRow, const uint32* data, uint64 count);
+
+    // Rows to give write() at a time to keep every thread busy
+    uint64 getBatchRows() const;
+
+private:
+    hid_t m_dataset;
+    std::string m_name;
+    uint64 m_rows;
+    uint32 m_columns;
+    uint32 m_chunkRows;
+    int m_level;
+    int m_threads;
+};
+
+// Rows [firstRow, firstRow + rows) of a dataset go to data
+struct ChunkTarget
+{
+    uint64 firstRow;
+    uint64 rows;
+    uint32* data;
+};
+
+//
+// Reads chunked datasets of 32-bit values, shuffled and/or deflated
+// or not filtered at all, as HdfFile writes them.
+//
+// read() reads the chunks from the file, with HDF5 so one thread at
+// a time, and queues them.  Once there are enough to keep every
+// thread busy they are decompressed on threads, and the rest when
+// finish() is called.
+//
+class ChunkReader
+{
+public:
+    // False if the dataset is not chunked in rows or has filters we
+    // don't know, then HDF5 has to read it
+    static bool canRead(hid_t dataset);
+
+    ChunkReader(int threads);
+    ~ChunkReader();
+
+    // Read targets of one dataset, which must not overlap.  A chunk
+    // holding rows of several targets is read once.  The dataset may
+    // be closed after, but the data is only all there after finish().
+    // name is for errors.
+    void read(hid_t dataset, const std::string& name,
+        const std::vector<ChunkTarget>& targets);
+
+    // Decompress whatever is queued, throws the first error
+    void finish();
+
+private:
+    struct Dataset;
+    struct Chunk;
+    struct Job;
+
+    void decompress();
+
+    static void* workerMain(void* arg);
+
+    int m_threads;
+
+    std::vector<Dataset*> m_datasets;
+    std::vector<Chunk*> m_chunks;
+    uint64 m_queuedBytes;
+
+    bool m_failed;
+    std::string m_error;
+};
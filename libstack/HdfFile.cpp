@@ -1,21 +1,48 @@
 #include "HdfFile.h"
+#include "HdfChunks.h"
 #include "Table.h"
+#include "Threads.h"
+#include "timers.h"
 #include "util.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
 //
 // VERSION is written as an attribute on the root dir 
 // so we can identify our own files.
 //
 const char * HdfFile::s_VERSION_NAME = "hdf-stack-version";
-const uint32 HdfFile::s_VERSION_NUMBER = 1;
+const uint32 HdfFile::s_VERSION_NUMBER = 2;
+
+// Where version 2 keeps the planes, see HdfPlaneWriter
+const char * HdfFile::s_SUPERPIXELS_NAME = "superpixels";
+const char * HdfFile::s_PLANE_INDEX_NAME = "superpixel_index";
+
+//
+// CHECKSUM is an XXH64 of the dataset's values, written as an
+// attribute on each dataset.  Files from before we wrote them have
+// none, and read as before.
+//
+const char * HdfFile::s_CHECKSUM_NAME = "checksum-xxh64";
 
 HdfFile::HdfFile() :
-    m_file(-1)
+    m_file(-1),
+    m_checkChecksums(false),
+    m_compression(0),
+    m_compressThreads(1),
+    m_extendible(false),
+    m_version(0),
+    m_planeIndex(NULL)
 {
 }
 
 HdfFile::~HdfFile()
 {
+    delete m_planeIndex;
+
     if (m_file >= 0)
     {
 	if (H5Fclose(m_file) < 0)
@@ -25,8 +52,15 @@ HdfFile::~HdfFile()
     }
 }
 
-void HdfFile::openForWrite(const std::string& path)
+void HdfFile::openForWrite(const std::string& path, uint32 version)
 {
+    if (version < 1 || version > s_VERSION_NUMBER)
+    {
+        throw FormatString("Cannot write version %u", version);
+    }
+
+    m_version = version;
+
     m_file = H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
     
     if (m_file < 0)
@@ -57,7 +91,7 @@ void HdfFile::openForWrite(const std::string& path)
 	throw std::string("Cannot create attribute on root");
     }
 	
-    if (H5Awrite(attr, H5T_NATIVE_UINT, &s_VERSION_NUMBER) < 0)
+    if (H5Awrite(attr, H5T_NATIVE_UINT, &version) < 0)
     {
 	throw std::string("Cannot write attribute to root");
     }
@@ -80,6 +114,7 @@ void HdfFile::openForWrite(const std::string& path)
 
 void HdfFile::openForRead(const std::string& path)
 {
+    m_path = path;
     m_file = H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
     
     if (m_file < 0)
@@ -90,6 +125,19 @@ void HdfFile::openForRead(const std::string& path)
     checkVersion();
 }
 
+void HdfFile::openForUpdate(const std::string& path)
+{
+    m_path = path;
+    m_file = H5Fopen(path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+
+    if (m_file < 0)
+    {
+	throw FormatString("Cannot open %s for update", path.c_str());
+    }
+
+    checkVersion();
+}
+
 // check the version attribute on the root group
 void HdfFile::checkVersion()
 {       
@@ -116,11 +164,14 @@ void HdfFile::checkVersion()
 	throw std::string("Cannot read version attribute");
     }
         
-    if (version != s_VERSION_NUMBER)
+    // We still read every older version
+    if (version < 1 || version > s_VERSION_NUMBER)
     {
 	throw std::string("Version mismatch");
     }	
 
+    m_version = version;
+
     ret = H5Aclose(attr);
     
     if (ret < 0)
@@ -144,10 +195,26 @@ void HdfFile::writeDataset(const std::string& name, const Table& table)
     writeDataset(name, rank, dims, table.getData());
 }
     
-void HdfFile::writeDataset(const std::string& name, 
-    int rank, hsize_t *dims, uint32* data)
+void HdfFile::setCompression(int level, int threads)
+{
+    if (level < 0 || level > 9)
+    {
+        throw FormatString("Bad compression level %d", level);
+    }
+
+    m_compression = level;
+    m_compressThreads = threads;
+}
+
+hid_t HdfFile::createDataset(const std::string& name, int rank,
+    hsize_t* dims, uint32& chunkRows)
 {
-    hid_t dataspace = H5Screate_simple(rank, dims, NULL);
+    bool extendible = m_extendible && rank == 2;
+
+    // Only the rows can change
+    hsize_t maxdims[2] = { H5S_UNLIMITED, rank == 2 ? dims[1] : 1 };
+
+    hid_t dataspace = H5Screate_simple(rank, dims, extendible ? maxdims : NULL);
     
     // Little endian unsigned ints
     hid_t datatype = H5Tcopy(H5T_NATIVE_UINT);
@@ -156,40 +223,83 @@ void HdfFile::writeDataset(const std::string& name,
     if (status < 0)
     {
 	printf("ERROR from H5Tset_order: %d\n", status);
-	return;
+	return -1;
+    }
+
+    // An empty dataset has no chunks to write
+    chunkRows = 0;
+    hid_t plist = H5P_DEFAULT;
+
+    if (m_compression > 0 && rank == 2 && dims[0] > 0)
+    {
+        chunkRows = getChunkRows(dims[0], dims[1]);
+        plist = createChunkedProperties(chunkRows, dims[1], m_compression);
+    }
+    else if (extendible)
+    {
+        // Resizing needs chunks, HDF5 writes these itself as they
+        // are not filtered
+        plist = createChunkedProperties(
+            getChunkRows(std::max(dims[0], hsize_t(1)), dims[1]), dims[1], 0);
     }
     
     hid_t dataset = H5Dcreate2(m_file, name.c_str(), datatype, dataspace,
-			H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+			H5P_DEFAULT, plist, H5P_DEFAULT);
 
-    status = H5Dwrite(dataset,
-        H5T_NATIVE_UINT,
-        H5S_ALL, H5S_ALL,
-        H5P_DEFAULT,
-        data);
-	
-    if (status < 0)
+    if (plist != H5P_DEFAULT)
     {
-	printf("ERROR from H5Dwrite: %d\n", status);
-	return;
+        H5Pclose(plist);
     }
 
-    status = H5Sclose(dataspace);
+    H5Tclose(datatype);
+    H5Sclose(dataspace);
+
+    return dataset;
+}
     
-    if (status < 0)
+void HdfFile::writeDataset(const std::string& name, 
+    int rank, hsize_t *dims, uint32* data)
+{
+    uint32 chunkRows;
+    hid_t dataset = createDataset(name, rank, dims, chunkRows);
+
+    if (dataset < 0)
     {
-	printf("ERROR from H5Sclose: %d\n", status);
+	printf("ERROR from H5Dcreate2: %s\n", name.c_str());
 	return;
     }
-    
-    status = H5Tclose(datatype);
 
+    herr_t status = 0;
+
+    if (chunkRows > 0)
+    {
+        ChunkWriter writer(dataset, name, dims[0], dims[1], chunkRows,
+            m_compression, m_compressThreads);
+        writer.write(0, data, dims[0]);
+    }
+    else
+    {
+        status = H5Dwrite(dataset,
+            H5T_NATIVE_UINT,
+            H5S_ALL, H5S_ALL,
+            H5P_DEFAULT,
+            data);
+    }
+	
     if (status < 0)
     {
-	printf("ERROR from H5Tclose: %d\n", status);
+	printf("ERROR from H5Dwrite: %d\n", status);
 	return;
     }
-    
+
+    size_t values = 1;
+    for (int i = 0; i < rank; ++i)
+    {
+        values *= dims[i];
+    }
+
+    writeChecksum(dataset, Checksum::of(data, values * sizeof(uint32)));
+
     status = H5Dclose(dataset);
     
     if (status < 0)
@@ -207,7 +317,55 @@ void HdfFile::createGroup(const std::string& name)
     H5Gclose(group);
 }
 
-Table* HdfFile::readTable(const std::string& path)
+//
+// Write count rows of columns values to a dataset from firstRow,
+// throws std::string on failure, name is for the error
+//
+static void writeHyperslab(hid_t dataset, const std::string& name,
+    uint64 firstRow, const uint32* rows, uint64 count, uint32 columns)
+{
+    hsize_t start[2] = { firstRow, 0 };
+    hsize_t counts[2] = { count, columns };
+
+    hid_t filespace = H5Dget_space(dataset);
+    hid_t memspace = H5Screate_simple(2, counts, NULL);
+
+    herr_t status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET, 
+        start, NULL, counts, NULL);
+
+    if (status >= 0)
+    {
+        status = H5Dwrite(dataset, H5T_NATIVE_UINT, memspace, filespace,
+            H5P_DEFAULT, rows);
+    }
+
+    H5Sclose(memspace);
+    H5Sclose(filespace);
+
+    if (status < 0)
+    {
+        throw FormatString("Cannot write dataset %s", name.c_str());
+    }
+}
+
+// 64-bit values of the plane index are two columns, low first
+static uint64 getValue64(const Table* table, uint32 row, uint32 low)
+{
+    return uint64(table->getValue(row, low)) |
+        (uint64(table->getValue(row, low + 1)) << 32);
+}
+
+static void setValue64(Table* table, uint32 row, uint32 low, uint64 value)
+{
+    table->setValue(row, low, uint32(value));
+    table->setValue(row, low + 1, uint32(value >> 32));
+}
+
+//
+// Open a dataset and check it holds a table of 32-bit values, the
+// caller closes it
+//
+hid_t HdfFile::openTable(const std::string& path, hsize_t& rows, hsize_t& cols)
 {
     hid_t dataset = H5Dopen2(m_file, path.c_str(), H5P_DEFAULT);
     
@@ -243,6 +401,8 @@ Table* HdfFile::readTable(const std::string& path)
     {
 	throw std::string("Expected 32-bit data.");
     }
+
+    H5Tclose(datatype);
 	
     hid_t dataspace = H5Dget_space(dataset);
     
@@ -266,12 +426,23 @@ Table* HdfFile::readTable(const std::string& path)
     {
 	throw std::string("Error getting dims");
     }
+
+    H5Sclose(dataspace);
     
-    hsize_t rows = dims_out[0];
-    hsize_t cols = dims_out[1];
+    rows = dims_out[0];
+    cols = dims_out[1];
     
     //printf("rank %d, dimensions %lu x %lu \n", rank,
 	//   (unsigned long)(dims_out[0]), (unsigned long)(dims_out[1]));
+
+    return dataset;
+}
+
+Table* HdfFile::readTable(const std::string& path)
+{
+    hsize_t rows;
+    hsize_t cols;
+    hid_t dataset = openTable(path, rows, cols);
 	   
     Table* table = new Table(rows, cols);
 	   
@@ -283,6 +454,22 @@ Table* HdfFile::readTable(const std::string& path)
 	delete table;
 	throw std::string("Read failed");
     }
+
+    uint64 expected;
+
+    if (m_checkChecksums && readChecksum(dataset, expected))
+    {
+        uint64 actual = Checksum::of(table->getData(),
+            size_t(rows) * cols * sizeof(uint32));
+
+        if (actual != expected)
+        {
+            delete table;
+            H5Dclose(dataset);
+            throw FormatString("Checksum mismatch in dataset %s",
+                path.c_str());
+        }
+    }
     
     if (H5Dclose(dataset) < 0)
     {
@@ -293,41 +480,1297 @@ Table* HdfFile::readTable(const std::string& path)
 }
 
 //
-// For findfile callback
-///
-StringList* gFilenames = NULL;
+// One dataset for readTables() to read straight from the file.
+//
+struct RawRead
+{
+    size_t index;
+
+    // For errors, "dataset <name>" or "plane <z>"
+    std::string name;
+    uint64 offset;
+    uint32 rows;
+    uint32 columns;
+    size_t bytes;
+
+    bool checksum;
+    uint64 expected;
+};
 
 //
-// Callback used by listDatasets
+// Shared by the threads of readTables() or readPlanes().  Chunked
+// datasets are not read by the threads, but their tables are
+// allocated and checked on them.
 //
-static herr_t findfile(hid_t loc_id, 
-    const char *name, const H5L_info_t *linfo, void *opdata)
+struct RawReadJob
 {
-    /* avoid compiler warnings */
-    loc_id = loc_id;
-    opdata = opdata;
-    linfo = linfo;
-    
-    gFilenames->push_back(name);
-    
-    return 0;
+    RawReadJob() : tables(NULL), step(READ), nextRead(0), failed(false) {}
+
+    enum Step { READ, ALLOCATE, CHECK };
+
+    std::string path;
+    std::vector<RawRead> reads;
+    std::vector<Table*>* tables;
+    Step step;
+
+    Mutex mutex;
+    size_t nextRead;
+
+    // The first error, by dataset order
+    bool failed;
+    size_t failedIndex;
+    std::string error;
+};
+
+static void rawReadFailed(RawReadJob& job, size_t index,
+    const std::string& error)
+{
+    ScopedLock lock(job.mutex);
+
+    if (!job.failed || index < job.failedIndex)
+    {
+        job.failed = true;
+        job.failedIndex = index;
+        job.error = error;
+    }
+}
+
+// For sorting the biggest reads first
+static bool biggerRead(const RawRead& a, const RawRead& b)
+{
+    return a.bytes > b.bytes;
+}
+
+static void deleteTables(std::vector<Table*>& tables)
+{
+    for (size_t i = 0; i < tables.size(); ++i)
+    {
+        delete tables[i];
+    }
+
+    tables.clear();
+}
+
+static bool rawRead(int fd, const RawRead& read, Table* table)
+{
+    char* data = (char*)table->getData();
+    size_t done = 0;
+
+    while (done < read.bytes)
+    {
+        ssize_t n = pread(fd, data + done, read.bytes - done,
+            off_t(read.offset + done));
+
+        if (n <= 0)
+        {
+            return false;
+        }
+
+        done += n;
+    }
+
+    return true;
+}
+
+static bool checkRead(const RawRead& read, Table* table)
+{
+    return !read.checksum ||
+        Checksum::of(table->getData(), read.bytes) == read.expected;
+}
+
+static void* rawReadWorkerMain(void* arg)
+{
+    RawReadJob* job = (RawReadJob*)arg;
+
+    // Our own handle, so the reads don't share a file position
+    int fd = -1;
+
+    if (job->step == RawReadJob::READ)
+    {
+        fd = open(job->path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            rawReadFailed(*job, 0, FormatString("Cannot open %s",
+                job->path.c_str()));
+            return NULL;
+        }
+    }
+
+    while (true)
+    {
+        size_t n;
+
+        {
+            ScopedLock lock(job->mutex);
+
+            if (job->nextRead == job->reads.size())
+            {
+                break;
+            }
+
+            n = job->nextRead++;
+        }
+
+        const RawRead& read = job->reads[n];
+
+        if (job->step == RawReadJob::CHECK)
+        {
+            if (!checkRead(read, (*job->tables)[read.index]))
+            {
+                rawReadFailed(*job, read.index, FormatString(
+                    "Checksum mismatch in %s", read.name.c_str()));
+            }
+
+            continue;
+        }
+
+        // Allocated here too, filling a new Table takes as long as
+        // reading it
+        Table* table = new Table(read.rows, read.columns);
+        (*job->tables)[read.index] = table;
+
+        if (job->step == RawReadJob::ALLOCATE)
+        {
+            continue;
+        }
+
+        if (!rawRead(fd, read, table))
+        {
+            rawReadFailed(*job, read.index, "Read failed");
+        }
+        else if (!checkRead(read, table))
+        {
+            rawReadFailed(*job, read.index,
+                FormatString("Checksum mismatch in %s", read.name.c_str()));
+        }
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return NULL;
 }
 
 //
-// Find all the datasets in a given group.
+// Do one step of a job on up to threads threads, on failure the
+// tables are deleted and the first error thrown
 //
-void HdfFile::listDatasets(const std::string& path, StringList& result)
+static void runRawReads(RawReadJob& job, std::vector<Table*>& tables,
+    int threads, RawReadJob::Step step = RawReadJob::READ)
 {
-    gFilenames = &result;
-    
-    herr_t it = H5Literate_by_name(
-	m_file, path.c_str(), H5_INDEX_NAME, H5_ITER_INC, NULL,
-	findfile, NULL, H5P_DEFAULT);   
-	
-    gFilenames = NULL;
-	
-    if (it < 0)
+    // Biggest first, so one big table doesn't finish last alone
+    std::sort(job.reads.begin(), job.reads.end(), biggerRead);
+
+    job.step = step;
+    job.nextRead = 0;
+
+    threads = std::min(size_t(std::max(threads, 1)), job.reads.size());
+
+    if (threads > 1)
     {
-	throw std::string("Iterate failed");
+        runThreads(threads, rawReadWorkerMain, &job);
+    }
+    else if (threads == 1)
+    {
+        rawReadWorkerMain(&job);
+    }
+
+    if (job.failed)
+    {
+        deleteTables(tables);
+        throw job.error;
+    }
+}
+
+void HdfFile::readTables(const std::vector<std::string>& names,
+    std::vector<Table*>& tables, int threads)
+{
+    RawReadJob job;
+    job.path = m_path;
+    job.tables = &tables;
+
+    // Compressed datasets, read in name order
+    RawReadJob chunkJob;
+    chunkJob.tables = &tables;
+    std::vector<size_t> chunked;
+
+    tables.assign(names.size(), NULL);
+
+    try
+    {
+        PBT pbt("open %zu datasets", names.size());
+
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            hsize_t rows;
+            hsize_t cols;
+            hid_t dataset = openTable(names[i], rows, cols);
+
+            hid_t datatype = H5Dget_type(dataset);
+            bool native = H5Tequal(datatype, H5T_NATIVE_UINT) > 0;
+            H5Tclose(datatype);
+
+            // Only contiguous storage has an offset, chunks we can
+            // decompress ourselves, anything else or a type HDF5
+            // would convert is read here through HDF5
+            haddr_t offset = H5Dget_offset(dataset);
+            bool chunks = native && offset == HADDR_UNDEF &&
+                ChunkReader::canRead(dataset);
+
+            if (!native || (offset == HADDR_UNDEF && !chunks) ||
+                rows * cols == 0)
+            {
+                H5Dclose(dataset);
+                tables[i] = readTable(names[i]);
+                continue;
+            }
+
+            RawRead read;
+            read.index = i;
+            read.name = "dataset " + names[i];
+            read.offset = offset;
+            read.rows = rows;
+            read.columns = cols;
+            read.bytes = size_t(rows) * cols * sizeof(uint32);
+            read.checksum = m_checkChecksums &&
+                readChecksum(dataset, read.expected);
+
+            H5Dclose(dataset);
+
+            if (chunks)
+            {
+                chunkJob.reads.push_back(read);
+                chunked.push_back(i);
+            }
+            else
+            {
+                job.reads.push_back(read);
+            }
+        }
+    }
+    catch (...)
+    {
+        deleteTables(tables);
+        throw;
+    }
+
+    {
+        PBT pbt("read %zu datasets", job.reads.size());
+        runRawReads(job, tables, threads);
+    }
+
+    if (chunked.empty())
+    {
+        return;
+    }
+
+    PBT pbt("decompress %zu datasets", chunked.size());
+
+    runRawReads(chunkJob, tables, threads, RawReadJob::ALLOCATE);
+
+    try
+    {
+        ChunkReader reader(threads);
+
+        for (size_t i = 0; i < chunked.size(); ++i)
+        {
+            Table* table = tables[chunked[i]];
+
+            std::vector<ChunkTarget> targets(1);
+            targets[0].firstRow = 0;
+            targets[0].rows = table->getRows();
+            targets[0].data = table->getData();
+
+            hsize_t rows;
+            hsize_t cols;
+            hid_t dataset = openTable(names[chunked[i]], rows, cols);
+
+            reader.read(dataset, names[chunked[i]], targets);
+
+            H5Dclose(dataset);
+        }
+
+        reader.finish();
+    }
+    catch (...)
+    {
+        deleteTables(tables);
+        throw;
+    }
+
+    runRawReads(chunkJob, tables, threads, RawReadJob::CHECK);
+}
+
+void HdfFile::readPlanes(const IntVec& planes, std::vector<Table*>& tables,
+    int threads)
+{
+    if (m_version == 1)
+    {
+        std::vector<std::string> names;
+
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            names.push_back(FormatString("superpixel/%u", planes[i]));
+        }
+
+        readTables(names, tables, threads);
+        return;
+    }
+
+    hsize_t totalRows;
+    hsize_t columns;
+    hid_t dataset = openTable(s_SUPERPIXELS_NAME, totalRows, columns);
+
+    hid_t datatype = H5Dget_type(dataset);
+    bool native = H5Tequal(datatype, H5T_NATIVE_UINT) > 0;
+    H5Tclose(datatype);
+
+    haddr_t offset = H5Dget_offset(dataset);
+    bool chunks = native && offset == HADDR_UNDEF &&
+        ChunkReader::canRead(dataset);
+    H5Dclose(dataset);
+
+    tables.assign(planes.size(), NULL);
+
+    // As readTables(), only an uncompressed dataset has an offset
+    if (!native || (offset == HADDR_UNDEF && !chunks))
+    {
+        try
+        {
+            for (size_t i = 0; i < planes.size(); ++i)
+            {
+                tables[i] = readPlane(planes[i]);
+            }
+        }
+        catch (...)
+        {
+            deleteTables(tables);
+            throw;
+        }
+
+        return;
+    }
+
+    RawReadJob job;
+    job.path = m_path;
+    job.tables = &tables;
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        uint32 row = findPlane(planes[i]);
+
+        RawRead read;
+        read.index = i;
+        read.name = FormatString("plane %u", planes[i]);
+        read.rows = m_planeIndex->getValue(row, PLANE_ROWS);
+        read.columns = columns;
+        read.bytes = size_t(read.rows) * columns * sizeof(uint32);
+        read.offset = offset +
+            getValue64(m_planeIndex, row, PLANE_FIRST_LOW) * columns *
+            sizeof(uint32);
+        read.checksum = m_checkChecksums;
+        read.expected = getValue64(m_planeIndex, row, PLANE_CHECKSUM_LOW);
+
+        if (getValue64(m_planeIndex, row, PLANE_FIRST_LOW) + read.rows >
+            totalRows)
+        {
+            throw FormatString("Plane %u is past the end of %s", planes[i],
+                s_SUPERPIXELS_NAME);
+        }
+
+        job.reads.push_back(read);
+    }
+
+    if (!chunks)
+    {
+        PBT pbt("read %zu planes", planes.size());
+        runRawReads(job, tables, threads);
+        return;
+    }
+
+    PBT pbt("decompress %zu planes", planes.size());
+
+    runRawReads(job, tables, threads, RawReadJob::ALLOCATE);
+
+    try
+    {
+        // The planes share chunks, so they are all one read
+        std::vector<ChunkTarget> targets(planes.size());
+
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            uint32 row = findPlane(planes[i]);
+
+            targets[i].firstRow = getValue64(m_planeIndex, row,
+                PLANE_FIRST_LOW);
+            targets[i].rows = tables[i]->getRows();
+            targets[i].data = tables[i]->getData();
+        }
+
+        ChunkReader reader(threads);
+
+        dataset = openTable(s_SUPERPIXELS_NAME, totalRows, columns);
+        reader.read(dataset, s_SUPERPIXELS_NAME, targets);
+        H5Dclose(dataset);
+
+        reader.finish();
+    }
+    catch (...)
+    {
+        deleteTables(tables);
+        throw;
+    }
+
+    runRawReads(job, tables, threads, RawReadJob::CHECK);
+}
+
+void HdfFile::writeChecksum(hid_t dataset, uint64 checksum)
+{
+    hid_t space = H5Screate(H5S_SCALAR);
+
+    // An updated dataset has one already
+    hid_t attr = H5Aexists(dataset, s_CHECKSUM_NAME) > 0 ?
+        H5Aopen(dataset, s_CHECKSUM_NAME, H5P_DEFAULT) :
+        H5Acreate(dataset, s_CHECKSUM_NAME, H5T_STD_U64LE, space,
+            H5P_DEFAULT, H5P_DEFAULT);
+
+    herr_t status = attr < 0 ? -1 :
+        H5Awrite(attr, H5T_NATIVE_ULLONG, &checksum);
+
+    if (attr >= 0)
+    {
+        H5Aclose(attr);
+    }
+    H5Sclose(space);
+
+    if (status < 0)
+    {
+        throw std::string("Cannot write checksum attribute");
+    }
+}
+
+bool HdfFile::readChecksum(hid_t dataset, uint64& checksum)
+{
+    if (H5Aexists(dataset, s_CHECKSUM_NAME) <= 0)
+    {
+        return false;
+    }
+
+    hid_t attr = H5Aopen(dataset, s_CHECKSUM_NAME, H5P_DEFAULT);
+
+    herr_t status = attr < 0 ? -1 :
+        H5Aread(attr, H5T_NATIVE_ULLONG, &checksum);
+
+    if (attr >= 0)
+    {
+        H5Aclose(attr);
+    }
+
+    if (status < 0)
+    {
+        throw std::string("Cannot read checksum attribute");
+    }
+
+    return true;
+}
+
+void HdfFile::readPlaneIndex()
+{
+    if (m_planeIndex)
+    {
+        return;
+    }
+
+    m_planeIndex = readTable(s_PLANE_INDEX_NAME);
+
+    if (m_planeIndex->getColumns() != NUM_PLANE_COLUMNS)
+    {
+        throw FormatString("Bad %s", s_PLANE_INDEX_NAME);
+    }
+
+    for (uint32 i = 0; i < m_planeIndex->getRows(); ++i)
+    {
+        m_planeRows[m_planeIndex->getValue(i, PLANE_Z)] = i;
+    }
+}
+
+uint32 HdfFile::findPlane(uint32 plane)
+{
+    readPlaneIndex();
+
+    IntMap::iterator it = m_planeRows.find(plane);
+
+    if (it == m_planeRows.end())
+    {
+        throw FormatString("No plane %u", plane);
+    }
+
+    return (*it).second;
+}
+
+void HdfFile::listPlanes(IntVec& planes)
+{
+    planes.clear();
+
+    if (m_version == 1)
+    {
+        StringList names;
+        listDatasets("/superpixel", names);
+
+        for (StringList::iterator it = names.begin(); it != names.end(); ++it)
+        {
+            uint32 plane;
+
+            if (!StrToInt(*it, plane))
+            {
+                throw FormatString("Bad superpixel dataset name %s",
+                    it->c_str());
+            }
+
+            planes.push_back(plane);
+        }
+
+        // Listed by name, so 10 comes before 9
+        std::sort(planes.begin(), planes.end());
+        return;
+    }
+
+    readPlaneIndex();
+
+    for (uint32 i = 0; i < m_planeIndex->getRows(); ++i)
+    {
+        planes.push_back(m_planeIndex->getValue(i, PLANE_Z));
+    }
+}
+
+void HdfFile::listPlaneDatasets(StringList& names)
+{
+    if (m_version == 1)
+    {
+        listDatasets("/superpixel", names);
+
+        for (StringList::iterator it = names.begin(); it != names.end(); ++it)
+        {
+            *it = "superpixel/" + *it;
+        }
+    }
+    else
+    {
+        names.push_back(s_SUPERPIXELS_NAME);
+        names.push_back(s_PLANE_INDEX_NAME);
+    }
+}
+
+uint32 HdfFile::getPlaneRows(uint32 plane)
+{
+    if (m_version == 1)
+    {
+        hsize_t rows;
+        hsize_t cols;
+        hid_t dataset = openTable(FormatString("superpixel/%u", plane),
+            rows, cols);
+        H5Dclose(dataset);
+
+        return rows;
+    }
+
+    uint32 i = findPlane(plane);
+    return m_planeIndex->getValue(i, PLANE_ROWS);
+}
+
+Table* HdfFile::readPlane(uint32 plane)
+{
+    if (m_version == 1)
+    {
+        return readTable(FormatString("superpixel/%u", plane));
+    }
+
+    uint32 i = findPlane(plane);
+    uint32 rows = m_planeIndex->getValue(i, PLANE_ROWS);
+
+    hsize_t totalRows;
+    hsize_t columns;
+    hid_t dataset = openTable(s_SUPERPIXELS_NAME, totalRows, columns);
+
+    hsize_t start[2] = { getValue64(m_planeIndex, i, PLANE_FIRST_LOW), 0 };
+    hsize_t count[2] = { rows, columns };
+
+    if (start[0] + rows > totalRows)
+    {
+        H5Dclose(dataset);
+        throw FormatString("Plane %u is past the end of %s", plane,
+            s_SUPERPIXELS_NAME);
+    }
+
+    Table* table = new Table(rows, columns);
+
+    if (rows == 0)
+    {
+        H5Dclose(dataset);
+        return table;
+    }
+
+    hid_t filespace = H5Dget_space(dataset);
+    hid_t memspace = H5Screate_simple(2, count, NULL);
+
+    herr_t status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET,
+        start, NULL, count, NULL);
+
+    if (status >= 0)
+    {
+        status = H5Dread(dataset, H5T_NATIVE_UINT, memspace, filespace,
+            H5P_DEFAULT, table->getData());
+    }
+
+    H5Sclose(memspace);
+    H5Sclose(filespace);
+    H5Dclose(dataset);
+
+    if (status < 0)
+    {
+        delete table;
+        throw FormatString("Cannot read plane %u", plane);
+    }
+
+    if (m_checkChecksums &&
+        Checksum::of(table->getData(), size_t(rows) * columns *
+            sizeof(uint32)) != getValue64(m_planeIndex, i, PLANE_CHECKSUM_LOW))
+    {
+        delete table;
+        throw FormatString("Checksum mismatch in plane %u", plane);
+    }
+
+    return table;
+}
+
+// Values read at a time by checkDataset()
+static const size_t s_CHECK_VALUES = 1 << 22;
+
+HdfFile::ChecksumResult HdfFile::checkDataset(const std::string& name)
+{
+    hid_t dataset = H5Dopen2(m_file, name.c_str(), H5P_DEFAULT);
+
+    if (dataset < 0)
+    {
+        throw FormatString("Cannot open dataset %s", name.c_str());
+    }
+
+    uint64 expected;
+
+    if (!readChecksum(dataset, expected))
+    {
+        H5Dclose(dataset);
+
+        // updatePlanes() leaves only the planes' checksums
+        if (m_version == 2 && name == s_SUPERPIXELS_NAME)
+        {
+            return checkPlanes();
+        }
+
+        return CHECKSUM_MISSING;
+    }
+
+    hid_t filespace = H5Dget_space(dataset);
+    int rank = H5Sget_simple_extent_ndims(filespace);
+
+    hsize_t dims[2] = { 0, 1 };
+
+    if (rank < 1 || rank > 2 ||
+        H5Sget_simple_extent_dims(filespace, dims, NULL) < 0)
+    {
+        H5Sclose(filespace);
+        H5Dclose(dataset);
+        throw FormatString("Bad dataspace in dataset %s", name.c_str());
+    }
+
+    hsize_t columns = dims[1];
+    hsize_t step = std::max(hsize_t(1), hsize_t(s_CHECK_VALUES / columns));
+    std::vector<uint32> buffer(step * columns);
+
+    Checksum checksum;
+    herr_t status = 0;
+
+    for (hsize_t row = 0; row < dims[0] && status >= 0; row += step)
+    {
+        hsize_t start[2] = { row, 0 };
+        hsize_t count[2] = { std::min(step, dims[0] - row), columns };
+
+        hid_t memspace = H5Screate_simple(rank, count, NULL);
+
+        status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET,
+            start, NULL, count, NULL);
+
+        if (status >= 0)
+        {
+            status = H5Dread(dataset, H5T_NATIVE_UINT, memspace, filespace,
+                H5P_DEFAULT, &buffer[0]);
+        }
+
+        H5Sclose(memspace);
+
+        checksum.update(&buffer[0], count[0] * columns * sizeof(uint32));
+    }
+
+    H5Sclose(filespace);
+    H5Dclose(dataset);
+
+    if (status < 0)
+    {
+        throw FormatString("Cannot read dataset %s", name.c_str());
+    }
+
+    return checksum.digest() == expected ? CHECKSUM_OK : CHECKSUM_BAD;
+}
+
+HdfFile::ChecksumResult HdfFile::checkPlanes()
+{
+    readPlaneIndex();
+
+    if (m_planeIndex->getRows() == 0)
+    {
+        return CHECKSUM_MISSING;
+    }
+
+    // We check them here, not in readPlane()
+    bool checkChecksums = m_checkChecksums;
+    m_checkChecksums = false;
+
+    ChecksumResult result = CHECKSUM_OK;
+
+    try
+    {
+        for (uint32 i = 0; i < m_planeIndex->getRows() &&
+                 result == CHECKSUM_OK; ++i)
+        {
+            Table* table = readPlane(m_planeIndex->getValue(i, PLANE_Z));
+
+            if (Checksum::of(table->getData(), size_t(table->getRows()) *
+                    table->getColumns() * sizeof(uint32)) !=
+                getValue64(m_planeIndex, i, PLANE_CHECKSUM_LOW))
+            {
+                result = CHECKSUM_BAD;
+            }
+
+            delete table;
+        }
+    }
+    catch (...)
+    {
+        m_checkChecksums = checkChecksums;
+        throw;
+    }
+
+    m_checkChecksums = checkChecksums;
+    return result;
+}
+
+bool HdfFile::isExtendible(hid_t dataset)
+{
+    hid_t dataspace = H5Dget_space(dataset);
+
+    hsize_t dims[2];
+    hsize_t maxdims[2];
+
+    bool extendible = H5Sget_simple_extent_ndims(dataspace) == 2 &&
+        H5Sget_simple_extent_dims(dataspace, dims, maxdims) >= 0 &&
+        maxdims[0] == H5S_UNLIMITED;
+
+    H5Sclose(dataspace);
+    return extendible;
+}
+
+bool HdfFile::canUpdateDataset(const std::string& name, const Table& table)
+{
+    if (H5Lexists(m_file, name.c_str(), H5P_DEFAULT) <= 0)
+    {
+        return false;
+    }
+
+    hsize_t rows;
+    hsize_t cols;
+    hid_t dataset = openTable(name, rows, cols);
+
+    bool ok = cols == table.getColumns() &&
+        (rows == table.getRows() || isExtendible(dataset));
+
+    H5Dclose(dataset);
+    return ok;
+}
+
+void HdfFile::updateDataset(const std::string& name, const Table& table)
+{
+    hsize_t rows;
+    hsize_t cols;
+    hid_t dataset = openTable(name, rows, cols);
+
+    try
+    {
+        if (cols != table.getColumns())
+        {
+            throw FormatString("Dataset %s has %llu columns, not %u",
+                name.c_str(), cols, table.getColumns());
+        }
+
+        if (rows != table.getRows())
+        {
+            hsize_t dims[2] = { table.getRows(), cols };
+
+            if (H5Dset_extent(dataset, dims) < 0)
+            {
+                throw FormatString("Cannot resize dataset %s", name.c_str());
+            }
+        }
+
+        std::vector<std::pair<uint32, uint32> > runs;
+        table.getDirtyRows(runs);
+
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            writeHyperslab(dataset, name, runs[i].first,
+                table.getData() + size_t(runs[i].first) * cols,
+                runs[i].second - runs[i].first, cols);
+        }
+
+        writeChecksum(dataset, Checksum::of(table.getData(),
+            size_t(table.getRows()) * cols * sizeof(uint32)));
+    }
+    catch (...)
+    {
+        H5Dclose(dataset);
+        throw;
+    }
+
+    if (H5Dclose(dataset) < 0)
+    {
+        throw FormatString("Cannot close dataset %s", name.c_str());
+    }
+}
+
+bool HdfFile::placePlanes(const IntVec& planes,
+    const std::vector<Table*>& tables, std::vector<uint64>& firstRows,
+    uint64& totalRows)
+{
+    readPlaneIndex();
+
+    hsize_t rows;
+    hsize_t columns;
+    hid_t dataset = openTable(s_SUPERPIXELS_NAME, rows, columns);
+    bool extendible = isExtendible(dataset);
+    H5Dclose(dataset);
+
+    uint64 liveRows = 0;
+
+    for (uint32 i = 0; i < m_planeIndex->getRows(); ++i)
+    {
+        liveRows += m_planeIndex->getValue(i, PLANE_ROWS);
+    }
+
+    firstRows.resize(planes.size());
+    totalRows = rows;
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        IntMap::iterator it = m_planeRows.find(planes[i]);
+
+        if (it == m_planeRows.end() || tables[i]->getColumns() != columns)
+        {
+            return false;
+        }
+
+        uint32 oldRows = m_planeIndex->getValue((*it).second, PLANE_ROWS);
+        uint32 newRows = tables[i]->getRows();
+
+        // A plane which grew goes on the end
+        if (newRows <= oldRows)
+        {
+            firstRows[i] = getValue64(m_planeIndex, (*it).second,
+                PLANE_FIRST_LOW);
+        }
+        else
+        {
+            firstRows[i] = totalRows;
+            totalRows += newRows;
+        }
+
+        liveRows += newRows;
+        liveRows -= oldRows;
+    }
+
+    if (totalRows != rows && !extendible)
+    {
+        return false;
+    }
+
+    // Past that a full write is worth it
+    return totalRows - liveRows <= liveRows / 4;
+}
+
+bool HdfFile::canUpdatePlanes(const IntVec& planes,
+    const std::vector<Table*>& tables)
+{
+    if (m_version == 1)
+    {
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            if (!canUpdateDataset(FormatString("superpixel/%u", planes[i]),
+                    *tables[i]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::vector<uint64> firstRows;
+    uint64 totalRows;
+
+    return placePlanes(planes, tables, firstRows, totalRows);
+}
+
+void HdfFile::updatePlanes(const IntVec& planes,
+    const std::vector<Table*>& tables)
+{
+    if (m_version == 1)
+    {
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            updateDataset(FormatString("superpixel/%u", planes[i]),
+                *tables[i]);
+        }
+
+        return;
+    }
+
+    std::vector<uint64> firstRows;
+    uint64 totalRows;
+
+    if (!placePlanes(planes, tables, firstRows, totalRows))
+    {
+        throw FormatString("Cannot update the planes of %s in place",
+            m_path.c_str());
+    }
+
+    hsize_t rows;
+    hsize_t columns;
+    hid_t dataset = openTable(s_SUPERPIXELS_NAME, rows, columns);
+
+    try
+    {
+        if (totalRows != rows)
+        {
+            hsize_t dims[2] = { totalRows, columns };
+
+            if (H5Dset_extent(dataset, dims) < 0)
+            {
+                throw FormatString("Cannot resize %s", s_SUPERPIXELS_NAME);
+            }
+        }
+
+        std::vector<std::pair<uint32, uint32> > runs;
+
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            const Table* table = tables[i];
+            uint32 row = findPlane(planes[i]);
+
+            // A plane which moved is written whole
+            if (firstRows[i] == getValue64(m_planeIndex, row, PLANE_FIRST_LOW))
+            {
+                table->getDirtyRows(runs);
+            }
+            else
+            {
+                runs.assign(1, std::make_pair(uint32(0), table->getRows()));
+            }
+
+            for (size_t j = 0; j < runs.size(); ++j)
+            {
+                writeHyperslab(dataset, s_SUPERPIXELS_NAME,
+                    firstRows[i] + runs[j].first,
+                    table->getData() + size_t(runs[j].first) * columns,
+                    runs[j].second - runs[j].first, columns);
+            }
+
+            m_planeIndex->setValue(row, PLANE_ROWS, table->getRows());
+            setValue64(m_planeIndex, row, PLANE_FIRST_LOW, firstRows[i]);
+            setValue64(m_planeIndex, row, PLANE_CHECKSUM_LOW,
+                Checksum::of(table->getData(), size_t(table->getRows()) *
+                    columns * sizeof(uint32)));
+        }
+
+        // It no longer has one checksum, the index has the planes'
+        if (H5Aexists(dataset, s_CHECKSUM_NAME) > 0 &&
+            H5Adelete(dataset, s_CHECKSUM_NAME) < 0)
+        {
+            throw FormatString("Cannot remove the checksum of %s",
+                s_SUPERPIXELS_NAME);
+        }
+    }
+    catch (...)
+    {
+        H5Dclose(dataset);
+        throw;
+    }
+
+    H5Dclose(dataset);
+
+    updateDataset(s_PLANE_INDEX_NAME, *m_planeIndex);
+}
+
+//
+// Callback used by listDatasets, opdata is the StringList
+//
+static herr_t findfile(hid_t loc_id, 
+    const char *name, const H5L_info_t *linfo, void *opdata)
+{
+    /* avoid compiler warnings */
+    loc_id = loc_id;
+    linfo = linfo;
+    
+    ((StringList*)opdata)->push_back(name);
+    
+    return 0;
+}
+
+//
+// Find all the datasets in a given group.
+//
+void HdfFile::listDatasets(const std::string& path, StringList& result)
+{
+    herr_t it = H5Literate_by_name(
+	m_file, path.c_str(), H5_INDEX_NAME, H5_ITER_INC, NULL,
+	findfile, &result, H5P_DEFAULT);   
+	
+    if (it < 0)
+    {
+	throw std::string("Iterate failed");
+    }
+}
+
+// Rows are written in pieces of about this many values
+static const size_t s_WRITE_VALUES = 1 << 20;
+
+HdfTableWriter::HdfTableWriter(HdfFile& file, const std::string& name,
+    uint64 rows, uint32 columns) :
+    m_name(name),
+    m_dataset(-1),
+    m_chunks(NULL),
+    m_rows(rows),
+    m_columns(columns),
+    m_written(0)
+{
+    // As in writeDataset()
+    hsize_t dims[2] = { rows, columns };
+    uint32 chunkRows;
+    m_dataset = file.createDataset(name, 2, dims, chunkRows);
+
+    if (m_dataset < 0)
+    {
+        throw FormatString("Cannot create dataset %s", name.c_str());
+    }
+
+    size_t values = std::max(size_t(columns), 
+        s_WRITE_VALUES / columns * columns);
+
+    if (chunkRows > 0)
+    {
+        // Enough whole chunks for every thread
+        m_chunks = new ChunkWriter(m_dataset, name, rows, columns, chunkRows,
+            file.m_compression, file.m_compressThreads);
+        values = m_chunks->getBatchRows() * columns;
+    }
+
+    m_buffer.reserve(values);
+}
+
+HdfTableWriter::~HdfTableWriter()
+{
+    delete m_chunks;
+
+    if (m_dataset >= 0)
+    {
+        H5Dclose(m_dataset);
+    }
+}
+
+void HdfTableWriter::writeRow(const uint32* row)
+{
+    if (getRow() >= m_rows)
+    {
+        throw FormatString("Too many rows for dataset %s", m_name.c_str());
+    }
+
+    m_buffer.insert(m_buffer.end(), row, row + m_columns);
+
+    if (m_buffer.size() == m_buffer.capacity())
+    {
+        flush();
+    }
+}
+
+void HdfTableWriter::writeRows(const uint32* rows, uint64 count)
+{
+    if (getRow() + count > m_rows)
+    {
+        throw FormatString("Too many rows for dataset %s", m_name.c_str());
+    }
+
+    // Chunks are only written whole, so they always go through the
+    // buffer
+    if (!m_chunks && count * m_columns >= m_buffer.capacity())
+    {
+        flush();
+        write(rows, count);
+        return;
+    }
+
+    while (count > 0)
+    {
+        uint64 room = (m_buffer.capacity() - m_buffer.size()) / m_columns;
+        uint64 n = std::min(room, count);
+
+        m_buffer.insert(m_buffer.end(), rows, rows + n * m_columns);
+        rows += n * m_columns;
+        count -= n;
+
+        if (m_buffer.size() == m_buffer.capacity())
+        {
+            flush();
+        }
+    }
+}
+
+void HdfTableWriter::flush()
+{
+    if (m_buffer.empty())
+    {
+        return;
+    }
+
+    write(&m_buffer[0], m_buffer.size() / m_columns);
+    m_buffer.clear();
+}
+
+void HdfTableWriter::write(const uint32* rows, uint64 rowCount)
+{
+    if (m_chunks)
+    {
+        m_chunks->write(m_written, rows, rowCount);
+        m_checksum.update(rows, rowCount * m_columns * sizeof(uint32));
+        m_written += rowCount;
+        return;
+    }
+
+    writeHyperslab(m_dataset, m_name, m_written, rows, rowCount, m_columns);
+
+    m_checksum.update(rows, rowCount * m_columns * sizeof(uint32));
+    m_written += rowCount;
+}
+
+void HdfTableWriter::close()
+{
+    flush();
+
+    if (m_written != m_rows)
+    {
+        throw FormatString("Dataset %s has %llu of %llu rows", 
+            m_name.c_str(), m_written, m_rows);
+    }
+
+    HdfFile::writeChecksum(m_dataset, m_checksum.digest());
+
+    delete m_chunks;
+    m_chunks = NULL;
+
+    if (H5Dclose(m_dataset) < 0)
+    {
+        m_dataset = -1;
+        throw FormatString("Cannot close dataset %s", m_name.c_str());
+    }
+
+    m_dataset = -1;
+}
+
+HdfPlaneWriter::HdfPlaneWriter(HdfFile& file, const IntVec& planes,
+    const IntVec& rows, uint32 columns) :
+    m_file(file),
+    m_planes(planes),
+    m_rows(rows),
+    m_columns(columns),
+    m_next(0),
+    m_firstRow(0),
+    m_writer(NULL),
+    m_index(NULL)
+{
+    if (m_file.m_version == 1)
+    {
+        m_file.createGroup("superpixel");
+        return;
+    }
+
+    uint64 total = 0;
+
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        total += rows[i];
+    }
+
+    m_writer = new HdfTableWriter(file, HdfFile::s_SUPERPIXELS_NAME,
+        total, columns);
+    m_index = new Table(planes.size(), HdfFile::NUM_PLANE_COLUMNS, 0.0);
+}
+
+HdfPlaneWriter::~HdfPlaneWriter()
+{
+    delete m_writer;
+    delete m_index;
+}
+
+void HdfPlaneWriter::writePlane(uint32 plane, const Table& table)
+{
+    if (m_next == m_planes.size() || m_planes[m_next] != plane ||
+        m_rows[m_next] != table.getRows() ||
+        m_columns != table.getColumns())
+    {
+        throw FormatString("Plane %u is not the one expected", plane);
+    }
+
+    if (!m_writer)
+    {
+        m_file.writeDataset(FormatString("superpixel/%u", plane), table);
+        ++m_next;
+        return;
+    }
+
+    size_t bytes = size_t(table.getRows()) * m_columns * sizeof(uint32);
+
+    m_index->setValue(m_next, HdfFile::PLANE_Z, plane);
+    m_index->setValue(m_next, HdfFile::PLANE_ROWS, table.getRows());
+    setValue64(m_index, m_next, HdfFile::PLANE_FIRST_LOW, m_firstRow);
+    setValue64(m_index, m_next, HdfFile::PLANE_CHECKSUM_LOW,
+        Checksum::of(table.getData(), bytes));
+
+    m_writer->writeRows(table.getData(), table.getRows());
+
+    m_firstRow += table.getRows();
+    ++m_next;
+}
+
+void HdfPlaneWriter::close()
+{
+    if (m_next != m_planes.size())
+    {
+        throw FormatString("Wrote %zu of %zu planes", m_next,
+            m_planes.size());
+    }
+
+    if (m_writer)
+    {
+        m_writer->close();
+        m_file.writeDataset(HdfFile::s_PLANE_INDEX_NAME, *m_index);
     }
 }
@@ -1,6 +1,9 @@
 #include "common.h"
+#include "Checksum.h"
 #include "hdf5.h"
 
+class ChunkWriter;
+
 //
 // Interface to read from or write to a single HDF5 file.
 //
@@ -10,36 +13,258 @@ public:
     HdfFile();
     ~HdfFile();
     
-    // Open HDF5 for writing, writes the "version" property
-    // Return true on success
-    void openForWrite(const std::string& path);
+    // Open HDF5 for writing, writes the "version" property.  Version
+    // 1 files have a dataset per plane, superpixel/<z>.  Version 2
+    // files have every plane in one dataset, see HdfPlaneWriter.
+    void openForWrite(const std::string& path,
+        uint32 version = s_VERSION_NUMBER);
     
     // Open HDF5 for reading, checks the version is okay
     // Return true on success
     void openForRead(const std::string& path);
+
+    // Open an existing file to change it in place with updateDataset()
+    // and updatePlanes(), checks the version is okay
+    void openForUpdate(const std::string& path);
+
+    uint32 getVersion() const { return m_version; }
     
-    // Write a table
+    // Write a table, with its checksum as an attribute
     void writeDataset(const std::string& name, const Table& table);
 
+    // Write datasets chunked, shuffled and deflated at level 1 to 9,
+    // compressing on threads threads.  0, the default, writes them
+    // contiguous and uncompressed.
+    void setCompression(int level, int threads);
+
+    // Write datasets which updateDataset() and updatePlanes() can
+    // grow or shrink later.  They are chunked even if not compressed,
+    // and read like compressed ones.
+    void setExtendible(bool extendible) { m_extendible = extendible; }
+
+    // True if updateDataset() can write table over the dataset, which
+    // must have as many columns and as many rows or be extendible
+    bool canUpdateDataset(const std::string& name, const Table& table);
+
+    // Write the rows of table changed since its clearDirty(), resizing
+    // the dataset if the table's size changed, and its new checksum
+    void updateDataset(const std::string& name, const Table& table);
+
     // Create a group off the root
     void createGroup(const std::string& name);
     
-    // Read a dataset, allocates a new Table
+    // Read a dataset, allocates a new Table.  If checking checksums
+    // and the dataset has one, throws std::string if they differ.
     Table* readTable(const std::string& name);
+
+    // Read several datasets, tables[i] is names[i].  HDF5 is only
+    // used to find each dataset, one at a time since it is not
+    // thread safe, then threads threads read them straight from the
+    // file, each with its own handle.  Compressed datasets have their
+    // chunks read by HDF5 and decompressed on the threads.  Datasets
+    // with filters we don't know are read through readTable().
+    void readTables(const std::vector<std::string>& names,
+        std::vector<Table*>& tables, int threads);
+
+    // Have readTable() and readTables() check checksums, off by default
+    void setCheckChecksums(bool check) { m_checkChecksums = check; }
+
+    enum ChecksumResult { CHECKSUM_OK, CHECKSUM_MISSING, CHECKSUM_BAD };
+
+    // Read a dataset a piece at a time and check it against its
+    // checksum, without holding it in memory.  Throws std::string
+    // if the dataset cannot be read at all.
+    ChecksumResult checkDataset(const std::string& name);
     
     // Get all datasets in a group
     void listDatasets(const std::string& path, StringList& result);
+
+    // The superpixel planes, however the file stores them.  Planes
+    // are listed in order.  readPlanes() reads like readTables().
+    void listPlanes(IntVec& planes);
+    uint32 getPlaneRows(uint32 plane);
+    Table* readPlane(uint32 plane);
+    void readPlanes(const IntVec& planes, std::vector<Table*>& tables,
+        int threads);
+
+    // Every dataset holding the planes
+    void listPlaneDatasets(StringList& names);
+
+    // True if updatePlanes() can write these planes over the ones in
+    // the file, tables[i] is planes[i].  Each must be in the file
+    // already.  In version 2 false as well if it would leave more
+    // than a quarter of "superpixels" unused, see updatePlanes().
+    bool canUpdatePlanes(const IntVec& planes,
+        const std::vector<Table*>& tables);
+
+    // Write the rows of the planes changed since their clearDirty().
+    // In version 2 a plane which grew moves to the end of
+    // "superpixels", leaving its old rows unused until the next full
+    // write, and the index gets its new place and checksum.
+    void updatePlanes(const IntVec& planes,
+        const std::vector<Table*>& tables);
+
+    // Current version, what openForWrite() writes by default
+    static const uint32 s_VERSION_NUMBER;
     
 private:
+    friend class HdfTableWriter;
+    friend class HdfPlaneWriter;
 
     void checkVersion();
 
+    // Version 2 only, read m_planeIndex the first time it's needed,
+    // and find a plane's row of it, throws if the plane is not there
+    void readPlaneIndex();
+    uint32 findPlane(uint32 plane);
+
+    hid_t openTable(const std::string& name, hsize_t& rows, hsize_t& cols);
+
+    // Whether the dataset can be resized, see setExtendible()
+    bool isExtendible(hid_t dataset);
+
+    // Version 2 only, where updatePlanes() would put each plane and
+    // the rows "superpixels" would have, false if it can't
+    bool placePlanes(const IntVec& planes, const std::vector<Table*>& tables,
+        std::vector<uint64>& firstRows, uint64& totalRows);
+
+    // Checksums of the planes in the index, for a "superpixels"
+    // which updatePlanes() left without one of its own
+    ChecksumResult checkPlanes();
+
+    // Create a dataset of little endian values, chunked if we are
+    // compressing, then chunkRows is the rows in each chunk, else 0
+    hid_t createDataset(const std::string& name, int rank, hsize_t* dims,
+        uint32& chunkRows);
+
     void writeDataset(const std::string& name,
         int rank, hsize_t *dims, uint32* data);
 
+    // Checksum attribute of a dataset, false if it has none
+    static void writeChecksum(hid_t dataset, uint64 checksum);
+    static bool readChecksum(hid_t dataset, uint64& checksum);
+
     // Our open HDF5 file
     hid_t m_file;
+    std::string m_path;
+
+    bool m_checkChecksums;
+
+    int m_compression;
+    int m_compressThreads;
+    bool m_extendible;
+
+    uint32 m_version;
+
+    // Version 2 only, a row per plane in plane order, and the row of
+    // each plane
+    Table* m_planeIndex;
+    IntMap m_planeRows;
+
+    enum PlaneIndex
+    {
+        PLANE_Z = 0,
+        PLANE_ROWS = 1,
+        PLANE_FIRST_LOW = 2,        // first row in s_SUPERPIXELS_NAME
+        PLANE_FIRST_HIGH = 3,
+        PLANE_CHECKSUM_LOW = 4,     // XXH64 of the plane's rows
+        PLANE_CHECKSUM_HIGH = 5,
+        NUM_PLANE_COLUMNS = 6
+    };
     
     static const char* s_VERSION_NAME;
-    static const uint32 s_VERSION_NUMBER;
+    static const char* s_CHECKSUM_NAME;
+    static const char* s_SUPERPIXELS_NAME;
+    static const char* s_PLANE_INDEX_NAME;
+};
+
+//
+// Writes one dataset of an HdfFile a row at a time, for tables too
+// big to build in memory.  The size is fixed when it is created and
+// every row must be written before close().  Rows are buffered and
+// written out as hyperslabs, or as whole chunks if the file is
+// compressed.  The dataset is laid out just as one from
+// HdfFile::writeDataset(), checksum included.
+//
+class HdfTableWriter
+{
+public:
+    HdfTableWriter(HdfFile& file, const std::string& name,
+        uint64 rows, uint32 columns);
+    ~HdfTableWriter();
+
+    // Append the next row of columns values
+    void writeRow(const uint32* row);
+
+    // Append a row of a one column table
+    void writeValue(uint32 value) { writeRow(&value); }
+
+    // Append count rows, large blocks go straight to the file
+    void writeRows(const uint32* rows, uint64 count);
+
+    // Throws std::string if not every row was written
+    void close();
+
+    uint64 getRow() const { return m_written + m_buffer.size() / m_columns; }
+
+private:
+    void flush();
+    void write(const uint32* rows, uint64 count);
+
+    std::string m_name;
+    hid_t m_dataset;
+    ChunkWriter* m_chunks;
+    uint64 m_rows;
+    uint32 m_columns;
+
+    // Rows written to the file, and rows waiting in m_buffer
+    uint64 m_written;
+    std::vector<uint32> m_buffer;
+
+    // Of the rows written so far
+    Checksum m_checksum;
+};
+
+//
+// Writes the superpixel planes of a stack, one at a time so only one
+// has to be in memory, in the layout of the file's version.
+//
+// Version 2 puts every plane in one dataset, "superpixels", the
+// planes' rows one after the other in plane order.  Unless the file
+// is compressed or extendible it is contiguous, so a plane is read
+// with one seek.  "superpixel_index" has a row per plane giving its
+// rows, where they start and their checksum, so one plane can be
+// read and checked alone.  Every plane's size is needed up front to
+// create the dataset.
+//
+// HdfFile::updatePlanes() may later move planes, so the planes need
+// not be in order or cover every row, and drops the checksum of the
+// whole dataset, leaving only those in the index.
+//
+class HdfPlaneWriter
+{
+public:
+    // The planes in the order they will be written, rows[i] is the
+    // number of rows of planes[i]
+    HdfPlaneWriter(HdfFile& file, const IntVec& planes, const IntVec& rows,
+        uint32 columns);
+    ~HdfPlaneWriter();
+
+    // The next plane, with the rows promised
+    void writePlane(uint32 plane, const Table& table);
+
+    // Throws std::string if not every plane was written
+    void close();
+
+private:
+    HdfFile& m_file;
+    IntVec m_planes;
+    IntVec m_rows;
+    uint32 m_columns;
+    size_t m_next;
+    uint64 m_firstRow;
+
+    // Version 2 only
+    HdfTableWriter* m_writer;
+    Table* m_index;
 };
@@ -7,6 +7,13 @@
 #include "util.h"
 #include "LogFile.h"
 #include "STLExport.h"
+#include "BoundsFile.h"
+#include "Threads.h"
+#include "TxtFile.h"
+#include "RadixSort.h"
+#include "StackVerifier.h"
+#include "PlaneCache.h"
+#include "StackSnapshot.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -14,7 +21,9 @@
 #include <stdlib.h>
 #include <limits.h>
 
-#include <fstream>
+#include <algorithm>
+#include <iterator>
+
 
 std::string formatIntVec(const IntVec& vec)
 {
@@ -34,10 +43,6 @@ std::string formatIntVec(const IntVec& vec)
     return result;
 }
 
-char BOUNDS_FILE[] = "superpixel_bounds.txt";
-char SEGMENT_FILE[] = "superpixel_to_segment_map.txt";
-char BODY_FILE[] = "segment_to_body_map.txt";
-
 HdfStack::HdfStack() :
     m_zmin(0),
     m_zmax(0),
@@ -45,6 +50,10 @@ HdfStack::HdfStack() :
     m_segment_sp(NULL),
     m_body_index(NULL),
     m_body_seg(NULL),
+    m_planes(NULL),
+    m_snapshot(NULL),
+    m_compression(0),
+    m_gcRows(0),
     m_log(NULL)
 {
     // TODO: make logging optional via ctypes?
@@ -60,6 +69,9 @@ void delete_ptr(T& ptr)
 
 HdfStack::~HdfStack()
 {
+    // Stops its prefetching before the tables go
+    delete_ptr(m_planes);
+
     for (uint32 z = m_zmin; z <= m_zmax; ++z)
     {
         delete_ptr(m_superpixel[z]);
@@ -71,6 +83,9 @@ HdfStack::~HdfStack()
     delete_ptr(m_body_index);
     delete_ptr(m_body_seg);
     delete_ptr(m_log);
+
+    // The tables may point into it
+    delete_ptr(m_snapshot);
 }
 
 void HdfStack::error(const std::string& format, ...)
@@ -92,41 +107,6 @@ void HdfStack::error(const std::string& format, ...)
     throw StackException(buffer);
 }
 
-// 
-// These Txt* enums descdribe the TXT files which are read
-// into Tables. These 3 input TXT files are processed into
-// the real HdfStack datastructures.
-
-// bounds = superpixel_bounds.txt
-enum TxtBounds
-{
-    TXT_BOUNDS_Z = 0,
-    TXT_BOUNDS_SPID = 1,
-    TXT_BOUNDS_X = 2,
-    TXT_BOUNDS_Y = 3,
-    TXT_BOUNDS_WIDTH = 4,
-    TXT_BOUNDS_HEIGHT = 5,
-    TXT_BOUNDS_VOLUME = 6,
-    NUM_TXT_BOUNDS_COLUMNS = 7
-};
-
-// segments = superpixel_to_segment_map.txt as a Table
-enum TxtSegment
-{
-    TXT_SEGMENT_Z = 0,
-    TXT_SEGMENT_SPID = 1,
-    TXT_SEGMENT_SEGID = 2,
-    NUM_TXT_SEGMENT_COLUMNS = 3
-};
-
-// bodies = segment_to_body_map.txt as a Table
-enum TxtBody
-{
-    TXT_BODY_SEGID = 0,
-    TXT_BODY_BODYID = 1,
-    NUM_TXT_BODY_COLUMNS = 2
-};
-
 //
 // "Compresses" a packed list of lists like m_segment_sp or m_body_seg
 //
@@ -271,56 +251,179 @@ void compressListOfLists(
 }
 
 // load from an HDF5 file.  Used at runtime by Raveler.
-void HdfStack::load(std::string path)
+void HdfStack::load(std::string path, bool checksums)
 {
     HdfFile file;
     file.openForRead(path);
+    file.setCheckChecksums(checksums);
     
-    StringList planeStrings;
-    file.listDatasets("/superpixel", planeStrings);
-    
+    IntVec planes;
+    findPlanes(file, planes);
+
+    std::vector<Table*> tables;
+    file.readPlanes(planes, tables, getNumCores());
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        m_superpixel[planes[i]] = tables[i];
+    }
+
+    readBodyTables(file);
+
+    m_gcRows = getListRows();
+    markSaved(path);
+}
+
+void HdfStack::loadLazy(std::string path, uint64 budget, bool checksums)
+{
+    HdfFile file;
+    file.openForRead(path);
+    file.setCheckChecksums(checksums);
+
+    IntVec planes;
+    findPlanes(file, planes);
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        m_superpixel[planes[i]] = NULL;
+    }
+
+    readBodyTables(file);
+
+    m_planes = new PlaneCache(m_superpixel, path, checksums, budget);
+
+    m_gcRows = getListRows();
+    markSaved(path);
+}
+
+void HdfStack::loadSnapshot(std::string path, bool checksums)
+{
+    m_snapshot = new StackSnapshot(path);
+
+    IntVec planes;
+
+    for (size_t i = 0; i < m_snapshot->getNumTables(); ++i)
+    {
+        Table* table = m_snapshot->getTable(i, checksums);
+
+        switch (m_snapshot->getKind(i))
+        {
+            case StackSnapshot::SNAPSHOT_PLANE:
+                m_superpixel[m_snapshot->getPlane(i)] = table;
+                planes.push_back(m_snapshot->getPlane(i));
+                break;
+            case StackSnapshot::SNAPSHOT_SEGMENT:
+                m_segment = table;
+                break;
+            case StackSnapshot::SNAPSHOT_SEGMENT_SUPERPIXELS:
+                m_segment_sp = table;
+                break;
+            case StackSnapshot::SNAPSHOT_BODY_INDEX:
+                m_body_index = table;
+                break;
+            case StackSnapshot::SNAPSHOT_BODY_SEGMENTS:
+                m_body_seg = table;
+                break;
+            default:
+                delete table;
+                error("Unknown table %zu in %s", i, path.c_str());
+        }
+    }
+
+    if (!m_segment || !m_segment_sp || !m_body_index || !m_body_seg)
+    {
+        error("Missing tables in %s", path.c_str());
+    }
+
+    std::sort(planes.begin(), planes.end());
+    setPlaneRange(planes);
+}
+
+void HdfStack::saveSnapshot(std::string path)
+{
+    loadAllPlanes();
+
+    IntVec planes;
+
+    for (TableMap::iterator it = m_superpixel.begin(); it != m_superpixel.end(); ++it)
+    {
+        planes.push_back((*it).first);
+    }
+
+    std::sort(planes.begin(), planes.end());
+
+    SnapshotWriter writer(path);
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        writer.addTable(StackSnapshot::SNAPSHOT_PLANE, planes[i],
+            *m_superpixel[planes[i]]);
+    }
+
+    writer.addTable(StackSnapshot::SNAPSHOT_SEGMENT, 0, *m_segment);
+    writer.addTable(StackSnapshot::SNAPSHOT_SEGMENT_SUPERPIXELS, 0,
+        *m_segment_sp);
+    writer.addTable(StackSnapshot::SNAPSHOT_BODY_INDEX, 0, *m_body_index);
+    writer.addTable(StackSnapshot::SNAPSHOT_BODY_SEGMENTS, 0, *m_body_seg);
+
+    writer.close();
+}
+
+//
+// Set m_zmin/m_zmax from the planes in the file and list them in
+// order, throw if any plane in between is missing.
+//
+void HdfStack::findPlanes(HdfFile& file, IntVec& planes)
+{
+    {
+        PBT pbt("list planes");
+        file.listPlanes(planes);
+    }
+
+    setPlaneRange(planes);
+}
+
+void HdfStack::setPlaneRange(const IntVec& planes)
+{
     m_zmin = INT_MAX;
     m_zmax = 0;
     
-    // Read the superpixel datasets names, convert to integers so we 
-    // can get zmin/zmax and verify we have every in-between plane    
-    std::set<int> planes;
-    for (StringList::iterator it = planeStrings.begin(); 
-         it != planeStrings.end(); ++it)
+    for (size_t i = 0; i < planes.size(); ++i)
     {        
-        uint32 plane;
-        
-        if (!StrToInt(*it, plane))
-        {
-            std::string("Bad superpixel dataset name");
-        }
-        
-        planes.insert(plane);
-        
-        m_zmin = std::min(m_zmin, plane);
-        m_zmax = std::max(m_zmax, plane);
+        m_zmin = std::min(m_zmin, planes[i]);
+        m_zmax = std::max(m_zmax, planes[i]);
     }
     
-    // Read each plane into m_superpixel[z]
-    for (uint32 z = m_zmin; z <= m_zmax; ++z)
+    // Sorted, so we have every in-between plane if there are as many
+    // planes as numbers in the range
+    if (!planes.empty() && planes.size() != m_zmax - m_zmin + 1)
     {
-        // We should have found this above
-        if (planes.find(z) == planes.end())
+        for (uint32 z = m_zmin, i = 0; z <= m_zmax; ++z, ++i)
         {
-            error("Missing plane %d", z);
+            if (planes[i] != z)
+            {
+                error("Missing plane %d", z);
+            }
         }
-        
-        std::string path = FormatString("superpixel/%d", z);
-
-        m_superpixel[z] = file.readTable(path);
-        
-        //printf("Read plane %d -> %d rows\n", z, m_superpixel[z]->getRows());
     }
-    
-    m_segment = file.readTable("segment");
-    m_segment_sp = file.readTable("segment_superpixels");
-    m_body_index = file.readTable("body_index");
-    m_body_seg = file.readTable("body_segments");
+}
+
+// The segment and body tables, read together
+void HdfStack::readBodyTables(HdfFile& file)
+{
+    std::vector<std::string> names;
+    names.push_back("segment");
+    names.push_back("segment_superpixels");
+    names.push_back("body_index");
+    names.push_back("body_segments");
+
+    std::vector<Table*> tables;
+    file.readTables(names, tables, getNumCores());
+
+    m_segment = tables[0];
+    m_segment_sp = tables[1];
+    m_body_index = tables[2];
+    m_body_seg = tables[3];
 }
 
 
@@ -331,15 +434,29 @@ void HdfStack::load(std::string path)
 void HdfStack::loadTXT(std::string root, std::string logpath)
 {
     Table* bounds = NULL;
-    Table* segments = NULL;
-    Table* bodies = NULL;
+    std::string binpath = join(root, BOUNDS_BIN_FILE);
+    std::string path = chooseBoundsFile(binpath, join(root, BOUNDS_FILE));
 
+    // [PLANE, SPID, X, Y, WIDTH, HEIGHT, VOLUME]
+    if (path == binpath)
+    {
+        PBT pbt("read %s", BOUNDS_BIN_FILE);
+        bounds = readBoundsFile(binpath);
+    }
+    else
     {
         PBT pbt("read %s", BOUNDS_FILE);
-        // [PLANE, SPID, X, Y, WIDTH, HEIGHT, VOLUME]
         bounds = readtxt(root, BOUNDS_FILE, 7);
     }
 
+    loadTXT(root, logpath, bounds);
+}
+
+void HdfStack::loadTXT(std::string root, std::string logpath, Table* bounds)
+{
+    Table* segments = NULL;
+    Table* bodies = NULL;
+
     {
         PBT pbt("read %s", SEGMENT_FILE);
         // [PLANE, SPID, SEGID]
@@ -488,6 +605,146 @@ void remapZeroSuperpixels(Table* bounds, Table* segments, Table* bodies,
     }
 }
 
+// Copy the rows of table whose column is in [zmin, zmax]
+static Table* filterPlanes(Table* table, uint32 column, uint32 zmin,
+    uint32 zmax)
+{
+    uint32 rows = 0;
+
+    for (uint32 i = 0; i < table->getRows(); ++i)
+    {
+        uint32 z = table->getValue(i, column);
+        rows += z >= zmin && z <= zmax;
+    }
+
+    Table* result = new Table(rows, table->getColumns(), 0.0);
+    uint32 columns = table->getColumns();
+    uint32* out = result->getData();
+
+    for (uint32 i = 0; i < table->getRows(); ++i)
+    {
+        uint32 z = table->getValue(i, column);
+
+        if (z >= zmin && z <= zmax)
+        {
+            memcpy(out, table->getData() + size_t(i) * columns,
+                columns * sizeof(uint32));
+            out += columns;
+        }
+    }
+
+    return result;
+}
+
+void HdfStack::loadTXTShard(std::string root, std::string logpath,
+    uint32 zmin, uint32 zmax)
+{
+    Table* bounds = NULL;
+
+    std::string shardbin = join(root,
+        FormatString("superpixel_bounds.%d-%d.bin", zmin, zmax));
+    std::string shardtxt = join(root,
+        FormatString("superpixel_bounds.%d-%d.txt", zmin, zmax));
+    std::string binpath = join(root, BOUNDS_BIN_FILE);
+    std::string path;
+
+    // The shard's own file if bounds wrote one, else the whole stack's
+    if (fileExists(shardbin) || fileExists(shardtxt))
+    {
+        path = chooseBoundsFile(shardbin, shardtxt);
+    }
+    else
+    {
+        path = chooseBoundsFile(binpath, join(root, BOUNDS_FILE));
+    }
+
+    // [PLANE, SPID, X, Y, WIDTH, HEIGHT, VOLUME]
+    {
+        PBT pbt("read bounds");
+
+        if (path == shardbin || path == binpath)
+        {
+            bounds = readBoundsFile(path);
+        }
+        else if (path == shardtxt)
+        {
+            printf("Reading %s...\n", shardtxt.c_str());
+            bounds = readTxtFile(shardtxt, NUM_TXT_BOUNDS_COLUMNS,
+                getNumCores());
+        }
+        else
+        {
+            bounds = readtxt(root, BOUNDS_FILE, NUM_TXT_BOUNDS_COLUMNS);
+        }
+    }
+
+    Table* segments = NULL;
+    Table* bodies = NULL;
+
+    {
+        PBT pbt("read %s", SEGMENT_FILE);
+        segments = readtxt(root, SEGMENT_FILE, NUM_TXT_SEGMENT_COLUMNS);
+    }
+
+    {
+        PBT pbt("read %s", BODY_FILE);
+        bodies = readtxt(root, BODY_FILE, NUM_TXT_BODY_COLUMNS);
+    }
+
+    remapZeroSuperpixels(bounds, segments, bodies, m_newbodies, logpath);
+
+    Table* shardBounds = filterPlanes(bounds, TXT_BOUNDS_Z, zmin, zmax);
+    Table* shardSegments = filterPlanes(segments, TXT_SEGMENT_Z, zmin, zmax);
+
+    delete bounds;
+    delete segments;
+
+    // Only the bodies of this shard's segments, the others would all
+    // be logged as empty segments
+    std::vector<uint64> segids(shardSegments->getRows());
+
+    for (uint32 i = 0; i < shardSegments->getRows(); ++i)
+    {
+        segids[i] = shardSegments->getValue(i, TXT_SEGMENT_SEGID);
+    }
+
+    radixSort(segids, getNumCores());
+    segids.erase(std::unique(segids.begin(), segids.end()), segids.end());
+
+    IntVec values;
+
+    for (uint32 i = 0; i < bodies->getRows(); ++i)
+    {
+        if (std::binary_search(segids.begin(), segids.end(),
+            uint64(bodies->getValue(i, TXT_BODY_SEGID))))
+        {
+            values.push_back(bodies->getValue(i, TXT_BODY_SEGID));
+            values.push_back(bodies->getValue(i, TXT_BODY_BODYID));
+        }
+    }
+
+    delete bodies;
+
+    Table* shardBodies = new Table(values.size() / NUM_TXT_BODY_COLUMNS,
+        NUM_TXT_BODY_COLUMNS);
+
+    if (!values.empty())
+    {
+        memcpy(shardBodies->getData(), &values[0],
+            values.size() * sizeof(uint32));
+    }
+
+    printf("Shard %u-%u has %u bounds, %u superpixels and %u segments\n",
+        zmin, zmax, shardBounds->getRows(), shardSegments->getRows(),
+        shardBodies->getRows());
+
+    createTables(shardBounds, shardSegments, shardBodies, logpath);
+
+    delete shardBounds;
+    delete shardSegments;
+    delete shardBodies;
+}
+
 // 
 // Create a new stack from 3 Tables which correspond to the 3 TXT
 // files which we normally import from.
@@ -511,55 +768,79 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
     // dumptables(bounds, segments, bodies);    
     remapZeroSuperpixels(bounds, segments, bodies, m_newbodies, logpath);
     
-    ext::hash_map<uint32, IntSet> boundSet;
+    createTables(bounds, segments, bodies, logpath);
+}
+
+void HdfStack::createTables(Table* bounds, Table* segments, Table* bodies,
+    std::string logpath)
+{
+    int threads = getNumCores();
 
     m_zmin = INT_MAX;
     m_zmax = 0;
     
-    // Create boundSet[z][spid]
+    // Sorted (z, spid) keys of the bounds and of the segment map.
+    // A (z, spid) is looked up in the other table by merging the two.
+    std::vector<uint64> boundKeys(bounds->getRows());
+
+    // maxspid[z] = <maxspid>
+    IntMap maxspid;
+
     for (uint32 i = 0; i < bounds->getRows(); ++i)
     {
         uint32 z = bounds->getValue(i, TXT_BOUNDS_Z);
         uint32 spid = bounds->getValue(i, TXT_BOUNDS_SPID);
         
-        boundSet[z].insert(spid);        
+        boundKeys[i] = makeKey(z, spid);
         
         m_zmin = std::min(m_zmin, z);
         m_zmax = std::max(m_zmax, z);   
+
+        if (maxspid.find(z) == maxspid.end())
+        {
+            maxspid[z] = spid;
+        }
+        else
+        {
+            maxspid[z] = std::max(maxspid[z], spid);
+        }
     }
     
-    uint32 numsegments = bodies->getRows();
-    
-    ext::hash_map<uint32, IntMap> segMap;
+    std::vector<uint64> segKeys(segments->getRows());
 
-    // Create a segMap[z][spids] = row
     for (uint32 i = 0; i < segments->getRows(); ++i)
     {
         uint32 z = segments->getValue(i, TXT_SEGMENT_Z);
         uint32 spid = segments->getValue(i, TXT_SEGMENT_SPID);
         
-        segMap[z][spid] = i;
+        segKeys[i] = makeKey(z, spid);
     }
 
-    // maxspid[z] = <maxspid>
-    IntMap maxspid;
-
-    // Find maxspid for each plane
-    for (uint32 i = 0; i < bounds->getRows(); ++i)
     {
-        uint32 z = bounds->getValue(i, TXT_BOUNDS_Z);
-        uint32 spid = bounds->getValue(i, TXT_BOUNDS_SPID);
-    
-        if (maxspid.find(z) == maxspid.end())
-        {
-            maxspid[z] = spid;
-        }
-        else
-        {
-            maxspid[z] = std::max(maxspid[z], spid);
-        }
+        PBT pbt("Sort superpixels");
+        radixSort(boundKeys, threads);
+        radixSort(segKeys, threads);
     }
 
+    boundKeys.erase(std::unique(boundKeys.begin(), boundKeys.end()), 
+        boundKeys.end());
+    segKeys.erase(std::unique(segKeys.begin(), segKeys.end()),
+        segKeys.end());
+
+    // Superpixels which are in the bounds but not the segment map,
+    // and the other way round.  These are normally few, so the rows
+    // below can be checked against them quickly.
+    std::vector<uint64> orphanKeys;
+    std::vector<uint64> phantomKeys;
+    
+    std::set_difference(boundKeys.begin(), boundKeys.end(),
+        segKeys.begin(), segKeys.end(), std::back_inserter(orphanKeys));
+    std::set_difference(segKeys.begin(), segKeys.end(),
+        boundKeys.begin(), boundKeys.end(), std::back_inserter(phantomKeys));
+    
+    std::vector<uint64>().swap(boundKeys);
+    std::vector<uint64>().swap(segKeys);
+
     // Create a table for each plane, sized by maxspid
     for (IntMap::iterator it = maxspid.begin(); it != maxspid.end(); ++it)
     {
@@ -581,8 +862,8 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
         uint32 spid = bounds->getValue(i, TXT_BOUNDS_SPID);
 
         // If not in the segments table
-        if (segMap.find(z) == segMap.end() ||
-            segMap[z].find(spid) == segMap[z].end())
+        if (std::binary_search(orphanKeys.begin(), orphanKeys.end(),
+            makeKey(z, spid)))
         {
             uint32 volume = bounds->getValue(i, TXT_BOUNDS_VOLUME);
             
@@ -625,10 +906,9 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
         uint32 spid = segments->getValue(i, TXT_SEGMENT_SPID);
         uint32 segid = segments->getValue(i, TXT_SEGMENT_SEGID);
         
-        IntSet& set = boundSet[z];
-        
         // If we do not have bounds for this spid
-        if (set.find(spid) == set.end())
+        if (std::binary_search(phantomKeys.begin(), phantomKeys.end(),
+            makeKey(z, spid)))
         {
             // This is a "phantom" spid, it exists in the spseg map but 
             // we don't have bounds for it, thus it was not present in the
@@ -653,7 +933,11 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
     // Create our segment table
     m_segment = new Table(maxsegid + 1, NUM_SEGMENT_COLUMNS);
 
-   // Fill in segment z from the superpixel tables   
+    // (segid, spid) of every superpixel in a segment, sorted so each
+    // segment's spids are one run
+    std::vector<uint64> spKeys;
+    
+    // Fill in segment z from the superpixel tables   
     for (TableMap::iterator it = m_superpixel.begin(); 
          it != m_superpixel.end(); ++it)
     {
@@ -667,12 +951,11 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
             if (segid != EMPTY_VALUE)
             {
                 m_segment->setValue(segid, SEGMENT_Z, z);
+                spKeys.push_back(makeKey(segid, spid));
             }
         }
     }
  
-    IntSet deletedSegs;
-    
     drop = keep = 0;
     LogFile empty_segments(logpath, "empty-segments.txt", "# segid");
     
@@ -696,13 +979,10 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
             // Segment was empty
             drop++;
             empty_segments.log("%u", segid);
-            
-            // Keep track so we can ignore these segments later            
-            deletedSegs.insert(segid);
         }
     }
     
-    numsegments -= deletedSegs.size();
+    uint32 numsegments = keep;
     
     if (drop > 0)
     {
@@ -710,192 +990,369 @@ void HdfStack::create(Table* bounds, Table* segments, Table* bodies,
         printf("WARN: See %s\n", empty_segments.getFilename());
     }
  
-    typedef std::list<uint32> IntList;
-    typedef ext::hash_map<uint32, IntList> IntListMap;
+    {
+        PBT pbt("Sort segments");
+        radixSort(spKeys, threads);
+    }
 
-    // Create the reverse map from segment to its list of spids
-    // spids[segid] = [spid1, spid2, ...]
-    IntListMap spids;
-    
-    uint32 numsp = 0;
+    uint32 numsp = spKeys.size();
+    uint32 numsegs = 0;
     
-    // For each plane
-    for (TableMap::iterator it = m_superpixel.begin(); 
-        it != m_superpixel.end(); ++it)
+    for (uint32 i = 0; i < numsp; ++i)
     {
-        //uint32 z = it->first;
-        Table* table = it->second;
-
-        // For each spid on this plane
-        for (uint32 spid = 0; spid < table->getRows(); ++spid)
+        if (i == 0 || keyHigh(spKeys[i]) != keyHigh(spKeys[i - 1]))
         {
-            // Get the segid from this spid
-            uint32 segid = table->getValue(spid, SUPERPIXEL_SEGID);
-            
-            if (segid != EMPTY_VALUE)
-            {
-                IntListMap::iterator it = spids.find(segid);
-            
-                if (it == spids.end())
-                {
-                    IntList list;
-                    list.push_back(spid);
-                    spids[segid] = list;
-                }
-                else
-                {
-                    spids[segid].push_back(spid);
-                }
-                
-                numsp += 1;
-            }
+            ++numsegs;
         }
     }
 
     // segment_sp is big enough for each spid plus one terminator per segment
-    uint32 segment_sp_size = numsp + spids.size();
+    uint32 segment_sp_size = numsp + numsegs;
     m_segment_sp = new Table(segment_sp_size, 1);
 
     // index into m_segment_sp
     uint32 spindex = 0;
 
-    // Convert spids map into m_segment and m_segment_sp tables
-    for (IntListMap::iterator it = spids.begin(); it != spids.end(); ++it)
+    // Write each run of spids into m_segment_sp
+    for (uint32 i = 0; i < numsp; ++i)
     {   
-        uint32 segid = it->first;
-        IntList& spids = it->second;
+        uint32 segid = keyHigh(spKeys[i]);
     
-        // Point to location in m_segment_sp
-        m_segment->setValue(segid, SEGMENT_SPINDEX, spindex);
-        
-        // Write all spids into m_segment_sp    
-        for (IntList::iterator it2 = spids.begin(); it2 != spids.end(); ++it2)
+        if (i == 0 || segid != keyHigh(spKeys[i - 1]))
         {
-            m_segment_sp->setValue(spindex++, 0, *it2);
+            // Point to location in m_segment_sp
+            m_segment->setValue(segid, SEGMENT_SPINDEX, spindex);
         }
+        
+        m_segment_sp->setValue(spindex++, 0, keyLow(spKeys[i]));
     
         // Terminate the list
-        m_segment_sp->setValue(spindex++, 0, END_OF_LIST);
+        if (i == numsp - 1 || segid != keyHigh(spKeys[i + 1]))
+        {
+            m_segment_sp->setValue(spindex++, 0, END_OF_LIST);
+        }
     }
     
     assert(spindex == segment_sp_size);
+    
+    std::vector<uint64>().swap(spKeys);
 
-    // Create a list of segments for each body
-    // segs[bodyid] = [segid1, segid2, ...]
-    IntListMap segs;
+    // need to be sure segment IDs don't appear twice in the list
+    {
+        std::vector<uint64> segids(bodies->getRows());
+        
+        for (uint32 i = 0; i < bodies->getRows(); ++i)
+        {
+            segids[i] = bodies->getValue(i, TXT_BODY_SEGID);
+        }
+        
+        radixSort(segids, threads);
+        
+        for (uint32 i = 1; i < segids.size(); ++i)
+        {
+            if (segids[i] == segids[i - 1])
+            {
+                printf("Error: segment %u mapped to more than one body in segment_to_body_map.txt; quitting.\n", uint32(segids[i]));
+                exit(1);
+            }
+        }
+    }
+    
+    // (bodyid, row) of each kept segment, sorted so each body's
+    // segments are one run, in the order of the bodies table
+    std::vector<uint64> segKeysByBody;
+    segKeysByBody.reserve(numsegments);
+    
     uint32 maxbodyid = 0;
     
     // For each segment that was deleted, keep track of the body
     // it was mapped to.  That body implicitly gets deleted if no
     // other segments map to it.
-    IntSet pendingBodies;
+    std::vector<uint64> pendingBodies;
     
-    // need to be sure segment IDs don't appear twice in the list
-    IntSet uniqueSegments;
+    for (uint32 i = 0; i < bodies->getRows(); ++i)
+    {
+        uint32 segid = bodies->getValue(i, TXT_BODY_SEGID);
+        uint32 bodyid = bodies->getValue(i, TXT_BODY_BODYID);
+        
+        // If we deleted this segment
+        if (segid >= m_segment->getRows() ||
+            m_segment->getValue(segid, SEGMENT_Z) == EMPTY_VALUE)
+        {
+            // ignore this mapping, might result in body
+            // getting deleted if it has no other segments
+            pendingBodies.push_back(bodyid);
+            continue;
+        }
+    
+        maxbodyid = std::max(maxbodyid, bodyid);
+        segKeysByBody.push_back(makeKey(bodyid, i));
+    }
+    
+    {
+        PBT pbt("Sort bodies");
+        radixSort(segKeysByBody, threads);
+    }
+    
+    uint32 numbodies = 0;
+    
+    for (uint32 i = 0; i < segKeysByBody.size(); ++i)
+    {
+        if (i == 0 || 
+            keyHigh(segKeysByBody[i]) != keyHigh(segKeysByBody[i - 1]))
+        {
+            ++numbodies;
+        }
+    }
+    
+    std::sort(pendingBodies.begin(), pendingBodies.end());
+    pendingBodies.erase(std::unique(pendingBodies.begin(), pendingBodies.end()),
+        pendingBodies.end());
+    
+    drop = keep = 0;
+    LogFile empty_bodies(logpath, "empty-bodies.txt", "# bodyid");
+    
+    // Check which bodies got deleted, just to report them
+    for (uint32 i = 0; i < pendingBodies.size(); ++i)
+    {
+        uint32 bodyid = pendingBodies[i];
+        
+        std::vector<uint64>::iterator it = std::lower_bound(
+            segKeysByBody.begin(), segKeysByBody.end(), makeKey(bodyid, 0));
+        
+        // If it has no segments left
+        if (it == segKeysByBody.end() || keyHigh(*it) != bodyid)
+        {
+            drop++;
+            empty_bodies.log("%u", bodyid);            
+        }
+    }
+    
+    // Compute keep for number of bodies
+    keep = numbodies;
+    
+    if (drop > 0)
+    {
+        printf("WARN: dropped %u empty bodies, keep %u\n", drop, keep);
+        printf("WARN: See %s\n", empty_bodies.getFilename());
+    }
+
+    uint32 body_index_size = maxbodyid + 1;
+
+    // Directly indexed by bodyid.  Value is an index into m_body_seg.
+    m_body_index = new Table(body_index_size, 1);
+    
+    // Big enough for each seg plus one terminator per body
+    uint32 body_seg_size = numbodies + numsegments;
+    m_body_seg = new Table(body_seg_size, 1);
+
+    uint32 bodyindex = 0;
+    
+    printf("Convert segs into body_index and body_seg arrays...\n");
+       
+    // Write each run of segments into body_index and body_seg arrays
+    for (uint32 i = 0; i < segKeysByBody.size(); ++i)
+    {   
+        uint32 bodyid = keyHigh(segKeysByBody[i]);
+        uint32 row = keyLow(segKeysByBody[i]);
+    
+        if (i == 0 || bodyid != keyHigh(segKeysByBody[i - 1]))
+        {
+            m_body_index->setValue(bodyid, 0, bodyindex);
+        }
+        
+        m_body_seg->setValue(bodyindex++, 0, 
+            bodies->getValue(row, TXT_BODY_SEGID));
+    
+        if (i == segKeysByBody.size() - 1 || 
+            bodyid != keyHigh(segKeysByBody[i + 1]))
+        {
+            m_body_seg->setValue(bodyindex++, 0, END_OF_LIST);
+        }
+    }
+        
+    assert(bodyindex == body_seg_size);
     
+    printf("Verifying...\n");
+    verify();
+}
+
+
+void HdfStack::updateBodies(Table* bodies, std::string logpath)
+{
+    int threads = getNumCores();
+
+    // need to be sure segment IDs don't appear twice in the list
+    {
+        std::vector<uint64> segids(bodies->getRows());
+        
+        for (uint32 i = 0; i < bodies->getRows(); ++i)
+        {
+            segids[i] = bodies->getValue(i, TXT_BODY_SEGID);
+        }
+        
+        radixSort(segids, threads);
+        
+        for (uint32 i = 1; i < segids.size(); ++i)
+        {
+            if (segids[i] == segids[i - 1])
+            {
+                printf("Error: segment %u mapped to more than one body; quitting.\n", uint32(segids[i]));
+                exit(1);
+            }
+        }
+    }
+
+    uint32 drop = 0;
+    uint32 same = 0;
+    LogFile empty_segments(logpath, "empty-segments.txt", "# segid");
+
+    // Rows of the table whose segment changes body
+    IntVec moved;
+    uint32 maxbodyid = 0;
     
     for (uint32 i = 0; i < bodies->getRows(); ++i)
     {
         uint32 segid = bodies->getValue(i, TXT_BODY_SEGID);
         uint32 bodyid = bodies->getValue(i, TXT_BODY_BODYID);
-        
-        // check for duplicated segments
-        if (uniqueSegments.find(segid) != uniqueSegments.end())
+    
+        // A segment with no superpixels cannot be in a body
+        if (segid >= m_segment->getRows() ||
+            m_segment->getValue(segid, SEGMENT_Z) == EMPTY_VALUE)
         {
-            printf("Error: segment %u mapped to more than one body in segment_to_body_map.txt; quitting.\n", segid);
-            exit(1);
+            drop++;
+            empty_segments.log("%u", segid);
+            continue;
         }
-        else
+        
+        if (m_segment->getValue(segid, SEGMENT_BODYID) == bodyid)
         {
-            uniqueSegments.insert(segid);
+            same++;
+            continue;
         }
         
-        // If we deleted this segment
-        if (deletedSegs.find(segid) != deletedSegs.end())
+        m_segment->setValue(segid, SEGMENT_BODYID, bodyid);
+        moved.push_back(i);
+        maxbodyid = std::max(maxbodyid, bodyid);
+    }
+    
+    if (drop > 0)
+    {
+        printf("INFO: dropped %u empty segments\n", drop);
+        printf("WARN: See %s\n", empty_segments.getFilename());
+    }
+    
+    printf("Move %u segments, %u are already in their body\n", 
+        uint32(moved.size()), same);
+    
+    if (moved.empty())
+    {
+        return;
+    }
+    
+    // (bodyid, n) for the n'th segment of the new lists, sorted so
+    // each body's segments are one run.  Segments which stay keep
+    // their place, moved ones follow them.
+    std::vector<uint64> keys;
+    IntVec segids;
+    
+    for (uint32 bodyid = 0; bodyid < m_body_index->getRows(); ++bodyid)
+    {
+        uint32 index = m_body_index->getValue(bodyid, 0);
+        
+        if (index == EMPTY_VALUE)
         {
-            // ignore this mapping, might result in body
-            // getting deleted if it has no other segments
-            pendingBodies.insert(bodyid);
             continue;
         }
+        
+        for (; m_body_seg->getValue(index, 0) != END_OF_LIST; ++index)
+        {
+            uint32 segid = m_body_seg->getValue(index, 0);
+        
+            if (m_segment->getValue(segid, SEGMENT_BODYID) == bodyid)
+            {
+                keys.push_back(makeKey(bodyid, segids.size()));
+                segids.push_back(segid);
+            }
+        }
+    }
+    
+    for (uint32 i = 0; i < moved.size(); ++i)
+    {
+        uint32 segid = bodies->getValue(moved[i], TXT_BODY_SEGID);
+        uint32 bodyid = bodies->getValue(moved[i], TXT_BODY_BODYID);
     
-        maxbodyid = std::max(maxbodyid, bodyid);
+        keys.push_back(makeKey(bodyid, segids.size()));
+        segids.push_back(segid);
+    }
     
-        if (segs.find(bodyid) == segs.end())
-        {
-            IntList list;
-            list.push_back(segid);
-            segs[bodyid] = list;
-        }
-        else
-        {
-            segs[bodyid].push_back(segid);
-        }
+    {
+        PBT pbt("Sort bodies");
+        radixSort(keys, threads);
     }
     
-    drop = keep = 0;
-    LogFile empty_bodies(logpath, "empty-bodies.txt", "# bodyid");
+    uint32 numbodies = 0;
     
-    // Check which bodies got deleted, just to report them
-    for (IntSet::iterator it = pendingBodies.begin();
-         it != pendingBodies.end(); ++it)
+    for (uint32 i = 0; i < keys.size(); ++i)
     {
-        uint32 bodyid = *it;
-        
-        // If it's not in the map
-        if (segs.find(bodyid) == segs.end())
+        if (i == 0 || keyHigh(keys[i]) != keyHigh(keys[i - 1]))
         {
-            drop++;
-            empty_bodies.log("%u", bodyid);            
+            ++numbodies;
         }
     }
     
-    // Compute keep for number of bodies
-    keep = segs.size();
+    uint32 body_index_size = std::max(m_body_index->getRows(), maxbodyid + 1);
+    uint32 body_seg_size = numbodies + keys.size();
     
-    if (drop > 0)
-    {
-        printf("WARN: dropped %u empty bodies, keep %u\n", drop, keep);
-        printf("WARN: See %s\n", empty_bodies.getFilename());
-    }
-
-    uint32 numbodies = segs.size();
-    uint32 body_index_size = maxbodyid + 1;
-
-    // Directly indexed by bodyid.  Value is an index into m_body_seg.
-    m_body_index = new Table(body_index_size, 1);
+    Table* body_index = new Table(body_index_size, 1);
+    Table* body_seg = new Table(body_seg_size, 1);
     
-    // Big enough for each seg plus one terminator per body
-    uint32 body_seg_size = numbodies + numsegments;
-    m_body_seg = new Table(body_seg_size, 1);
-
     uint32 bodyindex = 0;
     
-    printf("Convert segs into body_index and body_seg arrays...\n");
-       
-    // Convert segs into body_index and body_seg arrays
-    for (IntListMap::iterator it = segs.begin(); it != segs.end(); ++it)
-    {   
-        uint32 bodyid = it->first;
-        IntList& seglist = it->second;
+    // Write each run of segments into the new arrays
+    for (uint32 i = 0; i < keys.size(); ++i)
+    {
+        uint32 bodyid = keyHigh(keys[i]);
     
-        m_body_index->setValue(bodyid, 0, bodyindex);
-        
-        for (IntList::iterator it2 = seglist.begin(); it2 != seglist.end(); ++it2)
+        if (i == 0 || bodyid != keyHigh(keys[i - 1]))
         {
-            m_body_seg->setValue(bodyindex++, 0, *it2);
+            body_index->setValue(bodyid, 0, bodyindex);
         }
+        
+        body_seg->setValue(bodyindex++, 0, segids[keyLow(keys[i])]);
     
-        m_body_seg->setValue(bodyindex++, 0, END_OF_LIST);
+        if (i == keys.size() - 1 || bodyid != keyHigh(keys[i + 1]))
+        {
+            body_seg->setValue(bodyindex++, 0, END_OF_LIST);
+        }
     }
-        
+    
     assert(bodyindex == body_seg_size);
     
-    printf("Verifying...\n");
-    verify();
+    // Bodies whose segments all moved away are gone
+    uint32 emptied = 0;
+    
+    for (uint32 bodyid = 0; bodyid < m_body_index->getRows(); ++bodyid)
+    {
+        if (m_body_index->getValue(bodyid, 0) != EMPTY_VALUE &&
+            body_index->getValue(bodyid, 0) == EMPTY_VALUE)
+        {
+            emptied++;
+        }
+    }
+    
+    if (emptied > 0)
+    {
+        printf("INFO: %u bodies lost all their segments\n", emptied);
+    }
+    
+    delete_ptr(m_body_index);
+    delete_ptr(m_body_seg);
+    
+    m_body_index = body_index;
+    m_body_seg = body_seg;
 }
 
-
 // Read a TXT file which is a table of integer values.
 // Ignore comment (#) or blank lines. 
 // Return a linear array of size [rows*columns].
@@ -905,191 +1362,71 @@ Table* HdfStack::readtxt(std::string root, std::string fname, int columns)
 
     std::string path = root + "/" + fname;
 
-    char buffer[1024];
-    std::ifstream fin(path.c_str());
-    
-    if (!fin)
+    if (!fileExists(path))
     {
         printf("Error opening: %s\n", path.c_str());
         exit(1);
     }
 
-    std::vector<char *> lines;
-
-    while (fin.getline(buffer, 1024))
-    {
-        int len = strlen(buffer);
-        if (len > 0 && buffer[0] != '#')
-        {
-            char *line = new char[len + 1];
-            strcpy(line, buffer);
-            lines.push_back(line);
-        }
-    }
-
-    Table* table = new Table(lines.size(), columns);
-    table->import(lines);
-   
-    for (uint32 i = 0; i < lines.size(); ++i)
-    {
-        delete lines[i];
-    }
-
-    return table;
+    return readTxtFile(path, columns, getNumCores());
 }
 
 bool HdfStack::verify(bool repair)
 {
-    const int MAX_ERRORS = 30;
-    int errors = 0;
-    
     // For every segment:
     // 1) Make sure the row is all-empty or all non-emtpy
     // 2) Make sure each superpixel in the segment refers back to the segment
     // 3) For the body which the segment maps to:
     //    a) Make sure the body exists
     //    b) Make sure body refers back to the segment
-    //    
-    for (uint32 segid = 0; segid < m_segment->getRows(); ++segid)
-    {
-        uint32 plane = m_segment->getValue(segid, SEGMENT_Z);
-        uint32 bodyid = m_segment->getValue(segid, SEGMENT_BODYID);
-        uint32 spindex = m_segment->getValue(segid, SEGMENT_SPINDEX);
-        
-        // If first-value is empty
-        if (plane == EMPTY_VALUE)
-        {
-            // Make sure row is all-empty
-            if (bodyid != EMPTY_VALUE)
-            {
-                printf("ERROR: segid=%u expected empty BODYID\n", segid);
-                ++errors;
-            }
-            if (spindex != EMPTY_VALUE)
-            {
-                printf("ERROR: segid=%u expected empty SPINDEX\n", segid);
-                ++errors;
-            }
-        }
-        else
-        {
-            // Make sure row is non-empty
-            if (bodyid == EMPTY_VALUE)
-            {
-                printf("ERROR: segid=%u expected non-empty BODYID\n", segid);
-                ++errors;
-            }
-            
-            if (spindex == EMPTY_VALUE)
-            {
-                printf("ERROR: segid=%u expected non-empty SPINDEX\n", segid);
-                ++errors;
-            }
-            else
-            {
-                IntVec spids;
-                getsuperpixelsinsegment(segid, spids);
-                
-                // Check every superpixel in the segment refers back to
-                // us as the segment.
-                for (uint32 i = 0; i < spids.size(); ++i)
-                {
-                    uint32 spid = spids[i];
-                    uint32 sp_seg = getsegmentid(plane, spid);
-                    
-                    if (segid != sp_seg)
-                    {
-                        printf("ERROR: segid=%u has spid (%u, %u)\n",
-                            segid, plane, spid);
-                        printf("ERROR: superpixel (%u, %u) had segid=%u\n",
-                            plane, spid, sp_seg);
-                        
-                        if (++errors > MAX_ERRORS)
-                        {
-                            break;
-                        }
-                    }
-                }
-            }
-            
-            // Check body exists
-            uint32 bodyid = getsegmentbodyid(segid);
-            checkBody(bodyid);
+    //
+    // Then find superpixels with no segment, and repair them.
+    //
+    loadAllPlanes();
 
-            // Check we are in the body's list of segments
-            IntVec bodysegs;
-            getsegments(bodyid, bodysegs);
-            
-            if (!contains(bodysegs, segid))
-            {
-                printf("ERROR: bodyid=%u doesn't contain segid=%u\n",
-                    bodyid, segid);
-                    
-                if (++errors > MAX_ERRORS)
-                {
-                    break;
-                }
-            }
-        }
-        
-        if (errors > MAX_ERRORS)
-        {
-            break;
-        }
-    }
+    StackVerifier verifier(*this, getNumCores());
+    int errors = verifier.checkSegments();
 
-    // For every plane
-    for (TableMap::iterator it = m_superpixel.begin(); it != m_superpixel.end(); ++it)
+    IntVec planes;
+    IntVec spids;
+    verifier.findOrphans(planes, spids);
+
+    for (uint32 i = 0; i < spids.size(); ++i)
     {
-        uint32 z = (*it).first;
-        Table* table = (*it).second;
-    
-        // For every superpixel in this plane
-        for (uint32 i = 0; i < table->getRows(); ++i)
+        uint32 z = planes[i];
+        uint32 spid = spids[i];
+
+        printf("ERROR: Superpixel has no segment plane=%u spid=%u\n", z, spid);
+
+        if (repair)
         {
-            // If does not exist, skip
-            if (table->getValue(i, SUPERPIXEL_X) == EMPTY_VALUE)
-            {
-                continue;
-            }
-            
-            // If empty segment
-            if (table->getValue(i, SUPERPIXEL_SEGID) == EMPTY_VALUE)
-            {
-                printf("ERROR: Superpixel has no segment plane=%u spid=%u\n", z, i);
-                
-                if (repair) 
-                {
-                    // Repair by creating a new segment/body and adding
-                    // the superpixel to this new segment/body.
-                    uint32 bodyid = createbody();
-                    uint32 segid = createsegment();                    
-                    
-                    IntVec segids;
-                    segids.push_back(segid);
-                    
-                    addsegments(segids, bodyid);
-                    
-                    IntVec spids;
-                    spids.push_back(i);
+            // Repair by creating a new segment/body and adding
+            // the superpixel to this new segment/body.
+            uint32 bodyid = createbody();
+            uint32 segid = createsegment();
 
-                    setsuperpixels(segid, z, spids);                    
-                    setsegmentid(z, i, segid);
-                    
-                    printf("REPAIR: added z=%u spid=%u to new body=%u\n",
-                        z, i, bodyid);
-                }
-            }
+            IntVec segids;
+            segids.push_back(segid);
+
+            addsegments(segids, bodyid);
+
+            IntVec segsp;
+            segsp.push_back(spid);
+
+            setsuperpixels(segid, z, segsp);
+            setsegmentid(z, spid, segid);
+
+            printf("REPAIR: added z=%u spid=%u to new body=%u\n",
+                z, spid, bodyid);
         }
     }
 
-    
     return errors == 0;
 }
 
 uint32 HdfStack::getnumsuperpixelsinplane(uint32 plane)
 {
-    Table *table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane);
     
     uint32 total = 0;
     
@@ -1128,7 +1465,7 @@ uint32 HdfStack::getnumsuperpixelsinbody(uint32 bodyid)
 
 bool HdfStack::hassuperpixel(uint32 plane, uint32 spid)
 {
-    Table *table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane);
     
     if (spid >= table->getRows())
     {
@@ -1145,7 +1482,7 @@ bool HdfStack::hassuperpixel(uint32 plane, uint32 spid)
 
 uint32 HdfStack::createsuperpixel(uint32 plane)
 {
-    Table *table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane, true);
     int spid = table->getRows();
     
     // Already initialized to all EMPTY_VALUE
@@ -1161,7 +1498,7 @@ void HdfStack::addsuperpixel(uint32 plane, uint32 spid, uint32 segid)
         m_log->log("addsuperpixel(%u, %u, %u)", plane, spid, segid);
     }    
     
-    Table* table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane, true);
     
     if (segid == 0)
     {
@@ -1203,7 +1540,7 @@ void HdfStack::addsuperpixel(uint32 plane, uint32 spid, uint32 segid)
 
 void HdfStack::getsuperpixelsinplane(uint32 plane, IntVec& result)
 {
-    Table *table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane);
     
     result.clear();
     for (uint32 i = 0; i < table->getRows(); ++i)
@@ -1220,7 +1557,7 @@ void HdfStack::getsuperpixelsinplane(uint32 plane, IntVec& result)
 
 void HdfStack::getsuperpixelbodiesinplane(uint32 plane, IntVec& result)
 {
-    Table *table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane);
     
     result.clear();
     for (uint32 i = 0; i < table->getRows(); ++i)
@@ -1240,15 +1577,13 @@ void HdfStack::getsuperpixelbodiesinplane(uint32 plane, IntVec& result)
 
 uint32 HdfStack::getmaxsuperpixelid(uint32 plane)
 {
-    Table *table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane);
     return table->getRows() - 1;    
 }
 
 
-Table* HdfStack::getSuperpixelTableAndCheckRow(uint32 plane, uint32 spid)
+void HdfStack::checkSuperpixelRow(Table* table, uint32 spid)
 {
-    Table *table = getSuperpixelTable(plane);
-    
     if (spid >= table->getRows())
     {
         error("spid=%u is out of range [0..%u]", spid, table->getRows() - 1);
@@ -1263,14 +1598,13 @@ Table* HdfStack::getSuperpixelTableAndCheckRow(uint32 plane, uint32 spid)
             error("spid=%u empty in column=%d", spid, i);
         }
     }
-    
-    return table;
 }
 
 
 Bounds HdfStack::getbounds(uint32 plane, uint32 spid)
 {
-    Table *table = getSuperpixelTableAndCheckRow(plane, spid);
+    PlaneRef table(*this, plane);
+    checkSuperpixelRow(table.get(), spid);
     
     Bounds bounds;
     bounds.x = table->getValue(spid, SUPERPIXEL_X);
@@ -1283,7 +1617,8 @@ Bounds HdfStack::getbounds(uint32 plane, uint32 spid)
 
 uint32 HdfStack::getvolume(uint32 plane, uint32 spid)
 {
-    Table *table = getSuperpixelTableAndCheckRow(plane, spid);
+    PlaneRef table(*this, plane);
+    checkSuperpixelRow(table.get(), spid);
     
     return table->getValue(spid, SUPERPIXEL_VOLUME);    
 }
@@ -1291,8 +1626,8 @@ uint32 HdfStack::getvolume(uint32 plane, uint32 spid)
 void HdfStack::setboundsandvolume(uint32 plane, uint32 spid, Bounds bounds, 
     uint32 volume)
 {
-    // Don't use getSuperpixelTableAndCheckRow because it could be empty
-    Table *table = getSuperpixelTable(plane);
+    // Don't use checkSuperpixelRow because it could be empty
+    PlaneRef table(*this, plane, true);
     
     table->setValue(spid, SUPERPIXEL_X, bounds.x);
     table->setValue(spid, SUPERPIXEL_Y, bounds.y);
@@ -1320,7 +1655,7 @@ bool HdfStack::hassegment(uint32 segid)
 
 uint32 HdfStack::getsegmentid(uint32 plane, uint32 spid)
 {
-    Table* table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane);
     
     if (spid < table->getRows())
     {
@@ -1353,7 +1688,7 @@ void HdfStack::setsegmentid(uint32 plane, uint32 spid, uint32 segid)
         m_log->log("setsegmentid(%u, %u, %u)", plane, spid, segid);
     }
     
-    Table* table = getSuperpixelTable(plane);
+    PlaneRef table(*this, plane, true);
     
     if (spid < table->getRows())
     {
@@ -1710,34 +2045,225 @@ void HdfStack::garbageCollect()
 
 void HdfStack::save(std::string path, uint isbackup)
 {
+    writeFile(path, !isbackup, false);
+}
+
+void HdfStack::writeFile(std::string path, bool gc, bool extendible)
+{
+    // Every plane is written, and this closes a lazily loaded file
+    // in case we're saving over it
+    loadAllPlanes();
+
     // First get rid of empty entities, and compress down the 
     // reverse-maps to cleanup unused/dead space.
     // Only do this if it's not a backup!  For backups, we need to
     // keep the "empty" entities, because an undo might resurrect them
-    if (!isbackup)
+    if (gc)
+    {
         garbageCollect();
+        m_gcRows = getListRows();
+    }
+
+    // Until it's all written the file matches nothing
+    m_savedPath.clear();
     
     HdfFile file;
     file.openForWrite(path);
-    
-    file.createGroup("superpixel");
+    file.setCompression(m_compression, getNumCores());
+    file.setExtendible(extendible);
+
+    // Planes in order, the hash map is not
+    IntVec planes;
+    IntVec rows;
+
     for (TableMap::iterator it = m_superpixel.begin(); it != m_superpixel.end(); ++it)
     {
-        uint32 z = (*it).first;
-        Table* superpixels = (*it).second;
-        char name[64];
-        sprintf(name, "superpixel/%d", z);        
-        file.writeDataset(name, *superpixels);
+        planes.push_back((*it).first);
     }
 
+    std::sort(planes.begin(), planes.end());
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        rows.push_back(m_superpixel[planes[i]]->getRows());
+    }
+
+    HdfPlaneWriter writer(file, planes, rows, NUM_SUPERPIXEL_COLUMNS);
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        writer.writePlane(planes[i], *m_superpixel[planes[i]]);
+    }
+
+    writer.close();
+
     file.writeDataset("segment", *m_segment);
     file.writeDataset("segment_superpixels", *m_segment_sp);
     file.writeDataset("body_index", *m_body_index);
     file.writeDataset("body_segments", *m_body_seg);
+
+    markSaved(path);
 }    
 
-Table* HdfStack::getSuperpixelTable(uint32 plane)
+bool HdfStack::saveChanges(std::string path, uint isbackup)
+{
+    // Garbage collecting moves most lists, that's a full write
+    bool gc = !isbackup && getListRows() > m_gcRows + m_gcRows / 4;
+
+    if (path != m_savedPath || gc)
+    {
+        writeFile(path, !isbackup, true);
+        return false;
+    }
+
+    // HDF5 won't open the file for writing while a lazy stack has it
+    // open for reading.  This also stops the prefetching, which would
+    // change m_superpixel and drop planes under us.
+    if (m_planes)
+    {
+        m_planes->closeFile();
+    }
+
+    // Changed planes in order, a lazy stack has no others in memory
+    IntVec planes;
+
+    for (TableMap::iterator it = m_superpixel.begin(); it != m_superpixel.end(); ++it)
+    {
+        if ((*it).second && (*it).second->isDirty())
+        {
+            planes.push_back((*it).first);
+        }
+    }
+
+    std::sort(planes.begin(), planes.end());
+
+    std::vector<Table*> tables;
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        tables.push_back(m_superpixel[planes[i]]);
+    }
+
+    const char* names[] = { "segment", "segment_superpixels", "body_index",
+        "body_segments" };
+    Table* others[] = { m_segment, m_segment_sp, m_body_index, m_body_seg };
+
+    bool updated = false;
+
+    try
+    {
+        PBT pbt("save changes");
+
+        HdfFile file;
+        file.openForUpdate(path);
+
+        bool fits = file.canUpdatePlanes(planes, tables);
+
+        for (int i = 0; i < 4 && fits; ++i)
+        {
+            fits = !others[i]->isDirty() ||
+                file.canUpdateDataset(names[i], *others[i]);
+        }
+
+        if (fits)
+        {
+            // Half written, the file matches nothing until we're done
+            m_savedPath.clear();
+
+            if (!planes.empty())
+            {
+                file.updatePlanes(planes, tables);
+            }
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (others[i]->isDirty())
+                {
+                    file.updateDataset(names[i], *others[i]);
+                }
+            }
+
+            updated = true;
+        }
+    }
+    catch (...)
+    {
+        if (m_planes)
+        {
+            m_planes->reopenFile();
+        }
+
+        throw;
+    }
+
+    if (m_planes)
+    {
+        m_planes->reopenFile();
+    }
+
+    if (!updated)
+    {
+        writeFile(path, !isbackup, true);
+        return false;
+    }
+
+    markSaved(path);
+    return true;
+}
+
+void HdfStack::markSaved(std::string path)
+{
+    for (TableMap::iterator it = m_superpixel.begin(); it != m_superpixel.end(); ++it)
+    {
+        // A lazy stack's planes not in memory are as in the file
+        if ((*it).second)
+        {
+            (*it).second->clearDirty();
+        }
+    }
+
+    m_segment->clearDirty();
+    m_segment_sp->clearDirty();
+    m_body_index->clearDirty();
+    m_body_seg->clearDirty();
+
+    if (m_planes)
+    {
+        m_planes->markSaved();
+    }
+
+    m_savedPath = path;
+}
+
+uint64 HdfStack::getListRows() const
+{
+    return uint64(m_segment_sp->getRows()) + m_body_seg->getRows();
+}
+
+void HdfStack::setCompression(int level)
+{
+    if (level < 0 || level > 9)
+    {
+        error("compression level=%d is not 0 to 9", level);
+    }
+
+    m_compression = level;
+}
+
+Table* HdfStack::getSuperpixelTable(uint32 plane, bool modify)
 {
+    if (m_planes)
+    {
+        Table* table = m_planes->acquire(plane, modify);
+
+        if (!table)
+        {
+            error("plane=%u does not exist", plane);
+        }
+
+        return table;
+    }
+
     TableMap::iterator it = m_superpixel.find(plane);
        
     if (it == m_superpixel.end())
@@ -1751,6 +2277,32 @@ Table* HdfStack::getSuperpixelTable(uint32 plane)
     }
 }
 
+void HdfStack::releaseSuperpixelTable(uint32 plane)
+{
+    if (m_planes)
+    {
+        m_planes->release(plane);
+    }
+}
+
+void HdfStack::loadAllPlanes()
+{
+    if (m_planes)
+    {
+        PBT pbt("read remaining planes");
+        m_planes->loadAll(getNumCores());
+        delete_ptr(m_planes);
+    }
+}
+
+void HdfStack::prefetchplanes(uint32 zmin, uint32 zmax)
+{
+    if (m_planes)
+    {
+        m_planes->prefetch(std::max(zmin, m_zmin), std::min(zmax, m_zmax));
+    }
+}
+
 uint32 HdfStack::getsegmentbodyid(uint32 segid)
 {
     checkSegment(segid);
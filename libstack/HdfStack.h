@@ -17,6 +17,8 @@ class StackException : public std::runtime_error
 };
 
 class LogFile;
+class PlaneCache;
+class StackSnapshot;
 
 
 //
@@ -38,12 +40,58 @@ class HdfStack
         HdfStack();
         ~HdfStack();
         
-        // Load from HDF5 
-        void load(std::string path);
+        // Load from HDF5.  If checksums is true every dataset which
+        // has a checksum is checked as it is read, and a corrupt one
+        // throws.  That takes seconds, where verify() takes minutes.
+        void load(std::string path, bool checksums = false);
+
+        // Load from HDF5 but leave the superpixel planes in the file,
+        // each is read the first time it's used.  The file stays open
+        // until the stack is saved or deleted.  If budget is not 0,
+        // planes which were read but not modified are dropped again,
+        // least recently used first, to keep them within budget bytes.
+        // save() and verify() read every plane first.
+        void loadLazy(std::string path, uint64 budget = 0,
+            bool checksums = false);
+
+        // Hint that planes zmin to zmax will be wanted soon, a lazily
+        // loaded stack reads them in the background
+        void prefetchplanes(uint32 zmin, uint32 zmax);
+
+        // Load a snapshot from saveSnapshot().  The file is mapped and
+        // the tables use it where it is, so this takes milliseconds
+        // whatever the size of the stack, and pages are read as they
+        // are used.  Modified tables get their own copy of the pages
+        // they change, the file is never written.  If checksums is
+        // true every table is read and checked, which costs as much
+        // as reading the whole file.
+        void loadSnapshot(std::string path, bool checksums = false);
+
+        // Write every table to a snapshot at path, see StackSnapshot.
+        // Unlike save() nothing is garbage collected, the snapshot
+        // holds the stack just as it is.
+        void saveSnapshot(std::string path);
         
         // Load all data from the 3 TXT files, used when compiling 
-        // the stack for the first time.
+        // the stack for the first time.  If superpixel_bounds.bin
+        // exists it is read instead of superpixel_bounds.txt, or the
+        // newer of the two if both exist, see chooseBoundsFile().
         void loadTXT(std::string root, std::string logpath);
+        
+        // Load the 2 mapping TXT files and create the stack using
+        // bounds we already have in memory, for example straight
+        // from the bounds tool.  The caller still owns the bounds
+        // table.
+        void loadTXT(std::string root, std::string logpath, Table* bounds);
+
+        // Load the TXT files like loadTXT(), but keep only planes
+        // zmin to zmax, for one shard of a stack compiled in pieces
+        // and put together with mergestack.  The shard's own bounds
+        // file from bounds --zmin/--zmax is read if there is one.
+        // Zero superpixels are remapped over the whole segment map
+        // first, so every shard gives them the same new segments.
+        void loadTXTShard(std::string root, std::string logpath,
+            uint32 zmin, uint32 zmax);
 
         // Create from Tables.  This is for conversion from TXT files
         // or from legacy Raveler sessions.
@@ -55,6 +103,14 @@ class HdfStack
         void create(Table* bounds, Table* segments, Table* bodies,
             std::string logpath="");
         
+        // Move segments to new bodies, for a stack loaded from HDF5.
+        // bodies is some or all of a newer segment_to_body_map.txt,
+        // [SEGID, BODYID].  Segments not in it keep their body.  The
+        // body lists are rebuilt once, so this is fast however many
+        // segments move.  A moved segment goes at the end of its new
+        // body's list, in the order of the table.
+        void updateBodies(Table* bodies, std::string logpath="");
+        
         // Get bodies added during create() step.  These are bodies
         // which didn't exist in the import tables.  These are bodies
         // we created to old superpixels which were previously part
@@ -62,11 +118,31 @@ class HdfStack
         void getnewbodies(IntVec& result);
         
         // Return true if stack is internally consinstant, otherwise
-        // any errors are printed.
+        // any errors are printed.  The tables are checked on every
+        // core, see StackVerifier.
         bool verify(bool repair = false);
         
         // Write the HDF5 file to the given path
         void save(std::string path, uint isbackup);
+
+        // Save like save(), but if path is the file last loaded or
+        // saved only write what changed since into it, in place.
+        // Returns true if it did, false if it had to write the whole
+        // file.  It does that when the file can't take the changes
+        // in place, and writes it so that later saves can.
+        //
+        // Lists are not garbage collected in place, so until they
+        // have grown by a quarter since they last were this saves
+        // like a backup, keeping empty entities.  Past that, unless
+        // isbackup, the whole file is written garbage collected.
+        // Like save() a failure part way leaves a damaged file.
+        bool saveChanges(std::string path, uint isbackup);
+
+        // Have save() write compressed datasets, deflated at level 1
+        // to 9 on every core, or 0 for uncompressed.  Compressed
+        // stacks load as fast, the chunks are decompressed on every
+        // core too.
+        void setCompression(int level);
         
         // Lowest and highest numbered planes in the stack
         uint32 getzmin() const { return m_zmin; }
@@ -195,11 +271,53 @@ class HdfStack
         void exportstl(uint32 bodyid, const char* path, float zaspect);
 
     private:
+        // Writes the same datasets without an HdfStack in memory
+        friend class StackCompiler;
+
+        // Puts shards from loadTXTShard() together
+        friend class StackMerger;
+
+        // Does the checks for verify()
+        friend class StackVerifier;
+
+        // Holds a plane in memory while it's used
+        friend class PlaneRef;
+
+        // create() after zero superpixels are remapped
+        void createTables(Table* bounds, Table* segments, Table* bodies,
+            std::string logpath);
+
         // Read one TXT file into a table directly
         Table* readtxt(std::string root, std::string fname, int columns);
         
-        // Get a single superpixel table, throw if invalid plane
-        Table* getSuperpixelTable(uint32 plane);
+        // Set m_zmin and m_zmax and list the planes of the file
+        void findPlanes(HdfFile& file, IntVec& planes);
+
+        // Set m_zmin and m_zmax from sorted planes, throw if any
+        // plane in between is missing
+        void setPlaneRange(const IntVec& planes);
+
+        // Read the four tables which aren't planes
+        void readBodyTables(HdfFile& file);
+
+        // Get a single superpixel table, throw if invalid plane.  A
+        // lazy stack reads it if need be, and keeps it until it's
+        // released.  Use a PlaneRef rather than calling these.
+        Table* getSuperpixelTable(uint32 plane, bool modify = false);
+        void releaseSuperpixelTable(uint32 plane);
+
+        // Read the planes a lazy stack hasn't, and stop being lazy
+        void loadAllPlanes();
+
+        // Write the whole file for save() and saveChanges()
+        void writeFile(std::string path, bool gc, bool extendible);
+
+        // The file matches the tables, they and path are what
+        // saveChanges() tracks changes against
+        void markSaved(std::string path);
+
+        // Rows of the two lists of lists, m_segment_sp and m_body_seg
+        uint64 getListRows() const;
         
         // Remove superpixel from segment list
         void removesuperpixel(uint32 plane, uint32 spid);
@@ -223,7 +341,8 @@ class HdfStack
         // We garbage collect before save
         void garbageCollect();
         
-        Table* getSuperpixelTableAndCheckRow(uint32 plane, uint32 spid);
+        // Throw if spid has no bounds in table
+        void checkSuperpixelRow(Table* table, uint32 spid);
         
         void log(const std::string& format, ...);
         void error(const std::string& format, ...);
@@ -242,6 +361,8 @@ class HdfStack
         // Per-superpixel data.  One Table for each section.
         //
         // m_superpixel[z] = Table(maxsp+1, NUM_SUPERPIXEL_COLUMNS)
+        //
+        // When loaded lazily a plane not read yet is NULL.
         TableMap m_superpixel;
     
         enum Superpixel
@@ -293,6 +414,22 @@ class HdfStack
         // Indexed by m_body_index value.  Each "list" of segments 
         // is terminated by END_OF_LIST.
         Table* m_body_seg;
+
+        // Reads the planes when loaded lazily, otherwise NULL
+        PlaneCache* m_planes;
+
+        // The mapped file when loaded from a snapshot, the tables
+        // point into it so it goes after them
+        StackSnapshot* m_snapshot;
+
+        // Deflate level of save(), 0 for none
+        int m_compression;
+
+        // The file the tables were last loaded from or saved to, if
+        // saveChanges() can update it, and getListRows() when the
+        // lists were last garbage collected
+        std::string m_savedPath;
+        uint64 m_gcRows;
         
         LogFile* m_log;
 };
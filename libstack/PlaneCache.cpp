@@ -0,0 +1,370 @@
+#include "PlaneCache.h"
+#include "HdfFile.h"
+#include "HdfStack.h"
+#include "util.h"
+
+#include <algorithm>
+
+PlaneCache::PlaneCache(TableMap& tables, const std::string& path,
+    bool checksums, uint64 budget) :
+    m_tables(tables),
+    m_budget(budget),
+    m_path(path),
+    m_checksums(checksums),
+    m_bytes(0),
+    m_clock(0),
+    m_file(new HdfFile()),
+    m_stopping(false)
+{
+    try
+    {
+        m_file->openForRead(path);
+    }
+    catch (...)
+    {
+        delete m_file;
+        throw;
+    }
+
+    m_file->setCheckChecksums(checksums);
+
+    for (TableMap::iterator it = m_tables.begin(); it != m_tables.end(); ++it)
+    {
+        m_planes[(*it).first] = Plane();
+    }
+}
+
+PlaneCache::~PlaneCache()
+{
+    stopPrefetch();
+    delete m_file;
+}
+
+Table* PlaneCache::acquire(uint32 plane, bool modify)
+{
+    ScopedLock lock(m_mutex);
+
+    PlaneMap::iterator it = m_planes.find(plane);
+
+    if (it == m_planes.end())
+    {
+        return NULL;
+    }
+
+    Plane& entry = (*it).second;
+
+    // Pinned first, so it can't go while we wait for it
+    ++entry.pins;
+
+    try
+    {
+        while (!entry.table)
+        {
+            if (entry.loading)
+            {
+                m_loaded.wait(m_mutex);
+            }
+            else
+            {
+                readPlane(plane, entry);
+            }
+        }
+    }
+    catch (...)
+    {
+        --entry.pins;
+        throw;
+    }
+
+    entry.lastUse = ++m_clock;
+
+    if (modify)
+    {
+        entry.dirty = true;
+    }
+
+    return entry.table;
+}
+
+void PlaneCache::release(uint32 plane)
+{
+    ScopedLock lock(m_mutex);
+
+    Plane& entry = m_planes[plane];
+
+    if (--entry.pins == 0)
+    {
+        evict();
+    }
+}
+
+void PlaneCache::readPlane(uint32 plane, Plane& entry)
+{
+    entry.loading = true;
+    m_mutex.unlock();
+
+    Table* table = NULL;
+
+    try
+    {
+        ScopedLock lock(m_fileMutex);
+
+        if (!m_file)
+        {
+            throw FormatString("%s is not open", m_path.c_str());
+        }
+
+        table = m_file->readPlane(plane);
+        table->clearDirty();
+    }
+    catch (...)
+    {
+        m_mutex.lock();
+        entry.loading = false;
+        m_loaded.broadcast();
+        throw;
+    }
+
+    m_mutex.lock();
+    entry.loading = false;
+    m_loaded.broadcast();
+
+    entry.table = table;
+    entry.bytes = uint64(table->getRows()) * table->getColumns() *
+        sizeof(uint32);
+    entry.lastUse = ++m_clock;
+    m_tables[plane] = table;
+    m_bytes += entry.bytes;
+
+    evict();
+}
+
+void PlaneCache::evict()
+{
+    while (m_budget > 0 && m_bytes > m_budget)
+    {
+        // Least recently used, a scan is cheap next to a read
+        Plane* oldest = NULL;
+        uint32 oldestPlane = 0;
+
+        for (PlaneMap::iterator it = m_planes.begin();
+             it != m_planes.end(); ++it)
+        {
+            Plane& entry = (*it).second;
+
+            if (entry.table && !entry.dirty && entry.pins == 0 &&
+                (!oldest || entry.lastUse < oldest->lastUse))
+            {
+                oldest = &entry;
+                oldestPlane = (*it).first;
+            }
+        }
+
+        if (!oldest)
+        {
+            return;
+        }
+
+        delete oldest->table;
+        oldest->table = NULL;
+        m_tables[oldestPlane] = NULL;
+        m_bytes -= oldest->bytes;
+        oldest->bytes = 0;
+    }
+}
+
+void PlaneCache::prefetch(uint32 zmin, uint32 zmax)
+{
+    ScopedLock lock(m_mutex);
+
+    for (uint32 z = zmin; z <= zmax; ++z)
+    {
+        PlaneMap::iterator it = m_planes.find(z);
+
+        if (it != m_planes.end() && !(*it).second.table)
+        {
+            m_queue.push_back(z);
+        }
+    }
+
+    if (m_threads.empty() && !m_queue.empty())
+    {
+        startThreads(1, prefetchMain, this, m_threads);
+    }
+
+    m_queued.signal();
+}
+
+void* PlaneCache::prefetchMain(void* arg)
+{
+    ((PlaneCache*)arg)->runPrefetch();
+    return NULL;
+}
+
+void PlaneCache::runPrefetch()
+{
+    ScopedLock lock(m_mutex);
+
+    while (true)
+    {
+        while (m_queue.empty() && !m_stopping)
+        {
+            m_queued.wait(m_mutex);
+        }
+
+        if (m_stopping)
+        {
+            return;
+        }
+
+        uint32 plane = m_queue.front();
+        m_queue.pop_front();
+
+        Plane& entry = m_planes[plane];
+
+        if (entry.table || entry.loading)
+        {
+            continue;
+        }
+
+        try
+        {
+            readPlane(plane, entry);
+        }
+        catch (...)
+        {
+            // acquire() will try again and report it
+        }
+    }
+}
+
+void PlaneCache::stopPrefetch()
+{
+    {
+        ScopedLock lock(m_mutex);
+        m_stopping = true;
+        m_queue.clear();
+        m_queued.broadcast();
+    }
+
+    joinThreads(m_threads);
+}
+
+void PlaneCache::loadAll(int threads)
+{
+    stopPrefetch();
+
+    IntVec planes;
+
+    for (PlaneMap::iterator it = m_planes.begin(); it != m_planes.end(); ++it)
+    {
+        if (!(*it).second.table)
+        {
+            planes.push_back((*it).first);
+        }
+    }
+
+    // In file order
+    std::sort(planes.begin(), planes.end());
+
+    if (!m_file && !planes.empty())
+    {
+        throw FormatString("%s is not open", m_path.c_str());
+    }
+
+    std::vector<Table*> tables;
+    m_file->readPlanes(planes, tables, threads);
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        Plane& entry = m_planes[planes[i]];
+        tables[i]->clearDirty();
+        entry.table = tables[i];
+        entry.bytes = uint64(tables[i]->getRows()) * tables[i]->getColumns() *
+            sizeof(uint32);
+        m_tables[planes[i]] = tables[i];
+        m_bytes += entry.bytes;
+    }
+}
+
+void PlaneCache::closeFile()
+{
+    stopPrefetch();
+
+    ScopedLock lock(m_fileMutex);
+    delete m_file;
+    m_file = NULL;
+}
+
+void PlaneCache::reopenFile()
+{
+    // A new HdfFile, the plane index may have changed
+    HdfFile* file = new HdfFile();
+
+    try
+    {
+        file->openForRead(m_path);
+    }
+    catch (...)
+    {
+        delete file;
+        throw;
+    }
+
+    file->setCheckChecksums(m_checksums);
+
+    {
+        ScopedLock lock(m_fileMutex);
+        m_file = file;
+    }
+
+    ScopedLock lock(m_mutex);
+    m_stopping = false;
+}
+
+void PlaneCache::markSaved()
+{
+    ScopedLock lock(m_mutex);
+
+    for (PlaneMap::iterator it = m_planes.begin(); it != m_planes.end(); ++it)
+    {
+        (*it).second.dirty = false;
+    }
+
+    evict();
+}
+
+uint32 PlaneCache::getNumResident()
+{
+    ScopedLock lock(m_mutex);
+
+    uint32 count = 0;
+
+    for (PlaneMap::iterator it = m_planes.begin(); it != m_planes.end(); ++it)
+    {
+        if ((*it).second.table)
+        {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+uint64 PlaneCache::getResidentBytes()
+{
+    ScopedLock lock(m_mutex);
+    return m_bytes;
+}
+
+PlaneRef::PlaneRef(HdfStack& stack, uint32 plane, bool modify) :
+    m_stack(stack),
+    m_plane(plane),
+    m_table(stack.getSuperpixelTable(plane, modify))
+{
+}
+
+PlaneRef::~PlaneRef()
+{
+    m_stack.releaseSuperpixelTable(m_plane);
+}
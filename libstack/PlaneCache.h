@@ -0,0 +1,146 @@
+//
+// PlaneCache.h
+//
+
+#pragma once
+
+#include <deque>
+
+#include "common.h"
+#include "Threads.h"
+
+class HdfStack;
+
+//
+// Superpixel tables of a lazily loaded HdfStack, see
+// HdfStack::loadLazy().
+//
+// The file stays open and a plane is read the first time it's
+// asked for.  While a caller uses a plane it is pinned, use PlaneRef
+// for that.  If there is a budget, once the planes in memory add up
+// to more than it the least recently used planes which are not
+// pinned and not modified are dropped, to be read again if they're
+// needed.  Modified planes stay until the stack is saved.
+//
+// It's safe to use from several threads.  HDF5 is not thread safe,
+// so only one plane is read at a time, but planes already in memory
+// can be used while another is read.
+//
+class PlaneCache
+{
+public:
+    // tables has an entry for each plane, NULL as none are read yet.
+    // budget is in bytes, 0 to keep every plane once read.
+    PlaneCache(TableMap& tables, const std::string& path, bool checksums,
+        uint64 budget);
+    ~PlaneCache();
+
+    // Plane's table, read if need be and pinned until release().
+    // NULL if there is no such plane.
+    Table* acquire(uint32 plane, bool modify);
+    void release(uint32 plane);
+
+    // Read planes zmin to zmax on a background thread, if they are
+    // not in memory already.  A hint, planes which fail to read are
+    // left for acquire() to report.
+    void prefetch(uint32 zmin, uint32 zmax);
+
+    // Read every plane not in memory, ignoring the budget.  Nothing
+    // else may use the cache during or after this.
+    void loadAll(int threads);
+
+    // Close the file so it can be written, and open it again after.
+    // closeFile() stops the prefetching first, so in between the
+    // tables only change if the caller changes them.  Nothing else
+    // may use the cache in between.
+    void closeFile();
+    void reopenFile();
+
+    // The planes in memory were saved, modified ones may be dropped
+    // again
+    void markSaved();
+
+    uint32 getNumResident();
+    uint64 getResidentBytes();
+
+private:
+    struct Plane
+    {
+        Plane() : table(NULL), bytes(0), pins(0), lastUse(0),
+            dirty(false), loading(false) {}
+
+        Table* table;
+        uint64 bytes;
+        uint32 pins;
+        uint64 lastUse;
+        bool dirty;
+
+        // Being read by some thread with m_mutex unlocked
+        bool loading;
+    };
+
+    typedef ext::hash_map<uint32, Plane> PlaneMap;
+
+    // Called with m_mutex locked, unlocks it for the read
+    void readPlane(uint32 plane, Plane& entry);
+
+    // Drop planes until we're in the budget, m_mutex locked
+    void evict();
+
+    static void* prefetchMain(void* arg);
+    void runPrefetch();
+    void stopPrefetch();
+
+    TableMap& m_tables;
+    uint64 m_budget;
+    std::string m_path;
+    bool m_checksums;
+
+    // Guards the planes, m_tables and the prefetch queue.  Every
+    // plane is in m_planes from the start, so the map is never
+    // resized and Plane references stay valid.
+    Mutex m_mutex;
+    PlaneMap m_planes;
+    uint64 m_bytes;
+    uint64 m_clock;
+
+    // Signalled when a read finishes
+    Condition m_loaded;
+
+    // HDF5 may only be used by one thread at a time
+    Mutex m_fileMutex;
+    HdfFile* m_file;
+
+    std::deque<uint32> m_queue;
+    Condition m_queued;
+    ThreadList m_threads;
+    bool m_stopping;
+};
+
+//
+// Holds one plane's table in memory for the life of a block:
+//
+// {
+//     PlaneRef table(*this, plane);
+//     table->getValue(spid, SUPERPIXEL_X);
+// }
+//
+// modify marks the plane as changed, so a lazy stack keeps it.
+//
+class PlaneRef
+{
+public:
+    PlaneRef(HdfStack& stack, uint32 plane, bool modify = false);
+    ~PlaneRef();
+
+    Table* operator->() const { return m_table; }
+    Table* get() const { return m_table; }
+
+private:
+    PlaneRef(const PlaneRef&);
+    PlaneRef& operator=(const PlaneRef&);
+
+    HdfStack& m_stack;
+    uint32 m_plane;
+    Table* m_table;
+};
@@ -0,0 +1,148 @@
+#include "RadixSort.h"
+#include "Threads.h"
+
+#include <algorithm>
+
+static const int s_DIGIT_BITS = 11;
+static const size_t s_BUCKETS = size_t(1) << s_DIGIT_BITS;
+static const int s_PASSES = (64 + s_DIGIT_BITS - 1) / s_DIGIT_BITS;
+
+// Below this std::sort is faster than setting up the passes
+static const size_t s_MIN_RADIX = 1 << 16;
+
+//
+// State of one pass, shared by its threads.
+//
+struct RadixJob
+{
+    uint64* source;
+    uint64* dest;
+    size_t size;
+    int shift;
+    int threads;
+
+    // counts[t * s_BUCKETS + digit], turned into offsets before
+    // the scatter
+    std::vector<size_t> counts;
+
+    Mutex mutex;
+    int nextThread;
+    bool scatter;
+};
+
+static inline size_t getDigit(uint64 key, int shift)
+{
+    return size_t(key >> shift) & (s_BUCKETS - 1);
+}
+
+static void* radixWorkerMain(void* arg)
+{
+    RadixJob* job = (RadixJob*)arg;
+    int t;
+
+    {
+        ScopedLock lock(job->mutex);
+        t = job->nextThread++;
+    }
+
+    size_t begin = job->size / job->threads * t;
+    size_t end = t == job->threads - 1 ?
+        job->size : job->size / job->threads * (t + 1);
+
+    size_t* counts = &job->counts[t * s_BUCKETS];
+
+    if (!job->scatter)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            ++counts[getDigit(job->source[i], job->shift)];
+        }
+    }
+    else
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            uint64 key = job->source[i];
+            job->dest[counts[getDigit(key, job->shift)]++] = key;
+        }
+    }
+
+    return NULL;
+}
+
+static void runPass(RadixJob& job)
+{
+    job.nextThread = 0;
+
+    if (job.threads > 1)
+    {
+        runThreads(job.threads, radixWorkerMain, &job);
+    }
+    else
+    {
+        radixWorkerMain(&job);
+    }
+}
+
+void radixSort(std::vector<uint64>& keys, int threads)
+{
+    if (keys.size() < s_MIN_RADIX)
+    {
+        std::sort(keys.begin(), keys.end());
+        return;
+    }
+
+    // Only the bits which differ between keys need sorting on
+    uint64 varying = 0;
+
+    for (size_t i = 1; i < keys.size(); ++i)
+    {
+        varying |= keys[i] ^ keys[0];
+    }
+
+    std::vector<uint64> buffer(keys.size());
+
+    RadixJob job;
+    job.size = keys.size();
+    job.threads = std::max(1, std::min(threads, int(keys.size() / s_MIN_RADIX)));
+    job.source = &keys[0];
+    job.dest = &buffer[0];
+
+    for (int pass = 0; pass < s_PASSES; ++pass)
+    {
+        job.shift = pass * s_DIGIT_BITS;
+
+        if (getDigit(varying, job.shift) == 0)
+        {
+            // Every key has the same digit here
+            continue;
+        }
+
+        job.counts.assign(job.threads * s_BUCKETS, 0);
+        job.scatter = false;
+        runPass(job);
+
+        // Digit major, thread minor, so equal digits keep their order
+        size_t offset = 0;
+
+        for (size_t digit = 0; digit < s_BUCKETS; ++digit)
+        {
+            for (int t = 0; t < job.threads; ++t)
+            {
+                size_t count = job.counts[t * s_BUCKETS + digit];
+                job.counts[t * s_BUCKETS + digit] = offset;
+                offset += count;
+            }
+        }
+
+        job.scatter = true;
+        runPass(job);
+
+        std::swap(job.source, job.dest);
+    }
+
+    if (job.source != &keys[0])
+    {
+        keys.swap(buffer);
+    }
+}
@@ -0,0 +1,32 @@
+//
+// RadixSort.h
+//
+
+#pragma once
+
+#include "common.h"
+
+//
+// Sort 64-bit keys in place, with an LSD radix sort spread over
+// the given number of threads.
+//
+// Pairs of uint32 ids are packed into one key, high id first, so
+// sorting keys sorts by the high id and then the low one.  This
+// replaces a hash_map of sets, which costs a heap node per entry,
+// with two flat arrays of 8 bytes per entry.
+//
+// Each pass sorts on 11 bits: every thread counts the digits of
+// its part of the array, then scatters its part using offsets
+// which keep the sort stable.  Passes over digits which are the
+// same in every key are skipped, so small ids sort in few passes.
+//
+void radixSort(std::vector<uint64>& keys, int threads);
+
+// Pack two ids into a key which sorts by high then low
+inline uint64 makeKey(uint32 high, uint32 low)
+{
+    return (uint64(high) << 32) | low;
+}
+
+inline uint32 keyHigh(uint64 key) { return uint32(key >> 32); }
+inline uint32 keyLow(uint64 key) { return uint32(key); }
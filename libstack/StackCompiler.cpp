@@ -0,0 +1,768 @@
+#include "StackCompiler.h"
+#include "HdfStack.h"
+#include "HdfFile.h"
+#include "BoundsFile.h"
+#include "TxtFile.h"
+#include "RadixSort.h"
+#include "Threads.h"
+#include "LogFile.h"
+#include "timers.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+
+// Sorts alive at once: at most four, while the planes are written
+static const size_t s_SORTS = 4;
+
+StackCompiler::StackCompiler(const std::string& root,
+    const std::string& logpath, size_t budget, const std::string& scratch) :
+    m_root(root),
+    m_logpath(logpath),
+    m_scratch(scratch),
+    m_share(budget / s_SORTS),
+    m_compression(0),
+    m_bounds(NULL),
+    m_map(NULL),
+    m_bodies(NULL),
+    m_members(NULL),
+    m_bodySegments(NULL),
+    m_maxsegid(0),
+    m_maxbodyid(0),
+    m_bodyRows(0),
+    m_segmentRows(0),
+    m_bodyIndexRows(0)
+{
+}
+
+StackCompiler::~StackCompiler()
+{
+    delete m_bounds;
+    delete m_map;
+    delete m_bodies;
+    delete m_members;
+    delete m_bodySegments;
+}
+
+void StackCompiler::compile(const std::string& path)
+{
+    scanIds();
+    sortBounds();
+    sortMaps();
+
+    // Catch bad input before creating anything
+    checkBodies();
+
+    // Write aside so a failed compile never leaves a stack.h5
+    std::string tmppath = path + ".tmp";
+
+    try
+    {
+        HdfFile file;
+        file.openForWrite(tmppath);
+        file.setCompression(m_compression, getNumCores());
+
+        writePlanes(file);
+        writeSegments(file);
+        writeBodies(file);
+    }
+    catch (...)
+    {
+        unlink(tmppath.c_str());
+        throw;
+    }
+
+    if (rename(tmppath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmppath.c_str());
+        throw FormatString("Cannot rename %s", tmppath.c_str());
+    }
+}
+
+//
+// Remapping zero superpixels needs the highest segid and bodyid
+// before the first row is sorted, see remapZeroSuperpixels().
+//
+void StackCompiler::scanIds()
+{
+    PBT pbt("scan ids");
+
+    uint32 row[NUM_TXT_SEGMENT_COLUMNS];
+
+    TxtFileReader segments;
+    segments.open(join(m_root, SEGMENT_FILE), NUM_TXT_SEGMENT_COLUMNS);
+
+    while (segments.readRow(row))
+    {
+        m_maxsegid = std::max(m_maxsegid, row[TXT_SEGMENT_SEGID]);
+    }
+
+    TxtFileReader bodies;
+    bodies.open(join(m_root, BODY_FILE), NUM_TXT_BODY_COLUMNS);
+
+    while (bodies.readRow(row))
+    {
+        m_maxbodyid = std::max(m_maxbodyid, row[TXT_BODY_BODYID]);
+        ++m_bodyRows;
+    }
+}
+
+void StackCompiler::sortBounds()
+{
+    m_bounds = new ExternalSorter<BoundsRecord>("bounds", m_scratch, m_share);
+
+    uint32 row[NUM_TXT_BOUNDS_COLUMNS];
+    BoundsRecord record;
+    record.row = 0;
+
+    std::string binpath = join(m_root, BOUNDS_BIN_FILE);
+    std::string path = chooseBoundsFile(binpath, join(m_root, BOUNDS_FILE));
+
+    // Same choice of file as HdfStack::loadTXT()
+    if (path == binpath)
+    {
+        PBT pbt("sort %s", BOUNDS_BIN_FILE);
+
+        BoundsFileReader reader;
+        reader.open(binpath);
+
+        while (reader.readRows(row))
+        {
+            addBounds(row, record);
+        }
+
+        m_bounds->finish();
+    }
+    else
+    {
+        PBT pbt("sort %s", BOUNDS_FILE);
+
+        TxtFileReader reader;
+        reader.open(join(m_root, BOUNDS_FILE), NUM_TXT_BOUNDS_COLUMNS);
+
+        while (reader.readRow(row))
+        {
+            addBounds(row, record);
+        }
+
+        m_bounds->finish();
+    }
+
+    printf("Sorted %llu bounds in %lu runs\n", m_bounds->size(),
+        (unsigned long)m_bounds->getRuns());
+}
+
+void StackCompiler::addBounds(const uint32* row, BoundsRecord& record)
+{
+    uint32 z = row[TXT_BOUNDS_Z];
+    uint32 spid = row[TXT_BOUNDS_SPID];
+
+    record.key = makeKey(z, spid);
+    memcpy(record.values, &row[TXT_BOUNDS_X], sizeof(record.values));
+    m_bounds->add(record);
+    ++record.row;
+
+    uint32& rows = m_planeRows[z];
+    rows = std::max(rows, spid + 1);
+}
+
+//
+// Sort the segment map by (plane, spid) and the body map by segid.
+// Zero superpixels get a new segment and body as they are read,
+// just as remapZeroSuperpixels() does to the Tables.
+//
+void StackCompiler::sortMaps()
+{
+    PBT pbt("sort %s %s", SEGMENT_FILE, BODY_FILE);
+
+    m_map = new ExternalSorter<MapRecord>("segments", m_scratch, m_share);
+    m_bodies = new ExternalSorter<BodyRecord>("bodies", m_scratch, m_share);
+
+    LogFile log(m_logpath, "zerosuperpixels.txt");
+
+    uint32 row[NUM_TXT_SEGMENT_COLUMNS];
+    uint32 maxsegid = m_maxsegid;
+    uint32 maxbodyid = m_maxbodyid;
+    int newseg = 0;
+
+    MapRecord record;
+    record.row = 0;
+
+    TxtFileReader segments;
+    segments.open(join(m_root, SEGMENT_FILE), NUM_TXT_SEGMENT_COLUMNS);
+
+    while (segments.readRow(row))
+    {
+        uint32 z = row[TXT_SEGMENT_Z];
+        uint32 spid = row[TXT_SEGMENT_SPID];
+
+        record.key = makeKey(z, spid);
+        record.segid = row[TXT_SEGMENT_SEGID];
+
+        // If a superpixel other than zero is mapped to zero segment
+        if (spid != 0 && record.segid == 0)
+        {
+            ++newseg;
+
+            record.segid = ++maxsegid;
+            ++maxbodyid;
+
+            // New body rows go after those of the file
+            BodyRecord body;
+            body.segid = maxsegid;
+            body.bodyid = maxbodyid;
+            body.row = m_bodyRows + newseg - 1;
+            m_bodies->add(body);
+
+            log.log("%u %u %u %u", z, spid, maxsegid, maxbodyid);
+        }
+
+        m_map->add(record);
+        ++record.row;
+    }
+
+    if (newseg > 0)
+    {
+        printf("WARN: Remapped %d zero superpixels\n", newseg);
+        printf("WARN: See %s\n", log.getFilename());
+    }
+
+    TxtFileReader bodies;
+    bodies.open(join(m_root, BODY_FILE), NUM_TXT_BODY_COLUMNS);
+
+    BodyRecord body;
+    body.row = 0;
+
+    while (bodies.readRow(row))
+    {
+        body.segid = row[TXT_BODY_SEGID];
+        body.bodyid = row[TXT_BODY_BODYID];
+        m_bodies->add(body);
+        ++body.row;
+    }
+
+    m_map->finish();
+    m_bodies->finish();
+
+    printf("Sorted %llu segment map rows in %lu runs\n", m_map->size(),
+        (unsigned long)m_map->getRuns());
+    printf("Sorted %llu body map rows in %lu runs\n", m_bodies->size(),
+        (unsigned long)m_bodies->getRuns());
+}
+
+void StackCompiler::checkBodies()
+{
+    BodyRecord body;
+    bool first = true;
+    uint32 segid = 0;
+
+    // need to be sure segment IDs don't appear twice in the list
+    while (m_bodies->next(body))
+    {
+        if (!first && body.segid == segid)
+        {
+            printf("Error: segment %u mapped to more than one body in segment_to_body_map.txt; quitting.\n", segid);
+            exit(1);
+        }
+
+        first = false;
+        segid = body.segid;
+    }
+
+    m_bodies->rewind();
+}
+
+//
+// Merge the bounds with the segment map one plane at a time, and
+// write each plane's superpixel table.  Superpixels without a
+// volume are garbage collected here, as HdfStack::save() would.
+//
+void StackCompiler::writePlanes(HdfFile& file)
+{
+    PBT pbt("write planes");
+
+    m_members = new ExternalSorter<MemberRecord>("members", m_scratch,
+        m_share);
+
+    // Every plane with bounds, in the order they are merged
+    IntVec planes;
+    IntVec rows;
+
+    for (IntMap::iterator it = m_planeRows.begin(); it != m_planeRows.end();
+         ++it)
+    {
+        planes.push_back((*it).first);
+    }
+
+    std::sort(planes.begin(), planes.end());
+
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        rows.push_back(m_planeRows[planes[i]]);
+    }
+
+    HdfPlaneWriter writer(file, planes, rows,
+        HdfStack::NUM_SUPERPIXEL_COLUMNS);
+
+    LogFile orphans(m_logpath, "superpixels-in-bounds-only.txt",
+        "# z spid volume");
+    LogFile phantoms(m_logpath, "superpixels-in-map-only.txt",
+        "# z spid segid");
+
+    uint64 dropOrphans = 0;
+    uint64 keepBounds = 0;
+    uint64 dropPhantoms = 0;
+    uint64 keepMap = 0;
+
+    uint32 maxsegid = 0;
+
+    BoundsRecord bounds;
+    MapRecord map = MapRecord();
+    bool haveBounds = m_bounds->next(bounds);
+    bool haveMap = m_map->next(map);
+
+    std::vector<BoundsRecord> plane;
+
+    while (haveBounds || haveMap)
+    {
+        uint32 z = UINT_MAX;
+
+        if (haveBounds)
+        {
+            z = keyHigh(bounds.key);
+        }
+
+        if (haveMap)
+        {
+            z = std::min(z, keyHigh(map.key));
+        }
+
+        plane.clear();
+
+        while (haveBounds && keyHigh(bounds.key) == z)
+        {
+            plane.push_back(bounds);
+            haveBounds = m_bounds->next(bounds);
+        }
+
+        // A plane with no bounds at all has only phantoms
+        if (plane.empty())
+        {
+            while (haveMap && keyHigh(map.key) == z)
+            {
+                phantoms.log("%u %u %u", z, keyLow(map.key), map.segid);
+                ++dropPhantoms;
+                haveMap = m_map->next(map);
+            }
+
+            continue;
+        }
+
+        // Sized by maxspid, which sorts last
+        Table table(keyLow(plane.back().key) + 1,
+            HdfStack::NUM_SUPERPIXEL_COLUMNS, 0.0);
+
+        size_t i = 0;
+
+        while (i < plane.size() || (haveMap && keyHigh(map.key) == z))
+        {
+            uint64 key = ~0ULL;
+
+            if (i < plane.size())
+            {
+                key = plane[i].key;
+            }
+
+            if (haveMap && keyHigh(map.key) == z)
+            {
+                key = std::min(key, map.key);
+            }
+
+            uint32 spid = keyLow(key);
+
+            // Bounds rows of this superpixel are [i, end)
+            size_t end = i;
+
+            while (end < plane.size() && plane[end].key == key)
+            {
+                ++end;
+            }
+
+            bool mapped = haveMap && map.key == key;
+
+            if (!mapped)
+            {
+                // Drop it, this (z, spid) appears in the bounds but not
+                // in the segment table.
+                for (size_t j = i; j < end; ++j)
+                {
+                    orphans.log("%u %u %u", z, spid, plane[j].values[4]);
+                    ++dropOrphans;
+                }
+            }
+            else if (i == end)
+            {
+                // In the segment map but we have no bounds for it
+                while (haveMap && map.key == key)
+                {
+                    phantoms.log("%u %u %u", z, spid, map.segid);
+                    ++dropPhantoms;
+                    haveMap = m_map->next(map);
+                }
+            }
+            else
+            {
+                // Later rows win, as when create() copies row by row
+                keepBounds += end - i;
+
+                for (uint32 j = 0; j < 5; ++j)
+                {
+                    table.setValue(spid, j, plane[end - 1].values[j]);
+                }
+
+                while (haveMap && map.key == key)
+                {
+                    table.setValue(spid, HdfStack::SUPERPIXEL_SEGID,
+                        map.segid);
+                    maxsegid = std::max(maxsegid, map.segid);
+                    ++keepMap;
+                    haveMap = m_map->next(map);
+                }
+            }
+
+            i = end;
+        }
+
+        // Hand each superpixel to its segment, and clear the ones
+        // garbageCollect() would delete for having no pixels
+        for (uint32 spid = 0; spid < table.getRows(); ++spid)
+        {
+            uint32 segid = table.getValue(spid, HdfStack::SUPERPIXEL_SEGID);
+
+            if (segid == EMPTY_VALUE)
+            {
+                continue;
+            }
+
+            MemberRecord member;
+            member.segid = segid;
+            member.spid = spid;
+            member.z = z;
+            member.empty =
+                table.getValue(spid, HdfStack::SUPERPIXEL_X) != EMPTY_VALUE &&
+                table.getValue(spid, HdfStack::SUPERPIXEL_VOLUME) == 0;
+
+            m_members->add(member);
+
+            if (member.empty)
+            {
+                for (uint32 j = 0; j < table.getColumns(); ++j)
+                {
+                    table.setValue(spid, j, EMPTY_VALUE);
+                }
+            }
+        }
+
+        writer.writePlane(z, table);
+    }
+
+    writer.close();
+
+    if (dropOrphans > 0)
+    {
+        printf("WARN: Drop %llu orphaned superpixels and keep %llu\n",
+            dropOrphans, keepBounds);
+        printf("WARN: See %s\n", orphans.getFilename());
+    }
+
+    if (dropPhantoms > 0)
+    {
+        printf("Drop %llu phantom superpixels and keep %llu\n",
+            dropPhantoms, keepMap);
+        printf("WARN: See %s\n", phantoms.getFilename());
+    }
+
+    m_segmentRows = maxsegid + 1;
+
+    delete m_bounds;
+    m_bounds = NULL;
+    delete m_map;
+    m_map = NULL;
+
+    m_members->finish();
+}
+
+//
+// Merge the superpixels of each segment with the body map, and write
+// the segment table and its lists of superpixels.
+//
+void StackCompiler::writeSegments(HdfFile& file)
+{
+    PBT pbt("write segments");
+
+    // Size segment_superpixels: the superpixels which survive garbage
+    // collection plus a terminator for each segment that has any
+    uint64 spRows = 0;
+    uint32 lastsegid = EMPTY_VALUE;
+    MemberRecord member = MemberRecord();
+
+    while (m_members->next(member))
+    {
+        if (!member.empty)
+        {
+            if (member.segid != lastsegid)
+            {
+                ++spRows;
+                lastsegid = member.segid;
+            }
+
+            ++spRows;
+        }
+    }
+
+    m_members->rewind();
+
+    m_bodySegments = new ExternalSorter<BodySegmentRecord>("body_segments",
+        m_scratch, m_share);
+
+    HdfTableWriter segments(file, "segment", m_segmentRows,
+        HdfStack::NUM_SEGMENT_COLUMNS);
+    HdfTableWriter superpixels(file, "segment_superpixels", spRows, 1);
+
+    LogFile empty_segments(m_logpath, "empty-segments.txt", "# segid");
+
+    const uint32 empty[HdfStack::NUM_SEGMENT_COLUMNS] =
+        { EMPTY_VALUE, EMPTY_VALUE, EMPTY_VALUE };
+
+    uint32 drop = 0;
+    uint32 keep = 0;
+    uint32 maxbodyid = 0;
+    uint32 spindex = 0;
+
+    BodyRecord body = BodyRecord();
+    bool haveMember = m_members->next(member);
+    bool haveBody = m_bodies->next(body);
+
+    while (haveMember || haveBody)
+    {
+        uint32 segid = EMPTY_VALUE;
+
+        if (haveMember)
+        {
+            segid = member.segid;
+        }
+
+        if (haveBody)
+        {
+            segid = std::min(segid, body.segid);
+        }
+
+        // At most one body row per segment, see checkBodies()
+        BodySegmentRecord bodySegment;
+        bodySegment.segid = segid;
+        bodySegment.bodyid = EMPTY_VALUE;
+        bodySegment.row = 0;
+
+        bool hasBody = haveBody && body.segid == segid;
+
+        if (hasBody)
+        {
+            bodySegment.bodyid = body.bodyid;
+            bodySegment.row = body.row;
+            haveBody = m_bodies->next(body);
+        }
+
+        if (!haveMember || member.segid != segid)
+        {
+            // Segment was empty, its body might be deleted if it has
+            // no other segments
+            drop++;
+            empty_segments.log("%u", segid);
+
+            bodySegment.state = SEGMENT_EMPTY;
+            m_bodySegments->add(bodySegment);
+            continue;
+        }
+
+        // Segments with no superpixels have empty rows
+        while (segments.getRow() < segid)
+        {
+            segments.writeRow(empty);
+        }
+
+        uint32 row[HdfStack::NUM_SEGMENT_COLUMNS] =
+            { EMPTY_VALUE, EMPTY_VALUE, spindex };
+
+        while (haveMember && member.segid == segid)
+        {
+            row[HdfStack::SEGMENT_Z] = member.z;
+
+            if (!member.empty)
+            {
+                superpixels.writeValue(member.spid);
+                ++spindex;
+            }
+
+            haveMember = m_members->next(member);
+        }
+
+        if (spindex > row[HdfStack::SEGMENT_SPINDEX])
+        {
+            superpixels.writeValue(END_OF_LIST);
+            ++spindex;
+
+            row[HdfStack::SEGMENT_BODYID] = bodySegment.bodyid;
+            segments.writeRow(row);
+
+            bodySegment.state = SEGMENT_LIVE;
+        }
+        else
+        {
+            // Every superpixel was empty so garbage collection
+            // deletes the segment
+            segments.writeRow(empty);
+
+            bodySegment.state = SEGMENT_COLLECTED;
+        }
+
+        if (hasBody)
+        {
+            keep++;
+            maxbodyid = std::max(maxbodyid, bodySegment.bodyid);
+            m_bodySegments->add(bodySegment);
+        }
+    }
+
+    while (segments.getRow() < m_segmentRows)
+    {
+        segments.writeRow(empty);
+    }
+
+    segments.close();
+    superpixels.close();
+
+    if (drop > 0)
+    {
+        printf("INFO: dropped %u empty segments, keep %u\n", drop, keep);
+        printf("WARN: See %s\n", empty_segments.getFilename());
+    }
+
+    m_bodyIndexRows = maxbodyid + 1;
+
+    delete m_members;
+    m_members = NULL;
+    delete m_bodies;
+    m_bodies = NULL;
+
+    m_bodySegments->finish();
+}
+
+//
+// Write the body index and each body's list of segments, in the
+// order of the body map.
+//
+void StackCompiler::writeBodies(HdfFile& file)
+{
+    PBT pbt("write bodies");
+
+    // Size body_segments: the segments which survive garbage
+    // collection plus a terminator for each body that has any
+    uint64 segRows = 0;
+    uint32 lastbodyid = EMPTY_VALUE;
+    BodySegmentRecord record;
+
+    while (m_bodySegments->next(record))
+    {
+        if (record.state == SEGMENT_LIVE)
+        {
+            if (record.bodyid != lastbodyid)
+            {
+                ++segRows;
+                lastbodyid = record.bodyid;
+            }
+
+            ++segRows;
+        }
+    }
+
+    m_bodySegments->rewind();
+
+    HdfTableWriter index(file, "body_index", m_bodyIndexRows, 1);
+    HdfTableWriter segments(file, "body_segments", segRows, 1);
+
+    LogFile empty_bodies(m_logpath, "empty-bodies.txt", "# bodyid");
+
+    uint32 drop = 0;
+    uint32 keep = 0;
+    uint32 bodyindex = 0;
+
+    bool haveRecord = m_bodySegments->next(record);
+
+    while (haveRecord)
+    {
+        uint32 bodyid = record.bodyid;
+        uint32 first = bodyindex;
+        bool kept = false;
+
+        while (haveRecord && record.bodyid == bodyid)
+        {
+            if (record.state != SEGMENT_EMPTY)
+            {
+                kept = true;
+            }
+
+            if (record.state == SEGMENT_LIVE)
+            {
+                segments.writeValue(record.segid);
+                ++bodyindex;
+            }
+
+            haveRecord = m_bodySegments->next(record);
+        }
+
+        if (!kept)
+        {
+            // Only empty segments mapped to this body
+            drop++;
+            empty_bodies.log("%u", bodyid);
+            continue;
+        }
+
+        keep++;
+
+        while (index.getRow() < bodyid)
+        {
+            index.writeValue(EMPTY_VALUE);
+        }
+
+        if (bodyindex > first)
+        {
+            segments.writeValue(END_OF_LIST);
+            ++bodyindex;
+            index.writeValue(first);
+        }
+        else
+        {
+            // Every segment was garbage collected, so is the body
+            index.writeValue(EMPTY_VALUE);
+        }
+    }
+
+    while (index.getRow() < m_bodyIndexRows)
+    {
+        index.writeValue(EMPTY_VALUE);
+    }
+
+    index.close();
+    segments.close();
+
+    if (drop > 0)
+    {
+        printf("WARN: dropped %u empty bodies, keep %u\n", drop, keep);
+        printf("WARN: See %s\n", empty_bodies.getFilename());
+    }
+
+    delete m_bodySegments;
+    m_bodySegments = NULL;
+}
@@ -0,0 +1,177 @@
+//
+// StackCompiler.h
+//
+
+#pragma once
+
+#include "common.h"
+#include "ExternalSort.h"
+
+//
+// Compiles the TXT files of a stack straight to stack.h5 within a
+// memory budget, for stacks too big for HdfStack::loadTXT().
+//
+// The result holds the same stack as loadTXT() followed by save().
+// The difference is that lists in segment_superpixels and
+// body_segments may be laid out in a different order.
+//
+// No input file is ever held in memory:
+//
+// - The bounds and the segment map are sorted by (plane, spid) with
+//   ExternalSorter.  It spills sorted runs to scratch files once a
+//   sort is over its share of the budget.
+// - The two sorts are merged a plane at a time, and each plane's
+//   superpixel table is written as soon as it is done.
+// - The segment and body tables are built the same way, from
+//   superpixels sorted by segid and segments sorted by bodyid.
+//   They are written a row at a time with HdfTableWriter.
+//
+// Only one plane's superpixel table has to fit in memory besides the
+// budget.
+//
+// The log files match those of HdfStack::create(), except that each
+// is in sorted order instead of the order of the input rows.
+//
+class StackCompiler
+{
+public:
+    // Compile root's TXT files, logs go in logpath and scratch files
+    // in scratch
+    StackCompiler(const std::string& root, const std::string& logpath,
+        size_t budget, const std::string& scratch);
+    ~StackCompiler();
+
+    // Write the stack to path, throws std::string on failure
+    void compile(const std::string& path);
+
+    // Deflate the datasets at level 1 to 9, 0 for none
+    void setCompression(int level) { m_compression = level; }
+
+private:
+    // A row of the bounds, by (plane, spid) then row
+    struct BoundsRecord
+    {
+        uint64 key;
+        uint64 row;
+
+        // X Y WIDTH HEIGHT VOLUME
+        uint32 values[5];
+
+        bool operator<(const BoundsRecord& other) const
+        {
+            return key < other.key || (key == other.key && row < other.row);
+        }
+    };
+
+    // A row of the segment map, by (plane, spid) then row
+    struct MapRecord
+    {
+        uint64 key;
+        uint64 row;
+        uint32 segid;
+
+        bool operator<(const MapRecord& other) const
+        {
+            return key < other.key || (key == other.key && row < other.row);
+        }
+    };
+
+    // A row of the body map, by segid then row
+    struct BodyRecord
+    {
+        uint32 segid;
+        uint32 bodyid;
+        uint64 row;
+
+        bool operator<(const BodyRecord& other) const
+        {
+            return segid < other.segid ||
+                (segid == other.segid && row < other.row);
+        }
+    };
+
+    // A superpixel of a segment, by segid then spid
+    struct MemberRecord
+    {
+        uint32 segid;
+        uint32 spid;
+        uint32 z;
+
+        // No volume, so garbage collection drops it
+        uint32 empty;
+
+        bool operator<(const MemberRecord& other) const
+        {
+            if (segid != other.segid) return segid < other.segid;
+            if (spid != other.spid) return spid < other.spid;
+            return z < other.z;
+        }
+    };
+
+    // A segment of a body, by bodyid then row of the body map
+    struct BodySegmentRecord
+    {
+        uint32 bodyid;
+        uint32 segid;
+        uint64 row;
+        uint32 state;
+
+        bool operator<(const BodySegmentRecord& other) const
+        {
+            return bodyid < other.bodyid ||
+                (bodyid == other.bodyid && row < other.row);
+        }
+    };
+
+    // BodySegmentRecord::state
+    enum SegmentState
+    {
+        // Segment has superpixels which survive garbage collection
+        SEGMENT_LIVE,
+
+        // Segment has superpixels, but all of them are empty
+        SEGMENT_COLLECTED,
+
+        // Segment has no superpixels at all
+        SEGMENT_EMPTY
+    };
+
+    void scanIds();
+    void sortBounds();
+    void addBounds(const uint32* row, BoundsRecord& record);
+    void sortMaps();
+    void checkBodies();
+
+    void writePlanes(HdfFile& file);
+    void writeSegments(HdfFile& file);
+    void writeBodies(HdfFile& file);
+
+    std::string m_root;
+    std::string m_logpath;
+    std::string m_scratch;
+
+    // Budget of each sort, a few are alive at once
+    size_t m_share;
+
+    int m_compression;
+
+    ExternalSorter<BoundsRecord>* m_bounds;
+    ExternalSorter<MapRecord>* m_map;
+    ExternalSorter<BodyRecord>* m_bodies;
+    ExternalSorter<MemberRecord>* m_members;
+    ExternalSorter<BodySegmentRecord>* m_bodySegments;
+
+    // Highest ids in the TXT files, for remapping zero superpixels
+    uint32 m_maxsegid;
+    uint32 m_maxbodyid;
+    uint64 m_bodyRows;
+
+    // Rows of each plane's superpixel table, highest spid in the
+    // bounds plus one, so the planes can be laid out before writing
+    IntMap m_planeRows;
+
+    // Sizes of the segment and body_index tables, which are known
+    // before their rows are
+    uint32 m_segmentRows;
+    uint32 m_bodyIndexRows;
+};
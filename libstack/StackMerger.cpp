@@ -0,0 +1,372 @@
+#include "StackMerger.h"
+#include "HdfStack.h"
+#include "HdfFile.h"
+#include "RadixSort.h"
+#include "Threads.h"
+#include "timers.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+StackMerger::StackMerger() :
+    m_compression(0),
+    m_haveZeroBody(false)
+{
+}
+
+void StackMerger::addShard(const std::string& path)
+{
+    HdfFile file;
+    file.openForRead(path);
+
+    IntVec planes;
+    file.listPlanes(planes);
+
+    if (planes.empty())
+    {
+        throw FormatString("%s has no planes", path.c_str());
+    }
+
+    Shard shard;
+    shard.path = path;
+    shard.zmin = planes.front();
+    shard.zmax = planes.back();
+
+    // Planes are unique, so a full count means no gaps
+    if (planes.size() != shard.zmax - shard.zmin + 1)
+    {
+        throw FormatString("%s is missing planes between %u and %u",
+            path.c_str(), shard.zmin, shard.zmax);
+    }
+
+    // Sizes are needed before any plane is written
+    for (size_t i = 0; i < planes.size(); ++i)
+    {
+        shard.rows.push_back(file.getPlaneRows(planes[i]));
+    }
+
+    m_shards.push_back(shard);
+}
+
+void StackMerger::checkPlanes()
+{
+    if (m_shards.empty())
+    {
+        throw std::string("No shards to merge");
+    }
+
+    std::sort(m_shards.begin(), m_shards.end());
+
+    for (size_t i = 1; i < m_shards.size(); ++i)
+    {
+        const Shard& last = m_shards[i - 1];
+        const Shard& shard = m_shards[i];
+
+        if (shard.zmin <= last.zmax)
+        {
+            throw FormatString("%s and %s both have plane %u",
+                last.path.c_str(), shard.path.c_str(), shard.zmin);
+        }
+
+        if (shard.zmin > last.zmax + 1)
+        {
+            throw FormatString("Planes %u-%u are missing, between %s and %s",
+                last.zmax + 1, shard.zmin - 1, last.path.c_str(),
+                shard.path.c_str());
+        }
+    }
+}
+
+void StackMerger::merge(const std::string& path)
+{
+    checkPlanes();
+
+    // Write aside so a failed merge never leaves a stack.h5
+    std::string tmppath = path + ".tmp";
+
+    try
+    {
+        HdfFile out;
+        out.openForWrite(tmppath);
+        out.setCompression(m_compression, getNumCores());
+
+        IntVec planes;
+        IntVec rows;
+
+        for (size_t i = 0; i < m_shards.size(); ++i)
+        {
+            for (uint32 z = m_shards[i].zmin; z <= m_shards[i].zmax; ++z)
+            {
+                planes.push_back(z);
+            }
+
+            rows.insert(rows.end(), m_shards[i].rows.begin(),
+                m_shards[i].rows.end());
+        }
+
+        HdfPlaneWriter writer(out, planes, rows,
+            HdfStack::NUM_SUPERPIXEL_COLUMNS);
+
+        for (size_t i = 0; i < m_shards.size(); ++i)
+        {
+            PBT pbt("merge %s", m_shards[i].path.c_str());
+
+            HdfFile in;
+            in.openForRead(m_shards[i].path);
+
+            copyPlanes(writer, in, m_shards[i]);
+
+            // Segments first, bodies check their segments are here
+            mergeSegments(in, i);
+            mergeBodies(in, i);
+
+            printf("%s: planes %u-%u\n", m_shards[i].path.c_str(),
+                m_shards[i].zmin, m_shards[i].zmax);
+        }
+
+        writer.close();
+        writeSegments(out);
+        writeBodies(out);
+    }
+    catch (...)
+    {
+        unlink(tmppath.c_str());
+        throw;
+    }
+
+    if (rename(tmppath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmppath.c_str());
+        throw FormatString("Cannot rename %s", tmppath.c_str());
+    }
+
+    printf("Wrote planes %u-%u to %s\n", m_shards.front().zmin,
+        m_shards.back().zmax, path.c_str());
+}
+
+void StackMerger::copyPlanes(HdfPlaneWriter& out, HdfFile& in,
+    const Shard& shard)
+{
+    for (uint32 z = shard.zmin; z <= shard.zmax; ++z)
+    {
+        Table* table = in.readPlane(z);
+        out.writePlane(z, *table);
+        delete table;
+    }
+}
+
+void StackMerger::mergeSegments(HdfFile& in, int shard)
+{
+    const uint32 columns = HdfStack::NUM_SEGMENT_COLUMNS;
+
+    Table* segment = in.readTable("segment");
+    Table* segment_sp = in.readTable("segment_superpixels");
+
+    uint32 rows = segment->getRows();
+    uint32 spRows = segment_sp->getRows();
+
+    if (m_owner.size() < rows)
+    {
+        m_segment.resize(size_t(rows) * columns, EMPTY_VALUE);
+        m_owner.resize(rows, -1);
+    }
+
+    for (uint32 segid = 0; segid < rows; ++segid)
+    {
+        uint32 z = segment->getValue(segid, HdfStack::SEGMENT_Z);
+
+        // Deleted by garbage collection, or not in this shard
+        if (z == EMPTY_VALUE)
+        {
+            continue;
+        }
+
+        uint32 bodyid = segment->getValue(segid, HdfStack::SEGMENT_BODYID);
+        uint32* row = &m_segment[size_t(segid) * columns];
+
+        if (m_owner[segid] >= 0)
+        {
+            if (segid != 0)
+            {
+                throw FormatString("Segment %u is in both %s and %s", segid,
+                    m_shards[m_owner[segid]].path.c_str(),
+                    m_shards[shard].path.c_str());
+            }
+
+            if (row[HdfStack::SEGMENT_BODYID] != bodyid)
+            {
+                throw FormatString("Zero segment is in body %u in %s and "
+                    "body %u in %s", row[HdfStack::SEGMENT_BODYID],
+                    m_shards[m_owner[segid]].path.c_str(), bodyid,
+                    m_shards[shard].path.c_str());
+            }
+        }
+
+        m_owner[segid] = shard;
+        row[HdfStack::SEGMENT_Z] = z;
+        row[HdfStack::SEGMENT_BODYID] = bodyid;
+
+        // The zero segment's list is written after all the shards
+        IntVec& list = segid == 0 ? m_zero_sp : m_segment_sp;
+
+        if (segid != 0)
+        {
+            row[HdfStack::SEGMENT_SPINDEX] = m_segment_sp.size();
+        }
+
+        uint32 spindex = segment->getValue(segid, HdfStack::SEGMENT_SPINDEX);
+
+        for (; spindex < spRows; ++spindex)
+        {
+            uint32 spid = segment_sp->getValue(spindex, 0);
+
+            if (spid == END_OF_LIST)
+            {
+                break;
+            }
+
+            list.push_back(spid);
+        }
+
+        if (segid != 0)
+        {
+            m_segment_sp.push_back(END_OF_LIST);
+        }
+    }
+
+    delete segment;
+    delete segment_sp;
+}
+
+void StackMerger::mergeBodies(HdfFile& in, int shard)
+{
+    Table* body_index = in.readTable("body_index");
+    Table* body_seg = in.readTable("body_segments");
+
+    uint32 segRows = body_seg->getRows();
+
+    for (uint32 bodyid = 0; bodyid < body_index->getRows(); ++bodyid)
+    {
+        uint32 index = body_index->getValue(bodyid, 0);
+
+        for (; index != EMPTY_VALUE && index < segRows; ++index)
+        {
+            uint32 segid = body_seg->getValue(index, 0);
+
+            if (segid == END_OF_LIST)
+            {
+                break;
+            }
+
+            // A body's segments must be those this shard brought,
+            // in the body mergeSegments() recorded for them
+            if (segid >= m_owner.size() || m_owner[segid] != shard ||
+                m_segment[size_t(segid) * HdfStack::NUM_SEGMENT_COLUMNS +
+                    HdfStack::SEGMENT_BODYID] != bodyid)
+            {
+                throw FormatString("%s: body %u lists segment %u which is "
+                    "not in it", m_shards[shard].path.c_str(), bodyid,
+                    segid);
+            }
+
+            // Every shard lists the zero segment, keep it once
+            if (segid == 0)
+            {
+                if (m_haveZeroBody)
+                {
+                    continue;
+                }
+
+                m_haveZeroBody = true;
+            }
+
+            m_bodyKeys.push_back(makeKey(bodyid, m_bodySegids.size()));
+            m_bodySegids.push_back(segid);
+        }
+    }
+
+    delete body_index;
+    delete body_seg;
+}
+
+void StackMerger::writeSegments(HdfFile& out)
+{
+    const uint32 columns = HdfStack::NUM_SEGMENT_COLUMNS;
+
+    if (!m_zero_sp.empty())
+    {
+        m_segment[HdfStack::SEGMENT_SPINDEX] = m_segment_sp.size();
+        m_segment_sp.insert(m_segment_sp.end(), m_zero_sp.begin(),
+            m_zero_sp.end());
+        m_segment_sp.push_back(END_OF_LIST);
+    }
+
+    uint32 rows = m_owner.size();
+
+    Table segment(rows, columns, 0.0);
+
+    if (rows > 0)
+    {
+        memcpy(segment.getData(), &m_segment[0],
+            size_t(rows) * columns * sizeof(uint32));
+    }
+
+    Table segment_sp(m_segment_sp.size(), 1, 0.0);
+
+    if (!m_segment_sp.empty())
+    {
+        memcpy(segment_sp.getData(), &m_segment_sp[0],
+            m_segment_sp.size() * sizeof(uint32));
+    }
+
+    out.writeDataset("segment", segment);
+    out.writeDataset("segment_superpixels", segment_sp);
+
+    printf("Merged %lu segment superpixels\n",
+        (unsigned long)m_segment_sp.size());
+}
+
+void StackMerger::writeBodies(HdfFile& out)
+{
+    radixSort(m_bodyKeys, getNumCores());
+
+    uint32 maxbodyid = 0;
+    uint32 bodies = 0;
+
+    for (size_t i = 0; i < m_bodyKeys.size(); ++i)
+    {
+        if (i == 0 || keyHigh(m_bodyKeys[i]) != maxbodyid)
+        {
+            maxbodyid = keyHigh(m_bodyKeys[i]);
+            ++bodies;
+        }
+    }
+
+    // Each body's list ends with a terminator
+    Table body_index(maxbodyid + 1, 1, 0.0);
+    Table body_seg(m_bodyKeys.size() + bodies, 1, 0.0);
+
+    uint32 index = 0;
+
+    for (size_t i = 0; i < m_bodyKeys.size(); )
+    {
+        uint32 bodyid = keyHigh(m_bodyKeys[i]);
+
+        body_index.setValue(bodyid, 0, index);
+
+        for (; i < m_bodyKeys.size() && keyHigh(m_bodyKeys[i]) == bodyid; ++i)
+        {
+            body_seg.setValue(index++, 0, m_bodySegids[keyLow(m_bodyKeys[i])]);
+        }
+
+        body_seg.setValue(index++, 0, END_OF_LIST);
+    }
+
+    out.writeDataset("body_index", body_index);
+    out.writeDataset("body_segments", body_seg);
+
+    printf("Merged %u bodies\n", bodies);
+}
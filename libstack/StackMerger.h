@@ -0,0 +1,89 @@
+//
+// StackMerger.h
+//
+
+#pragma once
+
+#include "common.h"
+
+class HdfFile;
+class HdfPlaneWriter;
+
+//
+// Puts together the shards of a sharded compile, each a stack.h5 of
+// some planes written by HdfStack::loadTXTShard(), into one stack.h5.
+//
+// Between them the shards must cover a run of planes with no gaps and
+// no plane in more than one shard.  Superpixel tables are copied one
+// plane at a time.  The segment and body tables are merged:
+//
+// - Each segment belongs to the shard which has its plane, so a segid
+//   in two shards means the TXT files changed between the shards, or
+//   the shards came from different stacks.  That is an error.  The
+//   exception is the zero segment, which has superpixel 0 of every
+//   plane, and whose lists are joined.
+// - Bodies span shards, so each body's list of segments is the lists
+//   from every shard one after another, in shard order.
+//
+// The result holds the same stack as compiling all the planes at
+// once, though lists may be laid out in a different order.
+//
+class StackMerger
+{
+public:
+    StackMerger();
+
+    // Throws std::string if the shard cannot be read
+    void addShard(const std::string& path);
+
+    // Write the merged stack to path, throws std::string on failure
+    void merge(const std::string& path);
+
+    // Deflate the datasets at level 1 to 9, 0 for none
+    void setCompression(int level) { m_compression = level; }
+
+private:
+    struct Shard
+    {
+        std::string path;
+        uint32 zmin;
+        uint32 zmax;
+
+        // Of each plane from zmin
+        IntVec rows;
+
+        bool operator<(const Shard& other) const
+        {
+            return zmin < other.zmin;
+        }
+    };
+
+    // Throws on a gap or overlap between shards
+    void checkPlanes();
+
+    void copyPlanes(HdfPlaneWriter& out, HdfFile& in, const Shard& shard);
+    void mergeSegments(HdfFile& in, int shard);
+    void mergeBodies(HdfFile& in, int shard);
+
+    void writeSegments(HdfFile& out);
+    void writeBodies(HdfFile& out);
+
+    std::vector<Shard> m_shards;
+    int m_compression;
+
+    // Merged segment table, NUM_SEGMENT_COLUMNS per segid, and the
+    // shard each segment came from, -1 for none
+    IntVec m_segment;
+    std::vector<int> m_owner;
+
+    // Merged segment_superpixels, the zero segment's list is kept
+    // apart until every shard is in
+    IntVec m_segment_sp;
+    IntVec m_zero_sp;
+
+    // (bodyid, n) for the nth segment listed by any body, so sorting
+    // puts each body's segments together in shard order
+    std::vector<uint64> m_bodyKeys;
+    IntVec m_bodySegids;
+    bool m_haveZeroBody;
+};
@@ -0,0 +1,198 @@
+#include "StackSnapshot.h"
+#include "Checksum.h"
+#include "Table.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char StackSnapshot::s_MAGIC[8] = { 'H', 'S', 'T', 'K', 'S', 'N', 'A', 'P' };
+const uint32 StackSnapshot::s_VERSION_NUMBER = 1;
+const uint64 StackSnapshot::s_ALIGNMENT = 4096;
+
+StackSnapshot::StackSnapshot(const std::string& path) :
+    m_path(path),
+    m_data(NULL),
+    m_size(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        throw FormatString("Cannot open %s", path.c_str());
+    }
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0 || uint64(info.st_size) < sizeof(Header))
+    {
+        close(fd);
+        throw FormatString("%s is not a stack snapshot", path.c_str());
+    }
+
+    m_size = info.st_size;
+
+    // Private, so changes are copied and never reach the file
+    void* data = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        throw FormatString("Cannot map %s", path.c_str());
+    }
+
+    m_data = (char*)data;
+
+    const Header* header = (const Header*)m_data;
+
+    if (memcmp(header->magic, s_MAGIC, sizeof(s_MAGIC)) != 0)
+    {
+        munmap(m_data, m_size);
+        throw FormatString("%s is not a stack snapshot", path.c_str());
+    }
+
+    if (header->version != s_VERSION_NUMBER)
+    {
+        munmap(m_data, m_size);
+        throw FormatString("%s is snapshot version %u, not %u", path.c_str(),
+            header->version, s_VERSION_NUMBER);
+    }
+
+    if (header->size != m_size ||
+        header->directory > m_size ||
+        (m_size - header->directory) / sizeof(Entry) < header->tables)
+    {
+        munmap(m_data, m_size);
+        throw FormatString("%s is truncated", path.c_str());
+    }
+
+    const Entry* entries = (const Entry*)(m_data + header->directory);
+    m_entries.assign(entries, entries + header->tables);
+
+    for (size_t i = 0; i < m_entries.size(); ++i)
+    {
+        const Entry& entry = m_entries[i];
+        uint64 bytes = uint64(entry.rows) * entry.columns * sizeof(uint32);
+
+        if (entry.columns == 0 || entry.offset % s_ALIGNMENT != 0 ||
+            entry.offset > m_size || bytes > m_size - entry.offset)
+        {
+            munmap(m_data, m_size);
+            throw FormatString("Bad table %zu in %s", i, path.c_str());
+        }
+    }
+}
+
+StackSnapshot::~StackSnapshot()
+{
+    munmap(m_data, m_size);
+}
+
+Table* StackSnapshot::getTable(size_t i, bool checksum) const
+{
+    const Entry& entry = m_entries[i];
+    uint32* data = (uint32*)(m_data + entry.offset);
+
+    if (checksum && Checksum::of(data, size_t(entry.rows) * entry.columns *
+            sizeof(uint32)) != entry.checksum)
+    {
+        throw FormatString("Checksum mismatch in table %zu of %s", i,
+            m_path.c_str());
+    }
+
+    return Table::wrap(entry.rows, entry.columns, data);
+}
+
+SnapshotWriter::SnapshotWriter(const std::string& path) :
+    m_path(path),
+    m_tmppath(path + ".tmp"),
+    m_file(NULL),
+    m_offset(0)
+{
+    m_file = fopen(m_tmppath.c_str(), "wb");
+
+    if (!m_file)
+    {
+        throw FormatString("Cannot create %s", m_tmppath.c_str());
+    }
+
+    // The header is filled in by close()
+    StackSnapshot::Header header;
+    memset(&header, 0, sizeof(header));
+    write(&header, sizeof(header));
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (m_file)
+    {
+        fclose(m_file);
+        unlink(m_tmppath.c_str());
+    }
+}
+
+void SnapshotWriter::write(const void* data, size_t bytes)
+{
+    if (bytes > 0 && fwrite(data, 1, bytes, m_file) != bytes)
+    {
+        throw FormatString("Cannot write %s", m_tmppath.c_str());
+    }
+
+    m_offset += bytes;
+}
+
+void SnapshotWriter::addTable(StackSnapshot::Kind kind, uint32 plane,
+    const Table& table)
+{
+    // Every table starts a page
+    static const char zeros[4096] = { 0 };
+    write(zeros, (StackSnapshot::s_ALIGNMENT -
+        m_offset % StackSnapshot::s_ALIGNMENT) % StackSnapshot::s_ALIGNMENT);
+
+    size_t bytes = size_t(table.getRows()) * table.getColumns() *
+        sizeof(uint32);
+
+    StackSnapshot::Entry entry;
+    entry.kind = kind;
+    entry.plane = plane;
+    entry.rows = table.getRows();
+    entry.columns = table.getColumns();
+    entry.offset = m_offset;
+    entry.checksum = Checksum::of(table.getData(), bytes);
+    m_entries.push_back(entry);
+
+    write(table.getData(), bytes);
+}
+
+void SnapshotWriter::close()
+{
+    StackSnapshot::Header header;
+    memcpy(header.magic, StackSnapshot::s_MAGIC, sizeof(header.magic));
+    header.version = StackSnapshot::s_VERSION_NUMBER;
+    header.tables = m_entries.size();
+    header.directory = m_offset;
+    header.size = m_offset + m_entries.size() * sizeof(StackSnapshot::Entry);
+
+    if (!m_entries.empty())
+    {
+        write(&m_entries[0], m_entries.size() * sizeof(StackSnapshot::Entry));
+    }
+
+    bool ok = fseek(m_file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, m_file) == 1 &&
+        fflush(m_file) == 0 &&
+        fsync(fileno(m_file)) == 0;
+
+    ok = fclose(m_file) == 0 && ok;
+    m_file = NULL;
+
+    if (!ok || rename(m_tmppath.c_str(), m_path.c_str()) != 0)
+    {
+        unlink(m_tmppath.c_str());
+        throw FormatString("Cannot write %s", m_path.c_str());
+    }
+}
@@ -0,0 +1,114 @@
+//
+// StackSnapshot.h
+//
+
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+
+//
+// A flat binary copy of every table of an HdfStack, laid out so the
+// tables can be used straight from an mmap of the file.  Opening one
+// reads only the directory, whatever the size of the stack, and the
+// pages of a table are read the first time they are touched.
+//
+// The file is a header, the tables, then a directory with an entry
+// per table giving what it is, its size, where it starts and its
+// XXH64 checksum.  Every table starts on a 4096 byte boundary.
+// Values are little endian, as in memory on our hosts.
+//
+// The file is mapped private and writable, so a table modified in
+// memory gets its own copy of each page it changes and the file is
+// never written.  A snapshot is only ever replaced by renaming a new
+// file over it, never rewritten in place, since that would show
+// through the pages of a mapping which were not copied yet.
+//
+class StackSnapshot
+{
+public:
+    enum Kind
+    {
+        SNAPSHOT_PLANE = 0,
+        SNAPSHOT_SEGMENT = 1,
+        SNAPSHOT_SEGMENT_SUPERPIXELS = 2,
+        SNAPSHOT_BODY_INDEX = 3,
+        SNAPSHOT_BODY_SEGMENTS = 4
+    };
+
+    // Map the file at path, throws std::string if it is not a
+    // snapshot or is truncated
+    StackSnapshot(const std::string& path);
+    ~StackSnapshot();
+
+    size_t getNumTables() const { return m_entries.size(); }
+    Kind getKind(size_t i) const { return Kind(m_entries[i].kind); }
+    uint32 getPlane(size_t i) const { return m_entries[i].plane; }
+
+    // Table i over the mapping, which must be deleted before the
+    // snapshot is.  If checksum is true every page is read to check
+    // it, throws std::string if it doesn't match.
+    Table* getTable(size_t i, bool checksum) const;
+
+    struct Header
+    {
+        char magic[8];
+        uint32 version;
+        uint32 tables;
+        uint64 directory;
+        uint64 size;
+    };
+
+    struct Entry
+    {
+        uint32 kind;
+        uint32 plane;
+        uint32 rows;
+        uint32 columns;
+        uint64 offset;
+        uint64 checksum;
+    };
+
+    static const char s_MAGIC[8];
+    static const uint32 s_VERSION_NUMBER;
+    static const uint64 s_ALIGNMENT;
+
+private:
+    StackSnapshot(const StackSnapshot&);
+    StackSnapshot& operator=(const StackSnapshot&);
+
+    std::string m_path;
+    char* m_data;
+    uint64 m_size;
+    std::vector<Entry> m_entries;
+};
+
+//
+// Writes a StackSnapshot a table at a time.  The file is written as
+// path.tmp and only renamed to path by close(), so a stack mapped
+// from path is never written under it.
+//
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const std::string& path);
+
+    // Removes the partial file if close() was not called
+    ~SnapshotWriter();
+
+    void addTable(StackSnapshot::Kind kind, uint32 plane, const Table& table);
+
+    // Write the directory and put the file in place, throws
+    // std::string on failure
+    void close();
+
+private:
+    void write(const void* data, size_t bytes);
+
+    std::string m_path;
+    std::string m_tmppath;
+    FILE* m_file;
+    uint64 m_offset;
+    std::vector<StackSnapshot::Entry> m_entries;
+};
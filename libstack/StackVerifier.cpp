@@ -0,0 +1,453 @@
+#include "StackVerifier.h"
+#include "HdfStack.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <limits.h>
+
+#include <algorithm>
+
+// Same limit as the serial verify()
+static const int s_MAX_ERRORS = 30;
+
+// Bodies or segids handed to a thread at a time
+static const uint32 s_JOB_SIZE = 1 << 16;
+
+static uint32 numRangeJobs(uint32 rows)
+{
+    return (rows + s_JOB_SIZE - 1) / s_JOB_SIZE;
+}
+
+StackVerifier::StackVerifier(HdfStack& stack, int threads) :
+    m_stack(stack),
+    m_threads(std::max(1, threads)),
+    m_nextJob(0),
+    m_numJobs(0),
+    m_stopJob(UINT_MAX)
+{
+}
+
+void StackVerifier::runPass(ThreadFunc func, uint32 numJobs)
+{
+    m_nextJob = 0;
+    m_numJobs = numJobs;
+    m_stopJob = UINT_MAX;
+
+    int threads = int(std::min(uint32(m_threads), numJobs));
+
+    if (threads > 1)
+    {
+        runThreads(threads, func, this);
+    }
+    else if (threads == 1)
+    {
+        func(this);
+    }
+}
+
+bool StackVerifier::nextJob(uint32& job)
+{
+    ScopedLock lock(m_mutex);
+
+    if (m_nextJob >= m_numJobs || m_nextJob > m_stopJob)
+    {
+        return false;
+    }
+
+    job = m_nextJob++;
+    return true;
+}
+
+void* StackVerifier::bodyWorkerMain(void* arg)
+{
+    StackVerifier* verifier = (StackVerifier*)arg;
+    uint32 rows = verifier->m_stack.m_body_index->getRows();
+    uint32 job;
+
+    while (verifier->nextJob(job))
+    {
+        uint32 begin = job * s_JOB_SIZE;
+        verifier->walkBodies(begin, std::min(rows, begin + s_JOB_SIZE));
+    }
+
+    return NULL;
+}
+
+void* StackVerifier::segmentWorkerMain(void* arg)
+{
+    StackVerifier* verifier = (StackVerifier*)arg;
+    uint32 rows = verifier->m_stack.m_segment->getRows();
+    uint32 job;
+
+    while (verifier->nextJob(job))
+    {
+        uint32 begin = job * s_JOB_SIZE;
+        bool stopped = verifier->checkSegmentRange(begin,
+            std::min(rows, begin + s_JOB_SIZE), verifier->m_segmentResults[job]);
+
+        // Once a range stops the output no later range is printed
+        if (stopped)
+        {
+            ScopedLock lock(verifier->m_mutex);
+            verifier->m_stopJob = std::min(verifier->m_stopJob, job);
+        }
+    }
+
+    return NULL;
+}
+
+void* StackVerifier::planeWorkerMain(void* arg)
+{
+    StackVerifier* verifier = (StackVerifier*)arg;
+    uint32 job;
+
+    while (verifier->nextJob(job))
+    {
+        verifier->checkPlane(verifier->m_planes[job],
+            verifier->m_planeResults[job]);
+    }
+
+    return NULL;
+}
+
+//
+// Set the bit of every segment listed by the body it belongs to.
+// Bodies are split between threads, but any body may list any
+// segment, so the bits are set atomically.
+//
+void StackVerifier::walkBodies(uint32 begin, uint32 end)
+{
+    const uint32* index = m_stack.m_body_index->getData();
+    const uint32* lists = m_stack.m_body_seg->getData();
+    const uint32* segment = m_stack.m_segment->getData();
+
+    uint32 listRows = m_stack.m_body_seg->getRows();
+    uint32 segmentRows = m_stack.m_segment->getRows();
+
+    for (uint32 bodyid = begin; bodyid < end; ++bodyid)
+    {
+        uint32 i = index[bodyid];
+
+        if (i == EMPTY_VALUE)
+        {
+            continue;
+        }
+
+        for (; i < listRows && lists[i] != END_OF_LIST; ++i)
+        {
+            uint32 segid = lists[i];
+
+            if (segid < segmentRows &&
+                segment[size_t(segid) * HdfStack::NUM_SEGMENT_COLUMNS +
+                    HdfStack::SEGMENT_BODYID] == bodyid)
+            {
+                __sync_fetch_and_or(&m_listed[segid >> 6],
+                    uint64(1) << (segid & 63));
+            }
+        }
+
+        if (i >= listRows)
+        {
+            // Only an error if a segment we check maps to this body
+            ScopedLock lock(m_mutex);
+            m_brokenBodies[bodyid] = i;
+        }
+    }
+}
+
+bool StackVerifier::checkSegmentRange(uint32 begin, uint32 end,
+    SegmentReportsVec& out)
+{
+    int errors = 0;
+
+    for (uint32 segid = begin; segid < end; ++segid)
+    {
+        ReportVec reports;
+        checkSegment(segid, reports);
+
+        if (reports.empty())
+        {
+            continue;
+        }
+
+        out.push_back(reports);
+
+        // Our count is at most the count verify() had by here, so
+        // if we are over the limit so is verify()
+        for (size_t i = 0; i < reports.size(); ++i)
+        {
+            if (reports[i].kind != Report::ERROR)
+            {
+                return true;
+            }
+            ++errors;
+        }
+
+        if (errors > s_MAX_ERRORS)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// The checks verify() did for one segment, done without copying any
+// lists.  Each error or exception verify() would give here is added
+// to reports in order.
+//
+void StackVerifier::checkSegment(uint32 segid, ReportVec& reports)
+{
+    const uint32* row = m_stack.m_segment->getData() +
+        size_t(segid) * HdfStack::NUM_SEGMENT_COLUMNS;
+
+    uint32 plane = row[HdfStack::SEGMENT_Z];
+    uint32 bodyid = row[HdfStack::SEGMENT_BODYID];
+    uint32 spindex = row[HdfStack::SEGMENT_SPINDEX];
+
+    if (plane == EMPTY_VALUE)
+    {
+        if (bodyid != EMPTY_VALUE)
+        {
+            reports.push_back(Report(Report::ERROR, FormatString(
+                "ERROR: segid=%u expected empty BODYID\n", segid), false));
+        }
+        if (spindex != EMPTY_VALUE)
+        {
+            reports.push_back(Report(Report::ERROR, FormatString(
+                "ERROR: segid=%u expected empty SPINDEX\n", segid), false));
+        }
+        return;
+    }
+
+    if (bodyid == EMPTY_VALUE)
+    {
+        reports.push_back(Report(Report::ERROR, FormatString(
+            "ERROR: segid=%u expected non-empty BODYID\n", segid), false));
+    }
+
+    if (spindex == EMPTY_VALUE)
+    {
+        reports.push_back(Report(Report::ERROR, FormatString(
+            "ERROR: segid=%u expected non-empty SPINDEX\n", segid), false));
+    }
+    else
+    {
+        const uint32* list = m_stack.m_segment_sp->getData();
+        uint32 listRows = m_stack.m_segment_sp->getRows();
+
+        // verify() copied the whole list before checking any of it
+        uint32 listEnd = spindex;
+
+        while (listEnd < listRows && list[listEnd] != END_OF_LIST)
+        {
+            ++listEnd;
+        }
+
+        if (listEnd >= listRows)
+        {
+            reports.push_back(Report(Report::STRING_THROW, FormatString(
+                "Table::getValue(%u, %u) not in range", listEnd, 0), false));
+            return;
+        }
+
+        if (listEnd > spindex)
+        {
+            TableMap::iterator it = m_stack.m_superpixel.find(plane);
+
+            if (it == m_stack.m_superpixel.end())
+            {
+                reports.push_back(Report(Report::STACK_THROW, FormatString(
+                    "plane=%u does not exist", plane), true));
+                return;
+            }
+
+            const Table* table = (*it).second;
+            const uint32* superpixels = table->getData();
+            uint32 spRows = table->getRows();
+            int errors = 0;
+
+            for (uint32 i = spindex; i < listEnd; ++i)
+            {
+                uint32 spid = list[i];
+
+                if (spid >= spRows)
+                {
+                    reports.push_back(Report(Report::STACK_THROW, FormatString(
+                        "getsegmentid(%u, %u) invalid spid=%u",
+                        plane, spid, spid), true));
+                    return;
+                }
+
+                uint32 sp_seg = superpixels[size_t(spid) *
+                    HdfStack::NUM_SUPERPIXEL_COLUMNS + HdfStack::SUPERPIXEL_SEGID];
+
+                if (segid != sp_seg)
+                {
+                    reports.push_back(Report(Report::ERROR, FormatString(
+                        "ERROR: segid=%u has spid (%u, %u)\n"
+                        "ERROR: superpixel (%u, %u) had segid=%u\n",
+                        segid, plane, spid, plane, spid, sp_seg), true));
+
+                    // verify() never printed more than this many
+                    if (++errors > s_MAX_ERRORS)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Check body exists, as getsegmentbodyid() and checkBody() did
+    if (spindex == EMPTY_VALUE)
+    {
+        reports.push_back(Report(Report::STACK_THROW, FormatString(
+            "segid=%u does not exist in range [0..%u)", segid,
+            m_stack.m_segment->getRows()), false));
+        return;
+    }
+
+    uint32 bodyRows = m_stack.m_body_index->getRows();
+
+    if (bodyid >= bodyRows)
+    {
+        reports.push_back(Report(Report::STACK_THROW, FormatString(
+            "bodyid=%u not in range [0..%u)", bodyid, bodyRows), false));
+        return;
+    }
+
+    if (m_stack.m_body_index->getData()[bodyid] == EMPTY_VALUE)
+    {
+        reports.push_back(Report(Report::STACK_THROW, FormatString(
+            "bodyid=%u does not exist in range [0..%u)", bodyid, bodyRows),
+            false));
+        return;
+    }
+
+    // Check we are in the body's list of segments
+    IntMap::const_iterator broken = m_brokenBodies.find(bodyid);
+
+    if (broken != m_brokenBodies.end())
+    {
+        reports.push_back(Report(Report::STRING_THROW, FormatString(
+            "Table::getValue(%u, %u) not in range", (*broken).second, 0),
+            false));
+        return;
+    }
+
+    if (!isListed(segid))
+    {
+        reports.push_back(Report(Report::ERROR, FormatString(
+            "ERROR: bodyid=%u doesn't contain segid=%u\n", bodyid, segid),
+            false));
+    }
+}
+
+void StackVerifier::checkPlane(uint32 plane, IntVec& spids)
+{
+    const Table* table = (*m_stack.m_superpixel.find(plane)).second;
+    const uint32* row = table->getData();
+
+    for (uint32 i = 0; i < table->getRows(); ++i)
+    {
+        if (row[HdfStack::SUPERPIXEL_X] != EMPTY_VALUE &&
+            row[HdfStack::SUPERPIXEL_SEGID] == EMPTY_VALUE)
+        {
+            spids.push_back(i);
+        }
+
+        row += HdfStack::NUM_SUPERPIXEL_COLUMNS;
+    }
+}
+
+int StackVerifier::checkSegments()
+{
+    uint32 segmentRows = m_stack.m_segment->getRows();
+
+    m_listed.assign(segmentRows / 64 + 1, 0);
+    m_brokenBodies.clear();
+    runPass(bodyWorkerMain, numRangeJobs(m_stack.m_body_index->getRows()));
+
+    uint32 numJobs = numRangeJobs(segmentRows);
+    m_segmentResults.assign(numJobs, SegmentReportsVec());
+    runPass(segmentWorkerMain, numJobs);
+
+    // Print what verify() would have, in segid order
+    int errors = 0;
+
+    for (uint32 job = 0; job < numJobs; ++job)
+    {
+        const SegmentReportsVec& segments = m_segmentResults[job];
+
+        for (size_t s = 0; s < segments.size(); ++s)
+        {
+            const ReportVec& reports = segments[s];
+            bool leftLoop = false;
+
+            for (size_t i = 0; i < reports.size(); ++i)
+            {
+                const Report& report = reports[i];
+
+                if (report.loop && leftLoop)
+                {
+                    continue;
+                }
+
+                if (report.kind == Report::STACK_THROW)
+                {
+                    m_stack.error("%s", report.text.c_str());
+                }
+                else if (report.kind == Report::STRING_THROW)
+                {
+                    throw report.text;
+                }
+
+                printf("%s", report.text.c_str());
+
+                if (++errors > s_MAX_ERRORS && report.loop)
+                {
+                    leftLoop = true;
+                }
+            }
+
+            if (errors > s_MAX_ERRORS)
+            {
+                return errors;
+            }
+        }
+    }
+
+    m_segmentResults.clear();
+    return errors;
+}
+
+void StackVerifier::findOrphans(IntVec& planes, IntVec& spids)
+{
+    m_planes.clear();
+
+    for (TableMap::iterator it = m_stack.m_superpixel.begin();
+         it != m_stack.m_superpixel.end(); ++it)
+    {
+        m_planes.push_back((*it).first);
+    }
+
+    std::sort(m_planes.begin(), m_planes.end());
+
+    m_planeResults.assign(m_planes.size(), IntVec());
+    runPass(planeWorkerMain, m_planes.size());
+
+    planes.clear();
+    spids.clear();
+
+    for (size_t i = 0; i < m_planes.size(); ++i)
+    {
+        const IntVec& found = m_planeResults[i];
+
+        planes.insert(planes.end(), found.size(), m_planes[i]);
+        spids.insert(spids.end(), found.begin(), found.end());
+    }
+
+    m_planeResults.clear();
+}
@@ -0,0 +1,119 @@
+//
+// StackVerifier.h
+//
+
+#pragma once
+
+#include "common.h"
+#include "Threads.h"
+
+class HdfStack;
+
+//
+// Does the checks of HdfStack::verify() spread over several threads.
+//
+// The old verify() copied each segment's superpixel list, then
+// copied its body's whole segment list to search it for the segment,
+// so a body of n segments cost n^2.  Instead every table is walked
+// once:
+//
+// - The body lists are walked first.  A segment listed by the body
+//   it maps to gets its bit set in a bitset indexed by segid, so the
+//   back-reference check for a segment is one bit test.
+// - The segments are split into ranges of segids, each range walks
+//   its segments' superpixel lists in place.
+// - The planes are split between the threads, and superpixels which
+//   exist but have no segment are collected for repair.
+//
+// The errors printed, the point where we stop after too many errors,
+// and the exceptions thrown for a broken stack are the same as the
+// serial verify() gave, in the same order.
+//
+class StackVerifier
+{
+public:
+    StackVerifier(HdfStack& stack, int threads);
+
+    // Print the errors, return how many were counted.  Throws the
+    // StackException or std::string the serial verify() threw.
+    int checkSegments();
+
+    // Find superpixels which exist but have no segment, sorted by
+    // plane then spid.  They are not counted as errors.
+    void findOrphans(IntVec& planes, IntVec& spids);
+
+    // Worker entry points, arg is the StackVerifier
+    static void* bodyWorkerMain(void* arg);
+    static void* segmentWorkerMain(void* arg);
+    static void* planeWorkerMain(void* arg);
+
+private:
+    // One thing verify() printed or threw, in segid order
+    struct Report
+    {
+        enum Kind
+        {
+            ERROR,          // printed and counted as one error
+            STACK_THROW,    // verify() threw StackException(text)
+            STRING_THROW    // verify() threw std::string(text)
+        };
+
+        Report(Kind kind_, const std::string& text_, bool loop_) :
+            kind(kind_),
+            text(text_),
+            loop(loop_)
+        {}
+
+        Kind kind;
+        std::string text;
+
+        // From the loop over the segment's superpixels, which
+        // verify() left once there were too many errors
+        bool loop;
+    };
+
+    typedef std::vector<Report> ReportVec;
+
+    // Reports of each segment which has any, in segid order
+    typedef std::vector<ReportVec> SegmentReportsVec;
+
+    void walkBodies(uint32 begin, uint32 end);
+    // True if the range has an exception or too many errors, where
+    // verify() stopped
+    bool checkSegmentRange(uint32 begin, uint32 end, SegmentReportsVec& out);
+    void checkSegment(uint32 segid, ReportVec& reports);
+    void checkPlane(uint32 plane, IntVec& spids);
+
+    // Run func on up to m_threads threads over numJobs jobs
+    void runPass(ThreadFunc func, uint32 numJobs);
+
+    // Claim the next job, false if there is none left
+    bool nextJob(uint32& job);
+
+    bool isListed(uint32 segid) const
+    {
+        return (m_listed[segid >> 6] >> (segid & 63)) & 1;
+    }
+
+    HdfStack& m_stack;
+    int m_threads;
+
+    // Bit per segid, set if its body lists it
+    std::vector<uint64> m_listed;
+
+    // Bodies whose segment list runs off the end of body_segments,
+    // and the row where reading it fails
+    IntMap m_brokenBodies;
+
+    // Work handed out to the threads, and what they found.  A job
+    // is a range of bodies or segids, or a plane, depending on the
+    // pass.  Segment jobs after m_stopJob are not needed, an earlier
+    // one already stops the output.
+    Mutex m_mutex;
+    uint32 m_nextJob;
+    uint32 m_numJobs;
+    uint32 m_stopJob;
+    IntVec m_planes;
+    std::vector<SegmentReportsVec> m_segmentResults;
+    std::vector<IntVec> m_planeResults;
+};
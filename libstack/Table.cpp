@@ -5,25 +5,50 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
 
 Table::Table(uint32 rows, uint32 columns, float padding) :
-    m_padding(padding)
+    m_padding(padding),
+    m_owned(true),
+    m_tracking(false),
+    m_dirty(false)
 {
     // allocate initial size, it will include padding
     m_data = allocateArray(rows, columns);
 }
 
 Table::Table(uint32 rows, uint32 columns, uint32* data, float padding) :
-    m_padding(padding)
+    m_padding(padding),
+    m_owned(true),
+    m_tracking(false),
+    m_dirty(false)
 {
     m_data = allocateArray(rows, columns);
     size_t nbytes = rows * columns * sizeof(uint32);
     memcpy(m_data, data, nbytes);    
 }
 
+Table* Table::wrap(uint32 rows, uint32 columns, uint32* data)
+{
+    Table* table = new Table();
+    table->m_rows = rows;
+    table->m_columns = columns;
+    table->m_rowsAllocated = rows;
+    table->m_padding = 0.1;
+    table->m_data = data;
+    table->m_owned = false;
+    table->m_tracking = false;
+    table->m_dirty = false;
+    return table;
+}
+
 Table::~Table()
 {
-    delete [] m_data;
+    if (m_owned)
+    {
+        delete [] m_data;
+    }
 }
 
 //
@@ -70,6 +95,8 @@ uint32* Table::allocateArray(size_t rows, uint32 columns)
 //
 void Table::import(const std::vector<char *>& lines)
 {
+    m_tracking = false;
+
     for (uint32 i = 0; i < lines.size(); i++)
     {
         const char* buffer = lines[i];
@@ -112,6 +139,11 @@ void Table::setValue(uint32 row, uint32 col, uint32 value)
     }
 
     m_data[row*m_columns + col] = value;
+
+    if (m_tracking)
+    {
+        markDirty(row, row + 1);
+    }
 }
 
 //
@@ -148,8 +180,19 @@ void Table::addRows(uint32 rows)
         size_t nbytes = sizeof(uint32) * (size_t)old_rows * m_columns;
         
         memcpy(new_data, m_data, nbytes);
-        delete m_data;
+
+        if (m_owned)
+        {
+            delete m_data;
+        }
+
         m_data = new_data;
+        m_owned = true;
+    }
+
+    if (m_tracking)
+    {
+        markDirty(m_rows - rows, m_rows);
     }
 }
 
@@ -171,4 +214,72 @@ void Table::truncateRows(uint32 rows)
     }   
     
     m_rows = rows;
+
+    // Only the size changed, the rows left are as they were
+    m_dirty = true;
+}
+
+void Table::clearDirty()
+{
+    m_tracking = true;
+    m_dirty = false;
+    m_dirtyBlocks.assign((m_rows + s_DIRTY_ROWS - 1) / s_DIRTY_ROWS, false);
+}
+
+void Table::markDirty(uint32 first, uint32 last)
+{
+    size_t blocks = (size_t(last) + s_DIRTY_ROWS - 1) / s_DIRTY_ROWS;
+
+    if (m_dirtyBlocks.size() < blocks)
+    {
+        m_dirtyBlocks.resize(blocks, false);
+    }
+
+    for (size_t i = first / s_DIRTY_ROWS; i < blocks; ++i)
+    {
+        m_dirtyBlocks[i] = true;
+    }
+
+    m_dirty = true;
+}
+
+void Table::getDirtyRows(std::vector<std::pair<uint32, uint32> >& runs) const
+{
+    runs.clear();
+
+    if (!m_tracking)
+    {
+        if (m_rows > 0)
+        {
+            runs.push_back(std::make_pair(uint32(0), m_rows));
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < m_dirtyBlocks.size(); ++i)
+    {
+        if (!m_dirtyBlocks[i])
+        {
+            continue;
+        }
+
+        uint32 first = i * s_DIRTY_ROWS;
+
+        if (first >= m_rows)
+        {
+            break;
+        }
+
+        uint32 last = std::min(size_t(m_rows), (i + 1) * s_DIRTY_ROWS);
+
+        if (!runs.empty() && runs.back().second == first)
+        {
+            runs.back().second = last;
+        }
+        else
+        {
+            runs.push_back(std::make_pair(first, last));
+        }
+    }
 }
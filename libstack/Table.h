@@ -27,6 +27,11 @@ public:
     // Create table from existing data, copy the given memory
     Table(uint32 rows, uint32 columns, uint32* data, float padding = 0.1);
 
+    // Table over memory it doesn't own, such as a file mapped
+    // copy-on-write, which must outlive the table.  Nothing is copied
+    // unless the table grows, then it gets an array of its own.
+    static Table* wrap(uint32 rows, uint32 columns, uint32* data);
+
     // Destructor
     ~Table();
 
@@ -62,7 +67,21 @@ public:
     // Get pointer to all the data
     uint32* getData() const { return m_data; }
 
+    // Change tracking, so a save can write only what changed.  A new
+    // table counts as changed everywhere.  clearDirty() starts over
+    // with nothing changed, from then on setValue(), addRows() and
+    // truncateRows() mark the blocks of rows they touch.  Writes
+    // through getData() are not seen.
+    void clearDirty();
+    bool isDirty() const { return !m_tracking || m_dirty; }
+
+    // Rows changed since clearDirty(), as [first, last) runs in
+    // order, whole blocks but none past the end of the table
+    void getDirtyRows(std::vector<std::pair<uint32, uint32> >& runs) const;
+
 private:
+    Table() {}
+
     // allocate our data array, including padding, save off sizes.
     uint32* allocateArray(size_t rows, uint32 columns);
 
@@ -77,4 +96,18 @@ private:
     float m_padding;
 
     uint32* m_data;
+
+    // False if m_data belongs to someone else, see wrap()
+    bool m_owned;
+
+    // Mark rows [first, last) changed
+    void markDirty(uint32 first, uint32 last);
+
+    // Rows in each block of m_dirtyBlocks
+    static const uint32 s_DIRTY_ROWS = 1024;
+
+    // Until clearDirty() every row counts as changed
+    bool m_tracking;
+    bool m_dirty;
+    std::vector<bool> m_dirtyBlocks;
 };
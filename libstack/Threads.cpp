@@ -0,0 +1,89 @@
+#include "Threads.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+Mutex::Mutex()
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+Mutex::~Mutex()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void Mutex::lock()
+{
+    pthread_mutex_lock(&m_mutex);
+}
+
+void Mutex::unlock()
+{
+    pthread_mutex_unlock(&m_mutex);
+}
+
+Condition::Condition()
+{
+    pthread_cond_init(&m_cond, NULL);
+}
+
+Condition::~Condition()
+{
+    pthread_cond_destroy(&m_cond);
+}
+
+void Condition::wait(Mutex& mutex)
+{
+    pthread_cond_wait(&m_cond, mutex.get());
+}
+
+void Condition::signal()
+{
+    pthread_cond_signal(&m_cond);
+}
+
+void Condition::broadcast()
+{
+    pthread_cond_broadcast(&m_cond);
+}
+
+void startThreads(int count, ThreadFunc func, void* arg, ThreadList& threads)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, func, arg) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot create thread %d\n", i);
+            exit(1);
+        }
+
+        threads.push_back(thread);
+    }
+}
+
+void joinThreads(ThreadList& threads)
+{
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    threads.clear();
+}
+
+void runThreads(int count, ThreadFunc func, void* arg)
+{
+    ThreadList threads;
+    startThreads(count, func, arg, threads);
+    joinThreads(threads);
+}
+
+int getNumCores()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? int(cores) : 1;
+}
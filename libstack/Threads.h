@@ -0,0 +1,86 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <vector>
+
+//
+// Thin wrappers around pthreads, just enough for the tools and
+// libstack to spread their work across several cores.
+//
+class Mutex
+{
+public:
+    Mutex();
+    ~Mutex();
+
+    void lock();
+    void unlock();
+
+    pthread_mutex_t* get() { return &m_mutex; }
+
+private:
+    // Not copyable
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+    pthread_mutex_t m_mutex;
+};
+
+//
+// Holds a Mutex locked for the life of a block.
+//
+class ScopedLock
+{
+public:
+    ScopedLock(Mutex& mutex) : m_mutex(mutex) { m_mutex.lock(); }
+    ~ScopedLock() { m_mutex.unlock(); }
+
+private:
+    Mutex& m_mutex;
+};
+
+//
+// Condition variable, always used together with a Mutex.
+//
+class Condition
+{
+public:
+    Condition();
+    ~Condition();
+
+    // Mutex must be locked by the caller
+    void wait(Mutex& mutex);
+
+    void signal();
+    void broadcast();
+
+private:
+    Condition(const Condition&);
+    Condition& operator=(const Condition&);
+
+    pthread_cond_t m_cond;
+};
+
+typedef void* (*ThreadFunc)(void*);
+typedef std::vector<pthread_t> ThreadList;
+
+//
+// Start func(arg) on count threads, adding them to threads.
+//
+void startThreads(int count, ThreadFunc func, void* arg, ThreadList& threads);
+
+//
+// Wait for all the threads to finish, then clear the list.
+//
+void joinThreads(ThreadList& threads);
+
+//
+// Run func(arg) on count threads and wait for all of them to finish.
+//
+void runThreads(int count, ThreadFunc func, void* arg);
+
+//
+// Number of cores we can run on, at least 1.
+//
+int getNumCores();
@@ -0,0 +1,482 @@
+#include "TxtFile.h"
+#include "Table.h"
+#include "Threads.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+char BOUNDS_FILE[] = "superpixel_bounds.txt";
+char BOUNDS_BIN_FILE[] = "superpixel_bounds.bin";
+char SEGMENT_FILE[] = "superpixel_to_segment_map.txt";
+char BODY_FILE[] = "segment_to_body_map.txt";
+
+// Several chunks per thread, so one slow chunk does not leave the
+// other threads idle at the end
+static const int s_CHUNKS_PER_THREAD = 8;
+
+// Smaller files are not worth splitting further
+static const size_t s_MIN_CHUNK_SIZE = 1 << 20;
+
+//
+// One piece of the file, starting at the beginning of a line.
+//
+struct TxtChunk
+{
+    const char* begin;
+    const char* end;
+
+    // Data lines in the chunk, and the Table row of the first one
+    uint64 rows;
+    uint64 firstRow;
+};
+
+//
+// Shared by the threads of one pass over the file.
+//
+struct TxtJob
+{
+    TxtJob() : fileEnd(NULL), columns(0), data(NULL), counting(true),
+        nextChunk(0) {}
+
+    const char* fileEnd;
+    std::vector<TxtChunk> chunks;
+
+    uint32 columns;
+    uint32* data;
+
+    // Counting rows, otherwise parsing them
+    bool counting;
+
+    Mutex mutex;
+    size_t nextChunk;
+};
+
+static inline bool isDataLine(char c)
+{
+    return c != '#' && c != '\n' && c != '\r';
+}
+
+static inline bool isDigit(char c)
+{
+    return (unsigned char)(c - '0') < 10;
+}
+
+static inline bool isSeparator(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Skip past the next newline, or to end
+static inline const char* nextLine(const char* p, const char* end)
+{
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    return eol ? eol + 1 : end;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+//
+// Eight characters at a time, the first one in the low byte.
+//
+// Digits are the bytes whose high nibble is 3 both before and
+// after adding 6, which pushes ':' and above out of 0x3_.
+//
+static inline int countDigits(uint64 chars)
+{
+    const uint64 high = 0xF0F0F0F0F0F0F0F0ULL;
+    const uint64 zeros = 0x3030303030303030ULL;
+
+    uint64 nondigit = ((chars & high) ^ zeros) |
+        (((chars + 0x0606060606060606ULL) & high) ^ zeros);
+
+    return nondigit == 0 ? 8 : __builtin_ctzll(nondigit) / 8;
+}
+
+//
+// Value of the first count (1 to 8) characters, which are all
+// digits.  Shifting them to the top makes the rest leading zeros,
+// then each step combines neighbouring pairs of digits, pairs of
+// pairs and pairs of those.
+//
+static inline uint64 parseDigits(uint64 chars, int count)
+{
+    chars <<= 8 * (8 - count);
+    chars = ((chars & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    chars = ((chars & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((chars & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+
+#define TXT_SWAR 1
+
+#endif
+
+//
+// Parse one value and leave p just past it.  Same results as the
+// strtol() we used to use: 0 and p unchanged if there is no number
+// before the end of the line, negative values wrap around.
+//
+static inline uint32 parseValue(const char*& p, const char* end)
+{
+    const char* q = p;
+
+    while (q < end && isSeparator(*q))
+    {
+        ++q;
+    }
+
+    bool negative = false;
+
+    if (q < end && (*q == '-' || *q == '+'))
+    {
+        negative = *q == '-';
+        ++q;
+    }
+
+    if (q == end || !isDigit(*q))
+    {
+        return 0;
+    }
+
+    uint64 value = 0;
+
+#ifdef TXT_SWAR
+    // Most values are short enough to be done in one go, the scalar
+    // loop finishes longer ones
+    if (end - q >= 8)
+    {
+        uint64 chars;
+        memcpy(&chars, q, sizeof(chars));
+
+        int count = countDigits(chars);
+        value = parseDigits(chars, count);
+        q += count;
+    }
+#endif
+
+    while (q < end && isDigit(*q))
+    {
+        value = value * 10 + (*q - '0');
+        ++q;
+    }
+
+    p = q;
+    return negative ? uint32(-value) : uint32(value);
+}
+
+static void countRows(TxtChunk& chunk)
+{
+    uint64 rows = 0;
+
+    for (const char* p = chunk.begin; p < chunk.end;
+         p = nextLine(p, chunk.end))
+    {
+        if (isDataLine(*p))
+        {
+            ++rows;
+        }
+    }
+
+    chunk.rows = rows;
+}
+
+static void parseRows(const TxtChunk& chunk, const char* fileEnd,
+    uint32 columns, uint32* data)
+{
+    uint32* row = data + chunk.firstRow * columns;
+
+    for (const char* p = chunk.begin; p < chunk.end;
+         p = nextLine(p, chunk.end))
+    {
+        if (!isDataLine(*p))
+        {
+            continue;
+        }
+
+        // Values never run past the end of the line
+        const char* eol = (const char*)memchr(p, '\n', fileEnd - p);
+        const char* lineEnd = eol ? eol : fileEnd;
+
+        for (uint32 j = 0; j < columns; ++j)
+        {
+            row[j] = parseValue(p, lineEnd);
+        }
+
+        row += columns;
+    }
+}
+
+static void* txtWorkerMain(void* arg)
+{
+    TxtJob* job = (TxtJob*)arg;
+
+    while (true)
+    {
+        size_t n;
+
+        {
+            ScopedLock lock(job->mutex);
+
+            if (job->nextChunk == job->chunks.size())
+            {
+                break;
+            }
+
+            n = job->nextChunk++;
+        }
+
+        if (job->counting)
+        {
+            countRows(job->chunks[n]);
+        }
+        else
+        {
+            parseRows(job->chunks[n], job->fileEnd, job->columns, job->data);
+        }
+    }
+
+    return NULL;
+}
+
+static void runJob(TxtJob& job, int threads)
+{
+    job.nextChunk = 0;
+
+    if (threads > 1)
+    {
+        runThreads(threads, txtWorkerMain, &job);
+    }
+    else
+    {
+        txtWorkerMain(&job);
+    }
+}
+
+Table* readTxtFile(const std::string& path, int columns, int threads)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        throw FormatString("Cannot open %s", path.c_str());
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw FormatString("Cannot stat %s", path.c_str());
+    }
+
+    size_t size = st.st_size;
+    const char* text = NULL;
+
+    if (size > 0)
+    {
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            throw FormatString("Cannot map %s", path.c_str());
+        }
+
+        text = (const char*)map;
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid without the descriptor
+    close(fd);
+
+    TxtJob job;
+    job.fileEnd = text + size;
+    job.columns = columns;
+
+    // Split at the first newline after each even division, a chunk
+    // can be empty if a line spans a whole division
+    size_t count = std::min(size_t(std::max(threads, 1)) * s_CHUNKS_PER_THREAD,
+        size / s_MIN_CHUNK_SIZE + 1);
+
+    const char* begin = text;
+
+    for (size_t k = 1; k <= count; ++k)
+    {
+        const char* end = job.fileEnd;
+
+        if (k < count)
+        {
+            end = std::max(begin, nextLine(text + size / count * k,
+                job.fileEnd));
+        }
+
+        TxtChunk chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        chunk.rows = 0;
+        chunk.firstRow = 0;
+        job.chunks.push_back(chunk);
+
+        begin = end;
+    }
+
+    threads = std::min(size_t(std::max(threads, 1)), count);
+
+    // Count the rows so the Table is allocated once
+    runJob(job, threads);
+
+    uint64 rows = 0;
+
+    for (size_t k = 0; k < job.chunks.size(); ++k)
+    {
+        job.chunks[k].firstRow = rows;
+        rows += job.chunks[k].rows;
+    }
+
+    if (rows > MAX_TABLE_ROWS)
+    {
+        if (text)
+        {
+            munmap((void*)text, size);
+        }
+
+        throw FormatString("%s has too many rows (%llu)", path.c_str(), rows);
+    }
+
+    Table* table = new Table(rows, columns);
+
+    job.counting = false;
+    job.data = table->getData();
+    runJob(job, threads);
+
+    if (text)
+    {
+        munmap((void*)text, size);
+    }
+
+    return table;
+}
+
+static bool getModifyTime(const std::string& path, struct timespec& mtime)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+
+    mtime = st.st_mtim;
+    return true;
+}
+
+std::string chooseBoundsFile(const std::string& binpath,
+    const std::string& txtpath)
+{
+    struct timespec bintime, txttime;
+    bool hasbin = getModifyTime(binpath, bintime);
+    bool hastxt = getModifyTime(txtpath, txttime);
+
+    if (!hasbin || !hastxt)
+    {
+        return hasbin ? binpath : txtpath;
+    }
+
+    if (bintime.tv_sec == txttime.tv_sec &&
+        bintime.tv_nsec == txttime.tv_nsec)
+    {
+        throw FormatString("Both %s and %s exist with the same time, "
+            "remove the stale one", binpath.c_str(), txtpath.c_str());
+    }
+
+    bool binNewer = bintime.tv_sec > txttime.tv_sec ||
+        (bintime.tv_sec == txttime.tv_sec &&
+         bintime.tv_nsec > txttime.tv_nsec);
+
+    const std::string& newer = binNewer ? binpath : txtpath;
+    const std::string& older = binNewer ? txtpath : binpath;
+
+    printf("WARNING: both %s and %s exist, using the newer %s\n",
+        binpath.c_str(), txtpath.c_str(), newer.c_str());
+    printf("WARNING: remove %s if it is stale\n", older.c_str());
+
+    return newer;
+}
+
+TxtFileReader::TxtFileReader() :
+    m_file(NULL),
+    m_columns(0),
+    m_line(NULL),
+    m_capacity(0)
+{
+}
+
+TxtFileReader::~TxtFileReader()
+{
+    close();
+    free(m_line);
+}
+
+void TxtFileReader::open(const std::string& path, int columns)
+{
+    close();
+
+    m_path = path;
+    m_columns = columns;
+    m_file = fopen(path.c_str(), "r");
+
+    if (!m_file)
+    {
+        throw FormatString("Cannot open %s", path.c_str());
+    }
+}
+
+bool TxtFileReader::readRow(uint32* row)
+{
+    while (true)
+    {
+        ssize_t length = getline(&m_line, &m_capacity, m_file);
+
+        if (length < 0)
+        {
+            if (ferror(m_file))
+            {
+                throw FormatString("Cannot read %s", m_path.c_str());
+            }
+
+            return false;
+        }
+
+        if (length == 0 || !isDataLine(m_line[0]))
+        {
+            continue;
+        }
+
+        const char* p = m_line;
+        const char* end = m_line + length;
+
+        if (end[-1] == '\n')
+        {
+            --end;
+        }
+
+        for (int j = 0; j < m_columns; ++j)
+        {
+            row[j] = parseValue(p, end);
+        }
+
+        return true;
+    }
+}
+
+void TxtFileReader::close()
+{
+    if (m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
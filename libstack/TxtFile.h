@@ -0,0 +1,106 @@
+//
+// TxtFile.h
+//
+
+#pragma once
+
+#include "common.h"
+
+// The TXT files a stack is compiled from
+extern char BOUNDS_FILE[];
+extern char BOUNDS_BIN_FILE[];
+extern char SEGMENT_FILE[];
+extern char BODY_FILE[];
+
+// 
+// These Txt* enums descdribe the TXT files which are read
+// into Tables. These 3 input TXT files are processed into
+// the real HdfStack datastructures.
+
+// bounds = superpixel_bounds.txt
+enum TxtBounds
+{
+    TXT_BOUNDS_Z = 0,
+    TXT_BOUNDS_SPID = 1,
+    TXT_BOUNDS_X = 2,
+    TXT_BOUNDS_Y = 3,
+    TXT_BOUNDS_WIDTH = 4,
+    TXT_BOUNDS_HEIGHT = 5,
+    TXT_BOUNDS_VOLUME = 6,
+    NUM_TXT_BOUNDS_COLUMNS = 7
+};
+
+// segments = superpixel_to_segment_map.txt as a Table
+enum TxtSegment
+{
+    TXT_SEGMENT_Z = 0,
+    TXT_SEGMENT_SPID = 1,
+    TXT_SEGMENT_SEGID = 2,
+    NUM_TXT_SEGMENT_COLUMNS = 3
+};
+
+// bodies = segment_to_body_map.txt as a Table
+enum TxtBody
+{
+    TXT_BODY_SEGID = 0,
+    TXT_BODY_BODYID = 1,
+    NUM_TXT_BODY_COLUMNS = 2
+};
+
+
+//
+// Reads a TXT file which is a table of integer values, like
+// superpixel_to_segment_map.txt, straight into a Table.
+//
+// The file is memory mapped and split at newlines into chunks
+// which are parsed on several threads.  A first pass counts the
+// rows in each chunk so the Table can be allocated once, then a
+// second pass parses each chunk into its own rows of the Table.
+// Nothing is allocated per line and the text is never copied.
+//
+// Comment (#) and blank lines are skipped.  Values are separated
+// by spaces or tabs, a missing value reads as 0, and anything past
+// the last column is ignored.
+//
+// Throws std::string if the file cannot be read.
+//
+Table* readTxtFile(const std::string& path, int columns, int threads);
+
+//
+// Picks which of a bounds file's .bin and .txt forms to read.  If
+// both exist one is probably left over from an earlier run of
+// bounds, so the newer one is used with a warning.  Throws
+// std::string if they are equally new and it cannot tell.  Returns
+// txtpath when neither exists so the reader reports it missing.
+//
+std::string chooseBoundsFile(const std::string& binpath,
+    const std::string& txtpath);
+
+//
+// Reads the same TXT files one row at a time, for files too big
+// to hold in memory.  Rows are parsed exactly as readTxtFile()
+// does, skipping comment and blank lines.
+//
+class TxtFileReader
+{
+public:
+    TxtFileReader();
+    ~TxtFileReader();
+
+    // Throws std::string if the file cannot be opened
+    void open(const std::string& path, int columns);
+
+    // Read the next row of columns values, false at the end
+    bool readRow(uint32* row);
+
+    void close();
+
+private:
+    std::string m_path;
+    FILE* m_file;
+    int m_columns;
+
+    // Line buffer for getline()
+    char* m_line;
+    size_t m_capacity;
+};
@@ -54,9 +54,33 @@ const char* init();
 // Load the HDF-STACK from disk
 const char* load(const char* path);
 
+// Load the HDF-STACK and check each dataset against its checksum,
+// fails if any is corrupt
+const char* loadchecked(const char* path);
+
+// Load the HDF-STACK but read each plane only when it's first used.
+// budgetmb limits the unmodified planes kept in memory, 0 for none.
+const char* loadlazy(const char* path, uint32 budgetmb);
+
+// Hint that planes zmin to zmax will be wanted soon
+const char* prefetchplanes(uint32 zmin, uint32 zmax);
+
+// Load a snapshot from savesnapshot(), mapped so it opens at once
+const char* loadsnapshot(const char* path);
+
+// Write every table to a snapshot for loadsnapshot()
+const char* savesnapshot(const char* path);
+
 // Save the HDF-STACK to disk
 const char* save(const char* path, uint isbackup);
 
+// Save, writing only what changed if path is the file last loaded or
+// saved.  retval is 1 if it did, 0 if the whole file was written.
+const char* savechanges(const char* path, uint isbackup, uint32* retval);
+
+// Have save() deflate the datasets at level 1 to 9, 0 for none
+const char* setcompression(int level);
+
 // Create from old session format
 const char* create(
     uint32 bounds_rows, uint32* bounds_data,
@@ -496,6 +520,47 @@ const char* load(const char* path)
     )
 }
 
+const char* loadchecked(const char* path)
+{
+    TRY_CATCH(
+        delete g_stack;
+        g_stack = new HdfStack();
+        getStack()->load(path, true);
+    )
+}
+
+const char* loadlazy(const char* path, uint32 budgetmb)
+{
+    TRY_CATCH(
+        delete g_stack;
+        g_stack = new HdfStack();
+        getStack()->loadLazy(path, uint64(budgetmb) << 20);
+    )
+}
+
+const char* prefetchplanes(uint32 zmin, uint32 zmax)
+{
+    TRY_CATCH(
+        getStack()->prefetchplanes(zmin, zmax);
+    )
+}
+
+const char* loadsnapshot(const char* path)
+{
+    TRY_CATCH(
+        delete g_stack;
+        g_stack = new HdfStack();
+        getStack()->loadSnapshot(path);
+    )
+}
+
+const char* savesnapshot(const char* path)
+{
+    TRY_CATCH(
+        getStack()->saveSnapshot(path);
+    )
+}
+
 const char* create( 
     uint32 bounds_rows, uint32* bounds_data,
     uint32 segment_rows, uint32* segment_data,
@@ -522,6 +587,20 @@ const char* save(const char* path, uint isbackup)
     )
 }
 
+const char* savechanges(const char* path, uint isbackup, uint32* retval)
+{
+    TRY_CATCH(
+        *retval = getStack()->saveChanges(path, isbackup) ? 1 : 0;
+    )
+}
+
+const char* setcompression(int level)
+{
+    TRY_CATCH(
+        getStack()->setCompression(level);
+    )
+}
+
 const char* close()
 {
     TRY_CATCH(
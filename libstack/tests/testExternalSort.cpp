@@ -0,0 +1,118 @@
+//
+// Checks ExternalSorter with budgets so small it spills many more
+// runs than it may hold at once.
+//
+
+#include "ExternalSort.h"
+
+#include <dirent.h>
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+    if (!(cond)) \
+    { \
+        printf("FAILED: %s at line %d\n", #cond, __LINE__); \
+        ++s_failures; \
+    }
+
+// File descriptors this process has open
+static size_t countOpenFiles()
+{
+    DIR* dir = opendir("/proc/self/fd");
+
+    if (!dir)
+    {
+        return 0;
+    }
+
+    size_t count = 0;
+
+    while (readdir(dir))
+    {
+        ++count;
+    }
+
+    closedir(dir);
+    return count;
+}
+
+//
+// Sort records values from a simple generator with budget bytes,
+// check they come back sorted and complete, twice
+//
+static void testSort(size_t budget, uint64 records)
+{
+    size_t openBefore = countOpenFiles();
+
+    ExternalSorter<uint64> sorter("test", "/tmp", budget);
+    uint64 sum = 0;
+    uint64 value = 12345;
+    size_t mostRuns = 0;
+
+    for (uint64 i = 0; i < records; ++i)
+    {
+        // Knuth's MMIX LCG, plenty of duplicates once shifted down
+        value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+        sorter.add(value >> 44);
+        sum += value >> 44;
+
+        mostRuns = std::max(mostRuns, sorter.getRuns());
+    }
+
+    sorter.finish();
+
+    printf("budget=%zu records=%llu runs=%zu most=%zu max=%zu\n", budget,
+        records, sorter.getRuns(), mostRuns, sorter.getMaxRuns());
+
+    CHECK(sorter.getRuns() > 0);
+    CHECK(mostRuns <= sorter.getMaxRuns());
+    CHECK(countOpenFiles() <= openBefore + sorter.getMaxRuns());
+
+    // More spills than the cap, so some were merged
+    CHECK(records / std::max(size_t(1), budget / sizeof(uint64)) >
+        sorter.getMaxRuns());
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        uint64 count = 0;
+        uint64 total = 0;
+        uint64 last = 0;
+        uint64 record;
+        bool sorted = true;
+
+        while (sorter.next(record))
+        {
+            sorted = sorted && record >= last;
+            last = record;
+            total += record;
+            ++count;
+        }
+
+        CHECK(sorted);
+        CHECK(count == records);
+        CHECK(total == sum);
+
+        sorter.rewind();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        // Too small to read s_MIN_READ records from even two runs
+        testSort(64 * sizeof(uint64), 20000);
+
+        // Room for 256 records from each of 64 runs, spills 300 runs
+        testSort(64 * 256 * sizeof(uint64), uint64(300) * 64 * 256);
+    }
+    catch (std::string& error)
+    {
+        printf("ERROR: %s\n", error.c_str());
+        return 1;
+    }
+
+    printf("%s\n", s_failures == 0 ? "PASSED" : "FAILED");
+    return s_failures == 0 ? 0 : 1;
+}
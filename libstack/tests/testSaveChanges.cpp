@@ -0,0 +1,183 @@
+//
+// Checks HdfStack::saveChanges() on a lazily loaded stack which is
+// prefetching planes and dropping them to stay in a small budget
+// while it saves.
+//
+
+#include "HdfStack.h"
+#include "util.h"
+
+#include <unistd.h>
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+    if (!(cond)) \
+    { \
+        printf("FAILED: %s at line %d\n", #cond, __LINE__); \
+        ++s_failures; \
+    }
+
+static const uint32 s_PLANES = 40;
+static const uint32 s_SUPERPIXELS = 400;
+
+// Columns of the tables create() takes
+static const uint32 s_BOUNDS_COLUMNS = 7;
+static const uint32 s_SEGMENT_COLUMNS = 3;
+static const uint32 s_BODY_COLUMNS = 2;
+
+//
+// Write a stack where every superpixel is its own segment and every
+// ten segments a body
+//
+static void createStack(const std::string& path)
+{
+    uint32 rows = s_PLANES * s_SUPERPIXELS;
+
+    Table bounds(rows, s_BOUNDS_COLUMNS);
+    Table segments(rows, s_SEGMENT_COLUMNS);
+    Table bodies(rows, s_BODY_COLUMNS);
+
+    for (uint32 z = 0, row = 0; z < s_PLANES; ++z)
+    {
+        for (uint32 spid = 1; spid <= s_SUPERPIXELS; ++spid, ++row)
+        {
+            uint32 segid = row + 1;
+            uint32 values[] = { z, spid, spid, z, 10, 20, 100 + spid };
+
+            for (uint32 i = 0; i < s_BOUNDS_COLUMNS; ++i)
+            {
+                bounds.setValue(row, i, values[i]);
+            }
+
+            segments.setValue(row, 0, z);
+            segments.setValue(row, 1, spid);
+            segments.setValue(row, 2, segid);
+
+            bodies.setValue(row, 0, segid);
+            bodies.setValue(row, 1, segid / 10 + 1);
+        }
+    }
+
+    HdfStack stack;
+    stack.create(&bounds, &segments, &bodies);
+    stack.save(path, 0);
+}
+
+// Change one superpixel and grow another plane by a new one, in a
+// new segment of a new body
+static void edit(HdfStack& stack, uint32 round)
+{
+    uint32 z = (round * 7) % s_PLANES;
+    Bounds bounds = stack.getbounds(z, 7);
+    bounds.width += round + 1;
+    stack.setboundsandvolume(z, 7, bounds, stack.getvolume(z, 7) + 1);
+
+    z = (round * 11 + 3) % s_PLANES;
+    uint32 body = stack.createbody();
+    uint32 segid = stack.createsegment();
+    stack.addsegments(IntVec(1, segid), body);
+
+    uint32 spid = stack.createsuperpixel(z);
+    stack.addsuperpixel(z, spid, segid);
+    stack.setboundsandvolume(z, spid, bounds, 5 + round);
+}
+
+// Compare every superpixel and segment of the two stacks
+static void compare(HdfStack& a, HdfStack& b)
+{
+    CHECK(a.getzmin() == b.getzmin() && a.getzmax() == b.getzmax());
+
+    for (uint32 z = a.getzmin(); z <= a.getzmax(); ++z)
+    {
+        CHECK(a.getmaxsuperpixelid(z) == b.getmaxsuperpixelid(z));
+
+        for (uint32 spid = 1; spid <= a.getmaxsuperpixelid(z); ++spid)
+        {
+            CHECK(a.hassuperpixel(z, spid) == b.hassuperpixel(z, spid));
+
+            if (!a.hassuperpixel(z, spid))
+            {
+                continue;
+            }
+
+            Bounds ba = a.getbounds(z, spid);
+            Bounds bb = b.getbounds(z, spid);
+
+            CHECK(ba.x == bb.x && ba.y == bb.y && ba.width == bb.width &&
+                ba.height == bb.height);
+            CHECK(a.getvolume(z, spid) == b.getvolume(z, spid));
+            CHECK(a.getsegmentid(z, spid) == b.getsegmentid(z, spid));
+        }
+    }
+
+    IntVec segments;
+    a.getallsegments(segments);
+
+    IntVec others;
+    b.getallsegments(others);
+    CHECK(segments == others);
+
+    for (size_t i = 0; i < segments.size(); ++i)
+    {
+        CHECK(a.getsegmentbodyid(segments[i]) ==
+            b.getsegmentbodyid(segments[i]));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string path = FormatString("/tmp/testSaveChanges.%d.h5",
+        int(getpid()));
+
+    try
+    {
+        createStack(path);
+
+        // About three planes, so prefetching keeps dropping them
+        uint64 budget = 3 * s_SUPERPIXELS * 6 * sizeof(uint32);
+
+        HdfStack stack;
+        stack.loadLazy(path, budget);
+
+        uint32 incremental = 0;
+
+        for (uint32 round = 0; round < 8; ++round)
+        {
+            edit(stack, round);
+
+            // Still reading planes in the background as we save
+            stack.prefetchplanes(0, s_PLANES - 1);
+
+            if (stack.saveChanges(path, 0))
+            {
+                ++incremental;
+            }
+
+            HdfStack saved;
+            saved.load(path, true);
+            CHECK(saved.verify());
+            compare(stack, saved);
+        }
+
+        printf("%u of 8 saves incremental\n", incremental);
+
+        // The first save makes the file extendible, the rest fit
+        CHECK(incremental == 7);
+    }
+    catch (std::string& error)
+    {
+        printf("ERROR: %s\n", error.c_str());
+        ++s_failures;
+    }
+    catch (std::exception& e)
+    {
+        printf("ERROR: %s\n", e.what());
+        ++s_failures;
+    }
+
+    unlink(path.c_str());
+
+    printf("%s\n", s_failures == 0 ? "PASSED" : "FAILED");
+    return s_failures == 0 ? 0 : 1;
+}
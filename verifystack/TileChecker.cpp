@@ -0,0 +1,293 @@
+#include "TileChecker.h"
+#include "HdfStack.h"
+#include "PngImage.h"
+#include "TileAccumulator.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+typedef TileAccumulator::BoundsMap BoundsMap;
+typedef TileAccumulator::VolumeMap VolumeMap;
+
+TileChecker::TileChecker(HdfStack& hdfstack, const std::string& root,
+    int tilesize) :
+    m_hdfstack(hdfstack),
+    m_stack(root, tilesize),
+    m_tilesize(tilesize),
+    m_nextPlane(0),
+    m_superpixels(0),
+    m_pixels(0)
+{
+    // Metadata is read here, before any threads start
+    m_rows = m_stack.getNumRows(0);
+    m_cols = m_stack.getNumCols(0);
+}
+
+void TileChecker::choosePlanes(uint32 n, unsigned int seed)
+{
+    m_planes.clear();
+
+    for (uint32 z = m_hdfstack.getzmin(); z <= m_hdfstack.getzmax(); ++z)
+    {
+        m_planes.push_back(z);
+    }
+
+    if (n == 0 || n >= m_planes.size())
+    {
+        return;
+    }
+
+    // Partial Fisher-Yates, the first n are the sample
+    srand(seed);
+
+    for (uint32 i = 0; i < n; ++i)
+    {
+        uint32 j = i + uint32(rand() % (m_planes.size() - i));
+        std::swap(m_planes[i], m_planes[j]);
+    }
+
+    m_planes.resize(n);
+    std::sort(m_planes.begin(), m_planes.end());
+}
+
+uint64 TileChecker::run(int threads, FILE* out)
+{
+    m_results.assign(m_planes.size(), PlaneResult());
+    m_nextPlane = 0;
+
+    threads = std::min(threads, int(m_planes.size()));
+
+    if (threads > 1)
+    {
+        runThreads(threads, workerMain, this);
+    }
+    else
+    {
+        runWorker();
+    }
+
+    fprintf(out, "# z\tspid\tfield\tstack\ttiles\n");
+
+    uint64 mismatches = 0;
+    m_superpixels = 0;
+    m_pixels = 0;
+
+    for (size_t i = 0; i < m_planes.size(); ++i)
+    {
+        const PlaneResult& result = m_results[i];
+
+        for (size_t k = 0; k < result.mismatches.size(); ++k)
+        {
+            const Mismatch& mismatch = result.mismatches[k];
+
+            fprintf(out, "%u\t%u\t%s\t%s\t%s\n", m_planes[i], mismatch.spid,
+                mismatch.field, mismatch.stack.c_str(),
+                mismatch.tiles.c_str());
+        }
+
+        mismatches += result.mismatches.size();
+        m_superpixels += result.superpixels;
+        m_pixels += result.pixels;
+    }
+
+    m_results.clear();
+    return mismatches;
+}
+
+void* TileChecker::workerMain(void* arg)
+{
+    ((TileChecker*)arg)->runWorker();
+    return NULL;
+}
+
+void TileChecker::runWorker()
+{
+    TileAccumulator accum;
+    PngRowReader reader;
+
+    while (true)
+    {
+        uint32 n;
+
+        {
+            ScopedLock lock(m_mutex);
+
+            if (m_nextPlane >= m_planes.size())
+            {
+                return;
+            }
+
+            n = m_nextPlane++;
+        }
+
+        checkPlane(m_planes[n], accum, reader, m_results[n]);
+    }
+}
+
+void TileChecker::addMismatch(std::vector<Mismatch>& mismatches,
+    uint32 spid, const char* field, uint32 stack, uint32 tiles)
+{
+    Mismatch mismatch;
+    mismatch.spid = spid;
+    mismatch.field = field;
+    mismatch.stack = FormatString("%u", stack);
+    mismatch.tiles = FormatString("%u", tiles);
+    mismatches.push_back(mismatch);
+}
+
+void TileChecker::checkPlane(int z, TileAccumulator& accum,
+    PngRowReader& reader, PlaneResult& result)
+{
+    BoundsMap bounds;
+    VolumeMap volumes;
+
+    // Same tiles in the same order as the bounds tool
+    for (int i = 0; i < m_cols; ++i)
+    {
+        for (int j = 0; j < m_rows; ++j)
+        {
+            std::string path = m_stack.getTilePath(0, j, i, 's', z);
+            int baseX = m_tilesize * i;
+            int baseY = m_tilesize * j;
+
+            reader.open(path.c_str());
+
+            int width = reader.getWidth();
+            int height = reader.getHeight();
+            int colsize = reader.getColSize();
+
+            if (reader.isInterlaced())
+            {
+                reader.close();
+
+                PngImage image(path.c_str());
+                unsigned int minSpid, maxSpid;
+                image.getPixelIDRange(minSpid, maxSpid);
+
+                accum.begin(minSpid, maxSpid);
+
+                for (int y = 0; y < height; ++y)
+                {
+                    accum.addRow(image.getRow(y), colsize, width,
+                        baseX, baseY + y);
+                }
+            }
+            else
+            {
+                size_t rowbytes = size_t(width) * colsize;
+
+                if (colsize == 2)
+                {
+                    accum.begin(0, 0xFFFF);
+                }
+                else
+                {
+                    accum.begin();
+                }
+
+                // Top row first, our y is flipped
+                for (int row = 0; row < height; ++row)
+                {
+                    const png_byte* pixels = reader.readRow();
+                    int y = baseY + height - row - 1;
+
+                    if (isZeroBytes(pixels, rowbytes))
+                    {
+                        accum.addSpan(0, baseX, baseX + width - 1, y);
+                    }
+                    else
+                    {
+                        accum.addRow(pixels, colsize, width, baseX, y);
+                    }
+                }
+
+                reader.close();
+            }
+
+            accum.finish(bounds, volumes, NULL);
+            result.pixels += uint64(width) * height;
+        }
+    }
+
+    IntVec tileSpids;
+
+    for (BoundsMap::iterator it = bounds.begin(); it != bounds.end(); ++it)
+    {
+        tileSpids.push_back((*it).first);
+    }
+
+    std::sort(tileSpids.begin(), tileSpids.end());
+
+    // Already sorted
+    IntVec stackSpids;
+    m_hdfstack.getsuperpixelsinplane(z, stackSpids);
+
+    result.superpixels = tileSpids.size();
+
+    std::vector<Mismatch>& mismatches = result.mismatches;
+    size_t s = 0;
+    size_t t = 0;
+
+    while (s < stackSpids.size() || t < tileSpids.size())
+    {
+        if (t == tileSpids.size() ||
+            (s < stackSpids.size() && stackSpids[s] < tileSpids[t]))
+        {
+            uint32 spid = stackSpids[s++];
+
+            Mismatch mismatch;
+            mismatch.spid = spid;
+            mismatch.field = "superpixel";
+            mismatch.stack = FormatString("%u",
+                m_hdfstack.getvolume(z, spid));
+            mismatch.tiles = "-";
+            mismatches.push_back(mismatch);
+        }
+        else if (s == stackSpids.size() || tileSpids[t] < stackSpids[s])
+        {
+            uint32 spid = tileSpids[t++];
+
+            Mismatch mismatch;
+            mismatch.spid = spid;
+            mismatch.field = "superpixel";
+            mismatch.stack = "-";
+            mismatch.tiles = FormatString("%d", volumes[spid]);
+            mismatches.push_back(mismatch);
+        }
+        else
+        {
+            uint32 spid = stackSpids[s++];
+            ++t;
+
+            Bounds stored = m_hdfstack.getbounds(z, spid);
+            uint32 volume = m_hdfstack.getvolume(z, spid);
+            const PixelBoundBox& box = bounds[spid];
+
+            if (stored.x != uint32(box.getX()))
+            {
+                addMismatch(mismatches, spid, "x", stored.x, box.getX());
+            }
+            if (stored.y != uint32(box.getY()))
+            {
+                addMismatch(mismatches, spid, "y", stored.y, box.getY());
+            }
+            if (stored.width != uint32(box.getWidth()))
+            {
+                addMismatch(mismatches, spid, "width", stored.width,
+                    box.getWidth());
+            }
+            if (stored.height != uint32(box.getHeight()))
+            {
+                addMismatch(mismatches, spid, "height", stored.height,
+                    box.getHeight());
+            }
+            if (volume != uint32(volumes[spid]))
+            {
+                addMismatch(mismatches, spid, "volume", volume,
+                    volumes[spid]);
+            }
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "Stack.h"
+#include "Threads.h"
+
+class HdfStack;
+class PngRowReader;
+class TileAccumulator;
+
+//
+// Checks the bounds and volumes stored in an HDF-STACK against the
+// superpixel tiles they were computed from.
+//
+// Each plane is recomputed from its tiles just as the bounds tool
+// does, with one plane per worker thread, and compared with
+// HdfStack::getbounds() and getvolume().  Only the differences are
+// kept, and they are written in plane order once every plane is
+// done, so the output doesn't depend on the number of threads.
+//
+// Mismatches are written one per line, tab separated:
+//
+//   z  spid  field  stack  tiles
+//
+// where field is x, y, width, height or volume.  A superpixel in
+// only one of the two has field "superpixel", with its volume on the
+// side which has it and "-" on the other.
+//
+class TileChecker
+{
+public:
+    TileChecker(HdfStack& hdfstack, const std::string& root, int tilesize);
+
+    // Check n planes of the stack picked at random with seed, or
+    // every plane if n is 0 or more than the stack has
+    void choosePlanes(uint32 n, unsigned int seed);
+
+    // Check the chosen planes on threads threads, write mismatches
+    // to out.  Returns the number of mismatches.
+    uint64 run(int threads, FILE* out);
+
+    uint32 getNumPlanes() const { return m_planes.size(); }
+
+    // Totals of the last run()
+    uint64 getNumSuperpixels() const { return m_superpixels; }
+    uint64 getNumPixels() const { return m_pixels; }
+
+private:
+    struct Mismatch
+    {
+        uint32 spid;
+        const char* field;
+        std::string stack;
+        std::string tiles;
+    };
+
+    struct PlaneResult
+    {
+        PlaneResult() : superpixels(0), pixels(0) {}
+
+        std::vector<Mismatch> mismatches;
+        uint64 superpixels;
+        uint64 pixels;
+    };
+
+    static void* workerMain(void* arg);
+    void runWorker();
+
+    // Recompute plane z from its tiles and compare, accum and
+    // reader are the worker's own
+    void checkPlane(int z, TileAccumulator& accum, PngRowReader& reader,
+        PlaneResult& result);
+
+    static void addMismatch(std::vector<Mismatch>& mismatches, uint32 spid,
+        const char* field, uint32 stack, uint32 tiles);
+
+    HdfStack& m_hdfstack;
+    Stack m_stack;
+    int m_tilesize;
+    int m_rows;
+    int m_cols;
+
+    // Planes to check, sorted, and what each one found
+    IntVec m_planes;
+    std::vector<PlaneResult> m_results;
+
+    Mutex m_mutex;
+    uint32 m_nextPlane;
+
+    uint64 m_superpixels;
+    uint64 m_pixels;
+};
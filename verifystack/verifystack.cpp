@@ -1,9 +1,133 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #include "timers.h"
+#include "HdfFile.h"
 #include "HdfStack.h"
+#include "Threads.h"
+#include "TileChecker.h"
+
+static void usage(const char* argv0)
+{
+    printf("USAGE: %s [options] <stack.h5> [-repair]\n", argv0);
+    printf("  --quick           only check each dataset against the checksum\n");
+    printf("                    saved with it, catches corrupt or truncated\n");
+    printf("                    files in seconds\n");
+    printf("  --tiles ROOT      instead of checking the tables, recompute\n");
+    printf("                    bounds from the tiles under ROOT and list\n");
+    printf("                    superpixels which don't match the stack\n");
+    printf("  --tilesize N      tile size under ROOT (default 1024)\n");
+    printf("  --sample N        with --tiles, check N random planes\n");
+    printf("                    instead of every plane\n");
+    printf("  --seed N          seed for --sample (default the time)\n");
+    printf("  --threads N       check planes on N threads (default all cores)\n");
+    printf("  --out FILE        write mismatches to FILE instead of stdout\n");
+    exit(1);
+}
+
+//
+// Read every dataset and check it against its checksum, without
+// loading the stack.  Returns the exit code, 1 if any is corrupt.
+//
+static int quickcheck(const char* path)
+{
+    HdfFile file;
+    file.openForRead(path);
+
+    StringList names;
+    file.listPlaneDatasets(names);
+
+    names.push_back("segment");
+    names.push_back("segment_superpixels");
+    names.push_back("body_index");
+    names.push_back("body_segments");
+
+    uint32 ok = 0;
+    uint32 missing = 0;
+    uint32 bad = 0;
+
+    for (StringList::iterator it = names.begin(); it != names.end(); ++it)
+    {
+        try
+        {
+            switch (file.checkDataset(*it))
+            {
+                case HdfFile::CHECKSUM_OK:
+                    ++ok;
+                    break;
+                case HdfFile::CHECKSUM_MISSING:
+                    ++missing;
+                    break;
+                case HdfFile::CHECKSUM_BAD:
+                    printf("ERROR: %s does not match its checksum\n",
+                        it->c_str());
+                    ++bad;
+                    break;
+            }
+        }
+        catch (std::string& error)
+        {
+            printf("ERROR: %s\n", error.c_str());
+            ++bad;
+        }
+    }
+
+    printf("datasets=%zu ok=%u no-checksum=%u bad=%u\n",
+        names.size(), ok, missing, bad);
+
+    return bad > 0 ? 1 : 0;
+}
+
+//
+// Recompute bounds from the tiles and compare them with the stack.
+// Returns the exit code, 1 if anything didn't match.
+//
+static int checktiles(HdfStack& stack, const std::string& root, int tilesize,
+    uint32 sample, unsigned int seed, int threads, const char* outpath)
+{
+    FILE* out = stdout;
+
+    if (outpath)
+    {
+        out = fopen(outpath, "w");
+
+        if (!out)
+        {
+            fprintf(stderr, "ERROR: cannot open %s\n", outpath);
+            return 1;
+        }
+    }
+
+    TileChecker checker(stack, root, tilesize);
+    checker.choosePlanes(sample, seed);
+
+    // Mismatches may be going to stdout, so report on stderr
+    if (sample > 0)
+    {
+        fprintf(stderr, "Checking %u planes, seed %u\n",
+            checker.getNumPlanes(), seed);
+    }
+
+    double start = getTimeInSeconds();
+    uint64 mismatches = checker.run(threads, out);
+    double seconds = getTimeInSeconds() - start;
+
+    if (outpath)
+    {
+        fclose(out);
+    }
+
+    fprintf(stderr, "planes=%u superpixels=%llu mismatches=%llu\n",
+        checker.getNumPlanes(), checker.getNumSuperpixels(), mismatches);
+    fprintf(stderr, "%.1f planes/s, %.1f Mpixels/s\n",
+        checker.getNumPlanes() / seconds,
+        checker.getNumPixels() / seconds / 1e6);
+
+    return mismatches > 0 ? 1 : 0;
+}
 
 //
 // verifystack
@@ -15,52 +139,126 @@ int main(int argc, char* argv[])
 {
     assert(sizeof(uint32) == 4);
 
-    if (argc == 2 || argc == 3)
+    bool quick = false;
+    std::string tiles;
+    int tilesize = 1024;
+    uint32 sample = 0;
+    unsigned int seed = (unsigned int)time(NULL);
+    int threads = getNumCores();
+    const char* outpath = NULL;
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            quick = true;
+        }
+        else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc)
+        {
+            tiles = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tilesize") == 0 && i + 1 < argc)
+        {
+            tilesize = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+        {
+            sample = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            outpath = argv[++i];
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            usage(argv[0]);
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (threads < 1 || tilesize < 1)
+    {
+        usage(argv[0]);
+    }
+
+    if (args.size() == 1 || args.size() == 2)
     {
-        const char* path = argv[1];
-        
+        const char* path = args[0];
+
         bool repair = false;
-        
-        if (argv[2])
+
+        if (args.size() == 2)
         {
-            repair = strcmp(argv[2], "-repair") == 0;
+            repair = strcmp(args[1], "-repair") == 0;
+        }
+
+        // Only one mode at a time
+        if (int(repair) + int(quick) + int(!tiles.empty()) > 1)
+        {
+            usage(argv[0]);
         }
-        
-        printf("Repair Mode: %s\n", repair ? "ON" : "OFF");
 
         HdfStack stack;
-        
+
         try
         {
+            if (quick)
+            {
+                PBT pbt("check checksums");
+                return quickcheck(path);
+            }
+
+            if (!tiles.empty())
+            {
+                // Only the planes checked are read
+                stack.loadLazy(path);
+                return checktiles(stack, tiles, tilesize, sample, seed,
+                    threads, outpath);
+            }
+
             {
                 PBT pbt("load HDF-STACK");
                 stack.load(path);
             }
+
+            printf("Repair Mode: %s\n", repair ? "ON" : "OFF");
+
             {
                 PBT pbt("verify HDF-STACK");
                 stack.verify(repair);
             }
-            
+
             if (repair)
             {
                 printf("Saving %s\n", path);
                 PBT pbt("save HDF-STACK");
                 stack.save(path, 0);
-                
+
             }
         }
         catch (std::string& error)
         {
             printf("CAUGHT ERROR: %s\n", error.c_str());
         }
-     
+
     }
     else
     {
-        printf("USAGE: %s <stack.h5> [-repair]\n", argv[0]);
-        exit(1);
+        usage(argv[0]);
     }
 
     printf("done\n");
     return 0;
-}
\ No newline at end of file
+}